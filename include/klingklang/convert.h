@@ -0,0 +1,76 @@
+#ifndef KK_CONVERT_H
+#define KK_CONVERT_H
+
+#include <klingklang/base.h>
+#include <klingklang/downmix.h>
+#include <klingklang/format.h>
+#include <klingklang/resample.h>
+
+/**
+ * Maximum number of formats kk_convert_get_formats returns.
+ */
+#define KK_CONVERT_MAX_FORMATS  10
+
+typedef struct kk_convert kk_convert_t;
+typedef void (*kk_convert_load_func) (float *dst, const void *src, size_t n);
+typedef void (*kk_convert_store_func) (kk_convert_t *conv, void *dst, const float *src, size_t n);
+
+/**
+ * Converts interleaved samples from format src to format dst. The sample
+ * type, size, rate and the number of channels may differ. The samples pass
+ * through 32 bit floats, so 32 and 64 bit sources keep 24 bits of
+ * precision. If dst has less bits than that, the samples get TPDF dithered.
+ * If dst has less channels than src, the floats go through downmix first.
+ * If the sample rates differ, they go through resample afterwards.
+ */
+struct kk_convert {
+  kk_format_t src;
+  kk_format_t dst;
+  kk_convert_load_func load;
+  kk_convert_store_func store;
+  kk_downmix_t *downmix;
+  kk_resample_t *resample;
+  float *buffer;
+  size_t size;
+  uint32_t seed[8];
+  size_t src_channels;
+  size_t dst_channels;
+  size_t src_bytes;
+  size_t dst_bytes;
+  int quality;
+  int dither;
+  int downmixing;
+  int resampling;
+};
+
+/**
+ * Fills formats with the formats samples in format src can be converted to,
+ * best first. The first one is src itself. Samples with more than two
+ * channels can be mixed down to stereo, these formats come last. Returns
+ * the number of formats.
+ */
+size_t kk_convert_get_formats (kk_format_t *src, kk_format_t *formats, size_t n);
+
+/**
+ * Quality is the quality of the resampler, matrix the downmix matrix the
+ * user passed, see kk_downmix_init.
+ */
+int kk_convert_init (kk_convert_t **conv, int quality, const char *matrix);
+int kk_convert_free (kk_convert_t *conv);
+int kk_convert_setup (kk_convert_t *conv, kk_format_t *src, kk_format_t *dst);
+void kk_convert_reset (kk_convert_t *conv);
+int kk_convert_is_needed (kk_convert_t *conv);
+
+/**
+ * Returns the maximum number of bytes len bytes of source samples take up
+ * after the conversion.
+ */
+size_t kk_convert_get_size (kk_convert_t *conv, size_t len);
+
+/**
+ * Converts len bytes of samples and returns the number of bytes written
+ * to dst.
+ */
+size_t kk_convert (kk_convert_t *conv, void *dst, const void *src, size_t len);
+
+#endif
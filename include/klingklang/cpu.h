@@ -0,0 +1,23 @@
+#ifndef KK_CPU_H
+#define KK_CPU_H
+
+#include <klingklang/base.h>
+
+enum {
+  KK_CPU_SSE2 = 1 << 0,
+  KK_CPU_AVX2 = 1 << 1,
+  KK_CPU_NEON = 1 << 2,
+};
+
+/**
+ * Returns the instruction set extensions the CPU supports as combination
+ * of the flags above. Setting KK_SIMD to 0 makes this function return 0.
+ */
+unsigned int kk_cpu_get_features (void);
+
+/**
+ * Returns the number of online CPUs, but at least 1.
+ */
+size_t kk_cpu_get_count (void);
+
+#endif
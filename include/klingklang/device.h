@@ -15,11 +15,33 @@ struct kk_device {
   pthread_mutex_t mutex;
 };
 
+/**
+ * Every backend lists the sample formats it can play in formats. For each
+ * kk_type_t, formats holds KK_DEVICE_BITS of every supported kk_bits_t.
+ */
+#define KK_DEVICE_BITS(bits)  (1u << (bits))
+
+/**
+ * The drop function discards the samples queued in the device right away,
+ * the device keeps playing whatever gets written next. The pause function
+ * stops the device without losing queued samples if pause is non-zero and
+ * resumes it otherwise. Backends which can't do that leave pause NULL.
+ * The delay function returns the number of sample frames written to the
+ * device which the user didn't hear yet. Backends which can't tell leave
+ * delay NULL. The channels function tells whether the device can play
+ * the given number of channels. Backends which only find out when they set
+ * up the device leave channels NULL.
+ */
 struct kk_device_backend {
   size_t size;
+  unsigned int formats[3];
   int (*init) (kk_device_t *dev);
   int (*free) (kk_device_t *dev);
   int (*drop) (kk_device_t *dev);
+  int (*drain) (kk_device_t *dev);
+  int (*pause) (kk_device_t *dev, int pause);
+  int (*delay) (kk_device_t *dev, size_t *frames);
+  int (*channels) (kk_device_t *dev, int channels);
   int (*setup) (kk_device_t *dev, kk_format_t *format);
   int (*write) (kk_device_t *dev, kk_frame_t *frame);
 };
@@ -27,7 +49,11 @@ struct kk_device_backend {
 int kk_device_init (kk_device_t **dev);
 int kk_device_free (kk_device_t *dev);
 int kk_device_drop (kk_device_t *dev);
+int kk_device_drain (kk_device_t *dev);
+int kk_device_pause (kk_device_t *dev, int pause);
+int kk_device_delay (kk_device_t *dev, size_t *frames);
 int kk_device_setup (kk_device_t *dev, kk_format_t *format);
+int kk_device_is_supported (kk_device_t *dev, kk_format_t *format);
 int kk_device_write (kk_device_t *dev, kk_frame_t *frame);
 
 #endif
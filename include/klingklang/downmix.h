@@ -0,0 +1,57 @@
+#ifndef KK_DOWNMIX_H
+#define KK_DOWNMIX_H
+
+#include <klingklang/base.h>
+#include <klingklang/format.h>
+
+typedef struct kk_downmix kk_downmix_t;
+typedef void (*kk_downmix_func) (kk_downmix_t *mix, float *dst, const float *src, size_t frames);
+
+/**
+ * Mixes interleaved float samples with in channels down to out channels.
+ * Output channel o is the sum of input channel i times matrix[o][i] over
+ * all input channels.
+ *
+ * The kernels keep the matrix column by column, padded to 8 floats: every
+ * input sample gets multiplied with its column and added to the output
+ * frame, which is a single vector register.
+ *
+ * Unless the user passes a matrix for the channel counts in question, the
+ * downmix only works to mono and stereo. The default matrices follow the
+ * speaker positions of the input. Without positions, they assume the
+ * channel orders of FLAC and WAV files: L R C, L R BL BR, L R C BL BR,
+ * L R C LFE BL BR, L R C LFE BC SL SR and L R C LFE BL BR SL SR.
+ */
+struct kk_downmix {
+  float columns[KK_FORMAT_MAX_CHANNELS][KK_FORMAT_MAX_CHANNELS];
+  struct {
+    float matrix[KK_FORMAT_MAX_CHANNELS][KK_FORMAT_MAX_CHANNELS];
+    size_t rows;
+    size_t cols;
+  } user;
+  size_t in;
+  size_t out;
+  kk_downmix_func kernel;
+};
+
+/**
+ * The matrix string holds the rows of a user defined matrix, separated by
+ * semicolons. The coefficients of a row are separated by commas. If matrix
+ * is NULL, only the default matrices get used.
+ */
+int kk_downmix_init (kk_downmix_t **mix, const char *matrix);
+int kk_downmix_free (kk_downmix_t *mix);
+
+/**
+ * The positions are those of the input format, see kk_format_t. A user
+ * matrix gets used as it is, regardless of the positions.
+ */
+int kk_downmix_setup (kk_downmix_t *mix, size_t in, size_t out,
+    unsigned int positions);
+
+/**
+ * Mixes frames frames of src to dst. Both buffers must not overlap.
+ */
+void kk_downmix (kk_downmix_t *mix, float *dst, const float *src, size_t frames);
+
+#endif
@@ -9,11 +9,14 @@
 #  define KK_BYTE_ORDER_NATIVE KK_BYTE_ORDER_LITTLE_ENDIAN
 #endif
 
+#define KK_FORMAT_MAX_CHANNELS  8
+
 typedef struct kk_format kk_format_t;
 typedef enum kk_bits kk_bits_t;
 typedef enum kk_byte_order kk_byte_order_t;
 typedef enum kk_channels kk_channels_t;
 typedef enum kk_layout kk_layout_t;
+typedef enum kk_position kk_position_t;
 typedef enum kk_type kk_type_t;
 
 /**
@@ -36,6 +39,12 @@ enum kk_byte_order {
 enum kk_channels {
   KK_CHANNELS_1,
   KK_CHANNELS_2,
+  KK_CHANNELS_3,
+  KK_CHANNELS_4,
+  KK_CHANNELS_5,
+  KK_CHANNELS_6,
+  KK_CHANNELS_7,
+  KK_CHANNELS_8,
 };
 
 enum kk_layout {
@@ -43,6 +52,30 @@ enum kk_layout {
   KK_LAYOUT_INTERLEAVED,
 };
 
+/**
+ * Speaker positions, in the order FFmpeg and WAVEEX use for their channel
+ * masks. The positions of a format hold KK_FORMAT_POSITION of every channel
+ * and the channels come in the order of these bits. If positions is 0, the
+ * decoder didn't tell and the usual order for the number of channels
+ * applies.
+ */
+enum kk_position {
+  KK_POSITION_FL,
+  KK_POSITION_FR,
+  KK_POSITION_FC,
+  KK_POSITION_LFE,
+  KK_POSITION_BL,
+  KK_POSITION_BR,
+  KK_POSITION_FLC,
+  KK_POSITION_FRC,
+  KK_POSITION_BC,
+  KK_POSITION_SL,
+  KK_POSITION_SR,
+  KK_POSITIONS,
+};
+
+#define KK_FORMAT_POSITION(pos)  (1u << (pos))
+
 enum kk_type {
   KK_TYPE_UINT,
   KK_TYPE_SINT,
@@ -56,9 +89,12 @@ struct kk_format {
   kk_layout_t layout;
   kk_type_t type;
   unsigned int sample_rate;
+  unsigned int positions;
 };
 
+int kk_format_equal (kk_format_t *a, kk_format_t *b);
 int kk_format_get_channels (kk_format_t *fmt);
+int kk_format_set_channels (kk_format_t *fmt, int channels);
 int kk_format_get_bits (kk_format_t *fmt);
 
 const char *kk_format_get_type_str (kk_format_t *fmt);
@@ -4,21 +4,55 @@
 #include <klingklang/base.h>
 #include <klingklang/format.h>
 
-#define KK_FRAME_MAX_PLANES		2
+#define KK_FRAME_MAX_PLANES		KK_FORMAT_MAX_CHANNELS
+
+/**
+ * The pool hands out buffers of KK_FRAME_POOL_CLASSES size classes. The
+ * smallest class holds KK_FRAME_POOL_MIN_SIZE bytes, every following class
+ * twice as much as the previous one.
+ */
+#define KK_FRAME_POOL_CLASSES   8
+#define KK_FRAME_POOL_MIN_SIZE  (1 << 12)
 
 typedef struct kk_frame kk_frame_t;
+typedef struct kk_frame_buffer kk_frame_buffer_t;
+typedef struct kk_frame_pool kk_frame_pool_t;
 
 struct kk_frame {
-  float prog;
   size_t size;
   size_t samples;
   size_t planes;
   uint8_t *data[KK_FRAME_MAX_PLANES];
+  kk_frame_pool_t *pool;
+};
+
+struct kk_frame_buffer {
+  kk_frame_buffer_t *next;
+  size_t size;
+};
+
+/**
+ * Buffers returned to the pool stay allocated until the pool gets freed,
+ * so once the pool holds enough buffers of the needed classes, getting a
+ * buffer doesn't touch the heap anymore. The pool isn't thread-safe.
+ */
+struct kk_frame_pool {
+  kk_frame_buffer_t *free[KK_FRAME_POOL_CLASSES];
+  size_t allocs;
 };
 
 int kk_frame_init (kk_frame_t **frame);
+int kk_frame_init_pooled (kk_frame_t **frame, kk_frame_pool_t *pool);
 int kk_frame_free (kk_frame_t *frame);
 
+int kk_frame_pool_init (kk_frame_pool_t **pool);
+int kk_frame_pool_free (kk_frame_pool_t *pool);
+int kk_frame_pool_reserve (kk_frame_pool_t *pool, size_t size, size_t count);
+uint8_t *kk_frame_pool_get (kk_frame_pool_t *pool, size_t size);
+void kk_frame_pool_put (kk_frame_pool_t *pool, uint8_t *data);
+size_t kk_frame_pool_get_allocs (kk_frame_pool_t *pool);
+
+int kk_frame_reserve (kk_frame_t *frame, size_t planes, size_t size);
 int kk_frame_interleave (kk_frame_t *restrict dst, kk_frame_t *restrict src, kk_format_t *fmt);
 
 #endif
@@ -4,12 +4,32 @@
 #include <klingklang/format.h>
 #include <klingklang/frame.h>
 
+/**
+ * Maximum number of frames kk_input_get_frames decodes at once.
+ */
+#define KK_INPUT_MAX_FRAMES     8
+
 typedef struct kk_input kk_input_t;
 
 int kk_input_init (kk_input_t **inp, const char *filename);
 int kk_input_free (kk_input_t *inp);
+
+/**
+ * Seeks to the sample at the given percentage of the track, the given time
+ * in seconds or the given sample. The first frame decoded afterwards starts
+ * right at that sample, as far as the timestamps of the file are exact.
+ */
 int kk_input_seek (kk_input_t *inp, float perc);
+int kk_input_seek_time (kk_input_t *inp, double time);
+int kk_input_seek_sample (kk_input_t *inp, int64_t sample);
+
+/**
+ * Returns the length of the track in seconds or 0 if it's unknown.
+ */
+double kk_input_get_duration (kk_input_t *inp);
+
 int kk_input_get_frame (kk_input_t *inp, kk_frame_t *frame);
+int kk_input_get_frames (kk_input_t *inp, kk_frame_t *frames, size_t count);
 int kk_input_get_format (kk_input_t *inp, kk_format_t *format);
 
 #endif
@@ -0,0 +1,79 @@
+#ifndef KK_LIBRARY_CACHE_H
+#define KK_LIBRARY_CACHE_H
+
+#include <klingklang/base.h>
+#include <klingklang/library.h>
+
+typedef struct kk_library_cache kk_library_cache_t;
+typedef struct kk_library_cache_dir kk_library_cache_dir_t;
+typedef struct kk_library_cache_file kk_library_cache_file_t;
+
+/**
+ * A directory refers to count files starting at index first. Strings are
+ * given as offsets into the string area.
+ */
+struct kk_library_cache_dir {
+  int64_t mtime;
+  uint32_t base;
+  uint32_t first;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+struct kk_library_cache_file {
+  uint32_t name;
+  uint32_t order;
+};
+
+/**
+ * Contents of the library as found by the last scan. The cache lists every
+ * directory below root, including the ones without audio files, and lives
+ * in a file named after the hash of root. The file gets mapped into memory
+ * and is used as is. Directories are sorted by path, with '/' sorting
+ * before every other character, so the subdirectories of a directory
+ * follow right behind it.
+ */
+struct kk_library_cache {
+  const kk_library_cache_dir_t *dirs;
+  const kk_library_cache_file_t *files;
+  const char *strings;
+  size_t dir_count;
+  size_t file_count;
+  size_t string_size;
+  void *data;
+  size_t size;
+  char *root;
+  char *path;
+  uint32_t flags;
+};
+
+/**
+ * Maps the cache file of root, if there is a valid one. Otherwise the cache
+ * starts out empty. Scans with different flags might find different
+ * directories, so the cache is only valid if it was saved with the same
+ * flags.
+ */
+int kk_library_cache_init (kk_library_cache_t **cache, const char *root, uint32_t flags);
+int kk_library_cache_free (kk_library_cache_t *cache);
+
+/**
+ * Returns the cached directory with the given base or NULL if there is none.
+ */
+const kk_library_cache_dir_t *kk_library_cache_find (kk_library_cache_t *cache, const char *base);
+
+/**
+ * Returns the subdirectory of dir following prev or the first one if prev
+ * is NULL. Returns NULL if there are no more.
+ */
+const kk_library_cache_dir_t *kk_library_cache_next_subdir (kk_library_cache_t *cache,
+    const kk_library_cache_dir_t *dir, const kk_library_cache_dir_t *prev);
+
+const char *kk_library_cache_get_str (kk_library_cache_t *cache, uint32_t offset);
+
+/**
+ * Replaces the cache file with the given list of directories, which has to
+ * contain every directory below root.
+ */
+int kk_library_cache_save (kk_library_cache_t *cache, kk_library_dir_t *dirs);
+
+#endif
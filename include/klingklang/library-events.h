@@ -0,0 +1,23 @@
+#ifndef KK_LIBRARY_EVENTS_H
+#define KK_LIBRARY_EVENTS_H
+
+#include <klingklang/event.h>
+
+enum {
+  KK_LIBRARY_SCAN_DONE
+};
+
+typedef struct kk_library_event_scan_done kk_library_event_scan_done_t;
+
+/**
+ * Sent once the background scan of the library finished. Status is -1 if
+ * the scan failed or was cancelled.
+ */
+struct kk_library_event_scan_done {
+  kk_event_fields;
+  int status;
+};
+
+void kk_library_event_scan_done (kk_event_queue_t *queue, int status);
+
+#endif
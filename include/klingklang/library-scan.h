@@ -0,0 +1,80 @@
+#ifndef KK_LIBRARY_SCAN_H
+#define KK_LIBRARY_SCAN_H
+
+#include <klingklang/base.h>
+#include <klingklang/library.h>
+
+#include <pthread.h>
+
+typedef struct kk_library_scan kk_library_scan_t;
+typedef struct kk_library_scan_worker kk_library_scan_worker_t;
+
+/**
+ * Visits a single directory: adds its files and pushes its subdirectories.
+ * Returns the number of files added or -1 if reading the directory failed.
+ */
+typedef int (*kk_library_scan_f) (kk_library_scan_t *scan, kk_library_scan_worker_t *worker,
+    kk_library_dir_t *dir);
+
+/**
+ * Every worker owns a deque of directories. The owner pushes and pops at the
+ * tail, so it walks its part of the tree depth first. Idle workers steal
+ * from the head, where the directories closest to the root wait, which
+ * tend to have the most work below them. Directories a worker finished
+ * visiting are linked into its own list.
+ */
+struct kk_library_scan_worker {
+  kk_library_scan_t *scan;
+  kk_library_dir_t **items;
+  size_t head;
+  size_t tail;
+  size_t cap;
+  kk_library_dir_t *first;
+  kk_library_dir_t *last;
+  pthread_mutex_t mutex;
+  pthread_t thread;
+  unsigned running:1;
+};
+
+/**
+ * Visits all directories of a library on a bounded pool of threads. Number
+ * of threads is given by KK_LIBRARY_THREADS. The calling thread works as
+ * the first worker, so a single thread scans without starting any others.
+ * Counters are updated while the scan runs and may be read by any thread.
+ */
+struct kk_library_scan {
+  kk_library_scan_f visit;
+  void *arg;
+  kk_library_scan_worker_t *workers;
+  size_t count;
+  size_t queued;
+  size_t pending;
+  size_t dirs;
+  size_t files;
+  unsigned idle;
+  int failed;
+  kk_library_dir_t **roots;
+  size_t num_roots;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+int kk_library_scan_init (kk_library_scan_t **scan, kk_library_scan_f visit, void *arg);
+int kk_library_scan_free (kk_library_scan_t *scan);
+
+/**
+ * Visits the directories linked to *dirs and everything below them in a
+ * single run. Afterwards *dirs points to all visited directories, sorted by
+ * path, no matter which worker visited them. Returns -1 if one of the
+ * given directories couldn't be visited.
+ */
+int kk_library_scan_run (kk_library_scan_t *scan, kk_library_dir_t **dirs);
+
+/**
+ * Queues a directory found by the visit function.
+ */
+int kk_library_scan_push (kk_library_scan_worker_t *worker, kk_library_dir_t *dir);
+
+void kk_library_scan_get_progress (kk_library_scan_t *scan, kk_library_scan_progress_t *progress);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef KK_LIBRARY_WATCH_H
+#define KK_LIBRARY_WATCH_H
+
+#include <klingklang/base.h>
+#include <klingklang/library.h>
+
+typedef struct kk_library_watch kk_library_watch_t;
+
+/**
+ * Keeps a library up to date while klingklang runs. Every directory of the
+ * library gets an inotify watch, the directories are found by the watch
+ * descriptors of the events. Directories reachable on more than one path,
+ * like linked ones, share a single watch. Events only mark the directory
+ * they happened in as dirty, so copying an album results in a single update
+ * of its directory. Only available on systems with inotify.
+ */
+struct kk_library_watch {
+  kk_library_t *lib;
+  kk_library_dir_t **watches;
+  uint8_t *shared;
+  size_t cap;
+  kk_library_dir_t **dirty;
+  size_t len;
+  size_t size;
+  int fd;
+  unsigned events:1;
+  unsigned overflow:1;
+  unsigned full:1;
+  unsigned rescan:1;
+};
+
+int kk_library_watch_init (kk_library_watch_t **watch, kk_library_t *lib);
+int kk_library_watch_free (kk_library_watch_t *watch);
+
+int kk_library_watch_get_fd (kk_library_watch_t *watch);
+
+/**
+ * Reads all pending events. Call it once the file descriptor is readable.
+ */
+int kk_library_watch_read (kk_library_watch_t *watch);
+
+/**
+ * Meant to be called periodically. Updates the dirty directories at once,
+ * but only if no events arrived since the last call. If the kernel dropped
+ * events, the library gets read again in the background. Returns 1 if the
+ * library was updated.
+ */
+int kk_library_watch_update (kk_library_watch_t *watch);
+
+/**
+ * Called with the status of the KK_LIBRARY_SCAN_DONE event that ends a
+ * rescan. Puts the new library in place and moves the watches over to it.
+ */
+int kk_library_watch_rescan_done (kk_library_watch_t *watch, int status);
+
+#endif
@@ -2,32 +2,150 @@
 #define KK_LIBRARY_H
 
 #include <klingklang/base.h>
+#include <klingklang/event.h>
+#include <klingklang/library-events.h>
 #include <klingklang/list.h>
 
+#include <pthread.h>
+
+typedef struct kk_library kk_library_t;
 typedef struct kk_library_dir kk_library_dir_t;
 typedef struct kk_library_file kk_library_file_t;
+typedef struct kk_library_scan_progress kk_library_scan_progress_t;
+
+/**
+ * Called for every directory kk_library_update added or removed.
+ */
+typedef void (*kk_library_update_f) (kk_library_dir_t *dir, int added, void *arg);
 
-typedef kk_library_dir_t kk_library_t;  /* shh.. don't tell anyone */
+/**
+ * The first directory is root itself. Files and directories removed by an
+ * update are kept until the library gets freed, since the player might
+ * still refer to them.
+ *
+ * The library gets scanned on a background thread. Until the scan is
+ * complete, dirs must not be touched by other threads. Instead, every
+ * directory is put in front of snapshot once its files are known. Published
+ * directories don't change anymore, so other threads can walk the snapshot
+ * at any time. A rescan reads the library again into the directories of
+ * rescan, which replace dirs once it's finished.
+ *
+ * Dirty is set once an update changed the library. The numbers of the files
+ * and the cache stay behind until the library gets freed.
+ *
+ * The initial scan and all rescans run on scan, which keeps their counters
+ * around until the next one starts.
+ */
+struct kk_library {
+  kk_library_dir_t *dirs;
+  kk_library_dir_t *snapshot;
+  kk_library_dir_t *rescan;
+  kk_library_dir_t *removed_dirs;
+  kk_library_file_t *removed_files;
+  kk_event_queue_t *events;
+  struct kk_library_scan *scan;
+  char *root;
+  int follow;
+  int complete;
+  int cancel;
+  pthread_t thread;
+  unsigned running:1;
+  unsigned dirty:1;
+};
 
+/**
+ * Every directory below root is part of the library, even if it contains no
+ * audio files. Base is the path relative to root, parent is NULL for root
+ * itself. The mtime of a directory is given in nanoseconds. It tells
+ * whether the cached entries of the directory are still valid. Device and
+ * inode number identify the directory when following symbolic links.
+ */
 struct kk_library_dir {
   kk_library_dir_t *next;
+  kk_library_dir_t *snapshot;
+  kk_library_dir_t *parent;
   kk_library_file_t *children;
   char *root;
   char *base;
+  int64_t mtime;
+  uint64_t dev;
+  uint64_t ino;
 };
 
+/**
+ * Files are numbered in natural sort order of their paths. Files added by
+ * an update have no number until the library gets numbered again.
+ */
 struct kk_library_file {
   kk_library_file_t *next;
   kk_library_dir_t *parent;
   char *name;
+  size_t order;
+};
+
+/**
+ * Directories and files a scan visited so far. Pending directories were
+ * found, but not visited yet.
+ */
+struct kk_library_scan_progress {
+  size_t dirs;
+  size_t files;
+  size_t pending;
 };
 
 size_t kk_library_dir_get_path (kk_library_dir_t *dir, char *dst, size_t len);
 size_t kk_library_file_get_path (kk_library_file_t *file, char *dst, size_t len);
 size_t kk_library_file_get_album_cover_path (kk_library_file_t *file, char *dst, size_t len);
 
+/**
+ * Opens the library at path and starts scanning it in the background. Only
+ * fails if path can't be opened. A KK_LIBRARY_SCAN_DONE event follows once
+ * the scan is complete.
+ */
 int kk_library_init (kk_library_t **lib, const char *path);
 int kk_library_free (kk_library_t *lib);
+
+/**
+ * Searches the library for files matching all words of keyword. While the
+ * scan is still running, only the directories scanned so far are searched.
+ * Results are in natural sort order of their paths.
+ */
 int kk_library_find (kk_library_t *lib, const char *keyword, kk_list_t **selection);
 
+int kk_library_get_event_fd (kk_library_t *lib);
+
+/**
+ * Returns 1 once the background scan is complete.
+ */
+int kk_library_is_complete (kk_library_t *lib);
+
+/**
+ * Gets the progress of the running background scan or rescan. Once it's
+ * done, these are the totals of the library.
+ */
+void kk_library_get_progress (kk_library_t *lib, kk_library_scan_progress_t *progress);
+
+/**
+ * Reads the given directories again and applies the differences to the
+ * library. New subdirectories get scanned completely, vanished ones get
+ * removed with everything below them. Entries of dirs that get removed on
+ * the way are set to NULL. Must not be called before the scan is complete.
+ */
+int kk_library_update (kk_library_t *lib, kk_library_dir_t **dirs, size_t count,
+    kk_library_update_f func, void *arg);
+
+/**
+ * Reads every directory again in the background, for when changes got
+ * missed. The library stays as it is until the KK_LIBRARY_SCAN_DONE event
+ * arrives. Must not be called before the scan is complete.
+ */
+int kk_library_rescan (kk_library_t *lib);
+
+/**
+ * Called with the status of the KK_LIBRARY_SCAN_DONE event of a rescan. If
+ * it succeeded, its directories replace the current ones, which are kept
+ * like removed ones. Returns -1 if the library stayed as it was.
+ */
+int kk_library_finish_rescan (kk_library_t *lib, int status);
+
 #endif
@@ -0,0 +1,24 @@
+#ifndef KK_MIX_H
+#define KK_MIX_H
+
+#include <klingklang/base.h>
+#include <klingklang/format.h>
+
+int kk_mix_is_supported (kk_format_t *fmt);
+
+/**
+ * Mixes len bytes of samples: dst = dst * a + src * b. The samples have to
+ * be in a format kk_mix_is_supported returns true for. Passing dst as src
+ * and 0 as b simply scales dst.
+ */
+void kk_mix (kk_format_t *fmt, void *dst, const void *src, size_t len,
+    float a, float b);
+
+/**
+ * Equal power crossfade curve. Returns the gain of the track fading in at
+ * position t of the crossfade, where t goes from 0 to 1. The gain of the
+ * track fading out is kk_mix_gain (1 - t).
+ */
+float kk_mix_gain (float t);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef KK_PLAYER_COMMANDS_H
+#define KK_PLAYER_COMMANDS_H
+
+#include <klingklang/base.h>
+
+#include <pthread.h>
+
+#define KK_PLAYER_MAX_COMMANDS  64
+
+enum {
+  KK_PLAYER_COMMAND_NEXT,
+  KK_PLAYER_COMMAND_QUIT,
+  KK_PLAYER_COMMAND_SEEK,
+  KK_PLAYER_COMMAND_START,
+  KK_PLAYER_COMMAND_STOP,
+};
+
+typedef struct kk_player_command kk_player_command_t;
+typedef struct kk_player_commands kk_player_commands_t;
+
+/**
+ * Seek commands go to time seconds if time isn't negative, otherwise to
+ * perc of the current track. The other commands ignore both fields.
+ */
+struct kk_player_command {
+  int type;
+  float perc;
+  double time;
+};
+
+/**
+ * Bounded multi-producer/single-consumer queue of commands. Any thread may
+ * push commands, only the decoder thread pops them. Neither takes a lock,
+ * every slot carries a sequence number which tells whether it's free or
+ * holds a command. The mutex and condition variable are only used to put
+ * the decoder thread to sleep if it has nothing else to do.
+ */
+struct kk_player_commands {
+  struct {
+    kk_player_command_t command;
+    size_t seq;
+  } items[KK_PLAYER_MAX_COMMANDS];
+  size_t head;
+  size_t tail;
+  unsigned waiters;
+  pthread_cond_t cond;
+  pthread_mutex_t mutex;
+};
+
+int kk_player_commands_init (kk_player_commands_t **cmds);
+int kk_player_commands_free (kk_player_commands_t *cmds);
+
+/**
+ * Returns -1 if the queue is full.
+ */
+int kk_player_commands_push (kk_player_commands_t *cmds, const kk_player_command_t *cmd);
+
+/**
+ * Returns -1 if the queue is empty.
+ */
+int kk_player_commands_pop (kk_player_commands_t *cmds, kk_player_command_t *cmd);
+
+/**
+ * Blocks until the queue holds at least one command.
+ */
+void kk_player_commands_wait (kk_player_commands_t *cmds);
+
+const char *kk_player_command_get_name (int type);
+
+#endif
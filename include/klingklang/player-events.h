@@ -5,26 +5,31 @@
 #include <klingklang/library.h>
 
 enum {
+  KK_PLAYER_DONE,
   KK_PLAYER_PAUSE,
-  KK_PLAYER_PROGRESS,
   KK_PLAYER_SEEK,
   KK_PLAYER_START,
   KK_PLAYER_STOP,
 };
 
+typedef struct kk_player_event_done kk_player_event_done_t;
 typedef struct kk_player_event_pause kk_player_event_pause_t;
-typedef struct kk_player_event_progress kk_player_event_progress_t;
 typedef struct kk_player_event_seek kk_player_event_seek_t;
 typedef struct kk_player_event_start kk_player_event_start_t;
 typedef struct kk_player_event_stop kk_player_event_stop_t;
 
-struct kk_player_event_pause {
+/**
+ * Sent after the decoder thread executed a command. Status is the result
+ * of the command, -1 if it failed.
+ */
+struct kk_player_event_done {
   kk_event_fields;
+  int command;
+  int status;
 };
 
-struct kk_player_event_progress {
+struct kk_player_event_pause {
   kk_event_fields;
-  float progress;
 };
 
 struct kk_player_event_seek {
@@ -41,9 +46,9 @@ struct kk_player_event_stop {
   kk_event_fields;
 };
 
+void kk_player_event_done (kk_event_queue_t *queue, int command, int status);
 void kk_player_event_seek (kk_event_queue_t *queue, float perc);
 void kk_player_event_start (kk_event_queue_t *queue, kk_library_file_t *file);
-void kk_player_event_progress (kk_event_queue_t *queue, float progress);
 void kk_player_event_stop (kk_event_queue_t *queue);
 void kk_player_event_pause (kk_event_queue_t *queue);
 
@@ -2,24 +2,140 @@
 #define KK_PLAYER_H
 
 #include <klingklang/base.h>
+#include <klingklang/convert.h>
 #include <klingklang/input.h>
 #include <klingklang/device.h>
 #include <klingklang/library.h>
+#include <klingklang/player-commands.h>
 #include <klingklang/player-events.h>
 #include <klingklang/player-queue.h>
+#include <klingklang/ringbuffer.h>
 
 #include <pthread.h>
 
+#define KK_PLAYER_MAX_MARKS     16
+
 typedef struct kk_player kk_player_t;
+typedef struct kk_player_anchor kk_player_anchor_t;
+typedef struct kk_player_mark kk_player_mark_t;
+
+/**
+ * Anchors tie a buffer position to a position in seconds in a track with
+ * the given duration and sample rate. The playback clock counts from the
+ * last anchor the user already hears.
+ */
+struct kk_player_anchor {
+  size_t pos;
+  double time;
+  double duration;
+  unsigned int rate;
+};
+
+/**
+ * Marks tell the output thread at which buffer position a new track starts
+ * or, if file is NULL, where playback stops. This way the events are sent
+ * when the user hears the change, not when the decoder thread gets there.
+ */
+struct kk_player_mark {
+  size_t pos;
+  kk_library_file_t *file;
+  double duration;
+  unsigned int rate;
+};
 
+/**
+ * The player runs two threads. The decoder thread reads frames from input
+ * and writes their samples to buffer. The output thread reads samples from
+ * buffer and writes them to device. The samples in buffer are always
+ * interleaved and stored in the format of the device. If the device can't
+ * play the format of a track, convert turns its samples into a format the
+ * device can play before they enter buffer. If rate isn't 0, the device
+ * always runs at this sample rate and convert resamples every track. If
+ * channels isn't 0, tracks with more channels get mixed down to channels.
+ *
+ * When the decoder reaches the end of input, it opens the next track right
+ * away. If both tracks share the same format, the samples of the next track
+ * go straight behind the current ones and the device keeps running. Until
+ * the output thread reaches the start of the next track, the user still
+ * hears the previous one, so its input stays open as prev. Tracks in
+ * different formats go right behind each other as well, as long as their
+ * samples get converted to the same device format.
+ *
+ * If crossfading is enabled, the last samples of every track wait in fade
+ * before they enter buffer. This way the decoder thread can mix them with
+ * the first samples of the next track.
+ *
+ * Only the decoder thread touches the decoder state. Other threads control
+ * it by posting commands to commands, which the decoder thread executes
+ * between two frames. It reports back with a done event per command.
+ *
+ * The output thread keeps the playback clock. After every write, it takes
+ * the number of samples written minus the delay of the device and
+ * publishes the resulting time in clock. Clock is a sequence lock, so any
+ * thread can read it at any time without taking a lock.
+ */
 struct kk_player {
   kk_player_queue_t *queue;
+  kk_player_commands_t *commands;
   kk_event_queue_t *events;
   kk_input_t *input;
   kk_device_t *device;
-  pthread_cond_t cond;
-  pthread_mutex_t mutex;
+  kk_ringbuffer_t *buffer;
+  kk_frame_pool_t *pool;
+  kk_frame_t *frame;
+  kk_frame_t *converted;
+  kk_convert_t *convert;
+  kk_format_t format;
+  size_t stride;
+  size_t chunk;
+  size_t need;
+  struct {
+    kk_input_t *input;
+    kk_format_t format;
+  } prev;
+  struct {
+    kk_input_t *input;
+    kk_format_t format;
+    kk_library_file_t *file;
+  } next;
+  struct {
+    kk_player_mark_t items[KK_PLAYER_MAX_MARKS];
+    size_t head;
+    size_t tail;
+  } marks;
+  struct {
+    uint8_t *data;
+    size_t size;
+    size_t head;
+    size_t fill;
+    size_t window;
+    size_t pos;
+    size_t len;
+  } fade;
   pthread_t thread;
+  struct {
+    pthread_cond_t cond;
+    pthread_mutex_t mutex;
+    pthread_t thread;
+    uint8_t *buffer;
+    double time;
+    kk_player_anchor_t flush;
+    int request;
+    unsigned alive:1;
+  } output;
+  struct {
+    kk_player_anchor_t current;
+    kk_player_anchor_t next;
+    unsigned pending;
+    unsigned seq;
+    double time;
+    double duration;
+  } clock;
+  int abort;
+  int start;
+  unsigned int rate;
+  unsigned int channels;
+  float crossfade;
   unsigned pause:1;
   unsigned shuffle:1;
 };
@@ -30,8 +146,12 @@ int kk_player_start (kk_player_t *player);
 int kk_player_pause (kk_player_t *player);
 int kk_player_stop (kk_player_t *player);
 int kk_player_seek (kk_player_t *player, float perc);
+int kk_player_seek_time (kk_player_t *player, double time);
 int kk_player_next (kk_player_t *player);
 
 int kk_player_get_event_fd (kk_player_t *player);
+int kk_player_get_position (kk_player_t *player, double *time, double *duration);
+int kk_player_get_buffer_fill (kk_player_t *player, size_t *fill, size_t *size);
+size_t kk_player_get_frame_allocs (kk_player_t *player);
 
 #endif
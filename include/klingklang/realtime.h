@@ -0,0 +1,35 @@
+#ifndef KK_REALTIME_H
+#define KK_REALTIME_H
+
+#include <klingklang/base.h>
+
+/**
+ * Real-time mode is off unless KK_REALTIME is set. It asks the system for
+ * real-time scheduling of the output thread and keeps the memory it needs
+ * from getting swapped out. The system might refuse either request, in which
+ * case playback works as usual. All functions report what got granted.
+ */
+int kk_realtime_is_enabled (void);
+
+/**
+ * Locks all current and future memory of the process. Only tried if the
+ * process may lock an unlimited amount of memory, otherwise later
+ * allocations would start failing. Returns -1 if nothing got locked.
+ */
+int kk_realtime_lock_memory (void);
+
+/**
+ * Touches every page of the buffer and locks it in memory. Name is only
+ * used in the report.
+ */
+int kk_realtime_lock (const char *name, void *ptr, size_t len);
+
+/**
+ * Called by a thread right after it started. Pins the thread to the CPUs
+ * listed in the KK_AFFINITY_<NAME> setting, if it's set. If realtime isn't
+ * zero and real-time mode is on, the thread gets real-time scheduling and
+ * its stack gets touched in advance.
+ */
+int kk_realtime_setup_thread (const char *name, int realtime);
+
+#endif
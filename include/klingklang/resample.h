@@ -0,0 +1,73 @@
+#ifndef KK_RESAMPLE_H
+#define KK_RESAMPLE_H
+
+#include <klingklang/base.h>
+
+typedef struct kk_resample kk_resample_t;
+
+enum {
+  KK_RESAMPLE_LOW,
+  KK_RESAMPLE_MEDIUM,
+  KK_RESAMPLE_HIGH,
+};
+
+/**
+ * Polyphase resampler for interleaved float samples. The ratio of the sample
+ * rates gets reduced to out / in = den / step. Every output frame lies frac
+ * / den frames behind input frame pos. The filter holds a windowed sinc for
+ * each of phases + 1 fractional positions. If den is larger than the maximum
+ * number of phases of the quality preset, frac gets rounded to the nearest
+ * phase.
+ *
+ * The resampler keeps the last taps frames of input in planar buffers, so
+ * the filter kernels work on contiguous samples.
+ */
+struct kk_resample {
+  unsigned int in_rate;
+  unsigned int out_rate;
+  int quality;
+  size_t channels;
+  size_t taps;
+  size_t phases;
+  size_t step;
+  size_t den;
+  size_t frac;
+  size_t pos;
+  size_t fill;
+  size_t frames;
+  size_t size;
+  float *filter;
+  float *planes;
+};
+
+int kk_resample_init (kk_resample_t **rs);
+int kk_resample_free (kk_resample_t *rs);
+
+/**
+ * Parses the name of a quality preset. Returns -1 for unknown names.
+ */
+int kk_resample_get_quality (const char *name);
+
+/**
+ * Prepares the resampler for frames of channels samples, passed in chunks of
+ * at most frames frames. If nothing changed since the last call, the
+ * resampler keeps its state.
+ */
+int kk_resample_setup (kk_resample_t *rs, unsigned int in_rate,
+    unsigned int out_rate, size_t channels, size_t frames, int quality);
+
+void kk_resample_reset (kk_resample_t *rs);
+
+/**
+ * Returns the maximum number of frames kk_resample produces from the given
+ * number of input frames.
+ */
+size_t kk_resample_get_frames (kk_resample_t *rs, size_t frames);
+
+/**
+ * Resamples frames frames of src to dst and returns the number of frames
+ * written to dst.
+ */
+size_t kk_resample (kk_resample_t *rs, float *dst, const float *src, size_t frames);
+
+#endif
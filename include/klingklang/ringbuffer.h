@@ -0,0 +1,57 @@
+#ifndef KK_RINGBUFFER_H
+#define KK_RINGBUFFER_H
+
+#include <klingklang/base.h>
+
+#include <pthread.h>
+
+typedef struct kk_ringbuffer kk_ringbuffer_t;
+
+/**
+ * Single-producer/single-consumer ring buffer. Reading and writing don't
+ * take any locks, only one thread may read and only one thread may write at
+ * a time. The mutex and condition variable are used to put a thread to sleep
+ * if it has to wait for data or space.
+ */
+struct kk_ringbuffer {
+  uint8_t *data;
+  size_t size;
+  size_t mask;
+  size_t rpos;
+  size_t wpos;
+  unsigned waiters;
+  pthread_cond_t cond;
+  pthread_mutex_t mutex;
+  struct {
+    unsigned cond:1;
+    unsigned mutex:1;
+  } init;
+};
+
+int kk_ringbuffer_init (kk_ringbuffer_t **rb, size_t size);
+int kk_ringbuffer_free (kk_ringbuffer_t *rb);
+
+size_t kk_ringbuffer_write (kk_ringbuffer_t *rb, const void *src, size_t len);
+size_t kk_ringbuffer_read (kk_ringbuffer_t *rb, void *dst, size_t len);
+size_t kk_ringbuffer_peek (kk_ringbuffer_t *rb, void **ptr);
+size_t kk_ringbuffer_skip (kk_ringbuffer_t *rb, size_t len);
+
+size_t kk_ringbuffer_wait_fill (kk_ringbuffer_t *rb, size_t len, const int *cancel);
+size_t kk_ringbuffer_wait_space (kk_ringbuffer_t *rb, size_t len, const int *cancel);
+
+/**
+ * Like kk_ringbuffer_wait_space, but checks for space every interval
+ * milliseconds instead of waiting for the reader to wake it up. Readers
+ * that must never take a lock, like audio callbacks, need writers to poll.
+ */
+size_t kk_ringbuffer_poll_space (kk_ringbuffer_t *rb, size_t len, const int *cancel,
+    unsigned interval);
+void kk_ringbuffer_wakeup (kk_ringbuffer_t *rb);
+
+size_t kk_ringbuffer_get_fill (kk_ringbuffer_t *rb);
+size_t kk_ringbuffer_get_space (kk_ringbuffer_t *rb);
+size_t kk_ringbuffer_get_size (kk_ringbuffer_t *rb);
+size_t kk_ringbuffer_get_read_pos (kk_ringbuffer_t *rb);
+size_t kk_ringbuffer_get_write_pos (kk_ringbuffer_t *rb);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef KK_SEEK_INDEX_H
+#define KK_SEEK_INDEX_H
+
+#include <klingklang/base.h>
+
+typedef struct kk_seek_index kk_seek_index_t;
+typedef struct kk_seek_index_entry kk_seek_index_entry_t;
+
+/**
+ * Timestamp of a packet and its byte offset in the file.
+ */
+struct kk_seek_index_entry {
+  int64_t ts;
+  int64_t pos;
+};
+
+/**
+ * Seek index of a single file, sorted by timestamp. Consecutive entries are
+ * at least interval apart. The index lives in a cache file named after the
+ * hash of the path of the file and is only valid as long as size and mtime
+ * of the file stay the same. An index is complete once it covers the whole
+ * file. Next links the indexes waiting to be written in the background.
+ */
+struct kk_seek_index {
+  kk_seek_index_t *next;
+  kk_seek_index_entry_t *entries;
+  size_t count;
+  size_t cap;
+  int64_t interval;
+  uint64_t size;
+  int64_t mtime;
+  char *file;
+  char *path;
+  unsigned complete:1;
+  unsigned dirty:1;
+};
+
+/**
+ * Loads the cached index of file, if there is one. Otherwise the index
+ * starts out empty.
+ */
+int kk_seek_index_init (kk_seek_index_t **idx, const char *file, int64_t interval);
+int kk_seek_index_free (kk_seek_index_t *idx);
+
+/**
+ * Adds an entry behind the last one. Entries closer than interval to the
+ * last one get ignored.
+ */
+int kk_seek_index_add (kk_seek_index_t *idx, int64_t ts, int64_t pos);
+
+/**
+ * Writes the index to its cache file if it changed since it was loaded.
+ */
+int kk_seek_index_save (kk_seek_index_t *idx);
+
+/**
+ * Frees the index like kk_seek_index_free, but if it changed, it gets
+ * written and freed on a background thread instead. Opening and closing
+ * files happens on the decoder thread, which must not wait for the disk.
+ */
+int kk_seek_index_release (kk_seek_index_t *idx);
+
+/**
+ * Waits until all released indexes are written. Called once before exit,
+ * after all inputs are closed.
+ */
+void kk_seek_index_finish (void);
+
+#endif
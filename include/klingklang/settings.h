@@ -0,0 +1,23 @@
+#ifndef KK_SETTINGS_H
+#define KK_SETTINGS_H
+
+#include <klingklang/base.h>
+
+/**
+ * Settings are read from environment variables, just like the MUSICPATH
+ * variable. All variable names start with "KK_". Variables which are not
+ * set or can't be parsed fall back to the given default value.
+ */
+const char *kk_settings_get_str (const char *name, const char *def);
+long kk_settings_get_int (const char *name, long def);
+double kk_settings_get_float (const char *name, double def);
+int kk_settings_get_bool (const char *name, int def);
+
+/**
+ * Writes the path of the cache directory with the given name to dst and
+ * creates the directory if it doesn't exist yet. Returns -1 if that fails
+ * or dst is too small.
+ */
+int kk_settings_get_cache_dir (const char *name, char *dst, size_t len);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <klingklang/base.h>
 
+#include <pthread.h>
+
 enum {
   KK_LOG_ATTACH,
   KK_LOG_DEBUG,
@@ -16,4 +18,17 @@ void kk_err (int status, const char *fmt, ...);
 
 size_t kk_get_next_pow2 (size_t val);
 
+/**
+ * FNV-1a hash of a string, used to name cache files.
+ */
+uint64_t kk_get_hash (const char *str);
+
+/**
+ * Same as pthread_create, but the thread starts with all signals blocked.
+ * Signals like the one of the UI timer only reach the main thread that way,
+ * where they can't cut short the blocking calls of the other threads.
+ */
+int kk_thread_create (pthread_t *thread, const pthread_attr_t *attr,
+    void *(*func) (void *), void *arg);
+
 #endif
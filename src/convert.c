@@ -0,0 +1,980 @@
+#include <klingklang/convert.h>
+#include <klingklang/cpu.h>
+#include <klingklang/downmix.h>
+#include <klingklang/resample.h>
+#include <klingklang/util.h>
+
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define CONVERT_X86
+#  include <immintrin.h>
+#endif
+
+/**
+ * Number of samples converted at once. The samples go from the source
+ * format to a float buffer of this size and from there to the destination
+ * format.
+ */
+#define KK_CONVERT_BLOCK        256
+
+/**
+ * Formats we convert to if the device doesn't support the format of a track,
+ * ordered by size. 24 bit samples are missing on purpose, the backends don't
+ * agree on how to store them.
+ */
+static const struct {
+  kk_type_t type;
+  kk_bits_t bits;
+} convert_formats[] = {
+  { KK_TYPE_UINT, KK_BITS_8 },
+  { KK_TYPE_SINT, KK_BITS_16 },
+  { KK_TYPE_SINT, KK_BITS_32 },
+  { KK_TYPE_FLOAT, KK_BITS_32 },
+};
+
+#define KK_CONVERT_FORMATS \
+  (sizeof (convert_formats) / sizeof (convert_formats[0]))
+
+/**
+ * Reference implementations of the load and store functions. The loaders
+ * scale the samples to [-1, 1).
+ */
+static void
+convert_load_u8 (float *dst, const void *src, size_t n)
+{
+  const uint8_t *s = src;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = (float) ((int) s[i] - 128) * (1.0f / 128.0f);
+}
+
+static void
+convert_load_s16 (float *dst, const void *src, size_t n)
+{
+  const int16_t *s = src;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = (float) s[i] * (1.0f / 32768.0f);
+}
+
+static void
+convert_load_s32 (float *dst, const void *src, size_t n)
+{
+  const int32_t *s = src;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = (float) s[i] * (1.0f / 2147483648.0f);
+}
+
+static void
+convert_load_f32 (float *dst, const void *src, size_t n)
+{
+  memcpy (dst, src, n * sizeof (float));
+}
+
+static void
+convert_load_f64 (float *dst, const void *src, size_t n)
+{
+  const double *s = src;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = (float) s[i];
+}
+
+/**
+ * TPDF dither is the sum of two uniform random values, so it's between -1
+ * and 1 LSB. The random values come from xorshift generators. Their upper
+ * 23 bits become the mantissa of a float in [1, 2).
+ */
+static inline uint32_t
+convert_xorshift (uint32_t x)
+{
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+static inline float
+convert_uniform (uint32_t x)
+{
+  union {
+    uint32_t i;
+    float f;
+  } u;
+
+  u.i = (x >> 9) | 0x3f800000u;
+  return u.f;
+}
+
+static inline float
+convert_dither (kk_convert_t *conv)
+{
+  float a;
+  float b;
+
+  conv->seed[0] = convert_xorshift (conv->seed[0]);
+  a = convert_uniform (conv->seed[0]);
+  conv->seed[0] = convert_xorshift (conv->seed[0]);
+  b = convert_uniform (conv->seed[0]);
+  return a + b - 3.0f;
+}
+
+static void
+convert_store_u8 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  uint8_t *d = dst;
+  size_t i;
+  float v;
+
+  for (i = 0; i < n; i++) {
+    v = src[i] * 128.0f;
+    if (conv->dither)
+      v += convert_dither (conv);
+    if (v > 127.0f)
+      v = 127.0f;
+    if (v < -128.0f)
+      v = -128.0f;
+    d[i] = (uint8_t) (lrintf (v) + 128);
+  }
+}
+
+static void
+convert_store_s16 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  int16_t *d = dst;
+  size_t i;
+  float v;
+
+  for (i = 0; i < n; i++) {
+    v = src[i] * 32768.0f;
+    if (conv->dither)
+      v += convert_dither (conv);
+    if (v > 32767.0f)
+      v = 32767.0f;
+    if (v < -32768.0f)
+      v = -32768.0f;
+    d[i] = (int16_t) lrintf (v);
+  }
+}
+
+/**
+ * The largest float below 2^31 is 2147483520. Clamping to INT32_MAX would
+ * round up to 2^31, which turns into INT32_MIN.
+ */
+static void
+convert_store_s32 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  int32_t *d = dst;
+  size_t i;
+  float v;
+
+  for (i = 0; i < n; i++) {
+    v = src[i] * 2147483648.0f;
+    if (v > 2147483520.0f)
+      v = 2147483520.0f;
+    if (v < -2147483648.0f)
+      v = -2147483648.0f;
+    d[i] = (int32_t) lrintf (v);
+  }
+  (void) conv;
+}
+
+static void
+convert_store_f32 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  (void) conv;
+  memcpy (dst, src, n * sizeof (float));
+}
+
+/**
+ * The vector kernels process as many samples as fill whole registers and
+ * leave the rest to the reference implementation. Without dither, they
+ * produce exactly the same samples. With dither, every lane has its own
+ * generator, the vector kernels use as many seeds as they have lanes.
+ */
+#ifdef CONVERT_X86
+__attribute__ ((target ("sse2")))
+static void
+convert_load_u8_sse2 (float *dst, const void *src, size_t n)
+{
+  const uint8_t *s = src;
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i bias = _mm_set1_epi16 (128);
+  const __m128 scale = _mm_set1_ps (1.0f / 128.0f);
+
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadl_epi64 ((const __m128i *) (const void *) (s + i));
+
+    v = _mm_sub_epi16 (_mm_unpacklo_epi8 (v, zero), bias);
+    _mm_storeu_ps (dst + i, _mm_mul_ps (scale,
+            _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16))));
+    _mm_storeu_ps (dst + i + 4, _mm_mul_ps (scale,
+            _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16))));
+  }
+  convert_load_u8 (dst + i, s + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+convert_load_s16_sse2 (float *dst, const void *src, size_t n)
+{
+  const int16_t *s = src;
+  const __m128 scale = _mm_set1_ps (1.0f / 32768.0f);
+
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) (const void *) (s + i));
+
+    /* Sign extend to 32 bits by unpacking into the upper halves */
+    _mm_storeu_ps (dst + i, _mm_mul_ps (scale,
+            _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (v, v), 16))));
+    _mm_storeu_ps (dst + i + 4, _mm_mul_ps (scale,
+            _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpackhi_epi16 (v, v), 16))));
+  }
+  convert_load_s16 (dst + i, s + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+convert_load_s32_sse2 (float *dst, const void *src, size_t n)
+{
+  const int32_t *s = src;
+  const __m128 scale = _mm_set1_ps (1.0f / 2147483648.0f);
+
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) (const void *) (s + i));
+    _mm_storeu_ps (dst + i, _mm_mul_ps (scale, _mm_cvtepi32_ps (v)));
+  }
+  convert_load_s32 (dst + i, s + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+convert_load_f64_sse2 (float *dst, const void *src, size_t n)
+{
+  const double *s = src;
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128 lo = _mm_cvtpd_ps (_mm_loadu_pd (s + i));
+    __m128 hi = _mm_cvtpd_ps (_mm_loadu_pd (s + i + 2));
+    _mm_storeu_ps (dst + i, _mm_movelh_ps (lo, hi));
+  }
+  convert_load_f64 (dst + i, s + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static inline __m128i
+convert_xorshift_sse2 (__m128i x)
+{
+  x = _mm_xor_si128 (x, _mm_slli_epi32 (x, 13));
+  x = _mm_xor_si128 (x, _mm_srli_epi32 (x, 17));
+  x = _mm_xor_si128 (x, _mm_slli_epi32 (x, 5));
+  return x;
+}
+
+__attribute__ ((target ("sse2")))
+static inline __m128
+convert_dither_sse2 (__m128i *seed)
+{
+  const __m128i one = _mm_set1_epi32 (0x3f800000);
+
+  __m128 a;
+  __m128 b;
+
+  *seed = convert_xorshift_sse2 (*seed);
+  a = _mm_castsi128_ps (_mm_or_si128 (_mm_srli_epi32 (*seed, 9), one));
+  *seed = convert_xorshift_sse2 (*seed);
+  b = _mm_castsi128_ps (_mm_or_si128 (_mm_srli_epi32 (*seed, 9), one));
+  return _mm_sub_ps (_mm_add_ps (a, b), _mm_set1_ps (3.0f));
+}
+
+__attribute__ ((target ("sse2")))
+static void
+convert_store_u8_sse2 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  const __m128 scale = _mm_set1_ps (128.0f);
+  const __m128 max = _mm_set1_ps (127.0f);
+  const __m128 min = _mm_set1_ps (-128.0f);
+  const __m128i bias = _mm_set1_epi32 (128);
+
+  uint8_t *d = dst;
+  __m128i seed;
+  size_t i;
+
+  seed = _mm_loadu_si128 ((const __m128i *) (const void *) conv->seed);
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128 lo = _mm_mul_ps (_mm_loadu_ps (src + i), scale);
+    __m128 hi = _mm_mul_ps (_mm_loadu_ps (src + i + 4), scale);
+    __m128i v16;
+
+    if (conv->dither) {
+      lo = _mm_add_ps (lo, convert_dither_sse2 (&seed));
+      hi = _mm_add_ps (hi, convert_dither_sse2 (&seed));
+    }
+
+    lo = _mm_max_ps (_mm_min_ps (lo, max), min);
+    hi = _mm_max_ps (_mm_min_ps (hi, max), min);
+
+    /* Both packs saturate, but the samples are in range already */
+    v16 = _mm_packs_epi32 (
+        _mm_add_epi32 (_mm_cvtps_epi32 (lo), bias),
+        _mm_add_epi32 (_mm_cvtps_epi32 (hi), bias));
+    _mm_storel_epi64 ((__m128i *) (void *) (d + i), _mm_packus_epi16 (v16, v16));
+  }
+
+  _mm_storeu_si128 ((__m128i *) (void *) conv->seed, seed);
+  convert_store_u8 (conv, d + i, src + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+convert_store_s16_sse2 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  const __m128 scale = _mm_set1_ps (32768.0f);
+  const __m128 max = _mm_set1_ps (32767.0f);
+  const __m128 min = _mm_set1_ps (-32768.0f);
+
+  int16_t *d = dst;
+  __m128i seed;
+  size_t i;
+
+  seed = _mm_loadu_si128 ((const __m128i *) (const void *) conv->seed);
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128 lo = _mm_mul_ps (_mm_loadu_ps (src + i), scale);
+    __m128 hi = _mm_mul_ps (_mm_loadu_ps (src + i + 4), scale);
+
+    if (conv->dither) {
+      lo = _mm_add_ps (lo, convert_dither_sse2 (&seed));
+      hi = _mm_add_ps (hi, convert_dither_sse2 (&seed));
+    }
+
+    lo = _mm_max_ps (_mm_min_ps (lo, max), min);
+    hi = _mm_max_ps (_mm_min_ps (hi, max), min);
+
+    _mm_storeu_si128 ((__m128i *) (void *) (d + i),
+        _mm_packs_epi32 (_mm_cvtps_epi32 (lo), _mm_cvtps_epi32 (hi)));
+  }
+
+  _mm_storeu_si128 ((__m128i *) (void *) conv->seed, seed);
+  convert_store_s16 (conv, d + i, src + i, n - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+convert_store_s32_sse2 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  const __m128 scale = _mm_set1_ps (2147483648.0f);
+  const __m128 max = _mm_set1_ps (2147483520.0f);
+  const __m128 min = _mm_set1_ps (-2147483648.0f);
+
+  int32_t *d = dst;
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128 v = _mm_mul_ps (_mm_loadu_ps (src + i), scale);
+    v = _mm_max_ps (_mm_min_ps (v, max), min);
+    _mm_storeu_si128 ((__m128i *) (void *) (d + i), _mm_cvtps_epi32 (v));
+  }
+  convert_store_s32 (conv, d + i, src + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+convert_load_u8_avx2 (float *dst, const void *src, size_t n)
+{
+  const uint8_t *s = src;
+  const __m256i bias = _mm256_set1_epi32 (128);
+  const __m256 scale = _mm256_set1_ps (1.0f / 128.0f);
+
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) (const void *) (s + i)));
+    _mm256_storeu_ps (dst + i, _mm256_mul_ps (scale,
+            _mm256_cvtepi32_ps (_mm256_sub_epi32 (v, bias))));
+  }
+  convert_load_u8 (dst + i, s + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+convert_load_s16_avx2 (float *dst, const void *src, size_t n)
+{
+  const int16_t *s = src;
+  const __m256 scale = _mm256_set1_ps (1.0f / 32768.0f);
+
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *) (const void *) (s + i)));
+    _mm256_storeu_ps (dst + i, _mm256_mul_ps (scale, _mm256_cvtepi32_ps (v)));
+  }
+  convert_load_s16 (dst + i, s + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+convert_load_s32_avx2 (float *dst, const void *src, size_t n)
+{
+  const int32_t *s = src;
+  const __m256 scale = _mm256_set1_ps (1.0f / 2147483648.0f);
+
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *) (const void *) (s + i));
+    _mm256_storeu_ps (dst + i, _mm256_mul_ps (scale, _mm256_cvtepi32_ps (v)));
+  }
+  convert_load_s32 (dst + i, s + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+convert_load_f64_avx2 (float *dst, const void *src, size_t n)
+{
+  const double *s = src;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128 lo = _mm256_cvtpd_ps (_mm256_loadu_pd (s + i));
+    __m128 hi = _mm256_cvtpd_ps (_mm256_loadu_pd (s + i + 4));
+    _mm256_storeu_ps (dst + i, _mm256_insertf128_ps (_mm256_castps128_ps256 (lo), hi, 1));
+  }
+  convert_load_f64 (dst + i, s + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i
+convert_xorshift_avx2 (__m256i x)
+{
+  x = _mm256_xor_si256 (x, _mm256_slli_epi32 (x, 13));
+  x = _mm256_xor_si256 (x, _mm256_srli_epi32 (x, 17));
+  x = _mm256_xor_si256 (x, _mm256_slli_epi32 (x, 5));
+  return x;
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256
+convert_dither_avx2 (__m256i *seed)
+{
+  const __m256i one = _mm256_set1_epi32 (0x3f800000);
+
+  __m256 a;
+  __m256 b;
+
+  *seed = convert_xorshift_avx2 (*seed);
+  a = _mm256_castsi256_ps (_mm256_or_si256 (_mm256_srli_epi32 (*seed, 9), one));
+  *seed = convert_xorshift_avx2 (*seed);
+  b = _mm256_castsi256_ps (_mm256_or_si256 (_mm256_srli_epi32 (*seed, 9), one));
+  return _mm256_sub_ps (_mm256_add_ps (a, b), _mm256_set1_ps (3.0f));
+}
+
+/**
+ * Packing works within 128 bit lanes, so the 64 bit blocks of the result
+ * get put back in order afterwards.
+ */
+__attribute__ ((target ("avx2")))
+static inline __m256i
+convert_pack_avx2 (kk_convert_t *conv, const float *src, __m256 scale,
+    __m256 max, __m256 min, __m256i *seed)
+{
+  __m256 lo = _mm256_mul_ps (_mm256_loadu_ps (src), scale);
+  __m256 hi = _mm256_mul_ps (_mm256_loadu_ps (src + 8), scale);
+
+  if (conv->dither) {
+    lo = _mm256_add_ps (lo, convert_dither_avx2 (seed));
+    hi = _mm256_add_ps (hi, convert_dither_avx2 (seed));
+  }
+
+  lo = _mm256_max_ps (_mm256_min_ps (lo, max), min);
+  hi = _mm256_max_ps (_mm256_min_ps (hi, max), min);
+
+  return _mm256_permute4x64_epi64 (
+      _mm256_packs_epi32 (_mm256_cvtps_epi32 (lo), _mm256_cvtps_epi32 (hi)), 0xd8);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+convert_store_u8_avx2 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  const __m256 scale = _mm256_set1_ps (128.0f);
+  const __m256 max = _mm256_set1_ps (127.0f);
+  const __m256 min = _mm256_set1_ps (-128.0f);
+  const __m256i bias = _mm256_set1_epi16 (128);
+
+  uint8_t *d = dst;
+  __m256i seed;
+  __m256i v;
+  size_t i;
+
+  seed = _mm256_loadu_si256 ((const __m256i *) (const void *) conv->seed);
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    v = _mm256_add_epi16 (convert_pack_avx2 (conv, src + i, scale, max, min, &seed), bias);
+    v = _mm256_permute4x64_epi64 (_mm256_packus_epi16 (v, v), 0x08);
+    _mm_storeu_si128 ((__m128i *) (void *) (d + i), _mm256_castsi256_si128 (v));
+  }
+
+  _mm256_storeu_si256 ((__m256i *) (void *) conv->seed, seed);
+  convert_store_u8 (conv, d + i, src + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+convert_store_s16_avx2 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  const __m256 scale = _mm256_set1_ps (32768.0f);
+  const __m256 max = _mm256_set1_ps (32767.0f);
+  const __m256 min = _mm256_set1_ps (-32768.0f);
+
+  int16_t *d = dst;
+  __m256i seed;
+  size_t i;
+
+  seed = _mm256_loadu_si256 ((const __m256i *) (const void *) conv->seed);
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    _mm256_storeu_si256 ((__m256i *) (void *) (d + i),
+        convert_pack_avx2 (conv, src + i, scale, max, min, &seed));
+  }
+
+  _mm256_storeu_si256 ((__m256i *) (void *) conv->seed, seed);
+  convert_store_s16 (conv, d + i, src + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+convert_store_s32_avx2 (kk_convert_t *conv, void *dst, const float *src, size_t n)
+{
+  const __m256 scale = _mm256_set1_ps (2147483648.0f);
+  const __m256 max = _mm256_set1_ps (2147483520.0f);
+  const __m256 min = _mm256_set1_ps (-2147483648.0f);
+
+  int32_t *d = dst;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_mul_ps (_mm256_loadu_ps (src + i), scale);
+    v = _mm256_max_ps (_mm256_min_ps (v, max), min);
+    _mm256_storeu_si256 ((__m256i *) (void *) (d + i), _mm256_cvtps_epi32 (v));
+  }
+  convert_store_s32 (conv, d + i, src + i, n - i);
+}
+#endif
+
+enum {
+  CONVERT_U8,
+  CONVERT_S16,
+  CONVERT_S32,
+  CONVERT_F32,
+  CONVERT_F64,
+  CONVERT_KERNELS
+};
+
+static kk_convert_load_func convert_loads[CONVERT_KERNELS];
+static kk_convert_store_func convert_stores[CONVERT_KERNELS];
+static pthread_once_t convert_kernels_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the fastest load and store function for every sample format.
+ * There's no store function for doubles, we never convert to them.
+ */
+static void
+convert_select_kernels (void)
+{
+  const unsigned int features = kk_cpu_get_features ();
+
+  convert_loads[CONVERT_U8] = convert_load_u8;
+  convert_loads[CONVERT_S16] = convert_load_s16;
+  convert_loads[CONVERT_S32] = convert_load_s32;
+  convert_loads[CONVERT_F32] = convert_load_f32;
+  convert_loads[CONVERT_F64] = convert_load_f64;
+
+  convert_stores[CONVERT_U8] = convert_store_u8;
+  convert_stores[CONVERT_S16] = convert_store_s16;
+  convert_stores[CONVERT_S32] = convert_store_s32;
+  convert_stores[CONVERT_F32] = convert_store_f32;
+
+#ifdef CONVERT_X86
+  if (features & KK_CPU_SSE2) {
+    convert_loads[CONVERT_U8] = convert_load_u8_sse2;
+    convert_loads[CONVERT_S16] = convert_load_s16_sse2;
+    convert_loads[CONVERT_S32] = convert_load_s32_sse2;
+    convert_loads[CONVERT_F64] = convert_load_f64_sse2;
+    convert_stores[CONVERT_U8] = convert_store_u8_sse2;
+    convert_stores[CONVERT_S16] = convert_store_s16_sse2;
+    convert_stores[CONVERT_S32] = convert_store_s32_sse2;
+  }
+  if (features & KK_CPU_AVX2) {
+    convert_loads[CONVERT_U8] = convert_load_u8_avx2;
+    convert_loads[CONVERT_S16] = convert_load_s16_avx2;
+    convert_loads[CONVERT_S32] = convert_load_s32_avx2;
+    convert_loads[CONVERT_F64] = convert_load_f64_avx2;
+    convert_stores[CONVERT_U8] = convert_store_u8_avx2;
+    convert_stores[CONVERT_S16] = convert_store_s16_avx2;
+    convert_stores[CONVERT_S32] = convert_store_s32_avx2;
+  }
+#endif
+
+  (void) features;
+}
+
+/**
+ * Returns the index of the kernels for samples in format fmt or -1 if we
+ * can't convert them.
+ */
+static int
+convert_get_kernel (kk_format_t *fmt)
+{
+  if (fmt->byte_order != KK_BYTE_ORDER_NATIVE)
+    return -1;
+
+  if ((fmt->type == KK_TYPE_UINT) && (fmt->bits == KK_BITS_8))
+    return CONVERT_U8;
+  if ((fmt->type == KK_TYPE_SINT) && (fmt->bits == KK_BITS_16))
+    return CONVERT_S16;
+  if ((fmt->type == KK_TYPE_SINT) && (fmt->bits == KK_BITS_32))
+    return CONVERT_S32;
+  if ((fmt->type == KK_TYPE_FLOAT) && (fmt->bits == KK_BITS_32))
+    return CONVERT_F32;
+  if ((fmt->type == KK_TYPE_FLOAT) && (fmt->bits == KK_BITS_64))
+    return CONVERT_F64;
+  return -1;
+}
+
+static kk_convert_load_func
+convert_get_load (kk_format_t *fmt)
+{
+  const int kernel = convert_get_kernel (fmt);
+
+  if (kernel < 0)
+    return NULL;
+
+  pthread_once (&convert_kernels_once, convert_select_kernels);
+  return convert_loads[kernel];
+}
+
+static kk_convert_store_func
+convert_get_store (kk_format_t *fmt)
+{
+  const int kernel = convert_get_kernel (fmt);
+
+  if (kernel < 0)
+    return NULL;
+
+  pthread_once (&convert_kernels_once, convert_select_kernels);
+  return convert_stores[kernel];
+}
+
+/**
+ * Returns the number of significant bits of a sample. Floats have 24 bits
+ * of precision, but since we convert through floats anyway, doubles don't
+ * need more than that either.
+ */
+static int
+convert_get_precision (kk_format_t *fmt)
+{
+  if (fmt->type == KK_TYPE_FLOAT)
+    return 24;
+  return kk_format_get_bits (fmt);
+}
+
+static void
+convert_set_format (kk_format_t *dst, kk_format_t *src, size_t i)
+{
+  memcpy (dst, src, sizeof (kk_format_t));
+  dst->type = convert_formats[i].type;
+  dst->bits = convert_formats[i].bits;
+}
+
+/**
+ * Formats which keep all bits of src come first, smallest first. The
+ * formats losing bits follow, largest first.
+ */
+static size_t
+convert_get_formats (kk_format_t *src, kk_format_t *formats, size_t n)
+{
+  const int precision = convert_get_precision (src);
+
+  kk_format_t tmp;
+  size_t result = 0;
+  size_t i;
+
+  if (n == 0)
+    return 0;
+
+  memcpy (formats + result++, src, sizeof (kk_format_t));
+
+  for (i = 0; (i < KK_CONVERT_FORMATS) && (result < n); i++) {
+    convert_set_format (&tmp, src, i);
+    if ((kk_format_equal (&tmp, src)) || (convert_get_precision (&tmp) < precision))
+      continue;
+    memcpy (formats + result++, &tmp, sizeof (kk_format_t));
+  }
+
+  for (i = KK_CONVERT_FORMATS; (i > 0) && (result < n); i--) {
+    convert_set_format (&tmp, src, i - 1);
+    if ((kk_format_equal (&tmp, src)) || (convert_get_precision (&tmp) >= precision))
+      continue;
+    memcpy (formats + result++, &tmp, sizeof (kk_format_t));
+  }
+  return result;
+}
+
+size_t
+kk_convert_get_formats (kk_format_t *src, kk_format_t *formats, size_t n)
+{
+  kk_format_t tmp;
+  size_t result;
+
+  if (convert_get_load (src) == NULL) {
+    if (n == 0)
+      return 0;
+    memcpy (formats, src, sizeof (kk_format_t));
+    return 1;
+  }
+
+  result = convert_get_formats (src, formats, n);
+
+  if (src->channels > KK_CHANNELS_2) {
+    memcpy (&tmp, src, sizeof (kk_format_t));
+    kk_format_set_channels (&tmp, 2);
+    result += convert_get_formats (&tmp, formats + result, n - result);
+  }
+  return result;
+}
+
+int
+kk_convert_init (kk_convert_t **conv, int quality, const char *matrix)
+{
+  kk_convert_t *result;
+
+  result = calloc (1, sizeof (kk_convert_t));
+  if (result == NULL)
+    goto error;
+
+  if (kk_downmix_init (&result->downmix, matrix) != 0)
+    goto error;
+
+  result->quality = quality;
+
+  *conv = result;
+  return 0;
+error:
+  kk_convert_free (result);
+  *conv = NULL;
+  return -1;
+}
+
+int
+kk_convert_free (kk_convert_t *conv)
+{
+  if (conv == NULL)
+    return 0;
+
+  if (conv->downmix)
+    kk_downmix_free (conv->downmix);
+  if (conv->resample)
+    kk_resample_free (conv->resample);
+  free (conv->buffer);
+  free (conv);
+  return 0;
+}
+
+/**
+ * The resampler gets fed one block at a time. Its output goes to buffer,
+ * which is large enough for everything it makes out of a block.
+ */
+static int
+convert_setup_resample (kk_convert_t *conv)
+{
+  const size_t frames = KK_CONVERT_BLOCK / conv->src_channels;
+
+  size_t size;
+
+  if (conv->resample == NULL) {
+    if (kk_resample_init (&conv->resample) != 0)
+      return -1;
+  }
+
+  if (kk_resample_setup (conv->resample, conv->src.sample_rate,
+          conv->dst.sample_rate, conv->dst_channels, frames, conv->quality) != 0)
+    return -1;
+
+  size = kk_resample_get_frames (conv->resample, frames) * conv->dst_channels;
+  if (size > conv->size) {
+    free (conv->buffer);
+    conv->buffer = calloc (size, sizeof (float));
+    if (conv->buffer == NULL) {
+      conv->size = 0;
+      return -1;
+    }
+    conv->size = size;
+  }
+  return 0;
+}
+
+int
+kk_convert_setup (kk_convert_t *conv, kk_format_t *src, kk_format_t *dst)
+{
+  int i;
+
+  memcpy (&conv->src, src, sizeof (kk_format_t));
+  memcpy (&conv->dst, dst, sizeof (kk_format_t));
+  conv->load = NULL;
+  conv->store = NULL;
+  conv->dither = 0;
+  conv->downmixing = 0;
+  conv->resampling = 0;
+
+  if (kk_format_equal (src, dst))
+    return 0;
+
+  if ((src->channels < dst->channels)
+      || (src->layout != KK_LAYOUT_INTERLEAVED)
+      || (dst->layout != KK_LAYOUT_INTERLEAVED))
+    goto error;
+
+  conv->load = convert_get_load (src);
+  conv->store = convert_get_store (dst);
+  if ((conv->load == NULL) || (conv->store == NULL))
+    goto error;
+
+  conv->src_channels = (size_t) kk_format_get_channels (src);
+  conv->dst_channels = (size_t) kk_format_get_channels (dst);
+  conv->src_bytes = (size_t) kk_format_get_bits (src) >> 3;
+  conv->dst_bytes = (size_t) kk_format_get_bits (dst) >> 3;
+
+  if (src->channels != dst->channels) {
+    if (kk_downmix_setup (conv->downmix, conv->src_channels, conv->dst_channels,
+            src->positions) != 0)
+      goto error;
+    conv->downmixing = 1;
+  }
+
+  if (src->sample_rate != dst->sample_rate) {
+    if (convert_setup_resample (conv) != 0)
+      goto error;
+    conv->resampling = 1;
+  }
+
+  /* Mixed samples need dither even if the sample size stays the same */
+  conv->dither = (dst->type != KK_TYPE_FLOAT)
+      && (convert_get_precision (dst) < 24)
+      && ((conv->downmixing) || (conv->resampling)
+          || (convert_get_precision (dst) < convert_get_precision (src)));
+
+  /* Xorshift generators must not start at zero */
+  for (i = 0; i < 8; i++) {
+    if (conv->seed[i] == 0)
+      conv->seed[i] = 0x9e3779b9u * (uint32_t) (i + 1);
+  }
+
+  kk_log (KK_LOG_DEBUG, "Converting %d channels of %d bit %s samples at %u Hz to %d channels of %d bit %s samples at %u Hz%s.",
+      kk_format_get_channels (src), kk_format_get_bits (src), kk_format_get_type_str (src), src->sample_rate,
+      kk_format_get_channels (dst), kk_format_get_bits (dst), kk_format_get_type_str (dst), dst->sample_rate,
+      conv->dither ? " with dither" : "");
+  return 0;
+error:
+  kk_log (KK_LOG_WARNING, "Can't convert %d channels of %d bit %s samples at %u Hz to %d channels of %d bit %s samples at %u Hz.",
+      kk_format_get_channels (src), kk_format_get_bits (src), kk_format_get_type_str (src), src->sample_rate,
+      kk_format_get_channels (dst), kk_format_get_bits (dst), kk_format_get_type_str (dst), dst->sample_rate);
+  conv->load = NULL;
+  conv->store = NULL;
+  conv->downmixing = 0;
+  conv->resampling = 0;
+  return -1;
+}
+
+/**
+ * Drops the samples the resampler holds back. Needed whenever the samples
+ * passed to kk_convert next don't follow the previous ones.
+ */
+void
+kk_convert_reset (kk_convert_t *conv)
+{
+  if (conv->resample)
+    kk_resample_reset (conv->resample);
+}
+
+int
+kk_convert_is_needed (kk_convert_t *conv)
+{
+  return conv->load != NULL;
+}
+
+/**
+ * How many frames the resampler produces only depends on how many frames it
+ * got in total, not on how they were split into blocks.
+ */
+size_t
+kk_convert_get_size (kk_convert_t *conv, size_t len)
+{
+  size_t frames;
+
+  if (!kk_convert_is_needed (conv))
+    return len;
+
+  frames = len / conv->src_bytes / conv->src_channels;
+  if (conv->resampling)
+    frames = kk_resample_get_frames (conv->resample, frames);
+  return frames * conv->dst_channels * conv->dst_bytes;
+}
+
+size_t
+kk_convert (kk_convert_t *conv, void *dst, const void *src, size_t len)
+{
+  const size_t block = (KK_CONVERT_BLOCK / conv->src_channels) * conv->src_channels;
+
+  const uint8_t *s = src;
+  uint8_t *d = dst;
+
+  float samples[KK_CONVERT_BLOCK];
+  float mixed[KK_CONVERT_BLOCK];
+  float *out;
+  size_t frames;
+  size_t n;
+  size_t k;
+  size_t m;
+
+  n = len / conv->src_bytes;
+  while (n > 0) {
+    k = (n < block) ? n : block;
+    conv->load (samples, s, k);
+
+    out = samples;
+    frames = k / conv->src_channels;
+    m = k;
+    if (conv->downmixing) {
+      kk_downmix (conv->downmix, mixed, out, frames);
+      out = mixed;
+      m = frames * conv->dst_channels;
+    }
+
+    if (conv->resampling) {
+      m = kk_resample (conv->resample, conv->buffer, out, frames) * conv->dst_channels;
+      out = conv->buffer;
+    }
+
+    conv->store (conv, d, out, m);
+    s += k * conv->src_bytes;
+    d += m * conv->dst_bytes;
+    n -= k;
+  }
+  return (size_t) (d - (uint8_t *) dst);
+}
@@ -0,0 +1,63 @@
+#include <klingklang/cpu.h>
+#include <klingklang/settings.h>
+#include <klingklang/util.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+static pthread_once_t cpu_once = PTHREAD_ONCE_INIT;
+static unsigned int cpu_features = 0;
+
+/**
+ * On x86 we ask the CPU at runtime. NEON can't be detected without parsing
+ * /proc/cpuinfo, so we rely on the compiler flags there.
+ */
+static void
+cpu_detect (void)
+{
+  unsigned int result = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse2"))
+    result |= KK_CPU_SSE2;
+  if (__builtin_cpu_supports ("avx2"))
+    result |= KK_CPU_AVX2;
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  result |= KK_CPU_NEON;
+#endif
+
+  if (!kk_settings_get_bool ("KK_SIMD", 1))
+    result = 0;
+
+  kk_log (KK_LOG_DEBUG, "CPU features:%s%s%s",
+      (result & KK_CPU_SSE2) ? " sse2" : "",
+      (result & KK_CPU_AVX2) ? " avx2" : "",
+      (result & KK_CPU_NEON) ? " neon" : "");
+
+  cpu_features = result;
+}
+
+unsigned int
+kk_cpu_get_features (void)
+{
+  pthread_once (&cpu_once, cpu_detect);
+  return cpu_features;
+}
+
+size_t
+kk_cpu_get_count (void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  long count = sysconf (_SC_NPROCESSORS_ONLN);
+
+  if (count > 0)
+    return (size_t) count;
+#endif
+  return 1;
+}
@@ -50,6 +50,52 @@ kk_device_drop (kk_device_t *dev)
   return ret;
 }
 
+int
+kk_device_drain (kk_device_t *dev)
+{
+  int ret;
+
+  pthread_mutex_lock (&dev->mutex);
+  ret = device_backend.drain (dev);
+  pthread_mutex_unlock (&dev->mutex);
+  return ret;
+}
+
+/**
+ * Returns -1 if the backend can't pause the device. In this case, samples
+ * already queued in the device keep playing.
+ */
+int
+kk_device_pause (kk_device_t *dev, int pause)
+{
+  int ret;
+
+  if (device_backend.pause == NULL)
+    return -1;
+
+  pthread_mutex_lock (&dev->mutex);
+  ret = device_backend.pause (dev, pause);
+  pthread_mutex_unlock (&dev->mutex);
+  return ret;
+}
+
+/**
+ * Returns -1 if the backend can't tell the delay of the device.
+ */
+int
+kk_device_delay (kk_device_t *dev, size_t *frames)
+{
+  int ret;
+
+  if (device_backend.delay == NULL)
+    return -1;
+
+  pthread_mutex_lock (&dev->mutex);
+  ret = device_backend.delay (dev, frames);
+  pthread_mutex_unlock (&dev->mutex);
+  return ret;
+}
+
 int
 kk_device_setup (kk_device_t *dev, kk_format_t *format)
 {
@@ -63,6 +109,27 @@ kk_device_setup (kk_device_t *dev, kk_format_t *format)
   return ret;
 }
 
+/**
+ * Tells whether the backend might be able to play samples in the given
+ * format. Only kk_device_setup knows for sure.
+ */
+int
+kk_device_is_supported (kk_device_t *dev, kk_format_t *format)
+{
+  int ret;
+
+  if ((device_backend.formats[format->type] & KK_DEVICE_BITS (format->bits)) == 0)
+    return 0;
+
+  if (device_backend.channels == NULL)
+    return 1;
+
+  pthread_mutex_lock (&dev->mutex);
+  ret = device_backend.channels (dev, kk_format_get_channels (format));
+  pthread_mutex_unlock (&dev->mutex);
+  return ret;
+}
+
 int
 kk_device_write (kk_device_t *dev, kk_frame_t *frame)
 {
@@ -1,28 +1,57 @@
 #include <klingklang/base.h>
 #include <klingklang/device.h>
 #include <klingklang/format.h>
+#include <klingklang/settings.h>
 #include <klingklang/util.h>
 
 #include <alsa/asoundlib.h>
 
+/**
+ * Defaults for the period time in microseconds and the number of periods,
+ * which give the same 500 ms buffer snd_pcm_set_params used to give us.
+ */
+#define KK_ALSA_PERIOD_TIME     125000u
+#define KK_ALSA_PERIODS         4u
+
 typedef struct kk_device_alsa kk_device_alsa_t;
 
 struct kk_device_alsa {
   kk_device_t base;
   snd_pcm_t *handle;
+  snd_pcm_uframes_t start_threshold;
+  snd_pcm_uframes_t avail_min;
+  size_t channels;
+  size_t sample_size;
+  unsigned can_pause:1;
+  unsigned paused:1;
 };
 
 static int device_init (kk_device_t *);
 static int device_free (kk_device_t *);
 static int device_drop (kk_device_t *);
+static int device_drain (kk_device_t *);
+static int device_pause (kk_device_t *, int);
+static int device_delay (kk_device_t *, size_t *);
+static int device_channels (kk_device_t *, int);
 static int device_setup (kk_device_t *, kk_format_t *);
 static int device_write (kk_device_t *, kk_frame_t *);
 
 const kk_device_backend_t device_backend = {
   .size = sizeof (kk_device_alsa_t),
+  .formats = {
+    [KK_TYPE_UINT] = KK_DEVICE_BITS (KK_BITS_8) | KK_DEVICE_BITS (KK_BITS_16) |
+        KK_DEVICE_BITS (KK_BITS_24) | KK_DEVICE_BITS (KK_BITS_32),
+    [KK_TYPE_SINT] = KK_DEVICE_BITS (KK_BITS_8) | KK_DEVICE_BITS (KK_BITS_16) |
+        KK_DEVICE_BITS (KK_BITS_24) | KK_DEVICE_BITS (KK_BITS_32),
+    [KK_TYPE_FLOAT] = KK_DEVICE_BITS (KK_BITS_32),
+  },
   .init = device_init,
   .free = device_free,
   .drop = device_drop,
+  .drain = device_drain,
+  .pause = device_pause,
+  .delay = device_delay,
+  .channels = device_channels,
   .setup = device_setup,
   .write = device_write
 };
@@ -100,12 +129,14 @@ device_init (kk_device_t *dev_base)
 {
   kk_device_alsa_t *dev = (kk_device_alsa_t *) dev_base;
 
-  const char *name = "default";
+  const char *name = kk_settings_get_str ("KK_ALSA_DEVICE", "default");
   const int mode = 0;
   const snd_pcm_stream_t stream = SND_PCM_STREAM_PLAYBACK;
 
-  if (snd_pcm_open (&dev->handle, name, stream, mode) < 0)
+  if (snd_pcm_open (&dev->handle, name, stream, mode) < 0) {
+    kk_log (KK_LOG_WARNING, "Could not open ALSA device '%s'.", name);
     return -1;
+  }
   return 0;
 }
 
@@ -128,11 +159,217 @@ device_drop (kk_device_t *dev_base)
 {
   kk_device_alsa_t *dev = (kk_device_alsa_t *) dev_base;
 
-  if (snd_pcm_drop (dev->handle) < 0)
+  /* After dropping, the device needs to be prepared before the next write */
+  dev->paused = 0;
+  if ((snd_pcm_drop (dev->handle) < 0) || (snd_pcm_prepare (dev->handle) < 0))
+    return -1;
+  return 0;
+}
+
+static int
+device_drain (kk_device_t *dev_base)
+{
+  kk_device_alsa_t *dev = (kk_device_alsa_t *) dev_base;
+
+  if (snd_pcm_drain (dev->handle) < 0)
     return -1;
   return 0;
 }
 
+/**
+ * A device that isn't running has nothing to pause. Resuming it is a no-op
+ * then, because it starts again with the next write.
+ */
+static int
+device_pause (kk_device_t *dev_base, int pause)
+{
+  kk_device_alsa_t *dev = (kk_device_alsa_t *) dev_base;
+
+  pause = (pause != 0);
+  if (!dev->can_pause)
+    return -1;
+  if (pause == dev->paused)
+    return 0;
+  if ((pause) && (snd_pcm_state (dev->handle) != SND_PCM_STATE_RUNNING))
+    return 0;
+
+  if (snd_pcm_pause (dev->handle, pause) < 0)
+    return -1;
+  dev->paused = (pause != 0);
+  return 0;
+}
+
+static int
+device_delay (kk_device_t *dev_base, size_t *frames)
+{
+  kk_device_alsa_t *dev = (kk_device_alsa_t *) dev_base;
+
+  snd_pcm_sframes_t delay = 0;
+
+  if (snd_pcm_delay (dev->handle, &delay) < 0)
+    return -1;
+  *frames = (delay > 0) ? (size_t) delay : 0;
+  return 0;
+}
+
+/**
+ * Asks the device's configuration space, which stays the same no matter
+ * what the device is set up for right now. If it can't tell, setup has to.
+ */
+static int
+device_channels (kk_device_t *dev_base, int channels)
+{
+  kk_device_alsa_t *dev = (kk_device_alsa_t *) dev_base;
+
+  snd_pcm_hw_params_t *params;
+
+  snd_pcm_hw_params_alloca (&params);
+  if (snd_pcm_hw_params_any (dev->handle, params) < 0)
+    return 1;
+  return snd_pcm_hw_params_test_channels (dev->handle, params, (unsigned int) channels) == 0;
+}
+
+/**
+ * Channel positions of multichannel files, indexed by the number of
+ * channels. ALSA devices use a different order by default.
+ */
+static const unsigned int device_chmap[KK_FORMAT_MAX_CHANNELS + 1][KK_FORMAT_MAX_CHANNELS] = {
+  [3] = { SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_FC },
+  [4] = { SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR },
+  [5] = { SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_FC, SND_CHMAP_RL,
+      SND_CHMAP_RR },
+  [6] = { SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_FC, SND_CHMAP_LFE,
+      SND_CHMAP_RL, SND_CHMAP_RR },
+  [7] = { SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_FC, SND_CHMAP_LFE,
+      SND_CHMAP_RC, SND_CHMAP_SL, SND_CHMAP_SR },
+  [8] = { SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_FC, SND_CHMAP_LFE,
+      SND_CHMAP_RL, SND_CHMAP_RR, SND_CHMAP_SL, SND_CHMAP_SR },
+};
+
+/**
+ * Not every device lets us change its channel map. In this case the
+ * channels come out in the order of the device, which is all we can do.
+ */
+static void
+device_set_chmap (kk_device_alsa_t *dev, unsigned int channels)
+{
+  union {
+    snd_pcm_chmap_t map;
+    unsigned int data[KK_FORMAT_MAX_CHANNELS + 1];
+  } u;
+
+  if (channels <= 2)
+    return;
+
+  u.map.channels = channels;
+  memcpy (u.map.pos, device_chmap[channels], channels * sizeof (unsigned int));
+  if (snd_pcm_set_chmap (dev->handle, &u.map) < 0)
+    kk_log (KK_LOG_DEBUG, "Device doesn't support setting its channel map.");
+}
+
+/**
+ * Period size and count can be set with KK_ALSA_PERIOD_SIZE (in sample
+ * frames) and KK_ALSA_PERIODS. The device might not support the exact
+ * values, in which case we take the nearest ones it offers.
+ */
+static int
+device_set_hw_params (kk_device_alsa_t *dev, kk_format_t *format,
+    snd_pcm_access_t access)
+{
+  const long period_size = kk_settings_get_int ("KK_ALSA_PERIOD_SIZE", 0);
+  const long periods = kk_settings_get_int ("KK_ALSA_PERIODS", 0);
+
+  snd_pcm_hw_params_t *params;
+  snd_pcm_uframes_t size;
+  unsigned int count;
+  unsigned int time;
+  int dir = 0;
+
+  snd_pcm_hw_params_alloca (&params);
+  if (snd_pcm_hw_params_any (dev->handle, params) < 0)
+    goto error;
+  if (snd_pcm_hw_params_set_rate_resample (dev->handle, params, 1) < 0)
+    goto error;
+  if (snd_pcm_hw_params_set_access (dev->handle, params, access) < 0)
+    goto error;
+  if (snd_pcm_hw_params_set_format (dev->handle, params, get_pcm_format (format)) < 0)
+    goto error;
+  if (snd_pcm_hw_params_set_channels (dev->handle, params,
+          (unsigned int) kk_format_get_channels (format)) < 0)
+    goto error;
+  if (snd_pcm_hw_params_set_rate (dev->handle, params, format->sample_rate, 0) < 0)
+    goto error;
+
+  if (period_size > 0) {
+    size = (snd_pcm_uframes_t) period_size;
+    if (snd_pcm_hw_params_set_period_size_near (dev->handle, params, &size, &dir) < 0)
+      goto error;
+  }
+  else {
+    time = KK_ALSA_PERIOD_TIME;
+    if (snd_pcm_hw_params_set_period_time_near (dev->handle, params, &time, &dir) < 0)
+      goto error;
+  }
+
+  count = (periods > 0) ? (unsigned int) periods : KK_ALSA_PERIODS;
+  if (snd_pcm_hw_params_set_periods_near (dev->handle, params, &count, &dir) < 0)
+    goto error;
+
+  if (snd_pcm_hw_params (dev->handle, params) < 0)
+    goto error;
+
+  dev->can_pause = (snd_pcm_hw_params_can_pause (params) != 0);
+  return 0;
+error:
+  kk_log (KK_LOG_WARNING, "Device doesn't support the requested hardware parameters.");
+  return -1;
+}
+
+/**
+ * KK_ALSA_START_THRESHOLD sets the number of sample frames the device waits
+ * for before it starts playing, KK_ALSA_AVAIL_MIN the amount of free space
+ * that wakes up a waiting write. They default to the buffer and the period
+ * size.
+ */
+static int
+device_set_sw_params (kk_device_alsa_t *dev, snd_pcm_uframes_t buffer_size,
+    snd_pcm_uframes_t period_size)
+{
+  const long start_threshold = kk_settings_get_int ("KK_ALSA_START_THRESHOLD", 0);
+  const long avail_min = kk_settings_get_int ("KK_ALSA_AVAIL_MIN", 0);
+
+  snd_pcm_sw_params_t *params;
+  snd_pcm_uframes_t start = buffer_size;
+  snd_pcm_uframes_t avail = period_size;
+
+  if ((start_threshold > 0) && ((snd_pcm_uframes_t) start_threshold < buffer_size))
+    start = (snd_pcm_uframes_t) start_threshold;
+  if ((avail_min > 0) && ((snd_pcm_uframes_t) avail_min < buffer_size))
+    avail = (snd_pcm_uframes_t) avail_min;
+
+  snd_pcm_sw_params_alloca (&params);
+  if (snd_pcm_sw_params_current (dev->handle, params) < 0)
+    goto error;
+  if (snd_pcm_sw_params_set_start_threshold (dev->handle, params, start) < 0)
+    goto error;
+  if (snd_pcm_sw_params_set_avail_min (dev->handle, params, avail) < 0)
+    goto error;
+  if (snd_pcm_sw_params (dev->handle, params) < 0)
+    goto error;
+
+  /* The device might round them, so ask for what we got */
+  if ((snd_pcm_sw_params_get_start_threshold (params, &dev->start_threshold) < 0)
+      || (snd_pcm_sw_params_get_avail_min (params, &dev->avail_min) < 0))
+    goto error;
+
+  kk_log (KK_LOG_INFO, "Device start threshold %lu, minimum available %lu sample frames.",
+      (unsigned long) dev->start_threshold, (unsigned long) dev->avail_min);
+  return 0;
+error:
+  kk_log (KK_LOG_WARNING, "Device doesn't support the requested software parameters.");
+  return -1;
+}
+
 static int
 device_setup (kk_device_t *dev_base, kk_format_t *format)
 {
@@ -140,15 +377,32 @@ device_setup (kk_device_t *dev_base, kk_format_t *format)
 
   const snd_pcm_format_t pcm_format = get_pcm_format (format);
   const snd_pcm_access_t pcm_access = get_pcm_access (format);
-
   const unsigned int channels = (unsigned int) kk_format_get_channels (format);
-  const unsigned int rate = format->sample_rate;
-  const unsigned int latency = 500000u;
-  const int soft_resample = 1;
 
-  if (snd_pcm_set_params (dev->handle, pcm_format, pcm_access, channels,
-          rate, soft_resample, latency) < 0)
+  snd_pcm_uframes_t buffer_size;
+  snd_pcm_uframes_t period_size;
+
+  if (device_set_hw_params (dev, format, pcm_access) != 0)
     return -1;
+
+  if (snd_pcm_get_params (dev->handle, &buffer_size, &period_size) < 0)
+    return -1;
+
+  kk_log (KK_LOG_INFO, "Device '%s' uses %s access, %lu sample frames per period, "
+      "%lu periods (%.1f ms).", snd_pcm_name (dev->handle), snd_pcm_access_name (pcm_access),
+      (unsigned long) period_size, (unsigned long) (buffer_size / period_size),
+      1000.0 * (double) buffer_size / (double) format->sample_rate);
+
+  if (device_set_sw_params (dev, buffer_size, period_size) != 0)
+    return -1;
+
+  dev->channels = channels;
+  dev->sample_size = (size_t) snd_pcm_format_physical_width (pcm_format) / 8;
+  dev->paused = 0;
+  if (!dev->can_pause)
+    kk_log (KK_LOG_DEBUG, "Device can't pause.");
+
+  device_set_chmap (dev, channels);
   return 0;
 }
 
@@ -160,6 +414,9 @@ device_write (kk_device_t *dev_base, kk_frame_t *frame)
   snd_pcm_sframes_t nframes = 0;
   snd_pcm_uframes_t uframes = 0;
   snd_pcm_sframes_t sframes = 0;
+  snd_pcm_uframes_t pos = 0;
+  void *planes[KK_FRAME_MAX_PLANES];
+  size_t i;
 
   if (frame->size > SSIZE_MAX)
     return -1;
@@ -169,18 +426,28 @@ device_write (kk_device_t *dev_base, kk_frame_t *frame)
   if (sframes <= 0)
     return -1;
 
-  switch (dev_base->format->layout) {
-    case KK_LAYOUT_PLANAR:
-      nframes = snd_pcm_writen (dev->handle, (void **) frame->data, uframes);
-      break;
-    case KK_LAYOUT_INTERLEAVED:
-      nframes = snd_pcm_writei (dev->handle, (void *) frame->data[0], uframes);
-      break;
-  }
+  /* Signals or a recovered xrun can cut a write short, so write the rest */
+  while (pos < uframes) {
+    switch (dev_base->format->layout) {
+      case KK_LAYOUT_PLANAR:
+        for (i = 0; i < dev->channels; i++)
+          planes[i] = frame->data[i] + pos * dev->sample_size;
+        nframes = snd_pcm_writen (dev->handle, planes, uframes - pos);
+        break;
+      case KK_LAYOUT_INTERLEAVED:
+        nframes = snd_pcm_writei (dev->handle,
+            frame->data[0] + pos * dev->sample_size * dev->channels, uframes - pos);
+        break;
+      default:
+        return -1;
+    }
 
-  if (nframes < 0) {
-    if (snd_pcm_recover (dev->handle, (int) nframes, 1) < 0)
-      return -1;
+    if (nframes < 0) {
+      if (snd_pcm_recover (dev->handle, (int) nframes, 1) < 0)
+        return -1;
+      continue;
+    }
+    pos += (snd_pcm_uframes_t) nframes;
   }
   return 0;
 }
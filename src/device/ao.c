@@ -17,14 +17,22 @@ struct kk_device_ao {
 static int device_init (kk_device_t *);
 static int device_free (kk_device_t *);
 static int device_drop (kk_device_t *);
+static int device_drain (kk_device_t *);
 static int device_setup (kk_device_t *, kk_format_t *);
 static int device_write (kk_device_t *, kk_frame_t *);
 
 const kk_device_backend_t device_backend = {
   .size = sizeof (kk_device_ao_t),
+  .formats = {
+    [KK_TYPE_UINT] = 0,
+    [KK_TYPE_SINT] = KK_DEVICE_BITS (KK_BITS_8) | KK_DEVICE_BITS (KK_BITS_16) |
+        KK_DEVICE_BITS (KK_BITS_24) | KK_DEVICE_BITS (KK_BITS_32),
+    [KK_TYPE_FLOAT] = 0,
+  },
   .init = device_init,
   .free = device_free,
   .drop = device_drop,
+  .drain = device_drain,
   .setup = device_setup,
   .write = device_write,
 };
@@ -64,6 +72,27 @@ device_drop (kk_device_t *dev_base)
   return 0;
 }
 
+static int
+device_drain (kk_device_t *dev_base)
+{
+  /* libao has no drain function, ao_play blocks until it's done */
+  (void) dev_base;
+  return 0;
+}
+
+/**
+ * Channel orders of multichannel files, indexed by the number of channels.
+ * libao reorders the channels for the driver if it knows their positions.
+ */
+static char *device_matrix[KK_FORMAT_MAX_CHANNELS + 1] = {
+  [3] = "L,R,C",
+  [4] = "L,R,BL,BR",
+  [5] = "L,R,C,BL,BR",
+  [6] = "L,R,C,LFE,BL,BR",
+  [7] = "L,R,C,LFE,BC,SL,SR",
+  [8] = "L,R,C,LFE,BL,BR,SL,SR",
+};
+
 static int
 device_setup (kk_device_t *dev_base, kk_format_t *format)
 {
@@ -74,7 +103,7 @@ device_setup (kk_device_t *dev_base, kk_format_t *format)
     .bits = kk_format_get_bits (format),
     .channels = kk_format_get_channels (format),
     .rate = (int) format->sample_rate,
-    .matrix = 0,
+    .matrix = device_matrix[kk_format_get_channels (format)],
   };
 
   if (dev->device)
@@ -1,34 +1,61 @@
 #include <klingklang/base.h>
 #include <klingklang/device.h>
+#include <klingklang/settings.h>
 #include <klingklang/util.h>
 #include <klingklang/format.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include <sys/ioctl.h>
 #include <sys/soundcard.h>
 #include <sys/stat.h>
 
+/**
+ * Defaults for the fragment size in bytes and the number of fragments.
+ */
+#define KK_OSS_FRAGMENT_SIZE    4096
+#define KK_OSS_FRAGMENTS        16
+
 typedef struct kk_device_oss kk_device_oss_t;
 
+/**
+ * The device gets opened non-blocking. Writes only pass as many bytes as
+ * fit into the buffer of the device and poll for space otherwise. The file
+ * descriptor is kept as long as the format stays the same.
+ */
 struct kk_device_oss {
   kk_device_t base;
   kk_frame_t *buffer;
+  kk_format_t format;
+  size_t stride;
+  int fragment;
   int fd;
 };
 
 static int device_init (kk_device_t *);
 static int device_free (kk_device_t *);
 static int device_drop (kk_device_t *);
+static int device_drain (kk_device_t *);
+static int device_delay (kk_device_t *, size_t *);
 static int device_setup (kk_device_t *, kk_format_t *);
 static int device_write (kk_device_t *, kk_frame_t *);
 
 const kk_device_backend_t device_backend = {
   .size = sizeof (kk_device_oss_t),
+  .formats = {
+    [KK_TYPE_UINT] = KK_DEVICE_BITS (KK_BITS_8),
+    [KK_TYPE_SINT] = KK_DEVICE_BITS (KK_BITS_16) | KK_DEVICE_BITS (KK_BITS_24) |
+        KK_DEVICE_BITS (KK_BITS_32),
+    [KK_TYPE_FLOAT] = 0,
+  },
   .init = device_init,
   .free = device_free,
   .drop = device_drop,
+  .drain = device_drain,
+  .delay = device_delay,
   .setup = device_setup,
   .write = device_write,
 };
@@ -48,6 +75,7 @@ device_init (kk_device_t *dev_base)
 {
   kk_device_oss_t *dev = (kk_device_oss_t *) dev_base;
 
+  dev->fd = -1;
   if (kk_frame_init (&dev->buffer) != 0)
     return -1;
   return 0;
@@ -58,7 +86,8 @@ device_free (kk_device_t *dev_base)
 {
   kk_device_oss_t *dev = (kk_device_oss_t *) dev_base;
 
-  close (dev->fd);
+  if (dev->fd >= 0)
+    close (dev->fd);
   kk_frame_free (dev->buffer);
   return 0;
 }
@@ -68,32 +97,108 @@ device_drop (kk_device_t *dev_base)
 {
   kk_device_oss_t *dev = (kk_device_oss_t *) dev_base;
 
-  if (device_ctrl (dev->fd, SNDCTL_DSP_SKIP, 0) != 0)
+  if ((dev->fd >= 0) && (device_ctrl (dev->fd, SNDCTL_DSP_SKIP, 0) != 0))
     return -1;
   return 0;
 }
 
+static int
+device_drain (kk_device_t *dev_base)
+{
+  kk_device_oss_t *dev = (kk_device_oss_t *) dev_base;
+
+  int flags;
+  int ret = 0;
+
+  if (dev->fd < 0)
+    return 0;
+
+  /* Not every implementation waits for a non-blocking device to drain */
+  flags = fcntl (dev->fd, F_GETFL);
+  fcntl (dev->fd, F_SETFL, flags & ~O_NONBLOCK);
+  if (ioctl (dev->fd, SNDCTL_DSP_SYNC, NULL) == -1)
+    ret = -1;
+  fcntl (dev->fd, F_SETFL, flags);
+  return ret;
+}
+
+static int
+device_delay (kk_device_t *dev_base, size_t *frames)
+{
+  kk_device_oss_t *dev = (kk_device_oss_t *) dev_base;
+
+  int delay = 0;
+
+  if ((dev->fd < 0) || (dev->stride == 0))
+    return -1;
+  if (ioctl (dev->fd, SNDCTL_DSP_GETODELAY, &delay) == -1)
+    return -1;
+  *frames = (delay > 0) ? (size_t) delay / dev->stride : 0;
+  return 0;
+}
+
+/**
+ * Fragment size and count can be set with KK_OSS_FRAGMENT_SIZE in bytes and
+ * KK_OSS_FRAGMENTS. The size gets rounded up to the next power of two. The
+ * device is free to pick different values, so we only log what it granted.
+ */
+static void
+device_set_fragment (kk_device_oss_t *dev)
+{
+  long size = kk_settings_get_int ("KK_OSS_FRAGMENT_SIZE", KK_OSS_FRAGMENT_SIZE);
+  long count = kk_settings_get_int ("KK_OSS_FRAGMENTS", KK_OSS_FRAGMENTS);
+
+  audio_buf_info info;
+  int shift = 4;
+  int arg;
+
+  if (count < 2)
+    count = 2;
+  if (count > 0x7fff)
+    count = 0x7fff;
+  while ((shift < 24) && ((1l << shift) < size))
+    shift++;
+
+  arg = (int) ((count << 16) | shift);
+  if (ioctl (dev->fd, SNDCTL_DSP_SETFRAGMENT, &arg) == -1)
+    kk_log (KK_LOG_DEBUG, "Device doesn't support setting its fragment size.");
+
+  dev->fragment = 1 << shift;
+  if (ioctl (dev->fd, SNDCTL_DSP_GETOSPACE, &info) == 0) {
+    dev->fragment = info.fragsize;
+    kk_log (KK_LOG_INFO, "Device granted %d fragments of %d bytes.",
+        info.fragstotal, info.fragsize);
+  }
+}
+
 static int
 device_setup (kk_device_t *dev_base, kk_format_t *format)
 {
   kk_device_oss_t *dev = (kk_device_oss_t *) dev_base;
   int req;
 
+  /* Tracks sharing the same format keep using the device */
+  if ((dev->fd >= 0) && (kk_format_equal (&dev->format, format)))
+    return 0;
+
   /**
    * There's no real reset ioctl. It's the recommended way to reopen
-   * the device on every setup.
+   * the device if the format changes.
    */
-  if (dev->fd > 0) {
+  if (dev->fd >= 0) {
     device_drop (dev_base);
     close (dev->fd);
   }
 
-  dev->fd = open ("/dev/dsp", O_WRONLY, 0);
+  dev->fd = open ("/dev/dsp", O_WRONLY | O_NONBLOCK, 0);
   if (dev->fd == -1) {
     kk_log (KK_LOG_WARNING, "Could not open audio device /dev/dsp.");
     return -1;
   }
 
+  /* The fragment size has to be set before anything else */
+  device_set_fragment (dev);
+
   req = kk_format_get_channels (format);
   if (device_ctrl (dev->fd, SNDCTL_DSP_CHANNELS, req) != 0) {
     kk_log (KK_LOG_WARNING, "Device doesn't support %d channels.", req);
@@ -133,30 +238,88 @@ device_setup (kk_device_t *dev_base, kk_format_t *format)
     kk_log (KK_LOG_WARNING, "Device doesn't %d Hz sample rate.", req);
     goto error;
   }
+
+  memcpy (&dev->format, format, sizeof (kk_format_t));
+  dev->stride = (size_t) (kk_format_get_channels (format) * (kk_format_get_bits (format) >> 3));
   return 0;
 error:
+  close (dev->fd);
+  dev->fd = -1;
   return -1;
 }
 
+/**
+ * Waits until the device has room for len bytes or at least one fragment.
+ * Returns the number of bytes that can be written without blocking.
+ */
+static ssize_t
+device_wait (kk_device_oss_t *dev, size_t len)
+{
+  struct pollfd pfd;
+  audio_buf_info info;
+  size_t need;
+
+  need = ((size_t) dev->fragment < len) ? (size_t) dev->fragment : len;
+  for (;;) {
+    if (ioctl (dev->fd, SNDCTL_DSP_GETOSPACE, &info) == -1)
+      return -1;
+    if ((info.bytes > 0) && ((size_t) info.bytes >= need))
+      return (ssize_t) info.bytes;
+
+    pfd.fd = dev->fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (poll (&pfd, 1, 1000) == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+      return -1;
+  }
+}
+
 static int
 device_write (kk_device_t *dev_base, kk_frame_t *frame)
 {
   kk_device_oss_t *dev = (kk_device_oss_t *) dev_base;
-  void *data;
+
+  const uint8_t *data = NULL;
+  size_t len = frame->size;
+  ssize_t space;
+  ssize_t n;
+
+  if (dev->fd < 0)
+    goto error;
 
   switch (dev_base->format->layout) {
     case KK_LAYOUT_PLANAR:
       if (kk_frame_interleave (dev->buffer, frame, dev_base->format) != 0)
         goto error;
-      data = (void *) dev->buffer->data[0];
+      data = dev->buffer->data[0];
       break;
     case KK_LAYOUT_INTERLEAVED:
-      data = (void *) frame->data[0];
+      data = frame->data[0];
       break;
   }
 
-  if (write (dev->fd, data, frame->size) <= 0)
-    goto error;
+  while (len > 0) {
+    space = device_wait (dev, len);
+    if (space < 0)
+      goto error;
+    if ((size_t) space > len)
+      space = (ssize_t) len;
+
+    /* Short writes are fine, we just write the rest later */
+    n = write (dev->fd, data, (size_t) space);
+    if (n < 0) {
+      if ((errno == EAGAIN) || (errno == EINTR))
+        continue;
+      goto error;
+    }
+    data += n;
+    len -= (size_t) n;
+  }
   return 0;
 error:
   kk_log (KK_LOG_WARNING, "Writing frame failed.");
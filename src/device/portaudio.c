@@ -1,46 +1,113 @@
 #include <klingklang/base.h>
 #include <klingklang/device.h>
 #include <klingklang/format.h>
+#include <klingklang/frame.h>
+#include <klingklang/ringbuffer.h>
 #include <klingklang/util.h>
 
 #include <portaudio.h>
 
+/**
+ * Duration in seconds of the samples the ring buffer between output thread
+ * and PortAudio callback can hold.
+ */
+#define KK_PORTAUDIO_BUFFER_TIME  0.2
+
+/**
+ * Milliseconds the output thread sleeps before it checks for space in the
+ * ring buffer again. Short compared to the buffer, so it never runs dry.
+ */
+#define KK_PORTAUDIO_POLL_INTERVAL  5
+
 typedef struct kk_device_portaudio kk_device_portaudio_t;
 
+/**
+ * PortAudio calls the callback from its own thread, which takes the samples
+ * out of the ring buffer the output thread writes to. The callback never
+ * blocks and never takes a lock, the output thread polls for space instead
+ * of waiting to be woken up. Stream and ring buffer are kept as long as the
+ * format stays the same.
+ */
 struct kk_device_portaudio {
   kk_device_t base;
   PaStream *handle;
+  kk_ringbuffer_t *buffer;
+  kk_frame_t *frame;
+  kk_format_t format;
+  size_t stride;
+  unsigned underflows;
+  unsigned reported;
+  int paused;
+  uint8_t silence;
 };
 
 static int device_init (kk_device_t *);
 static int device_free (kk_device_t *);
 static int device_drop (kk_device_t *);
+static int device_drain (kk_device_t *);
+static int device_pause (kk_device_t *, int);
+static int device_delay (kk_device_t *, size_t *);
+static int device_channels (kk_device_t *, int);
 static int device_setup (kk_device_t *, kk_format_t *);
 static int device_write (kk_device_t *, kk_frame_t *);
 
 const kk_device_backend_t device_backend = {
   .size = sizeof (kk_device_portaudio_t),
+  .formats = {
+    [KK_TYPE_UINT] = KK_DEVICE_BITS (KK_BITS_8),
+    [KK_TYPE_SINT] = KK_DEVICE_BITS (KK_BITS_8) | KK_DEVICE_BITS (KK_BITS_16) |
+        KK_DEVICE_BITS (KK_BITS_24) | KK_DEVICE_BITS (KK_BITS_32),
+    [KK_TYPE_FLOAT] = KK_DEVICE_BITS (KK_BITS_32),
+  },
   .init = device_init,
   .free = device_free,
   .drop = device_drop,
+  .drain = device_drain,
+  .pause = device_pause,
+  .delay = device_delay,
+  .channels = device_channels,
   .setup = device_setup,
   .write = device_write
 };
 
+/**
+ * Running out of samples in the middle of a callback counts as underflow,
+ * just like PortAudio telling us the device ran out. A completely empty
+ * buffer doesn't, that's just the player having nothing to play. Both sides
+ * move whole sample frames only. The size of the ring buffer is a power of
+ * two and not necessarily a multiple of stride, so that's up to us.
+ */
 static int
-device_init (kk_device_t *dev_base)
+device_callback (const void *input, void *output, unsigned long frames,
+    const PaStreamCallbackTimeInfo *time, PaStreamCallbackFlags flags, void *userdata)
 {
-  (void) dev_base;
+  kk_device_portaudio_t *dev = (kk_device_portaudio_t *) userdata;
 
-  if (Pa_Initialize () != paNoError)
-    return -1;
-  return 0;
+  const size_t len = (size_t) frames * dev->stride;
+  size_t n = 0;
+
+  (void) input;
+  (void) time;
+
+  if (!__atomic_load_n (&dev->paused, __ATOMIC_SEQ_CST)) {
+    n = kk_ringbuffer_get_fill (dev->buffer);
+    if (n > len)
+      n = len;
+    n -= n % dev->stride;
+    n = kk_ringbuffer_read (dev->buffer, output, n);
+  }
+
+  if (n < len)
+    memset ((uint8_t *) output + n, dev->silence, len - n);
+
+  if (((n > 0) && (n < len)) || (flags & paOutputUnderflow))
+    __atomic_add_fetch (&dev->underflows, 1, __ATOMIC_SEQ_CST);
+  return paContinue;
 }
 
 static int
-device_free (kk_device_t *dev_base)
+device_close (kk_device_portaudio_t *dev)
 {
-  kk_device_portaudio_t *dev = (kk_device_portaudio_t *) dev_base;
   PaError status;
 
   if (dev->handle) {
@@ -49,6 +116,49 @@ device_free (kk_device_t *dev_base)
       kk_log (KK_LOG_WARNING, "Closing stream failed.");
     dev->handle = NULL;
   }
+  kk_ringbuffer_free (dev->buffer);
+  dev->buffer = NULL;
+  return 0;
+}
+
+/**
+ * Starts the stream if it isn't running. Streams get started by the first
+ * write, so that the callback doesn't start with an empty buffer.
+ */
+static int
+device_start (kk_device_portaudio_t *dev)
+{
+  if (Pa_IsStreamStopped (dev->handle) != 1)
+    return 0;
+
+  if (Pa_StartStream (dev->handle) != paNoError) {
+    kk_log (KK_LOG_WARNING, "Starting stream failed.");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+device_init (kk_device_t *dev_base)
+{
+  kk_device_portaudio_t *dev = (kk_device_portaudio_t *) dev_base;
+
+  if (kk_frame_init (&dev->frame) != 0)
+    return -1;
+
+  if (Pa_Initialize () != paNoError)
+    return -1;
+  return 0;
+}
+
+static int
+device_free (kk_device_t *dev_base)
+{
+  kk_device_portaudio_t *dev = (kk_device_portaudio_t *) dev_base;
+  PaError status;
+
+  device_close (dev);
+  kk_frame_free (dev->frame);
 
   status = Pa_Terminate ();
   if (status != paNoError)
@@ -56,45 +166,115 @@ device_free (kk_device_t *dev_base)
   return 0;
 }
 
+/**
+ * Once the stream is stopped, nobody reads from the ring buffer and we can
+ * discard its content. The next write starts the stream again.
+ */
 static int
 device_drop (kk_device_t *dev_base)
 {
   kk_device_portaudio_t *dev = (kk_device_portaudio_t *) dev_base;
 
-  if ((dev->handle) && (Pa_IsStreamActive (dev->handle) > 0)) {
-    if (Pa_StopStream (dev->handle) != paNoError) {
-      kk_log (KK_LOG_WARNING, "Could not stop stream.");
-      return -1;
-    }
+  if (dev->handle == NULL)
+    return 0;
+
+  if ((Pa_IsStreamActive (dev->handle) > 0) && (Pa_AbortStream (dev->handle) != paNoError)) {
+    kk_log (KK_LOG_WARNING, "Could not stop stream.");
+    return -1;
+  }
+  kk_ringbuffer_skip (dev->buffer, kk_ringbuffer_get_fill (dev->buffer));
+  return 0;
+}
+
+static int
+device_drain (kk_device_t *dev_base)
+{
+  kk_device_portaudio_t *dev = (kk_device_portaudio_t *) dev_base;
+
+  if ((dev->handle == NULL) || (Pa_IsStreamActive (dev->handle) <= 0))
+    return 0;
+
+  /* Wait until the callback took everything, then let PortAudio play it */
+  kk_ringbuffer_poll_space (dev->buffer, kk_ringbuffer_get_size (dev->buffer), &dev->paused,
+      KK_PORTAUDIO_POLL_INTERVAL);
+  if (Pa_StopStream (dev->handle) != paNoError) {
+    kk_log (KK_LOG_WARNING, "Could not stop stream.");
+    return -1;
   }
   return 0;
 }
 
+/**
+ * The callback plays silence while the device is paused and leaves the
+ * samples in the ring buffer.
+ */
+static int
+device_pause (kk_device_t *dev_base, int pause)
+{
+  kk_device_portaudio_t *dev = (kk_device_portaudio_t *) dev_base;
+
+  __atomic_store_n (&dev->paused, pause != 0, __ATOMIC_SEQ_CST);
+  if (dev->buffer)
+    kk_ringbuffer_wakeup (dev->buffer);
+  return 0;
+}
+
+/**
+ * Samples wait in the ring buffer first and in the buffers of the host API
+ * afterwards.
+ */
+static int
+device_delay (kk_device_t *dev_base, size_t *frames)
+{
+  kk_device_portaudio_t *dev = (kk_device_portaudio_t *) dev_base;
+
+  const PaStreamInfo *info;
+
+  if (dev->handle == NULL)
+    return -1;
+
+  *frames = kk_ringbuffer_get_fill (dev->buffer) / dev->stride;
+  info = Pa_GetStreamInfo (dev->handle);
+  if ((info) && (Pa_IsStreamActive (dev->handle) > 0))
+    *frames += (size_t) (info->outputLatency * info->sampleRate);
+  return 0;
+}
+
+/**
+ * Without a device, setup fails anyway and tells why.
+ */
+static int
+device_channels (kk_device_t *dev_base, int channels)
+{
+  const PaDeviceIndex device = Pa_GetDefaultOutputDevice ();
+  const PaDeviceInfo *info;
+
+  (void) dev_base;
+
+  info = (device != paNoDevice) ? Pa_GetDeviceInfo (device) : NULL;
+  if (info == NULL)
+    return 1;
+  return channels <= info->maxOutputChannels;
+}
+
 static int
 device_setup (kk_device_t *dev_base, kk_format_t *format)
 {
   kk_device_portaudio_t *dev = (kk_device_portaudio_t *) dev_base;
 
+  const PaDeviceInfo *info;
   PaError status;
   PaSampleFormat sample_format = (PaSampleFormat) 0;
   PaStreamParameters params;
+  size_t size;
 
-  if (dev->handle) {
-    if (Pa_IsStreamActive (dev->handle) == 1) {
-      status = Pa_StopStream (dev->handle);
-      if (status != paNoError) {
-        kk_log (KK_LOG_WARNING, "Could not stop previous stream.");
-      }
-    }
+  /* Tracks sharing the same format keep using the stream */
+  if ((dev->handle) && (kk_format_equal (&dev->format, format)))
+    return 0;
 
-    if (Pa_IsStreamStopped (dev->handle) == 1) {
-      status = Pa_CloseStream (dev->handle);
-      if (status != paNoError) {
-        kk_log (KK_LOG_WARNING, "Could not close previous stream.");
-      }
-      dev->handle = NULL;
-    }
-  }
+  if ((dev->handle) && (Pa_IsStreamActive (dev->handle) > 0))
+    Pa_StopStream (dev->handle);
+  device_close (dev);
 
   if (format->type == KK_TYPE_FLOAT) {
     if (format->bits != KK_BITS_32) {
@@ -124,38 +304,38 @@ device_setup (kk_device_t *dev_base, kk_format_t *format)
     }
   }
 
-  if (format->layout == KK_LAYOUT_PLANAR)
-    sample_format |= paNonInterleaved;
-
   params.device = Pa_GetDefaultOutputDevice ();
-  if (params.device == paNoDevice) {
+  info = (params.device != paNoDevice) ? Pa_GetDeviceInfo (params.device) : NULL;
+  if (info == NULL) {
     kk_log (KK_LOG_ERROR, "No output device found.");
     return -1;
   }
 
+  /* Planar samples get interleaved on their way into the ring buffer */
   params.channelCount = kk_format_get_channels (format);
   params.sampleFormat = sample_format;
-  params.suggestedLatency = Pa_GetDeviceInfo (params.device)->defaultLowOutputLatency;
+  params.suggestedLatency = info->defaultLowOutputLatency;
   params.hostApiSpecificStreamInfo = NULL;
 
+  dev->stride = (size_t) Pa_GetSampleSize (sample_format) * (size_t) params.channelCount;
+  dev->silence = (sample_format == paUInt8) ? 0x80 : 0x00;
+  dev->paused = 0;
+
+  size = (size_t) (KK_PORTAUDIO_BUFFER_TIME * format->sample_rate) * dev->stride;
+  if (kk_ringbuffer_init (&dev->buffer, size) != 0)
+    return -1;
+
   status =
       Pa_OpenStream (&dev->handle, NULL, &params, (double) format->sample_rate,
-          paFramesPerBufferUnspecified, paClipOff, NULL, NULL);
+          paFramesPerBufferUnspecified, paClipOff, device_callback, dev);
   if (status != paNoError) {
     kk_log (KK_LOG_ERROR, "Pa_OpenStream failed. Unsupported PCM format?");
-    return -1;
-  }
-
-  status = Pa_StartStream (dev->handle);
-  if (status != paNoError) {
-    kk_log (KK_LOG_WARNING, "Starting stream failed.");
-    status = Pa_CloseStream (dev->handle);
-    if (status != paNoError) {
-      kk_log (KK_LOG_WARNING, "Emergency close failed too.");
-    }
     dev->handle = NULL;
+    device_close (dev);
     return -1;
   }
+
+  memcpy (&dev->format, format, sizeof (kk_format_t));
   return 0;
 }
 
@@ -164,21 +344,50 @@ device_write (kk_device_t *dev_base, kk_frame_t *frame)
 {
   kk_device_portaudio_t *dev = (kk_device_portaudio_t *) dev_base;
 
-  const void *data = NULL;
+  const uint8_t *data = NULL;
+  size_t len = frame->size;
+  size_t size;
+  size_t n;
+  unsigned underflows;
 
   if (dev->handle == NULL)
     return -1;
+  size = kk_ringbuffer_get_size (dev->buffer);
 
   switch (dev_base->format->layout) {
     case KK_LAYOUT_PLANAR:
-      data = (const void *) frame->data;
+      if (kk_frame_interleave (dev->frame, frame, dev_base->format) != 0)
+        return -1;
+      data = dev->frame->data[0];
       break;
     case KK_LAYOUT_INTERLEAVED:
-      data = (const void *) frame->data[0];
+      data = frame->data[0];
       break;
   }
 
-  if (Pa_WriteStream (dev->handle, data, frame->samples) != paNoError)
-    return -1;
+  len -= len % dev->stride;
+  while (len > 0) {
+    n = kk_ringbuffer_get_space (dev->buffer);
+    if (n > len)
+      n = len;
+    n -= n % dev->stride;
+
+    n = kk_ringbuffer_write (dev->buffer, data, n);
+    data += n;
+    len -= n;
+
+    if (device_start (dev) != 0)
+      return -1;
+    if (len > 0)
+      kk_ringbuffer_poll_space (dev->buffer, (len < size) ? len : size, NULL,
+          KK_PORTAUDIO_POLL_INTERVAL);
+  }
+
+  /* Logging in the callback isn't safe, so we report underflows here */
+  underflows = __atomic_load_n (&dev->underflows, __ATOMIC_SEQ_CST);
+  if (underflows != dev->reported) {
+    kk_log (KK_LOG_WARNING, "Stream ran out of samples %u times.", underflows - dev->reported);
+    dev->reported = underflows;
+  }
   return 0;
 }
@@ -2,30 +2,50 @@
 #include <klingklang/device.h>
 #include <klingklang/format.h>
 #include <klingklang/frame.h>
+#include <klingklang/settings.h>
 #include <klingklang/util.h>
 
-#include <pulse/simple.h>
-#include <pulse/error.h>
+#include <pulse/pulseaudio.h>
 
 typedef struct kk_device_pulseaudio kk_device_pulseaudio_t;
 
+/**
+ * The context lives as long as the device, only the stream gets replaced
+ * if the sample format changes. All callbacks run in the thread of the
+ * mainloop and do nothing but wake up whoever waits for them.
+ */
 struct kk_device_pulseaudio {
   kk_device_t base;
   kk_frame_t *buffer;
-  pa_simple *handle;
+  pa_threaded_mainloop *loop;
+  pa_context *context;
+  pa_stream *stream;
+  pa_sample_spec spec;
 };
 
 static int device_init (kk_device_t *);
 static int device_free (kk_device_t *);
 static int device_drop (kk_device_t *);
+static int device_drain (kk_device_t *);
+static int device_pause (kk_device_t *, int);
+static int device_delay (kk_device_t *, size_t *);
 static int device_setup (kk_device_t *, kk_format_t *);
 static int device_write (kk_device_t *, kk_frame_t *);
 
 const kk_device_backend_t device_backend = {
   .size = sizeof (kk_device_pulseaudio_t),
+  .formats = {
+    [KK_TYPE_UINT] = KK_DEVICE_BITS (KK_BITS_8),
+    [KK_TYPE_SINT] = KK_DEVICE_BITS (KK_BITS_16) | KK_DEVICE_BITS (KK_BITS_24) |
+        KK_DEVICE_BITS (KK_BITS_32),
+    [KK_TYPE_FLOAT] = KK_DEVICE_BITS (KK_BITS_32),
+  },
   .init = device_init,
   .free = device_free,
   .drop = device_drop,
+  .drain = device_drain,
+  .pause = device_pause,
+  .delay = device_delay,
   .setup = device_setup,
   .write = device_write
 };
@@ -33,20 +53,140 @@ const kk_device_backend_t device_backend = {
 static const enum pa_sample_format sample_format[2][5] = {
   [KK_BYTE_ORDER_LITTLE_ENDIAN] = {
     PA_SAMPLE_U8,
-    PA_SAMPLE_S16NE,
-    PA_SAMPLE_S24NE,
-    PA_SAMPLE_S32NE,
-    PA_SAMPLE_FLOAT32NE,
+    PA_SAMPLE_S16LE,
+    PA_SAMPLE_S24LE,
+    PA_SAMPLE_S32LE,
+    PA_SAMPLE_FLOAT32LE,
   },
   [KK_BYTE_ORDER_BIG_ENDIAN] = {
     PA_SAMPLE_U8,
-    PA_SAMPLE_S16NE,
-    PA_SAMPLE_S24NE,
-    PA_SAMPLE_S32NE,
-    PA_SAMPLE_FLOAT32NE,
+    PA_SAMPLE_S16BE,
+    PA_SAMPLE_S24BE,
+    PA_SAMPLE_S32BE,
+    PA_SAMPLE_FLOAT32BE,
   }
 };
 
+static void
+device_context_notify (pa_context *context, void *userdata)
+{
+  kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) userdata;
+
+  (void) context;
+  pa_threaded_mainloop_signal (dev->loop, 0);
+}
+
+static void
+device_stream_notify (pa_stream *stream, void *userdata)
+{
+  kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) userdata;
+
+  (void) stream;
+  pa_threaded_mainloop_signal (dev->loop, 0);
+}
+
+static void
+device_stream_request (pa_stream *stream, size_t len, void *userdata)
+{
+  kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) userdata;
+
+  (void) stream;
+  (void) len;
+  pa_threaded_mainloop_signal (dev->loop, 0);
+}
+
+static void
+device_stream_success (pa_stream *stream, int success, void *userdata)
+{
+  kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) userdata;
+
+  (void) stream;
+  (void) success;
+  pa_threaded_mainloop_signal (dev->loop, 0);
+}
+
+/**
+ * The following functions expect the caller to hold the mainloop lock.
+ */
+static int
+device_wait_operation (kk_device_pulseaudio_t *dev, pa_operation *op)
+{
+  if (op == NULL)
+    return -1;
+
+  /* Operations get cancelled if the stream fails */
+  while (pa_operation_get_state (op) == PA_OPERATION_RUNNING)
+    pa_threaded_mainloop_wait (dev->loop);
+  pa_operation_unref (op);
+  return 0;
+}
+
+static int
+device_wait_context (kk_device_pulseaudio_t *dev)
+{
+  pa_context_state_t state;
+
+  for (;;) {
+    state = pa_context_get_state (dev->context);
+    if (state == PA_CONTEXT_READY)
+      return 0;
+    if (!PA_CONTEXT_IS_GOOD (state))
+      return -1;
+    pa_threaded_mainloop_wait (dev->loop);
+  }
+}
+
+static int
+device_wait_stream (kk_device_pulseaudio_t *dev)
+{
+  pa_stream_state_t state;
+
+  for (;;) {
+    state = pa_stream_get_state (dev->stream);
+    if (state == PA_STREAM_READY)
+      return 0;
+    if (!PA_STREAM_IS_GOOD (state))
+      return -1;
+    pa_threaded_mainloop_wait (dev->loop);
+  }
+}
+
+/**
+ * Returns the time it takes until a sample written now gets played. The
+ * stream updates its timing information on its own, we only have to wait
+ * for the first update.
+ */
+static int
+device_get_latency (kk_device_pulseaudio_t *dev, pa_usec_t *usec)
+{
+  int negative = 0;
+
+  while (pa_stream_get_latency (dev->stream, usec, &negative) != 0) {
+    if ((pa_context_errno (dev->context) != PA_ERR_NODATA)
+        || (!PA_STREAM_IS_GOOD (pa_stream_get_state (dev->stream))))
+      return -1;
+    pa_threaded_mainloop_wait (dev->loop);
+  }
+
+  if (negative)
+    *usec = 0;
+  return 0;
+}
+
+static void
+device_close_stream (kk_device_pulseaudio_t *dev)
+{
+  if (dev->stream == NULL)
+    return;
+
+  pa_stream_set_state_callback (dev->stream, NULL, NULL);
+  pa_stream_set_write_callback (dev->stream, NULL, NULL);
+  pa_stream_set_latency_update_callback (dev->stream, NULL, NULL);
+  pa_stream_disconnect (dev->stream);
+  pa_stream_unref (dev->stream);
+  dev->stream = NULL;
+}
+
 static int
 device_init (kk_device_t *dev_base)
 {
@@ -54,7 +194,34 @@ device_init (kk_device_t *dev_base)
 
   if (kk_frame_init (&dev->buffer) != 0)
     return -1;
+
+  dev->loop = pa_threaded_mainloop_new ();
+  if (dev->loop == NULL)
+    return -1;
+
+  dev->context = pa_context_new (pa_threaded_mainloop_get_api (dev->loop), PACKAGE_STRING);
+  if (dev->context == NULL)
+    return -1;
+
+  pa_context_set_state_callback (dev->context, device_context_notify, dev);
+  if (pa_context_connect (dev->context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0)
+    goto error;
+
+  pa_threaded_mainloop_lock (dev->loop);
+  if (pa_threaded_mainloop_start (dev->loop) < 0) {
+    pa_threaded_mainloop_unlock (dev->loop);
+    goto error;
+  }
+  if (device_wait_context (dev) != 0) {
+    pa_threaded_mainloop_unlock (dev->loop);
+    goto error;
+  }
+  pa_threaded_mainloop_unlock (dev->loop);
   return 0;
+error:
+  kk_log (KK_LOG_WARNING, "Connecting to PulseAudio failed: %s.",
+      pa_strerror (pa_context_errno (dev->context)));
+  return -1;
 }
 
 static int
@@ -62,8 +229,18 @@ device_free (kk_device_t *dev_base)
 {
   kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) dev_base;
 
-  if (dev->handle)
-    pa_simple_free (dev->handle);
+  /* Without the mainloop running, nobody else touches context and stream */
+  if (dev->loop)
+    pa_threaded_mainloop_stop (dev->loop);
+
+  device_close_stream (dev);
+  if (dev->context) {
+    pa_context_set_state_callback (dev->context, NULL, NULL);
+    pa_context_disconnect (dev->context);
+    pa_context_unref (dev->context);
+  }
+  if (dev->loop)
+    pa_threaded_mainloop_free (dev->loop);
   kk_frame_free (dev->buffer);
   return 0;
 }
@@ -73,22 +250,126 @@ device_drop (kk_device_t *dev_base)
 {
   kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) dev_base;
 
-  if (dev->handle)
-    pa_simple_drain (dev->handle, NULL);
-  return 0;
+  int ret = 0;
+
+  pa_threaded_mainloop_lock (dev->loop);
+  if (dev->stream)
+    ret = device_wait_operation (dev, pa_stream_flush (dev->stream, device_stream_success, dev));
+  pa_threaded_mainloop_unlock (dev->loop);
+  return ret;
 }
 
 static int
-device_setup (kk_device_t *dev_base, kk_format_t *format)
+device_drain (kk_device_t *dev_base)
+{
+  kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) dev_base;
+
+  int ret = 0;
+
+  pa_threaded_mainloop_lock (dev->loop);
+  if (dev->stream)
+    ret = device_wait_operation (dev, pa_stream_drain (dev->stream, device_stream_success, dev));
+  pa_threaded_mainloop_unlock (dev->loop);
+  return ret;
+}
+
+/**
+ * A corked stream keeps the samples it already has.
+ */
+static int
+device_pause (kk_device_t *dev_base, int pause)
+{
+  kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) dev_base;
+
+  int ret = 0;
+
+  pa_threaded_mainloop_lock (dev->loop);
+  if (dev->stream)
+    ret = device_wait_operation (dev, pa_stream_cork (dev->stream, pause != 0,
+            device_stream_success, dev));
+  pa_threaded_mainloop_unlock (dev->loop);
+  return ret;
+}
+
+/**
+ * Doesn't wait for timing information, the stream keeps it up to date and
+ * interpolates between updates.
+ */
+static int
+device_delay (kk_device_t *dev_base, size_t *frames)
 {
   kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) dev_base;
 
-  const char *client = PACKAGE_STRING;
-  const char *stream = "playback";
-  const char *server = NULL;
-  const char *resource = NULL;
+  pa_usec_t usec = 0;
+  int negative = 0;
+  int ret = -1;
 
-  int status = 0;
+  pa_threaded_mainloop_lock (dev->loop);
+  if ((dev->stream) && (pa_stream_get_latency (dev->stream, &usec, &negative) == 0)) {
+    *frames = (negative) ? 0 : (size_t) (usec * dev->spec.rate / PA_USEC_PER_SEC);
+    ret = 0;
+  }
+  pa_threaded_mainloop_unlock (dev->loop);
+  return ret;
+}
+
+/**
+ * The target length of the server side buffer can be set in milliseconds
+ * with KK_PULSE_LATENCY. Otherwise the server picks it.
+ */
+static int
+device_open_stream (kk_device_pulseaudio_t *dev, pa_sample_spec *spec)
+{
+  const long latency = kk_settings_get_int ("KK_PULSE_LATENCY", 0);
+
+  pa_stream_flags_t flags = PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+  const pa_buffer_attr *granted;
+  pa_buffer_attr attr;
+  pa_channel_map map;
+  pa_usec_t usec = 0;
+
+  /**
+   * PulseAudio's default channel map doesn't match the channel order of
+   * multichannel files, WAVEEX does.
+   */
+  pa_channel_map_init_extend (&map, spec->channels, PA_CHANNEL_MAP_WAVEEX);
+
+  dev->stream = pa_stream_new (dev->context, "playback", spec, &map);
+  if (dev->stream == NULL)
+    return -1;
+
+  pa_stream_set_state_callback (dev->stream, device_stream_notify, dev);
+  pa_stream_set_write_callback (dev->stream, device_stream_request, dev);
+  pa_stream_set_latency_update_callback (dev->stream, device_stream_notify, dev);
+
+  attr.maxlength = (uint32_t) -1;
+  attr.tlength = (uint32_t) -1;
+  attr.prebuf = (uint32_t) -1;
+  attr.minreq = (uint32_t) -1;
+  attr.fragsize = (uint32_t) -1;
+  if (latency > 0) {
+    attr.tlength = (uint32_t) pa_usec_to_bytes ((pa_usec_t) latency * PA_USEC_PER_MSEC, spec);
+    flags |= PA_STREAM_ADJUST_LATENCY;
+  }
+
+  if (pa_stream_connect_playback (dev->stream, NULL, &attr, flags, NULL, NULL) < 0)
+    return -1;
+  if (device_wait_stream (dev) != 0)
+    return -1;
+
+  granted = pa_stream_get_buffer_attr (dev->stream);
+  if (granted)
+    kk_log (KK_LOG_INFO, "Stream granted %u bytes target length, %u bytes prebuffer, "
+        "%u bytes minimum request.", granted->tlength, granted->prebuf, granted->minreq);
+  if (device_get_latency (dev, &usec) == 0)
+    kk_log (KK_LOG_INFO, "Stream latency %.1f ms.", (double) usec / PA_USEC_PER_MSEC);
+  return 0;
+}
+
+static int
+device_setup (kk_device_t *dev_base, kk_format_t *format)
+{
+  kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) dev_base;
 
   pa_sample_spec spec = {
     .format = PA_SAMPLE_INVALID,
@@ -96,28 +377,23 @@ device_setup (kk_device_t *dev_base, kk_format_t *format)
     .rate = format->sample_rate,
   };
 
-  if (dev->handle) {
-    pa_simple_free (dev->handle);
-    dev->handle = NULL;
-  }
-
   if (format->type == KK_TYPE_FLOAT) {
     if (format->bits == KK_BITS_32)
-      spec.format = sample_format[format->layout][4];
+      spec.format = sample_format[format->byte_order][4];
   }
   else {
     switch (format->bits) {
       case KK_BITS_8:
-        spec.format = sample_format[format->layout][0];
+        spec.format = sample_format[format->byte_order][0];
         break;
       case KK_BITS_16:
-        spec.format = sample_format[format->layout][1];
+        spec.format = sample_format[format->byte_order][1];
         break;
       case KK_BITS_24:
-        spec.format = sample_format[format->layout][2];
+        spec.format = sample_format[format->byte_order][2];
         break;
       case KK_BITS_32:
-        spec.format = sample_format[format->layout][3];
+        spec.format = sample_format[format->byte_order][3];
         break;
       case KK_BITS_64:
         break;
@@ -126,49 +402,97 @@ device_setup (kk_device_t *dev_base, kk_format_t *format)
 
   if (spec.format == PA_SAMPLE_INVALID) {
     kk_log (KK_LOG_WARNING, "Sample format not supported by PulseAudio.");
-    goto error;
+    return -1;
   }
+  spec.channels = (uint8_t) kk_format_get_channels (format);
 
-  switch (format->channels) {
-    case KK_CHANNELS_1:
-      spec.channels = 1;
-      break;
-    case KK_CHANNELS_2:
-      spec.channels = 2;
-      break;
+  pa_threaded_mainloop_lock (dev->loop);
+
+  /* Tracks sharing the same format keep using the stream */
+  if ((dev->stream) && (pa_sample_spec_equal (&spec, &dev->spec))
+      && (PA_STREAM_IS_GOOD (pa_stream_get_state (dev->stream)))) {
+    pa_threaded_mainloop_unlock (dev->loop);
+    return 0;
   }
 
-  dev->handle =
-      pa_simple_new (server, client, PA_STREAM_PLAYBACK, resource, stream,
-          &spec, NULL, NULL, &status);
+  device_close_stream (dev);
+  if (device_open_stream (dev, &spec) != 0) {
+    kk_log (KK_LOG_WARNING, "Opening PulseAudio stream failed: %s.",
+        pa_strerror (pa_context_errno (dev->context)));
+    device_close_stream (dev);
+    pa_threaded_mainloop_unlock (dev->loop);
+    return -1;
+  }
+  dev->spec = spec;
 
-  if ((dev->handle == NULL) || (status != 0))
-    goto error;
+  pa_threaded_mainloop_unlock (dev->loop);
   return 0;
-error:
-  dev->handle = NULL;
-  return -1;
 }
 
+/**
+ * Samples get copied right into the memory PulseAudio sends to the server.
+ * We never write more than the stream asks for, so the server doesn't have
+ * to buffer anything on our behalf.
+ */
 static int
 device_write (kk_device_t *dev_base, kk_frame_t *frame)
 {
   kk_device_pulseaudio_t *dev = (kk_device_pulseaudio_t *) dev_base;
 
-  void *data = NULL;
+  const uint8_t *data = NULL;
+  size_t len = frame->size;
+  size_t frame_size;
+  size_t size;
+  void *buf;
 
   switch (dev_base->format->layout) {
     case KK_LAYOUT_PLANAR:
       if (kk_frame_interleave (dev->buffer, frame, dev_base->format) != 0)
         return -1;
-      data = (void *) dev->buffer->data[0];
+      data = dev->buffer->data[0];
       break;
     case KK_LAYOUT_INTERLEAVED:
-      data = (void *) frame->data[0];
+      data = frame->data[0];
       break;
   }
 
-  if (pa_simple_write (dev->handle, data, frame->size, NULL) != 0)
-    return -1;
+  pa_threaded_mainloop_lock (dev->loop);
+  if (dev->stream == NULL)
+    goto error;
+
+  frame_size = pa_frame_size (&dev->spec);
+  while (len > 0) {
+    if (!PA_STREAM_IS_GOOD (pa_stream_get_state (dev->stream)))
+      goto error;
+
+    size = pa_stream_writable_size (dev->stream);
+    if (size == (size_t) -1)
+      goto error;
+    if (size < frame_size) {
+      pa_threaded_mainloop_wait (dev->loop);
+      continue;
+    }
+
+    if (size > len)
+      size = len;
+    if (pa_stream_begin_write (dev->stream, &buf, &size) < 0)
+      goto error;
+    size -= size % frame_size;
+    if (size == 0) {
+      pa_stream_cancel_write (dev->stream);
+      goto error;
+    }
+
+    memcpy (buf, data, size);
+    if (pa_stream_write (dev->stream, buf, size, NULL, 0, PA_SEEK_RELATIVE) < 0)
+      goto error;
+    data += size;
+    len -= size;
+  }
+
+  pa_threaded_mainloop_unlock (dev->loop);
   return 0;
+error:
+  pa_threaded_mainloop_unlock (dev->loop);
+  return -1;
 }
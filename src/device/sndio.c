@@ -7,27 +7,61 @@
 
 typedef struct kk_device_sndio kk_device_sndio_t;
 
+/**
+ * The device tells us in the onmove callback how many sample frames got
+ * played. The difference to the number of written sample frames is what
+ * the user didn't hear yet. Both counters start over with sio_start.
+ */
 struct kk_device_sndio {
   kk_device_t base;
   kk_frame_t *buffer;
   struct sio_hdl *device;
+  size_t stride;
+  long long written;
+  long long played;
 };
 
 static int device_init (kk_device_t *);
 static int device_free (kk_device_t *);
 static int device_drop (kk_device_t *);
+static int device_drain (kk_device_t *);
+static int device_delay (kk_device_t *, size_t *);
 static int device_setup (kk_device_t *, kk_format_t *);
 static int device_write (kk_device_t *, kk_frame_t *);
 
 const kk_device_backend_t device_backend = {
   .size = sizeof (kk_device_sndio_t),
+  .formats = {
+    [KK_TYPE_UINT] = KK_DEVICE_BITS (KK_BITS_8) | KK_DEVICE_BITS (KK_BITS_16) |
+        KK_DEVICE_BITS (KK_BITS_24) | KK_DEVICE_BITS (KK_BITS_32),
+    [KK_TYPE_SINT] = KK_DEVICE_BITS (KK_BITS_8) | KK_DEVICE_BITS (KK_BITS_16) |
+        KK_DEVICE_BITS (KK_BITS_24) | KK_DEVICE_BITS (KK_BITS_32),
+    [KK_TYPE_FLOAT] = 0,
+  },
   .init = device_init,
   .free = device_free,
   .drop = device_drop,
+  .drain = device_drain,
+  .delay = device_delay,
   .setup = device_setup,
   .write = device_write,
 };
 
+static void
+device_onmove (void *arg, int delta)
+{
+  kk_device_sndio_t *dev = (kk_device_sndio_t *) arg;
+
+  dev->played += delta;
+}
+
+static void
+device_reset (kk_device_sndio_t *dev)
+{
+  dev->written = 0;
+  dev->played = 0;
+}
+
 static int
 device_init (kk_device_t *dev_base)
 {
@@ -36,6 +70,7 @@ device_init (kk_device_t *dev_base)
   dev->device = sio_open (SIO_DEVANY, SIO_PLAY, 0);
   if (dev->device == NULL)
     return -1;
+  sio_onmove (dev->device, device_onmove, dev);
   if (kk_frame_init (&dev->buffer) != 0)
     return -1;
   return 0;
@@ -56,8 +91,41 @@ device_drop (kk_device_t *dev_base)
 {
   kk_device_sndio_t *dev = (kk_device_sndio_t *) dev_base;
 
+  /**
+   * Without sio_flush, sio_stop plays the buffered samples first. Either
+   * way, the device has to be started again for the next write.
+   */
+#ifdef HAVE_SIO_FLUSH
+  if (sio_flush (dev->device) == 0)
+    return -1;
+#else
   if (sio_stop (dev->device) == 0)
     return -1;
+#endif
+  device_reset (dev);
+  if (sio_start (dev->device) == 0)
+    return -1;
+  return 0;
+}
+
+static int
+device_drain (kk_device_t *dev_base)
+{
+  kk_device_sndio_t *dev = (kk_device_sndio_t *) dev_base;
+
+  /* sio_stop waits until the buffered samples have been played */
+  if (sio_stop (dev->device) == 0)
+    return -1;
+  device_reset (dev);
+  return 0;
+}
+
+static int
+device_delay (kk_device_t *dev_base, size_t *frames)
+{
+  kk_device_sndio_t *dev = (kk_device_sndio_t *) dev_base;
+
+  *frames = (dev->written > dev->played) ? (size_t) (dev->written - dev->played) : 0;
   return 0;
 }
 
@@ -84,6 +152,17 @@ device_setup (kk_device_t *dev_base, kk_format_t *format)
   if (sio_setpar (dev->device, &param) == 0)
     return -1;
 
+  if (sio_getpar (dev->device, &param) == 0)
+    return -1;
+
+  /* sndio picks the closest number of channels, we need the exact one */
+  if (param.pchan != (unsigned int) kk_format_get_channels (format)) {
+    kk_log (KK_LOG_WARNING, "Device doesn't support %d channels.", kk_format_get_channels (format));
+    return -1;
+  }
+  dev->stride = (size_t) (param.bps * param.pchan);
+
+  device_reset (dev);
   if (sio_start (dev->device) == 0)
     return -1;
 
@@ -109,5 +188,7 @@ device_write (kk_device_t *dev_base, kk_frame_t *frame)
   }
   if (sio_write (dev->device, data, frame->size) == 0)
     return -1;
+  if (dev->stride)
+    dev->written += (long long) (frame->size / dev->stride);
   return 0;
 }
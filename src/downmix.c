@@ -0,0 +1,350 @@
+#include <klingklang/cpu.h>
+#include <klingklang/downmix.h>
+#include <klingklang/util.h>
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define DOWNMIX_X86
+#  include <immintrin.h>
+#endif
+
+/**
+ * Speaker positions of the channels, indexed by the number of channels.
+ * These are the default orders of FLAC and WAV files, which apply if the
+ * decoder doesn't tell the positions.
+ */
+static const kk_position_t downmix_layouts[KK_FORMAT_MAX_CHANNELS + 1][KK_FORMAT_MAX_CHANNELS] = {
+  [1] = { KK_POSITION_FC },
+  [2] = { KK_POSITION_FL, KK_POSITION_FR },
+  [3] = { KK_POSITION_FL, KK_POSITION_FR, KK_POSITION_FC },
+  [4] = { KK_POSITION_FL, KK_POSITION_FR, KK_POSITION_BL, KK_POSITION_BR },
+  [5] = { KK_POSITION_FL, KK_POSITION_FR, KK_POSITION_FC, KK_POSITION_BL, KK_POSITION_BR },
+  [6] = { KK_POSITION_FL, KK_POSITION_FR, KK_POSITION_FC, KK_POSITION_LFE, KK_POSITION_BL,
+          KK_POSITION_BR },
+  [7] = { KK_POSITION_FL, KK_POSITION_FR, KK_POSITION_FC, KK_POSITION_LFE, KK_POSITION_BC,
+          KK_POSITION_SL, KK_POSITION_SR },
+  [8] = { KK_POSITION_FL, KK_POSITION_FR, KK_POSITION_FC, KK_POSITION_LFE, KK_POSITION_BL,
+          KK_POSITION_BR, KK_POSITION_SL, KK_POSITION_SR },
+};
+
+/**
+ * How much of each position goes to the left and right channel. Centered
+ * channels get split between both sides at -3 dB, the low frequency
+ * channel gets dropped.
+ */
+static const float downmix_stereo[KK_POSITIONS][2] = {
+  [KK_POSITION_FL] = { 1.0f, 0.0f },
+  [KK_POSITION_FR] = { 0.0f, 1.0f },
+  [KK_POSITION_FC] = { (float) M_SQRT1_2, (float) M_SQRT1_2 },
+  [KK_POSITION_LFE] = { 0.0f, 0.0f },
+  [KK_POSITION_BL] = { (float) M_SQRT1_2, 0.0f },
+  [KK_POSITION_BR] = { 0.0f, (float) M_SQRT1_2 },
+  [KK_POSITION_FLC] = { 1.0f, 0.0f },
+  [KK_POSITION_FRC] = { 0.0f, 1.0f },
+  [KK_POSITION_BC] = { 0.5f, 0.5f },
+  [KK_POSITION_SL] = { (float) M_SQRT1_2, 0.0f },
+  [KK_POSITION_SR] = { 0.0f, (float) M_SQRT1_2 },
+};
+
+/**
+ * Reference implementation.
+ */
+static void
+downmix_scalar (kk_downmix_t *mix, float *dst, const float *src, size_t frames)
+{
+  const size_t in = mix->in;
+  const size_t out = mix->out;
+
+  float sum;
+  size_t f;
+  size_t o;
+  size_t i;
+
+  for (f = 0; f < frames; f++) {
+    for (o = 0; o < out; o++) {
+      sum = 0.0f;
+      for (i = 0; i < in; i++)
+        sum += src[i] * mix->columns[i][o];
+      *dst++ = sum;
+    }
+    src += in;
+  }
+}
+
+/**
+ * The vector kernels store a whole register per output frame, which runs
+ * into the following frames. These get overwritten by the next store. Only
+ * the last frames, whose store would run past the end of dst, go through a
+ * temporary buffer.
+ */
+#ifdef DOWNMIX_X86
+__attribute__ ((target ("sse2")))
+static void
+downmix_sse2 (kk_downmix_t *mix, float *dst, const float *src, size_t frames)
+{
+  const size_t in = mix->in;
+  const size_t out = mix->out;
+  const size_t total = frames * out;
+
+  float tmp[4];
+  __m128 acc;
+  size_t f;
+  size_t i;
+
+  for (f = 0; f < frames; f++) {
+    acc = _mm_mul_ps (_mm_set1_ps (src[0]), _mm_loadu_ps (mix->columns[0]));
+    for (i = 1; i < in; i++)
+      acc = _mm_add_ps (acc, _mm_mul_ps (_mm_set1_ps (src[i]),
+              _mm_loadu_ps (mix->columns[i])));
+
+    if (f * out + 4 <= total)
+      _mm_storeu_ps (dst + f * out, acc);
+    else {
+      _mm_storeu_ps (tmp, acc);
+      memcpy (dst + f * out, tmp, out * sizeof (float));
+    }
+    src += in;
+  }
+}
+
+__attribute__ ((target ("avx2")))
+static void
+downmix_avx2 (kk_downmix_t *mix, float *dst, const float *src, size_t frames)
+{
+  const size_t in = mix->in;
+  const size_t out = mix->out;
+  const size_t total = frames * out;
+
+  float tmp[8];
+  __m256 acc;
+  size_t f;
+  size_t i;
+
+  for (f = 0; f < frames; f++) {
+    acc = _mm256_mul_ps (_mm256_set1_ps (src[0]), _mm256_loadu_ps (mix->columns[0]));
+    for (i = 1; i < in; i++)
+      acc = _mm256_add_ps (acc, _mm256_mul_ps (_mm256_set1_ps (src[i]),
+              _mm256_loadu_ps (mix->columns[i])));
+
+    if (f * out + 8 <= total)
+      _mm256_storeu_ps (dst + f * out, acc);
+    else {
+      _mm256_storeu_ps (tmp, acc);
+      memcpy (dst + f * out, tmp, out * sizeof (float));
+    }
+    src += in;
+  }
+}
+#endif
+
+/**
+ * Up to four output channels fit into an SSE2 register, more need AVX2.
+ */
+static kk_downmix_func
+downmix_select_kernel (size_t out)
+{
+  const unsigned int features = kk_cpu_get_features ();
+
+#ifdef DOWNMIX_X86
+  if ((out <= 4) && (features & KK_CPU_SSE2))
+    return downmix_sse2;
+  if (features & KK_CPU_AVX2)
+    return downmix_avx2;
+#endif
+
+  (void) features;
+  (void) out;
+  return downmix_scalar;
+}
+
+/**
+ * Parses rows separated by semicolons of coefficients separated by commas.
+ * All rows need the same number of coefficients.
+ */
+static int
+downmix_parse (kk_downmix_t *mix, const char *str)
+{
+  const char *ptr = str;
+  char *end = NULL;
+  size_t cols = 0;
+
+  mix->user.rows = 0;
+  mix->user.cols = 0;
+
+  for (;;) {
+    if (mix->user.rows >= KK_FORMAT_MAX_CHANNELS)
+      goto error;
+
+    for (cols = 0;; cols++) {
+      if (cols >= KK_FORMAT_MAX_CHANNELS)
+        goto error;
+      mix->user.matrix[mix->user.rows][cols] = strtof (ptr, &end);
+      if (end == ptr)
+        goto error;
+      ptr = end;
+      while (*ptr == ' ')
+        ptr++;
+      if (*ptr != ',')
+        break;
+      ptr++;
+    }
+    cols++;
+
+    if ((mix->user.rows > 0) && (cols != mix->user.cols))
+      goto error;
+    mix->user.cols = cols;
+    mix->user.rows++;
+
+    if (*ptr == '\0')
+      break;
+    if (*ptr != ';')
+      goto error;
+    ptr++;
+  }
+
+  if (mix->user.rows >= mix->user.cols)
+    goto error;
+  return 0;
+error:
+  kk_log (KK_LOG_WARNING, "Ignoring invalid downmix matrix '%s'.", str);
+  mix->user.rows = 0;
+  mix->user.cols = 0;
+  return -1;
+}
+
+/**
+ * Fills layout with the speaker positions of the in channels. Positions
+ * which don't describe exactly in channels get replaced by the default
+ * layout.
+ */
+static void
+downmix_get_layout (kk_position_t *layout, size_t in, unsigned int positions)
+{
+  size_t n = 0;
+  int pos;
+
+  if (((positions >> KK_POSITIONS) != 0) || ((size_t) __builtin_popcount (positions) != in)) {
+    memcpy (layout, downmix_layouts[in], in * sizeof (kk_position_t));
+    return;
+  }
+
+  for (pos = 0; pos < KK_POSITIONS; pos++) {
+    if (positions & KK_FORMAT_POSITION (pos))
+      layout[n++] = (kk_position_t) pos;
+  }
+}
+
+/**
+ * Builds the default matrix for mixing in channels to one or two channels.
+ * Mono gets the average of left and right. The result gets scaled so that
+ * no output channel can clip.
+ */
+static int
+downmix_setup_default (kk_downmix_t *mix, unsigned int positions)
+{
+  kk_position_t layout[KK_FORMAT_MAX_CHANNELS];
+  float max = 0.0f;
+  float sum;
+  float c;
+  size_t o;
+  size_t i;
+  kk_position_t pos;
+
+  if ((mix->out != 1) && (mix->out != 2))
+    return -1;
+
+  downmix_get_layout (layout, mix->in, positions);
+  for (i = 0; i < mix->in; i++) {
+    pos = layout[i];
+    if (mix->out == 1)
+      mix->columns[i][0] = 0.5f * (downmix_stereo[pos][0] + downmix_stereo[pos][1]);
+    else {
+      mix->columns[i][0] = downmix_stereo[pos][0];
+      mix->columns[i][1] = downmix_stereo[pos][1];
+    }
+  }
+
+  for (o = 0; o < mix->out; o++) {
+    sum = 0.0f;
+    for (i = 0; i < mix->in; i++)
+      sum += fabsf (mix->columns[i][o]);
+    if (sum > max)
+      max = sum;
+  }
+
+  if (max > 1.0f) {
+    c = 1.0f / max;
+    for (i = 0; i < mix->in; i++) {
+      for (o = 0; o < mix->out; o++)
+        mix->columns[i][o] *= c;
+    }
+  }
+  return 0;
+}
+
+int
+kk_downmix_init (kk_downmix_t **mix, const char *matrix)
+{
+  kk_downmix_t *result;
+
+  result = calloc (1, sizeof (kk_downmix_t));
+  if (result == NULL)
+    goto error;
+
+  if (matrix)
+    downmix_parse (result, matrix);
+
+  *mix = result;
+  return 0;
+error:
+  *mix = NULL;
+  return -1;
+}
+
+int
+kk_downmix_free (kk_downmix_t *mix)
+{
+  free (mix);
+  return 0;
+}
+
+int
+kk_downmix_setup (kk_downmix_t *mix, size_t in, size_t out,
+    unsigned int positions)
+{
+  size_t o;
+  size_t i;
+
+  if ((out == 0) || (out >= in) || (in > KK_FORMAT_MAX_CHANNELS))
+    goto error;
+
+  mix->in = in;
+  mix->out = out;
+  memset (mix->columns, 0, sizeof (mix->columns));
+
+  if ((mix->user.rows == out) && (mix->user.cols == in)) {
+    for (o = 0; o < out; o++) {
+      for (i = 0; i < in; i++)
+        mix->columns[i][o] = mix->user.matrix[o][i];
+    }
+  }
+  else if (downmix_setup_default (mix, positions) != 0)
+    goto error;
+
+  mix->kernel = downmix_select_kernel (out);
+
+  kk_log (KK_LOG_DEBUG, "Mixing %zu channels down to %zu channels.", in, out);
+  return 0;
+error:
+  kk_log (KK_LOG_WARNING, "Can't mix %zu channels down to %zu channels.", in, out);
+  mix->kernel = NULL;
+  return -1;
+}
+
+void
+kk_downmix (kk_downmix_t *mix, float *dst, const float *src, size_t frames)
+{
+  if (frames > 0)
+    mix->kernel (mix, dst, src, frames);
+}
@@ -1,6 +1,18 @@
 #include <klingklang/format.h>
 #include <klingklang/util.h>
 
+int
+kk_format_equal (kk_format_t *a, kk_format_t *b)
+{
+  return (a->bits == b->bits)
+      && (a->byte_order == b->byte_order)
+      && (a->channels == b->channels)
+      && (a->layout == b->layout)
+      && (a->type == b->type)
+      && (a->sample_rate == b->sample_rate)
+      && (a->positions == b->positions);
+}
+
 /**
  * I know, these switch statements are ugly, but directly returning values
  * with every case lead to dead code warnings at the end of the switch
@@ -18,10 +30,48 @@ kk_format_get_channels (kk_format_t *fmt)
     case KK_CHANNELS_2:
       result = 2;
       break;
+    case KK_CHANNELS_3:
+      result = 3;
+      break;
+    case KK_CHANNELS_4:
+      result = 4;
+      break;
+    case KK_CHANNELS_5:
+      result = 5;
+      break;
+    case KK_CHANNELS_6:
+      result = 6;
+      break;
+    case KK_CHANNELS_7:
+      result = 7;
+      break;
+    case KK_CHANNELS_8:
+      result = 8;
+      break;
   }
   return result;
 }
 
+/**
+ * The channel enum members are in ascending order, so the number of
+ * channels maps directly to them. Returns -1 if there are too many. The
+ * positions only stay if the number of channels doesn't change.
+ */
+int
+kk_format_set_channels (kk_format_t *fmt, int channels)
+{
+  kk_channels_t result;
+
+  if ((channels < 1) || (channels > KK_FORMAT_MAX_CHANNELS))
+    return -1;
+
+  result = (kk_channels_t) (KK_CHANNELS_1 + (channels - 1));
+  if (fmt->channels != result)
+    fmt->positions = 0;
+  fmt->channels = result;
+  return 0;
+}
+
 int
 kk_format_get_bits (kk_format_t *fmt)
 {
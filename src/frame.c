@@ -1,6 +1,9 @@
+#include <klingklang/cpu.h>
 #include <klingklang/frame.h>
 #include <klingklang/util.h>
 
+#include <pthread.h>
+
 static size_t
 frame_get_planes (kk_frame_t *frame)
 {
@@ -10,6 +13,177 @@ frame_get_planes (kk_frame_t *frame)
     return KK_FRAME_MAX_PLANES;
 }
 
+/**
+ * The samples start right behind the buffer header. The header size gets
+ * rounded up, so that the samples are 16 byte aligned.
+ */
+#define FRAME_BUFFER_HEADER \
+  ((sizeof (kk_frame_buffer_t) + 15) & ~((size_t) 15))
+
+static inline uint8_t *
+frame_buffer_get_data (kk_frame_buffer_t *buf)
+{
+  return (uint8_t *) buf + FRAME_BUFFER_HEADER;
+}
+
+static inline kk_frame_buffer_t *
+frame_buffer_from_data (uint8_t *data)
+{
+  return (kk_frame_buffer_t *) (void *) (data - FRAME_BUFFER_HEADER);
+}
+
+/**
+ * Returns the index of the smallest class holding size bytes or -1 if the
+ * size exceeds the largest class.
+ */
+static int
+frame_pool_get_class (size_t size)
+{
+  size_t csize = KK_FRAME_POOL_MIN_SIZE;
+  int i;
+
+  for (i = 0; i < KK_FRAME_POOL_CLASSES; i++) {
+    if (size <= csize)
+      return i;
+    csize <<= 1;
+  }
+  return -1;
+}
+
+static size_t
+frame_pool_get_class_size (int class)
+{
+  return (size_t) KK_FRAME_POOL_MIN_SIZE << class;
+}
+
+static kk_frame_buffer_t *
+frame_pool_alloc (kk_frame_pool_t *pool, size_t size)
+{
+  kk_frame_buffer_t *buf;
+
+  buf = malloc (FRAME_BUFFER_HEADER + size);
+  if (buf == NULL)
+    return NULL;
+
+  buf->next = NULL;
+  buf->size = size;
+  __atomic_add_fetch (&pool->allocs, 1, __ATOMIC_RELAXED);
+  return buf;
+}
+
+int
+kk_frame_pool_init (kk_frame_pool_t **pool)
+{
+  kk_frame_pool_t *result;
+
+  result = calloc (1, sizeof (kk_frame_pool_t));
+  if (result == NULL)
+    goto error;
+  *pool = result;
+  return 0;
+error:
+  *pool = NULL;
+  return -1;
+}
+
+int
+kk_frame_pool_free (kk_frame_pool_t *pool)
+{
+  kk_frame_buffer_t *buf;
+  int i;
+
+  if (pool == NULL)
+    return 0;
+
+  for (i = 0; i < KK_FRAME_POOL_CLASSES; i++) {
+    while ((buf = pool->free[i]) != NULL) {
+      pool->free[i] = buf->next;
+      free (buf);
+    }
+  }
+  free (pool);
+  return 0;
+}
+
+/**
+ * Makes sure the pool holds at least count unused buffers of the class
+ * matching size.
+ */
+int
+kk_frame_pool_reserve (kk_frame_pool_t *pool, size_t size, size_t count)
+{
+  const int class = frame_pool_get_class (size);
+
+  kk_frame_buffer_t *buf;
+  size_t have = 0;
+
+  if (class < 0)
+    return -1;
+
+  for (buf = pool->free[class]; buf != NULL; buf = buf->next)
+    have++;
+
+  for (; have < count; have++) {
+    buf = frame_pool_alloc (pool, frame_pool_get_class_size (class));
+    if (buf == NULL)
+      return -1;
+    buf->next = pool->free[class];
+    pool->free[class] = buf;
+  }
+  return 0;
+}
+
+uint8_t *
+kk_frame_pool_get (kk_frame_pool_t *pool, size_t size)
+{
+  const int class = frame_pool_get_class (size);
+
+  kk_frame_buffer_t *buf;
+
+  /* Larger buffers don't get pooled */
+  if (class < 0)
+    buf = frame_pool_alloc (pool, size);
+  else if (pool->free[class] != NULL) {
+    buf = pool->free[class];
+    pool->free[class] = buf->next;
+  }
+  else
+    buf = frame_pool_alloc (pool, frame_pool_get_class_size (class));
+
+  if (buf == NULL)
+    return NULL;
+  return frame_buffer_get_data (buf);
+}
+
+void
+kk_frame_pool_put (kk_frame_pool_t *pool, uint8_t *data)
+{
+  kk_frame_buffer_t *buf;
+  int class;
+
+  if (data == NULL)
+    return;
+
+  buf = frame_buffer_from_data (data);
+  class = frame_pool_get_class (buf->size);
+  if ((class < 0) || (frame_pool_get_class_size (class) != buf->size)) {
+    free (buf);
+    return;
+  }
+  buf->next = pool->free[class];
+  pool->free[class] = buf;
+}
+
+/**
+ * Returns the number of buffers the pool allocated so far. Unlike the other
+ * pool functions, this one may be called from any thread.
+ */
+size_t
+kk_frame_pool_get_allocs (kk_frame_pool_t *pool)
+{
+  return __atomic_load_n (&pool->allocs, __ATOMIC_RELAXED);
+}
+
 static void
 frame_free_planes (kk_frame_t *frame)
 {
@@ -18,8 +192,12 @@ frame_free_planes (kk_frame_t *frame)
   if (frame == NULL)
     return;
 
-  for (i = 0; i < frame_get_planes (frame); i++)
-    free (frame->data[i]);
+  for (i = 0; i < frame_get_planes (frame); i++) {
+    if (frame->pool)
+      kk_frame_pool_put (frame->pool, frame->data[i]);
+    else
+      free (frame->data[i]);
+  }
 
   memset (frame->data, 0, KK_FRAME_MAX_PLANES * sizeof (uint8_t *));
   frame->planes = 0;
@@ -41,6 +219,19 @@ error:
   return -1;
 }
 
+/**
+ * Frames created with a pool take the memory of their planes from the pool
+ * and give it back when they need larger planes or get freed.
+ */
+int
+kk_frame_init_pooled (kk_frame_t **frame, kk_frame_pool_t *pool)
+{
+  if (kk_frame_init (frame) != 0)
+    return -1;
+  (*frame)->pool = pool;
+  return 0;
+}
+
 int
 kk_frame_free (kk_frame_t *frame)
 {
@@ -71,12 +262,22 @@ frame_realloc (kk_frame_t *frame, size_t planes, size_t size)
   if (frame->planes > 0)
     frame_free_planes (frame);
 
+  /* Set early, so that frame_free_planes frees what we got so far */
+  frame->planes = planes;
+
   for (i = 0; i < planes; i++) {
-    frame->data[i] = calloc (size / planes, sizeof (uint8_t));
+    if (frame->pool)
+      frame->data[i] = kk_frame_pool_get (frame->pool, size / planes);
+    else
+      frame->data[i] = calloc (size / planes, sizeof (uint8_t));
     if (frame->data[i] == NULL)
       goto error;
   }
-  frame->planes = planes;
+
+  /* Pooled planes might be larger than requested */
+  if (frame->pool)
+    size = frame_buffer_from_data (frame->data[0])->size * planes;
+
   frame->size = size;
   return 0;
 error:
@@ -84,55 +285,269 @@ error:
   return -1;
 }
 
-static inline void
-frame_interleave (kk_frame_t *restrict dst, kk_frame_t *restrict src,
-    size_t byte)
+/**
+ * Makes sure frame has the given number of planes and room for at least
+ * size bytes. Samples in frame get lost if it has to grow.
+ */
+int
+kk_frame_reserve (kk_frame_t *frame, size_t planes, size_t size)
 {
-  register uint8_t *restrict ilp = dst->data[0];
-  register uint8_t *restrict pla = src->data[0];
-  register uint8_t *restrict plb = src->data[1];
+  if ((size > frame->size) || (frame->planes != planes))
+    return frame_realloc (frame, planes, size);
+  return 0;
+}
 
+/**
+ * Reference implementation. Copies n samples of byte bytes from each plane
+ * to dst, alternating between both planes. Called with constant byte
+ * values only, so the compiler can specialize it for every sample width.
+ */
+static inline void
+frame_interleave (uint8_t *restrict dst, const uint8_t *restrict pla,
+    const uint8_t *restrict plb, size_t n, size_t byte)
+{
   size_t i;
   size_t j;
 
-  for (i = 0; i < (src->size / (2 * byte)); i++) {
+  for (i = 0; i < n; i++) {
     for (j = 0; j < byte; j++)
-      *ilp++ = *pla++;
+      *dst++ = *pla++;
     for (j = 0; j < byte; j++)
-      *ilp++ = *plb++;
+      *dst++ = *plb++;
+  }
+}
+
+typedef void (*frame_interleave_func) (uint8_t *restrict dst,
+    const uint8_t *restrict pla, const uint8_t *restrict plb, size_t n);
+
+#define FRAME_INTERLEAVE_SCALAR(bits, byte) \
+  static void \
+  frame_interleave_##bits (uint8_t *restrict dst, \
+      const uint8_t *restrict pla, const uint8_t *restrict plb, size_t n) \
+  { \
+    frame_interleave (dst, pla, plb, n, byte); \
+  }
+
+FRAME_INTERLEAVE_SCALAR (8, 1)
+FRAME_INTERLEAVE_SCALAR (16, 2)
+FRAME_INTERLEAVE_SCALAR (24, 3)
+FRAME_INTERLEAVE_SCALAR (32, 4)
+FRAME_INTERLEAVE_SCALAR (64, 8)
+
+/**
+ * Frames with more than two channels gather one sample from every plane
+ * for each interleaved sample frame. Like above, byte is always constant.
+ */
+static inline void
+frame_interleave_planes (uint8_t *restrict dst, uint8_t *const *planes,
+    size_t channels, size_t n, size_t byte)
+{
+  size_t i;
+  size_t c;
+
+  for (i = 0; i < n; i++) {
+    for (c = 0; c < channels; c++) {
+      memcpy (dst, planes[c] + i * byte, byte);
+      dst += byte;
+    }
   }
 }
 
+typedef void (*frame_interleave_planes_func) (uint8_t *restrict dst,
+    uint8_t *const *planes, size_t channels, size_t n);
+
+#define FRAME_INTERLEAVE_PLANES(bits, byte) \
+  static void \
+  frame_interleave_planes_##bits (uint8_t *restrict dst, \
+      uint8_t *const *planes, size_t channels, size_t n) \
+  { \
+    frame_interleave_planes (dst, planes, channels, n, byte); \
+  }
+
+FRAME_INTERLEAVE_PLANES (8, 1)
+FRAME_INTERLEAVE_PLANES (16, 2)
+FRAME_INTERLEAVE_PLANES (24, 3)
+FRAME_INTERLEAVE_PLANES (32, 4)
+FRAME_INTERLEAVE_PLANES (64, 8)
+
+static const frame_interleave_planes_func frame_planes_kernels[9] = {
+  [1] = frame_interleave_planes_8,
+  [2] = frame_interleave_planes_16,
+  [3] = frame_interleave_planes_24,
+  [4] = frame_interleave_planes_32,
+  [8] = frame_interleave_planes_64,
+};
+
+/**
+ * The vector kernels load one register from each plane and unpack both
+ * into two registers of interleaved samples. Whatever doesn't fill a whole
+ * register gets handled by the reference implementation. 24 bit samples
+ * don't fit into vector lanes, they always use the scalar kernel.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#  define FRAME_X86
+
+#  define FRAME_INTERLEAVE_SSE2(bits, byte) \
+  __attribute__ ((target ("sse2"))) \
+  static void \
+  frame_interleave_sse2_##bits (uint8_t *restrict dst, \
+      const uint8_t *restrict pla, const uint8_t *restrict plb, size_t n) \
+  { \
+    const size_t step = 16 / byte; \
+    size_t i; \
+    \
+    for (i = 0; i + step <= n; i += step) { \
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (pla + i * byte)); \
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (plb + i * byte)); \
+      _mm_storeu_si128 ((__m128i *) (dst + 2 * i * byte), \
+          _mm_unpacklo_epi##bits (a, b)); \
+      _mm_storeu_si128 ((__m128i *) (dst + 2 * i * byte + 16), \
+          _mm_unpackhi_epi##bits (a, b)); \
+    } \
+    frame_interleave (dst + 2 * i * byte, pla + i * byte, plb + i * byte, \
+        n - i, byte); \
+  }
+
+/**
+ * AVX2 unpacks within 128 bit lanes only. Permuting the lanes afterwards
+ * puts the samples in the right order.
+ */
+#  define FRAME_INTERLEAVE_AVX2(bits, byte) \
+  __attribute__ ((target ("avx2"))) \
+  static void \
+  frame_interleave_avx2_##bits (uint8_t *restrict dst, \
+      const uint8_t *restrict pla, const uint8_t *restrict plb, size_t n) \
+  { \
+    const size_t step = 32 / byte; \
+    size_t i; \
+    \
+    for (i = 0; i + step <= n; i += step) { \
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) (pla + i * byte)); \
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (plb + i * byte)); \
+      __m256i lo = _mm256_unpacklo_epi##bits (a, b); \
+      __m256i hi = _mm256_unpackhi_epi##bits (a, b); \
+      _mm256_storeu_si256 ((__m256i *) (dst + 2 * i * byte), \
+          _mm256_permute2x128_si256 (lo, hi, 0x20)); \
+      _mm256_storeu_si256 ((__m256i *) (dst + 2 * i * byte + 32), \
+          _mm256_permute2x128_si256 (lo, hi, 0x31)); \
+    } \
+    frame_interleave (dst + 2 * i * byte, pla + i * byte, plb + i * byte, \
+        n - i, byte); \
+  }
+
+#  include <immintrin.h>
+
+FRAME_INTERLEAVE_SSE2 (8, 1)
+FRAME_INTERLEAVE_SSE2 (16, 2)
+FRAME_INTERLEAVE_SSE2 (32, 4)
+FRAME_INTERLEAVE_SSE2 (64, 8)
+
+FRAME_INTERLEAVE_AVX2 (8, 1)
+FRAME_INTERLEAVE_AVX2 (16, 2)
+FRAME_INTERLEAVE_AVX2 (32, 4)
+FRAME_INTERLEAVE_AVX2 (64, 8)
+#endif
+
+/**
+ * NEON stores two registers interleaved on its own.
+ */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define FRAME_NEON
+
+#  define FRAME_INTERLEAVE_NEON(bits, byte, lanes) \
+  static void \
+  frame_interleave_neon_##bits (uint8_t *restrict dst, \
+      const uint8_t *restrict pla, const uint8_t *restrict plb, size_t n) \
+  { \
+    const size_t step = 16 / byte; \
+    size_t i; \
+    \
+    for (i = 0; i + step <= n; i += step) { \
+      uint##bits##x##lanes##x2_t v; \
+      v.val[0] = vld1q_u##bits ((const uint##bits##_t *) (const void *) (pla + i * byte)); \
+      v.val[1] = vld1q_u##bits ((const uint##bits##_t *) (const void *) (plb + i * byte)); \
+      vst2q_u##bits ((uint##bits##_t *) (void *) (dst + 2 * i * byte), v); \
+    } \
+    frame_interleave (dst + 2 * i * byte, pla + i * byte, plb + i * byte, \
+        n - i, byte); \
+  }
+
+#  include <arm_neon.h>
+
+FRAME_INTERLEAVE_NEON (8, 1, 16)
+FRAME_INTERLEAVE_NEON (16, 2, 8)
+FRAME_INTERLEAVE_NEON (32, 4, 4)
+#endif
+
+static frame_interleave_func frame_kernels[9];
+static pthread_once_t frame_kernels_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the fastest kernel for every sample width. The kernels are indexed
+ * by the number of bytes per sample.
+ */
+static void
+frame_select_kernels (void)
+{
+  const unsigned int features = kk_cpu_get_features ();
+
+  frame_kernels[1] = frame_interleave_8;
+  frame_kernels[2] = frame_interleave_16;
+  frame_kernels[3] = frame_interleave_24;
+  frame_kernels[4] = frame_interleave_32;
+  frame_kernels[8] = frame_interleave_64;
+
+#ifdef FRAME_X86
+  if (features & KK_CPU_SSE2) {
+    frame_kernels[1] = frame_interleave_sse2_8;
+    frame_kernels[2] = frame_interleave_sse2_16;
+    frame_kernels[4] = frame_interleave_sse2_32;
+    frame_kernels[8] = frame_interleave_sse2_64;
+  }
+  if (features & KK_CPU_AVX2) {
+    frame_kernels[1] = frame_interleave_avx2_8;
+    frame_kernels[2] = frame_interleave_avx2_16;
+    frame_kernels[4] = frame_interleave_avx2_32;
+    frame_kernels[8] = frame_interleave_avx2_64;
+  }
+#endif
+
+#ifdef FRAME_NEON
+  if (features & KK_CPU_NEON) {
+    frame_kernels[1] = frame_interleave_neon_8;
+    frame_kernels[2] = frame_interleave_neon_16;
+    frame_kernels[4] = frame_interleave_neon_32;
+  }
+#endif
+
+  (void) features;
+}
+
 int
 kk_frame_interleave (kk_frame_t *restrict dst, kk_frame_t *restrict src,
     kk_format_t *fmt)
 {
-  if ((src->size > dst->size) || (dst->planes != 1)) {
-    if (frame_realloc (dst, 1, src->size) != 0)
-      return -1;
-  }
+  const size_t channels = (size_t) kk_format_get_channels (fmt);
+  const size_t byte = (size_t) kk_format_get_bits (fmt) >> 3;
+
+  if (src->planes < channels)
+    return -1;
+
+  if (kk_frame_reserve (dst, 1, src->size) != 0)
+    return -1;
 
-  if (fmt->channels == KK_CHANNELS_1) {
+  if (channels == 1) {
     memcpy (dst->data[0], src->data[0], src->size);
   }
+  else if (channels == 2) {
+    pthread_once (&frame_kernels_once, frame_select_kernels);
+
+    frame_kernels[byte] (dst->data[0], src->data[0], src->data[1],
+        src->size / (2 * byte));
+  }
   else {
-    switch (fmt->bits) {
-      case KK_BITS_8:
-        frame_interleave (dst, src, 1);
-        break;
-      case KK_BITS_16:
-        frame_interleave (dst, src, 2);
-        break;
-      case KK_BITS_24:
-        frame_interleave (dst, src, 3);
-        break;
-      case KK_BITS_32:
-        frame_interleave (dst, src, 4);
-        break;
-      case KK_BITS_64:
-        frame_interleave (dst, src, 8);
-        break;
-    }
+    frame_planes_kernels[byte] (dst->data[0], src->data, channels,
+        src->size / (channels * byte));
   }
   return 0;
 }
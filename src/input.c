@@ -1,5 +1,6 @@
 #include <klingklang/base.h>
 #include <klingklang/input.h>
+#include <klingklang/seek-index.h>
 #include <klingklang/util.h>
 
 /**
@@ -11,36 +12,281 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
+#include <libavutil/channel_layout.h>
 #include <libavutil/dict.h>
+#include <libavutil/intreadwrite.h>
+
+#include <math.h>
+
+/**
+ * The send/receive decoding API and AVCodecParameters arrived with
+ * libavcodec 57.37.100 and libavformat 57.33.100, configure checks for these
+ * versions. Later versions made registering formats unnecessary and moved
+ * the channel count to the channel layout.
+ */
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58,9,100)
+#  define KK_INPUT_REGISTER_ALL
+#endif
+
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(59,24,100)
+#  define input_get_channels(inp) ((inp)->cctx->ch_layout.nb_channels)
+#  define input_get_channel_mask(inp) \
+     (((inp)->cctx->ch_layout.order == AV_CHANNEL_ORDER_NATIVE) ? (inp)->cctx->ch_layout.u.mask : 0)
+#else
+#  define input_get_channels(inp) ((inp)->cctx->channels)
+#  define input_get_channel_mask(inp) ((inp)->cctx->channel_layout)
+#endif
 
 /**
- * libavcodec versions >= 55.28.1:
- * av_frame_alloc(), av_frame_unref() and av_frame_free() now can and should be
- * used instead of avcodec_alloc_frame(), avcodec_get_frame_defaults() and
- * avcodec_free_frame() respectively. The latter three functions are
- * deprecated.
+ * FFmpeg can pass the number of samples to skip at the beginning and the end
+ * of a track to us instead of skipping them itself. Libav can't.
  */
-#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(55,28,1)
-#  define av_frame_alloc(x) avcodec_alloc_frame(x)
-#  define av_frame_unref(x) avcodec_get_frame_defaults(x)
+#if defined(AV_CODEC_FLAG2_SKIP_MANUAL)
+#  define KK_INPUT_SKIP_MANUAL AV_CODEC_FLAG2_SKIP_MANUAL
+#elif defined(CODEC_FLAG2_SKIP_MANUAL)
+#  define KK_INPUT_SKIP_MANUAL CODEC_FLAG2_SKIP_MANUAL
 #endif
 
+/**
+ * Decoders like MP3 and Opus need some packets before the target of a seek
+ * to get their state right. We seek at least this many seconds before the
+ * target and drop the decoded samples.
+ */
+#define KK_INPUT_SEEK_PREROLL   0.1
+
+/**
+ * Distance between the entries of the seek index in seconds.
+ */
+#define KK_INPUT_INDEX_INTERVAL 0.5
+
 int libav_initialized = 0;
 
+/**
+ * Speaker positions we know, by their bit in libav's channel masks.
+ */
+static const struct {
+  uint64_t mask;
+  kk_position_t pos;
+} input_positions[] = {
+  { AV_CH_FRONT_LEFT, KK_POSITION_FL },
+  { AV_CH_FRONT_RIGHT, KK_POSITION_FR },
+  { AV_CH_FRONT_CENTER, KK_POSITION_FC },
+  { AV_CH_LOW_FREQUENCY, KK_POSITION_LFE },
+  { AV_CH_BACK_LEFT, KK_POSITION_BL },
+  { AV_CH_BACK_RIGHT, KK_POSITION_BR },
+  { AV_CH_FRONT_LEFT_OF_CENTER, KK_POSITION_FLC },
+  { AV_CH_FRONT_RIGHT_OF_CENTER, KK_POSITION_FRC },
+  { AV_CH_BACK_CENTER, KK_POSITION_BC },
+  { AV_CH_SIDE_LEFT, KK_POSITION_SL },
+  { AV_CH_SIDE_RIGHT, KK_POSITION_SR },
+};
+
 struct kk_input {
-  AVCodec *codec;
+  const AVCodec *codec;
   AVCodecContext *cctx;
   AVFormatContext *fctx;
-  AVFrame *frame;
+  AVFrame *frames[KK_INPUT_MAX_FRAMES];
+  AVPacket *packet;
   AVStream *stream;
+  kk_seek_index_t *index;
   int32_t sidx;
+  unsigned eof:1;
+  unsigned indexing:1;
   struct {
     float end;
     float cur;
     float div;
   } time;
+  struct {
+    int64_t pos;
+    int64_t delay;
+    int64_t length;
+    unsigned side_data:1;
+    unsigned sync:1;
+  } trim;
+  struct {
+    int64_t target;
+    unsigned active:1;
+  } seek;
 };
 
+/**
+ * Files encoded by iTunes store the encoder delay, the padding and the
+ * number of valid samples in a metadata tag named iTunSMPB. It looks like
+ *
+ *   " 00000000 00000840 000001CA 00000000003F31F6 ..."
+ *
+ * All numbers are hex values. The second is the delay, the third the padding
+ * and the fourth the number of valid samples.
+ */
+static void
+input_trim_detect (kk_input_t *inp)
+{
+  AVDictionaryEntry *tag;
+  unsigned int zero;
+  unsigned int delay;
+  unsigned int padding;
+  unsigned long long length;
+
+  tag = av_dict_get (inp->stream->metadata, "iTunSMPB", NULL, 0);
+  if (tag == NULL)
+    tag = av_dict_get (inp->fctx->metadata, "iTunSMPB", NULL, 0);
+  if (tag == NULL)
+    return;
+
+  if (sscanf (tag->value, "%x %x %x %llx", &zero, &delay, &padding, &length) != 4)
+    return;
+
+  inp->trim.delay = (int64_t) delay;
+  inp->trim.length = (int64_t) length;
+}
+
+/**
+ * Returns the number of samples the timestamps of the stream are ahead of
+ * the trimmed track. Only the delay of iTunSMPB counts, skip samples passed
+ * as side data don't show up in the timestamps.
+ */
+static int64_t
+input_get_delay (kk_input_t *inp)
+{
+  return (inp->trim.side_data) ? 0 : inp->trim.delay;
+}
+
+/**
+ * Returns the position of the first sample of src in samples since the
+ * start of the stream or -1 if the decoder didn't tell.
+ */
+static int64_t
+input_get_sample_pos (kk_input_t *inp, AVFrame *src)
+{
+  const AVRational rate = { 1, inp->cctx->sample_rate };
+
+  int64_t ts = src->best_effort_timestamp;
+
+  if ((ts == AV_NOPTS_VALUE) || (rate.den <= 0))
+    return -1;
+
+  if (inp->stream->start_time != AV_NOPTS_VALUE)
+    ts -= inp->stream->start_time;
+  return av_rescale_q (ts, inp->stream->time_base, rate);
+}
+
+static void
+input_frame_cut (kk_input_t *inp, kk_frame_t *frame, size_t front, size_t back)
+{
+  const size_t channels = (size_t) input_get_channels (inp);
+  const size_t bps = (size_t) av_get_bytes_per_sample (inp->cctx->sample_fmt);
+
+  size_t i;
+
+  if (front + back >= frame->samples) {
+    frame->samples = 0;
+    frame->size = 0;
+    return;
+  }
+
+  if (frame->planes > 1) {
+    for (i = 0; i < frame->planes; i++)
+      frame->data[i] += front * bps;
+  }
+  else
+    frame->data[0] += front * bps * channels;
+
+  frame->samples -= front + back;
+  frame->size = frame->samples * bps * channels;
+}
+
+/**
+ * Removes encoder delay and padding from the decoded samples, otherwise
+ * there would be short silences between the tracks of gapless albums.
+ * Returns the number of samples removed from the front.
+ */
+static int64_t
+input_trim (kk_input_t *inp, AVFrame *src, kk_frame_t *frame)
+{
+  const int64_t len = (int64_t) frame->samples;
+
+  int64_t front = 0;
+  int64_t back = 0;
+  int64_t pos;
+
+#ifdef KK_INPUT_SKIP_MANUAL
+  AVFrameSideData *side;
+
+  side = av_frame_get_side_data (src, AV_FRAME_DATA_SKIP_SAMPLES);
+  if ((side) && (side->size >= 10)) {
+    front = (int64_t) AV_RL32 (side->data);
+    back = (int64_t) AV_RL32 (side->data + 4);
+    inp->trim.side_data = 1;
+  }
+#endif
+
+  /* After a seek, only the first frame tells where the decoder started */
+  if (inp->trim.sync) {
+    pos = input_get_sample_pos (inp, src);
+    inp->trim.pos = (pos >= 0) ? pos : inp->seek.target;
+    inp->trim.sync = 0;
+  }
+  pos = inp->trim.pos;
+
+  if (!inp->trim.side_data) {
+    if (pos < inp->trim.delay)
+      front = inp->trim.delay - pos;
+    if ((inp->trim.length > 0) && (pos + len > inp->trim.delay + inp->trim.length))
+      back = pos + len - (inp->trim.delay + inp->trim.length);
+  }
+
+  inp->trim.pos += len;
+
+  if (front > len)
+    front = len;
+  if (back > len - front)
+    back = len - front;
+
+  if ((front > 0) || (back > 0))
+    input_frame_cut (inp, frame, (size_t) front, (size_t) back);
+  return front;
+}
+
+/**
+ * After a seek, the decoder starts at a packet before the target. Samples
+ * before the target get dropped here, frames ending before the target
+ * entirely. Front is the number of samples input_trim already removed. The
+ * target is a position in the stream, just like the timestamps.
+ */
+static void
+input_seek_skip (kk_input_t *inp, AVFrame *src, kk_frame_t *frame, int64_t front)
+{
+  int64_t pos;
+  int64_t skip;
+
+  if (!inp->seek.active)
+    return;
+
+  pos = input_get_sample_pos (inp, src);
+  if (pos < 0) {
+    inp->seek.active = 0;
+    return;
+  }
+
+  skip = inp->seek.target - (pos + front);
+  if (skip <= 0) {
+    inp->seek.active = 0;
+    return;
+  }
+
+  if (skip >= (int64_t) frame->samples) {
+    frame->samples = 0;
+    frame->size = 0;
+    return;
+  }
+
+  input_frame_cut (inp, frame, (size_t) skip, 0);
+  inp->time.cur = (float) (inp->seek.target - input_get_delay (inp))
+                / (float) inp->cctx->sample_rate;
+  inp->seek.active = 0;
+}
+
 static int
 input_stream_detect (kk_input_t *inp)
 {
@@ -48,7 +294,7 @@ input_stream_detect (kk_input_t *inp)
 
   for (i = 0; i < (int32_t) inp->fctx->nb_streams; i++) {
     inp->stream = inp->fctx->streams[i];
-    if (inp->stream->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+    if (inp->stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
       inp->sidx = i;
       return 0;
     }
@@ -56,17 +302,76 @@ input_stream_detect (kk_input_t *inp)
   return -1;
 }
 
+/**
+ * Formats without an index of their own, like MP3 or ADTS, rely on the
+ * index libavformat builds while reading the file. Without it, seeking
+ * guesses the position or reads everything up to the target. We keep
+ * their indexes in a cache, so that seeking is fast and exact even in
+ * files we didn't read yet in this session.
+ */
+static void
+input_index_load (kk_input_t *inp, const char *filename)
+{
+  const AVRational tb = inp->stream->time_base;
+
+  kk_seek_index_entry_t *entry;
+  int64_t interval;
+  size_t i;
+
+  if ((inp->fctx->iformat->flags & AVFMT_GENERIC_INDEX) == 0)
+    return;
+
+  if ((tb.num <= 0) || (tb.den <= 0))
+    return;
+
+  interval = (int64_t) (KK_INPUT_INDEX_INTERVAL * tb.den / tb.num);
+  if (kk_seek_index_init (&inp->index, filename, interval) != 0)
+    return;
+
+  for (i = 0; i < inp->index->count; i++) {
+    entry = inp->index->entries + i;
+    av_add_index_entry (inp->stream, entry->pos, entry->ts, 0, 0, AVINDEX_KEYFRAME);
+  }
+
+  /* Packet timestamps are exact as long as we read from the start */
+  inp->indexing = !inp->index->complete;
+}
+
+/**
+ * Adds the position of a packet of our stream to the seek index. Reaching
+ * the end of the file completes the index.
+ */
+static void
+input_index_add (kk_input_t *inp, AVPacket *packet)
+{
+  if (!inp->indexing)
+    return;
+
+  if (packet == NULL) {
+    inp->index->complete = 1;
+    inp->index->dirty = 1;
+    inp->indexing = 0;
+    return;
+  }
+
+  if ((packet->pos >= 0) && (packet->dts != AV_NOPTS_VALUE))
+    kk_seek_index_add (inp->index, packet->dts, packet->pos);
+}
+
 int
 kk_input_init (kk_input_t **inp, const char *filename)
 {
   kk_input_t *result;
+  size_t i;
 
   result = calloc (1, sizeof (kk_input_t));
   if (result == NULL)
     goto error;
 
   if (!libav_initialized) {
+#ifdef KK_INPUT_REGISTER_ALL
     av_register_all ();
+#endif
     av_log_set_level (AV_LOG_ERROR);
     libav_initialized = 1;
   }
@@ -80,23 +385,60 @@ kk_input_init (kk_input_t **inp, const char *filename)
   if (input_stream_detect (result) != 0)
     goto error;
 
-  result->cctx = result->stream->codec;
-  result->codec = avcodec_find_decoder (result->cctx->codec_id);
+  result->codec = avcodec_find_decoder (result->stream->codecpar->codec_id);
+  if (result->codec == NULL)
+    goto error;
+
+  result->cctx = avcodec_alloc_context3 (result->codec);
+  if (result->cctx == NULL)
+    goto error;
+
+  if (avcodec_parameters_to_context (result->cctx, result->stream->codecpar) < 0)
+    goto error;
+
+  result->cctx->pkt_timebase = result->stream->time_base;
+#ifdef KK_INPUT_SKIP_MANUAL
+  result->cctx->flags2 |= KK_INPUT_SKIP_MANUAL;
+#endif
   if (avcodec_open2 (result->cctx, result->codec, NULL) < 0)
     goto error;
 
   /**
    * We want to use these as unsigned values, therefore check if we can
-   * convert them without changing signedness
+   * convert them without changing signedness. Every channel might get its
+   * own plane, so there mustn't be more channels than a frame has planes.
+   */
+  if ((input_get_channels (result) < 0) || (result->cctx->sample_rate < 0))
+    goto error;
+
+  if (input_get_channels (result) > KK_FRAME_MAX_PLANES) {
+    kk_log (KK_LOG_WARNING, "Can't play files with %d channels.",
+        input_get_channels (result));
+    goto error;
+  }
+
+  /**
+   * The packet and the frames live as long as the input does. Decoding only
+   * references and unreferences their buffers.
    */
-  if ((result->cctx->channels < 0) || (result->cctx->sample_rate < 0))
+  result->packet = av_packet_alloc ();
+  if (result->packet == NULL)
     goto error;
 
+  for (i = 0; i < KK_INPUT_MAX_FRAMES; i++) {
+    result->frames[i] = av_frame_alloc ();
+    if (result->frames[i] == NULL)
+      goto error;
+  }
+
   result->time.cur = 0.0f;
   result->time.end = (float) result->fctx->duration / AV_TIME_BASE;
   result->time.div = (float) result->stream->time_base.den \
                    * (float) result->stream->time_base.num;
 
+  input_trim_detect (result);
+  input_index_load (result, filename);
+
   *inp = result;
   return 0;
 error:
@@ -108,14 +450,18 @@ error:
 int
 kk_input_free (kk_input_t *inp)
 {
+  size_t i;
+
   if (inp == NULL)
     return 0;
 
-  if (inp->frame)
-    av_free (inp->frame);
+  for (i = 0; i < KK_INPUT_MAX_FRAMES; i++)
+    av_frame_free (&inp->frames[i]);
 
-  if (inp->cctx)
-    avcodec_close (inp->cctx);
+  kk_seek_index_release (inp->index);
+
+  av_packet_free (&inp->packet);
+  avcodec_free_context (&inp->cctx);
 
   if (inp->fctx)
     avformat_close_input (&inp->fctx);
@@ -124,134 +470,262 @@ kk_input_free (kk_input_t *inp)
   return 0;
 }
 
-static int64_t
-input_timestamp (kk_input_t *inp, float perc)
+double
+kk_input_get_duration (kk_input_t *inp)
 {
-  return (int64_t) ((perc * inp->time.end) * inp->time.div);
+  if (inp->time.end > 0.0f)
+    return (double) inp->time.end;
+  return 0.0;
 }
 
 int
 kk_input_seek (kk_input_t *inp, float perc)
 {
-  const int64_t ts = input_timestamp (inp, perc);
-  int error;
-
-  if (perc >= (inp->time.cur / inp->time.end))
-    error = av_seek_frame (inp->fctx, inp->sidx, ts, 0);
-  else
-    error = av_seek_frame (inp->fctx, inp->sidx, ts, AVSEEK_FLAG_BACKWARD);
+  return kk_input_seek_time (inp, (double) perc * kk_input_get_duration (inp));
+}
 
-  if (error < 0)
-    return -1;
-  return 0;
+int
+kk_input_seek_time (kk_input_t *inp, double time)
+{
+  return kk_input_seek_sample (inp,
+      (int64_t) llrint (time * (double) inp->cctx->sample_rate));
 }
 
+/**
+ * Seeking only gets us to a packet, so we seek backwards to the last packet
+ * before the target, with some preroll for the decoder. The samples from
+ * there to the target get decoded and dropped by input_seek_skip. Sample
+ * counts from the start of the trimmed track, the target of the seek and
+ * the timestamps from the start of the stream.
+ */
 int
-kk_input_get_frame (kk_input_t *inp, kk_frame_t *frame)
+kk_input_seek_sample (kk_input_t *inp, int64_t sample)
 {
-  AVPacket packet;
-  int ret = 0;
-  int g;
-  int ls;
+  const int rate = inp->cctx->sample_rate;
 
-  memset (frame, 0, sizeof (kk_frame_t));
+  int64_t preroll;
+  int64_t target;
+  int64_t ts;
+
+  if (rate <= 0)
+    return -1;
+  if (sample < 0)
+    sample = 0;
+
+  preroll = (int64_t) (KK_INPUT_SEEK_PREROLL * rate);
+  if (preroll < inp->stream->codecpar->seek_preroll)
+    preroll = inp->stream->codecpar->seek_preroll;
+
+  target = sample + input_get_delay (inp);
+  ts = target - preroll;
+  if (ts < 0)
+    ts = 0;
+
+  ts = av_rescale_q (ts, (AVRational) { 1, rate }, inp->stream->time_base);
+  if (inp->stream->start_time != AV_NOPTS_VALUE)
+    ts += inp->stream->start_time;
 
   /**
-   * What happens here? A loop reads packages until either av_read_frame
-   * returns a value less than zero or a package from the audio stream was
-   * read. Since every av_read_frame() call requires an av_free_packet()
-   * call, we have to free all the packages we aren't interested in.
+   * Behind the end of the index, the demuxer might have to guess, so the
+   * timestamps it hands out afterwards can't go into the index anymore.
    */
-  for (;;) {
-    ret = av_read_frame (inp->fctx, &packet);
-    if (ret < 0)
-      goto cleanup;
+  if ((inp->indexing) && ((inp->index->count == 0)
+        || (ts > inp->index->entries[inp->index->count - 1].ts)))
+    inp->indexing = 0;
 
-    if (packet.stream_index == inp->sidx)
-      break;
+  if (av_seek_frame (inp->fctx, inp->sidx, ts, AVSEEK_FLAG_BACKWARD) < 0)
+    return -1;
 
-    av_free_packet (&packet);
-  }
+  /* The decoder might still hold frames from before the seek */
+  avcodec_flush_buffers (inp->cctx);
+  inp->eof = 0;
 
-  if (inp->frame == NULL) {
-    inp->frame = av_frame_alloc ();
-    if (inp->frame == NULL)
-      goto cleanup;
-  }
-  else
-    av_frame_unref (inp->frame);
+  inp->seek.target = target;
+  inp->seek.active = (sample > 0);
+  inp->time.cur = (float) sample / (float) rate;
 
-  ret = avcodec_decode_audio4 (inp->cctx, inp->frame, &g, &packet);
-  if (ret < 0)
-    goto cleanup;
+  /**
+   * The decoder starts somewhere before the target, at least the preroll.
+   * Guessing that position would put the padding at the end in the wrong
+   * place, so input_trim takes it from the first decoded frame.
+   */
+  inp->trim.sync = 1;
+  return 0;
+}
 
-  ret = av_samples_get_buffer_size (&ls, inp->cctx->channels,
-            inp->frame->nb_samples, inp->cctx->sample_fmt, 1);
-  if (ret <= 0)
-    goto cleanup;
+/**
+ * Receives the next frame from the decoder. If the decoder needs more data,
+ * we read packets until it gets a packet of our stream. At the end of the
+ * file the decoder gets drained, since it might still hold some frames.
+ * Returns 1 if dst holds a frame, 0 at the end of the stream and -1 on
+ * errors.
+ */
+static int
+input_receive (kk_input_t *inp, AVFrame *dst)
+{
+  int ret;
 
-  if (ls < 0)
-    ls = 0;
+  for (;;) {
+    ret = avcodec_receive_frame (inp->cctx, dst);
+    if (ret == 0)
+      return 1;
+    if (ret == AVERROR_EOF)
+      return 0;
+    if ((ret != AVERROR (EAGAIN)) || (inp->eof))
+      return -1;
 
-  if (inp->frame->nb_samples > 0)
-    frame->samples = (size_t) inp->frame->nb_samples;
-  else
-    frame->samples = 0u;
+    ret = av_read_frame (inp->fctx, inp->packet);
+    if (ret == AVERROR (EAGAIN))
+      return -1;
 
-  inp->time.cur = (float) packet.pts / inp->time.div;
+    if (ret < 0) {
+      if (ret == AVERROR_EOF)
+        input_index_add (inp, NULL);
+      inp->eof = 1;
+      if (avcodec_send_packet (inp->cctx, NULL) < 0)
+        return 0;
+      continue;
+    }
 
-  /* We store a percentage value in frame, not the time in seconds */
-  frame->prog = inp->time.cur / inp->time.end;
+    if (inp->packet->stream_index == inp->sidx) {
+      input_index_add (inp, inp->packet);
+      ret = avcodec_send_packet (inp->cctx, inp->packet);
+    }
+    av_packet_unref (inp->packet);
 
-  if (av_sample_fmt_is_planar (inp->cctx->sample_fmt)) {
-    frame->planes = (size_t) inp->cctx->channels;
-    frame->size = (size_t) ls * frame->planes;
-  }
-  else {
-    frame->planes = 1;
-    frame->size = (size_t) ls;
+    /* Broken packet - the caller may try again with the next one */
+    if (ret < 0)
+      return -1;
   }
+}
+
+static void
+input_fill_frame (kk_input_t *inp, AVFrame *src, kk_frame_t *frame)
+{
+  const size_t channels = (size_t) input_get_channels (inp);
+  const size_t bps = (size_t) av_get_bytes_per_sample (inp->cctx->sample_fmt);
 
   uint8_t **planes;
+  int64_t front;
+  size_t i;
+
+  /**
+   * This runs for every decoded frame, so only the fields we need get set.
+   * The frame doesn't own any memory, its planes point into src.
+   */
+  frame->pool = NULL;
+  frame->samples = 0;
+
+  if (src->nb_samples > 0)
+    frame->samples = (size_t) src->nb_samples;
+
+  if (src->best_effort_timestamp != AV_NOPTS_VALUE)
+    inp->time.cur = (float) src->best_effort_timestamp / inp->time.div;
+  else if (inp->cctx->sample_rate > 0)
+    inp->time.cur += (float) frame->samples / (float) inp->cctx->sample_rate;
+
+  frame->size = frame->samples * bps * channels;
 
-  if (inp->frame->extended_data)
-    planes = inp->frame->extended_data;
+  if (av_sample_fmt_is_planar (inp->cctx->sample_fmt))
+    frame->planes = channels;
   else
-    planes = inp->frame->data;
+    frame->planes = 1;
 
-  if (planes == NULL)
-    return -1;
+  if (src->extended_data)
+    planes = src->extended_data;
+  else
+    planes = src->data;
 
-  /* Intendet fallthroughs, not a bug */
-  switch (frame->planes) {
-    case 2:
-      frame->data[1] = planes[1];
-    case 1:
-      frame->data[0] = planes[0];
-    default:
-      break;
+  for (i = 0; i < KK_FRAME_MAX_PLANES; i++)
+    frame->data[i] = (i < frame->planes) ? planes[i] : NULL;
+
+  front = input_trim (inp, src, frame);
+  input_seek_skip (inp, src, frame, front);
+}
+
+/**
+ * Decodes the next frame. Frames which got dropped entirely because they
+ * lie before the target of a seek don't count.
+ */
+static int
+input_next_frame (kk_input_t *inp, AVFrame *src, kk_frame_t *frame)
+{
+  int ret;
+
+  do {
+    av_frame_unref (src);
+
+    ret = input_receive (inp, src);
+    if (ret <= 0)
+      return ret;
+
+    input_fill_frame (inp, src, frame);
+  } while ((frame->samples == 0) && (inp->seek.active));
+  return 1;
+}
+
+/**
+ * Decodes up to count frames. Packets containing more than one frame are
+ * no problem, the decoder hands out one frame after the other. The samples
+ * stay valid until the next call. Returns the number of decoded frames,
+ * 0 at the end of the stream and -1 if an error occurred before the first
+ * frame was decoded.
+ */
+int
+kk_input_get_frames (kk_input_t *inp, kk_frame_t *frames, size_t count)
+{
+  size_t i;
+  int ret;
+
+  if (count > KK_INPUT_MAX_FRAMES)
+    count = KK_INPUT_MAX_FRAMES;
+
+  for (i = 0; i < count; i++) {
+    ret = input_next_frame (inp, inp->frames[i], frames + i);
+    if (ret <= 0) {
+      if (i > 0)
+        break;
+      return ret;
+    }
+  }
+  return (int) i;
+}
+
+int
+kk_input_get_frame (kk_input_t *inp, kk_frame_t *frame)
+{
+  return kk_input_get_frames (inp, frame, 1);
+}
+
+/**
+ * Channels of a native libav layout come in the order of their mask bits,
+ * just like ours. Layouts with positions we don't know, or with more or
+ * less positions than channels, get no positions at all.
+ */
+static unsigned int
+input_get_positions (kk_input_t *inp)
+{
+  uint64_t mask = (uint64_t) input_get_channel_mask (inp);
+  unsigned int result = 0;
+  size_t i;
+
+  for (i = 0; i < sizeof (input_positions) / sizeof (input_positions[0]); i++) {
+    if (mask & input_positions[i].mask) {
+      result |= KK_FORMAT_POSITION (input_positions[i].pos);
+      mask &= ~input_positions[i].mask;
+    }
   }
 
-cleanup:
-  av_free_packet (&packet);
-  if (ret >= 0)
-    return ret;
-  if (ret == (int) AVERROR_EOF)
+  if ((mask != 0) || (__builtin_popcount (result) != input_get_channels (inp)))
     return 0;
-  return -1;
+  return result;
 }
 
 int
 kk_input_get_format (kk_input_t *inp, kk_format_t *format)
 {
-  switch (inp->cctx->channels) {
-    case 1:
-      format->channels = KK_CHANNELS_1;
-      break;
-    case 2:
-      format->channels = KK_CHANNELS_2;
-      break;
-  }
+  if (kk_format_set_channels (format, input_get_channels (inp)) != 0)
+    return -1;
 
   switch (inp->cctx->sample_fmt) {
     case AV_SAMPLE_FMT_U8:
@@ -306,5 +780,6 @@ kk_input_get_format (kk_input_t *inp, kk_format_t *format)
 
   format->byte_order = KK_BYTE_ORDER_NATIVE;
   format->sample_rate = (unsigned int) inp->cctx->sample_rate;
+  format->positions = input_get_positions (inp);
   return 0;
 }
@@ -0,0 +1,453 @@
+#include <klingklang/base.h>
+#include <klingklang/library-cache.h>
+#include <klingklang/settings.h>
+#include <klingklang/util.h>
+
+#ifdef HAVE_FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#define KK_LIBRARY_CACHE_MAGIC  "KKLIB001"
+
+/**
+ * Cache files start with this header, followed by the table of directories,
+ * the table of files and the string area. The string area starts with the
+ * root path. Everything is stored in native byte order, the cache never
+ * leaves the machine.
+ */
+struct library_cache_header {
+  char magic[8];
+  uint32_t dirs;
+  uint32_t files;
+  uint32_t strings;
+  uint32_t flags;
+};
+
+/**
+ * Compares paths like strcmp, except that '/' sorts before every other
+ * character.
+ */
+static int
+library_cache_cmp (const char *a, const char *b)
+{
+  int ca;
+  int cb;
+
+  for (;;) {
+    ca = (unsigned char) *a++;
+    cb = (unsigned char) *b++;
+    if (ca == '/')
+      ca = 1;
+    if (cb == '/')
+      cb = 1;
+    if ((ca != cb) || (ca == '\0'))
+      return ca - cb;
+  }
+}
+
+/**
+ * Compares two kk_library_dir_t pointers, for use with qsort.
+ */
+static int
+library_cache_dir_cmp (const void *a, const void *b)
+{
+  const kk_library_dir_t *da = *((const kk_library_dir_t *const *) a);
+  const kk_library_dir_t *db = *((const kk_library_dir_t *const *) b);
+
+  return library_cache_cmp (da->base, db->base);
+}
+
+static void
+library_cache_unmap (kk_library_cache_t *cache)
+{
+  if (cache->data) {
+#ifdef HAVE_SYS_MMAN_H
+    munmap (cache->data, cache->size);
+#else
+    free (cache->data);
+#endif
+  }
+  cache->data = NULL;
+  cache->size = 0;
+  cache->dirs = NULL;
+  cache->files = NULL;
+  cache->strings = NULL;
+  cache->dir_count = 0;
+  cache->file_count = 0;
+  cache->string_size = 0;
+}
+
+/**
+ * Checks that every offset stays inside the file, so that we can use the
+ * mapped tables without checking them again.
+ */
+static int
+library_cache_check (kk_library_cache_t *cache)
+{
+  const kk_library_cache_dir_t *dir;
+  const kk_library_cache_file_t *file;
+  size_t i;
+
+  if ((cache->string_size == 0) || (cache->strings[cache->string_size - 1] != '\0'))
+    return -1;
+
+  if (strcmp (cache->strings, cache->root) != 0)
+    return -1;
+
+  for (i = 0; i < cache->dir_count; i++) {
+    dir = cache->dirs + i;
+    if ((dir->base >= cache->string_size)
+        || ((uint64_t) dir->first + dir->count > cache->file_count))
+      return -1;
+
+    /* Binary searches only work if the order is right */
+    if ((i > 0) && (library_cache_cmp (cache->strings + dir[-1].base,
+                cache->strings + dir->base) >= 0))
+      return -1;
+  }
+
+  for (i = 0; i < cache->file_count; i++) {
+    file = cache->files + i;
+    if ((file->name >= cache->string_size) || (file->order >= cache->file_count))
+      return -1;
+  }
+  return 0;
+}
+
+static int
+library_cache_map (kk_library_cache_t *cache)
+{
+  struct library_cache_header header;
+  struct stat sbuf;
+  const char *ptr;
+  int fd;
+
+  fd = open (cache->path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if ((fstat (fd, &sbuf) != 0) || ((size_t) sbuf.st_size < sizeof (header)))
+    goto error;
+
+  cache->size = (size_t) sbuf.st_size;
+#ifdef HAVE_SYS_MMAN_H
+  cache->data = mmap (NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (cache->data == MAP_FAILED) {
+    cache->data = NULL;
+    goto error;
+  }
+#else
+  cache->data = malloc (cache->size);
+  if (cache->data == NULL)
+    goto error;
+  if (read (fd, cache->data, cache->size) != (ssize_t) cache->size)
+    goto error;
+#endif
+  close (fd);
+  fd = -1;
+
+  memcpy (&header, cache->data, sizeof (header));
+  if ((memcmp (header.magic, KK_LIBRARY_CACHE_MAGIC, 8) != 0)
+      || (header.flags != cache->flags)
+      || (cache->size != sizeof (header)
+        + header.dirs * sizeof (kk_library_cache_dir_t)
+        + header.files * sizeof (kk_library_cache_file_t)
+        + header.strings))
+    goto error;
+
+  ptr = (const char *) cache->data + sizeof (header);
+  cache->dirs = (const kk_library_cache_dir_t *) ptr;
+  cache->dir_count = header.dirs;
+  ptr += header.dirs * sizeof (kk_library_cache_dir_t);
+  cache->files = (const kk_library_cache_file_t *) ptr;
+  cache->file_count = header.files;
+  ptr += header.files * sizeof (kk_library_cache_file_t);
+  cache->strings = ptr;
+  cache->string_size = header.strings;
+
+  if (library_cache_check (cache) != 0)
+    goto error;
+  return 0;
+error:
+  if (fd >= 0)
+    close (fd);
+  library_cache_unmap (cache);
+  return -1;
+}
+
+int
+kk_library_cache_init (kk_library_cache_t **cache, const char *root, uint32_t flags)
+{
+  kk_library_cache_t *result;
+  char dir[4096];
+  size_t len;
+
+  result = calloc (1, sizeof (kk_library_cache_t));
+  if (result == NULL)
+    goto error;
+
+  if (kk_settings_get_cache_dir ("library", dir, sizeof (dir)) != 0)
+    goto error;
+
+  result->root = strdup (root);
+  if (result->root == NULL)
+    goto error;
+  result->flags = flags;
+
+  len = strlen (dir) + 32;
+  result->path = calloc (len, sizeof (char));
+  if (result->path == NULL)
+    goto error;
+  snprintf (result->path, len, "%s/%016llx", dir,
+      (unsigned long long) kk_get_hash (root));
+
+  if (library_cache_map (result) == 0)
+    kk_log (KK_LOG_DEBUG, "Loaded library cache with %zu directories and %zu files.",
+        result->dir_count, result->file_count);
+
+  *cache = result;
+  return 0;
+error:
+  kk_library_cache_free (result);
+  *cache = NULL;
+  return -1;
+}
+
+int
+kk_library_cache_free (kk_library_cache_t *cache)
+{
+  if (cache == NULL)
+    return 0;
+
+  library_cache_unmap (cache);
+  free (cache->root);
+  free (cache->path);
+  free (cache);
+  return 0;
+}
+
+const kk_library_cache_dir_t *
+kk_library_cache_find (kk_library_cache_t *cache, const char *base)
+{
+  size_t lo = 0;
+  size_t hi = cache->dir_count;
+  size_t mid;
+  int cmp;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    cmp = library_cache_cmp (base, cache->strings + cache->dirs[mid].base);
+    if (cmp == 0)
+      return cache->dirs + mid;
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return NULL;
+}
+
+/**
+ * All directories below dir follow right behind it, so we stop at the first
+ * one that doesn't start with the path of dir.
+ */
+const kk_library_cache_dir_t *
+kk_library_cache_next_subdir (kk_library_cache_t *cache,
+    const kk_library_cache_dir_t *dir, const kk_library_cache_dir_t *prev)
+{
+  const kk_library_cache_dir_t *end = cache->dirs + cache->dir_count;
+  const kk_library_cache_dir_t *ptr;
+
+  const char *base = cache->strings + dir->base;
+  const char *sub;
+  size_t len = strlen (base);
+
+  for (ptr = ((prev) ? prev : dir) + 1; ptr < end; ptr++) {
+    sub = cache->strings + ptr->base;
+    if (len > 0) {
+      if ((strncmp (sub, base, len) != 0) || (sub[len] != '/'))
+        return NULL;
+      sub += len + 1;
+    }
+    if (strchr (sub, '/') == NULL)
+      return ptr;
+  }
+  return NULL;
+}
+
+const char *
+kk_library_cache_get_str (kk_library_cache_t *cache, uint32_t offset)
+{
+  return cache->strings + offset;
+}
+
+static int
+library_cache_write_str (FILE *fp, const char *str)
+{
+  size_t len = strlen (str) + 1;
+
+  return (fwrite (str, 1, len, fp) == len) ? 0 : -1;
+}
+
+/**
+ * The cache gets written to a temporary file first, so that other
+ * instances never read half written caches. Every instance gets a
+ * temporary file of its own. Strings are stored in the
+ * same order as the tables refer to them: the base of a directory, followed
+ * by the names of its files.
+ */
+int
+kk_library_cache_save (kk_library_cache_t *cache, kk_library_dir_t *dirs)
+{
+  struct library_cache_header header;
+  kk_library_cache_dir_t entry_dir;
+  kk_library_cache_file_t entry_file;
+  kk_library_file_t *file;
+  kk_library_dir_t *dir;
+  kk_library_dir_t **list = NULL;
+  char *tmp = NULL;
+  FILE *fp = NULL;
+  size_t strings;
+  size_t files;
+  size_t count;
+  size_t len;
+  size_t i;
+  int fd;
+
+  count = 0;
+  files = 0;
+  strings = strlen (cache->root) + 1;
+  for (dir = dirs; dir != NULL; dir = dir->next) {
+    strings += strlen (dir->base) + 1;
+    for (file = dir->children; file != NULL; file = file->next) {
+      strings += strlen (file->name) + 1;
+      files++;
+    }
+    count++;
+  }
+
+  if ((count == 0) || (count > UINT32_MAX) || (files > UINT32_MAX) || (strings > UINT32_MAX))
+    goto error;
+
+  /* Libraries easily exceed what kk_list_t is meant for, so use a plain array */
+  list = calloc (count, sizeof (kk_library_dir_t *));
+  if (list == NULL)
+    goto error;
+
+  for (dir = dirs, i = 0; dir != NULL; dir = dir->next)
+    list[i++] = dir;
+  qsort (list, count, sizeof (kk_library_dir_t *), library_cache_dir_cmp);
+
+  len = strlen (cache->path) + 8;
+  tmp = calloc (len, sizeof (char));
+  if (tmp == NULL)
+    goto error;
+  snprintf (tmp, len, "%s.XXXXXX", cache->path);
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, KK_LIBRARY_CACHE_MAGIC, 8);
+  header.dirs = (uint32_t) count;
+  header.files = (uint32_t) files;
+  header.strings = (uint32_t) strings;
+  header.flags = cache->flags;
+
+  fd = mkstemp (tmp);
+  if (fd < 0) {
+    free (tmp);
+    tmp = NULL;
+    goto error;
+  }
+
+  fp = fdopen (fd, "wb");
+  if (fp == NULL) {
+    close (fd);
+    goto error;
+  }
+
+  if (fwrite (&header, sizeof (header), 1, fp) != 1)
+    goto error;
+
+  files = 0;
+  strings = strlen (cache->root) + 1;
+  memset (&entry_dir, 0, sizeof (entry_dir));
+  for (i = 0; i < count; i++) {
+    dir = list[i];
+    entry_dir.mtime = dir->mtime;
+    entry_dir.base = (uint32_t) strings;
+    entry_dir.first = (uint32_t) files;
+    entry_dir.count = 0;
+    strings += strlen (dir->base) + 1;
+    for (file = dir->children; file != NULL; file = file->next) {
+      strings += strlen (file->name) + 1;
+      entry_dir.count++;
+    }
+    files += entry_dir.count;
+    if (fwrite (&entry_dir, sizeof (entry_dir), 1, fp) != 1)
+      goto error;
+  }
+
+  strings = strlen (cache->root) + 1;
+  for (i = 0; i < count; i++) {
+    dir = list[i];
+    strings += strlen (dir->base) + 1;
+    for (file = dir->children; file != NULL; file = file->next) {
+      entry_file.name = (uint32_t) strings;
+      entry_file.order = (uint32_t) file->order;
+      strings += strlen (file->name) + 1;
+      if (fwrite (&entry_file, sizeof (entry_file), 1, fp) != 1)
+        goto error;
+    }
+  }
+
+  if (library_cache_write_str (fp, cache->root) != 0)
+    goto error;
+  for (i = 0; i < count; i++) {
+    dir = list[i];
+    if (library_cache_write_str (fp, dir->base) != 0)
+      goto error;
+    for (file = dir->children; file != NULL; file = file->next) {
+      if (library_cache_write_str (fp, file->name) != 0)
+        goto error;
+    }
+  }
+
+  if (fclose (fp) != 0) {
+    fp = NULL;
+    goto error;
+  }
+  fp = NULL;
+
+  if (rename (tmp, cache->path) != 0)
+    goto error;
+
+  kk_log (KK_LOG_DEBUG, "Saved library cache with %zu directories and %zu files.",
+      count, files);
+  free (list);
+  free (tmp);
+  return 0;
+error:
+  kk_log (KK_LOG_WARNING, "Writing library cache '%s' failed.", cache->path);
+  if (fp)
+    fclose (fp);
+  if (tmp)
+    remove (tmp);
+  free (list);
+  free (tmp);
+  return -1;
+}
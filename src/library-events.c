@@ -0,0 +1,12 @@
+#include <klingklang/library-events.h>
+
+void
+kk_library_event_scan_done (kk_event_queue_t *queue, int status)
+{
+  kk_library_event_scan_done_t event;
+
+  memset (&event, 0, sizeof (kk_library_event_scan_done_t));
+  event.type = KK_LIBRARY_SCAN_DONE;
+  event.status = status;
+  kk_event_queue_write (queue, (void *) &event, sizeof (kk_library_event_scan_done_t));
+}
@@ -0,0 +1,392 @@
+#include <klingklang/base.h>
+#include <klingklang/cpu.h>
+#include <klingklang/library-scan.h>
+#include <klingklang/realtime.h>
+#include <klingklang/settings.h>
+#include <klingklang/str.h>
+#include <klingklang/util.h>
+
+/**
+ * Scanning is bound by I/O, not by CPU. Network filesystems answer many
+ * requests in parallel, so we use more threads than CPUs, but not too many.
+ */
+#define KK_LIBRARY_SCAN_THREADS_PER_CPU 2
+#define KK_LIBRARY_SCAN_DEFAULT_THREADS 16
+#define KK_LIBRARY_SCAN_MAX_THREADS     64
+
+/**
+ * Compares two kk_library_dir_t pointers by path, for use with qsort. Paths
+ * that only differ in ways kk_str_natcmp ignores are still put in a fixed
+ * order, so the result doesn't depend on the order the workers finished.
+ */
+static int
+library_scan_cmp (const void *a, const void *b)
+{
+  const kk_library_dir_t *da = *((const kk_library_dir_t *const *) a);
+  const kk_library_dir_t *db = *((const kk_library_dir_t *const *) b);
+
+  int result;
+
+  result = kk_str_natcmp (da->base, db->base);
+  if (result == 0)
+    result = strcmp (da->base, db->base);
+  return result;
+}
+
+static kk_library_dir_t *
+library_scan_pop (kk_library_scan_worker_t *worker)
+{
+  kk_library_dir_t *dir = NULL;
+
+  pthread_mutex_lock (&worker->mutex);
+  if (worker->tail > worker->head)
+    dir = worker->items[--worker->tail];
+  pthread_mutex_unlock (&worker->mutex);
+  return dir;
+}
+
+static kk_library_dir_t *
+library_scan_steal (kk_library_scan_worker_t *worker)
+{
+  kk_library_scan_t *scan = worker->scan;
+  kk_library_scan_worker_t *victim;
+  kk_library_dir_t *dir = NULL;
+
+  const size_t id = (size_t) (worker - scan->workers);
+  size_t i;
+
+  for (i = 1; (i < scan->count) && (dir == NULL); i++) {
+    victim = scan->workers + (id + i) % scan->count;
+    pthread_mutex_lock (&victim->mutex);
+    if (victim->tail > victim->head)
+      dir = victim->items[victim->head++];
+    pthread_mutex_unlock (&victim->mutex);
+  }
+  return dir;
+}
+
+/**
+ * A directory counts as pending from the moment it's pushed until its
+ * visit is done. Pushes only happen during visits, so once pending drops to
+ * zero, no more work can show up and the scan is done.
+ */
+static void
+library_scan_link (kk_library_scan_worker_t *worker, kk_library_dir_t *dir)
+{
+  dir->next = NULL;
+  if (worker->last)
+    worker->last->next = dir;
+  else
+    worker->first = dir;
+  worker->last = dir;
+}
+
+static int
+library_scan_is_root (kk_library_scan_t *scan, kk_library_dir_t *dir)
+{
+  size_t i;
+
+  for (i = 0; i < scan->num_roots; i++) {
+    if (scan->roots[i] == dir)
+      return 1;
+  }
+  return 0;
+}
+
+static void
+library_scan_finish (kk_library_scan_worker_t *worker, kk_library_dir_t *dir, int files)
+{
+  kk_library_scan_t *scan = worker->scan;
+
+  library_scan_link (worker, dir);
+
+  __atomic_add_fetch (&scan->dirs, 1, __ATOMIC_RELAXED);
+  if (files > 0)
+    __atomic_add_fetch (&scan->files, (size_t) files, __ATOMIC_RELAXED);
+  else if ((files < 0) && (library_scan_is_root (scan, dir)))
+    __atomic_store_n (&scan->failed, 1, __ATOMIC_RELAXED);
+
+  if (__atomic_sub_fetch (&scan->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+    pthread_mutex_lock (&scan->mutex);
+    pthread_cond_broadcast (&scan->cond);
+    pthread_mutex_unlock (&scan->mutex);
+  }
+}
+
+static void
+library_scan_work (kk_library_scan_worker_t *worker)
+{
+  kk_library_scan_t *scan = worker->scan;
+  kk_library_dir_t *dir;
+  int done;
+
+  for (;;) {
+    dir = library_scan_pop (worker);
+    if (dir == NULL)
+      dir = library_scan_steal (worker);
+
+    if (dir) {
+      __atomic_sub_fetch (&scan->queued, 1, __ATOMIC_SEQ_CST);
+      library_scan_finish (worker, dir, scan->visit (scan, worker, dir));
+      continue;
+    }
+
+    /* Nothing to steal, so wait until somebody pushes or the scan is done */
+    pthread_mutex_lock (&scan->mutex);
+    __atomic_add_fetch (&scan->idle, 1, __ATOMIC_SEQ_CST);
+    while ((__atomic_load_n (&scan->queued, __ATOMIC_SEQ_CST) == 0)
+        && (__atomic_load_n (&scan->pending, __ATOMIC_SEQ_CST) != 0))
+      pthread_cond_wait (&scan->cond, &scan->mutex);
+    __atomic_sub_fetch (&scan->idle, 1, __ATOMIC_SEQ_CST);
+    done = (__atomic_load_n (&scan->pending, __ATOMIC_SEQ_CST) == 0);
+    pthread_mutex_unlock (&scan->mutex);
+
+    if (done)
+      break;
+  }
+}
+
+static void *
+library_scan_thread (kk_library_scan_worker_t *worker)
+{
+  kk_realtime_setup_thread ("scanner", 0);
+  library_scan_work (worker);
+  return NULL;
+}
+
+int
+kk_library_scan_init (kk_library_scan_t **scan, kk_library_scan_f visit, void *arg)
+{
+  kk_library_scan_t *result;
+  long threads;
+  size_t i;
+
+  result = calloc (1, sizeof (kk_library_scan_t));
+  if (result == NULL)
+    goto error;
+
+  result->visit = visit;
+  result->arg = arg;
+
+  if (pthread_mutex_init (&result->mutex, NULL) != 0)
+    goto error;
+
+  if (pthread_cond_init (&result->cond, NULL) != 0)
+    goto error;
+
+  threads = (long) (kk_cpu_get_count () * KK_LIBRARY_SCAN_THREADS_PER_CPU);
+  if (threads > KK_LIBRARY_SCAN_DEFAULT_THREADS)
+    threads = KK_LIBRARY_SCAN_DEFAULT_THREADS;
+  threads = kk_settings_get_int ("KK_LIBRARY_THREADS", threads);
+  if (threads < 1)
+    threads = 1;
+  if (threads > KK_LIBRARY_SCAN_MAX_THREADS)
+    threads = KK_LIBRARY_SCAN_MAX_THREADS;
+
+  result->workers = calloc ((size_t) threads, sizeof (kk_library_scan_worker_t));
+  if (result->workers == NULL)
+    goto error;
+
+  for (i = 0; i < (size_t) threads; i++) {
+    result->workers[i].scan = result;
+    if (pthread_mutex_init (&result->workers[i].mutex, NULL) != 0)
+      goto error;
+    result->count++;
+  }
+
+  *scan = result;
+  return 0;
+error:
+  kk_library_scan_free (result);
+  *scan = NULL;
+  return -1;
+}
+
+int
+kk_library_scan_free (kk_library_scan_t *scan)
+{
+  size_t i;
+
+  if (scan == NULL)
+    return 0;
+
+  for (i = 0; i < scan->count; i++) {
+    pthread_mutex_destroy (&scan->workers[i].mutex);
+    free (scan->workers[i].items);
+  }
+  free (scan->workers);
+
+  pthread_cond_destroy (&scan->cond);
+  pthread_mutex_destroy (&scan->mutex);
+  free (scan);
+  return 0;
+}
+
+int
+kk_library_scan_push (kk_library_scan_worker_t *worker, kk_library_dir_t *dir)
+{
+  kk_library_scan_t *scan = worker->scan;
+  kk_library_dir_t **items;
+  size_t cap;
+
+  /* Count it first, so that nobody finishes it before it was counted */
+  __atomic_add_fetch (&scan->pending, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch (&scan->queued, 1, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock (&worker->mutex);
+  if (worker->tail == worker->cap) {
+    if (worker->head > 0) {
+      /* Reuse the space thieves left in front of head before growing */
+      memmove (worker->items, worker->items + worker->head,
+          (worker->tail - worker->head) * sizeof (kk_library_dir_t *));
+      worker->tail -= worker->head;
+      worker->head = 0;
+    }
+    else {
+      cap = (worker->cap) ? 2 * worker->cap : 64;
+      items = realloc (worker->items, cap * sizeof (kk_library_dir_t *));
+      if (items == NULL)
+        goto error;
+      worker->items = items;
+      worker->cap = cap;
+    }
+  }
+  worker->items[worker->tail++] = dir;
+  pthread_mutex_unlock (&worker->mutex);
+
+  if (__atomic_load_n (&scan->idle, __ATOMIC_SEQ_CST) != 0) {
+    pthread_mutex_lock (&scan->mutex);
+    pthread_cond_signal (&scan->cond);
+    pthread_mutex_unlock (&scan->mutex);
+  }
+  return 0;
+error:
+  pthread_mutex_unlock (&worker->mutex);
+  __atomic_sub_fetch (&scan->queued, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch (&scan->pending, 1, __ATOMIC_SEQ_CST);
+  return -1;
+}
+
+/**
+ * Chains the lists of all workers and puts the first root in front, so
+ * that every directory is reachable from it even if sorting fails.
+ */
+static int
+library_scan_merge (kk_library_scan_t *scan, kk_library_dir_t **result)
+{
+  kk_library_scan_worker_t *worker;
+  kk_library_dir_t **dirs;
+  kk_library_dir_t **link;
+  kk_library_dir_t *first = scan->roots[0];
+  kk_library_dir_t *head = NULL;
+  kk_library_dir_t *last = NULL;
+  kk_library_dir_t *dir;
+  size_t count = 0;
+  size_t i;
+
+  for (i = 0; i < scan->count; i++) {
+    worker = scan->workers + i;
+    if (worker->first) {
+      if (last)
+        last->next = worker->first;
+      else
+        head = worker->first;
+      last = worker->last;
+    }
+    worker->first = NULL;
+    worker->last = NULL;
+  }
+
+  for (link = &head; *link != first; link = &(*link)->next);
+  *link = first->next;
+  first->next = head;
+  *result = first;
+
+  for (dir = first; dir != NULL; dir = dir->next)
+    count++;
+
+  dirs = calloc (count, sizeof (kk_library_dir_t *));
+  if (dirs == NULL)
+    return -1;
+
+  for (dir = first, i = 0; dir != NULL; dir = dir->next)
+    dirs[i++] = dir;
+
+  qsort (dirs, count, sizeof (kk_library_dir_t *), library_scan_cmp);
+  for (i = 0; i + 1 < count; i++)
+    dirs[i]->next = dirs[i + 1];
+  dirs[count - 1]->next = NULL;
+  *result = dirs[0];
+
+  free (dirs);
+  return 0;
+}
+
+int
+kk_library_scan_run (kk_library_scan_t *scan, kk_library_dir_t **dirs)
+{
+  kk_library_scan_worker_t *worker;
+  kk_library_dir_t *dir;
+  kk_library_dir_t *next;
+  size_t i;
+
+  if (*dirs == NULL)
+    return 0;
+
+  scan->num_roots = 0;
+  for (dir = *dirs; dir != NULL; dir = dir->next)
+    scan->num_roots++;
+
+  scan->roots = calloc (scan->num_roots, sizeof (kk_library_dir_t *));
+  if (scan->roots == NULL)
+    return -1;
+
+  scan->failed = 0;
+  __atomic_store_n (&scan->dirs, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&scan->files, 0, __ATOMIC_RELAXED);
+
+  /* Directories that can't be queued still belong to the result */
+  for (dir = *dirs, i = 0; dir != NULL; dir = next) {
+    next = dir->next;
+    scan->roots[i++] = dir;
+    if (kk_library_scan_push (scan->workers, dir) != 0) {
+      library_scan_link (scan->workers, dir);
+      scan->failed = 1;
+    }
+  }
+
+  for (i = 1; i < scan->count; i++) {
+    worker = scan->workers + i;
+    if (kk_thread_create (&worker->thread, NULL,
+            (void *(*)(void *)) library_scan_thread, worker) == 0)
+      worker->running = 1;
+  }
+
+  library_scan_work (scan->workers);
+
+  for (i = 1; i < scan->count; i++) {
+    worker = scan->workers + i;
+    if (worker->running)
+      pthread_join (worker->thread, NULL);
+    worker->running = 0;
+  }
+
+  if (library_scan_merge (scan, dirs) != 0)
+    scan->failed = 1;
+
+  free (scan->roots);
+  scan->roots = NULL;
+  scan->num_roots = 0;
+
+  kk_log (KK_LOG_DEBUG, "Scanned %zu directories with %zu files on %zu threads.",
+      scan->dirs, scan->files, scan->count);
+  return (scan->failed) ? -1 : 0;
+}
+
+void
+kk_library_scan_get_progress (kk_library_scan_t *scan, kk_library_scan_progress_t *progress)
+{
+  progress->dirs = __atomic_load_n (&scan->dirs, __ATOMIC_RELAXED);
+  progress->files = __atomic_load_n (&scan->files, __ATOMIC_RELAXED);
+  progress->pending = __atomic_load_n (&scan->pending, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,377 @@
+#include <klingklang/base.h>
+#include <klingklang/library-watch.h>
+#include <klingklang/util.h>
+
+#include <errno.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#  include <sys/inotify.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define KK_LIBRARY_WATCH_MASK \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+static int
+library_watch_add (kk_library_watch_t *watch, kk_library_dir_t *dir)
+{
+  kk_library_dir_t **watches;
+  uint8_t *shared;
+  char *path;
+  size_t len;
+  size_t cap;
+  int wd;
+
+  len = strlen (dir->root) + strlen (dir->base) + 2;
+  path = calloc (len, sizeof (char));
+  if (path == NULL)
+    return -1;
+  snprintf (path, len, "%s/%s", dir->root, dir->base);
+
+  wd = inotify_add_watch (watch->fd, path, KK_LIBRARY_WATCH_MASK);
+  if (wd < 0) {
+    /* Most likely the limit of watches, no need to repeat it for every directory */
+    if (!watch->full)
+      kk_log (KK_LOG_WARNING, "Watching '%s' failed: %s.", path, strerror (errno));
+    watch->full = 1;
+    free (path);
+    return -1;
+  }
+  free (path);
+
+  if ((size_t) wd >= watch->cap) {
+    cap = kk_get_next_pow2 ((size_t) wd);
+    watches = realloc (watch->watches, cap * sizeof (kk_library_dir_t *));
+    if (watches == NULL)
+      goto error;
+    memset (watches + watch->cap, 0, (cap - watch->cap) * sizeof (kk_library_dir_t *));
+    watch->watches = watches;
+
+    shared = realloc (watch->shared, cap * sizeof (uint8_t));
+    if (shared == NULL)
+      goto error;
+    memset (shared + watch->cap, 0, (cap - watch->cap) * sizeof (uint8_t));
+    watch->shared = shared;
+    watch->cap = cap;
+  }
+
+  /* The kernel hands out the same descriptor for the same directory */
+  if ((watch->watches[wd] != NULL) && (watch->watches[wd] != dir))
+    watch->shared[wd] = 1;
+  else
+    watch->watches[wd] = dir;
+  return 0;
+error:
+  inotify_rm_watch (watch->fd, wd);
+  return -1;
+}
+
+/**
+ * Returns another directory of the library that is the same as dir, or
+ * NULL if there is none.
+ */
+static kk_library_dir_t *
+library_watch_find_alias (kk_library_watch_t *watch, kk_library_dir_t *dir)
+{
+  kk_library_dir_t *alias;
+
+  for (alias = watch->lib->dirs; alias != NULL; alias = alias->next) {
+    if ((alias != dir) && (alias->dev == dir->dev) && (alias->ino == dir->ino))
+      return alias;
+  }
+  return NULL;
+}
+
+static void
+library_watch_remove (kk_library_watch_t *watch, kk_library_dir_t *dir)
+{
+  kk_library_dir_t *alias = NULL;
+  size_t wd;
+
+  for (wd = 0; wd < watch->cap; wd++) {
+    if (watch->watches[wd] != dir)
+      continue;
+
+    /* Removed directories are no longer part of the library */
+    if (watch->shared[wd])
+      alias = library_watch_find_alias (watch, dir);
+
+    if (alias)
+      watch->watches[wd] = alias;
+    else {
+      inotify_rm_watch (watch->fd, (int) wd);
+      watch->watches[wd] = NULL;
+      watch->shared[wd] = 0;
+    }
+  }
+}
+
+static void
+library_watch_mark (kk_library_watch_t *watch, kk_library_dir_t *dir)
+{
+  kk_library_dir_t **dirty;
+  size_t size;
+  size_t i;
+
+  for (i = 0; i < watch->len; i++) {
+    if (watch->dirty[i] == dir)
+      return;
+  }
+
+  if (watch->len == watch->size) {
+    size = (watch->size) ? 2 * watch->size : 64;
+    dirty = realloc (watch->dirty, size * sizeof (kk_library_dir_t *));
+    if (dirty == NULL) {
+      /* Can't remember it, so update everything next time */
+      watch->overflow = 1;
+      return;
+    }
+    watch->dirty = dirty;
+    watch->size = size;
+  }
+  watch->dirty[watch->len++] = dir;
+}
+
+/**
+ * Called by kk_library_update for every directory it added or removed.
+ */
+static void
+library_watch_changed (kk_library_dir_t *dir, int added, kk_library_watch_t *watch)
+{
+  if (added)
+    library_watch_add (watch, dir);
+  else
+    library_watch_remove (watch, dir);
+}
+
+int
+kk_library_watch_init (kk_library_watch_t **watch, kk_library_t *lib)
+{
+  kk_library_watch_t *result;
+  kk_library_dir_t *dir;
+  size_t count = 0;
+
+  result = calloc (1, sizeof (kk_library_watch_t));
+  if (result == NULL)
+    goto error;
+
+  result->lib = lib;
+  result->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (result->fd < 0)
+    goto error;
+
+  for (dir = lib->dirs; dir != NULL; dir = dir->next) {
+    if (library_watch_add (result, dir) == 0)
+      count++;
+  }
+  kk_log (KK_LOG_DEBUG, "Watching %zu library directories.", count);
+
+  *watch = result;
+  return 0;
+error:
+  kk_library_watch_free (result);
+  *watch = NULL;
+  return -1;
+}
+
+int
+kk_library_watch_free (kk_library_watch_t *watch)
+{
+  if (watch == NULL)
+    return 0;
+
+  if (watch->fd > 0)
+    close (watch->fd);
+  free (watch->watches);
+  free (watch->shared);
+  free (watch->dirty);
+  free (watch);
+  return 0;
+}
+
+int
+kk_library_watch_get_fd (kk_library_watch_t *watch)
+{
+  return watch->fd;
+}
+
+int
+kk_library_watch_read (kk_library_watch_t *watch)
+{
+  char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  const struct inotify_event *event;
+  kk_library_dir_t *alias;
+  kk_library_dir_t *dir;
+  ssize_t len;
+  char *ptr;
+
+  while ((len = read (watch->fd, buf, sizeof (buf))) > 0) {
+    for (ptr = buf; ptr < buf + len; ptr += sizeof (struct inotify_event) + event->len) {
+      event = (const struct inotify_event *) ptr;
+      watch->events = 1;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        watch->overflow = 1;
+        continue;
+      }
+
+      /* Events of watches we removed might still be on their way */
+      if ((event->wd < 0) || ((size_t) event->wd >= watch->cap)
+          || (watch->watches[event->wd] == NULL))
+        continue;
+
+      if (event->mask & IN_IGNORED) {
+        watch->watches[event->wd] = NULL;
+        watch->shared[event->wd] = 0;
+        continue;
+      }
+
+      dir = watch->watches[event->wd];
+      library_watch_mark (watch, dir);
+      if (watch->shared[event->wd]) {
+        for (alias = watch->lib->dirs; alias != NULL; alias = alias->next) {
+          if ((alias != dir) && (alias->dev == dir->dev) && (alias->ino == dir->ino))
+            library_watch_mark (watch, alias);
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+int
+kk_library_watch_update (kk_library_watch_t *watch)
+{
+  int result;
+
+  /* Still busy, wait until things calmed down */
+  if (watch->events) {
+    watch->events = 0;
+    return 0;
+  }
+
+  /* Dirty directories wait for the library the rescan brings */
+  if (watch->rescan)
+    return 0;
+
+  if ((watch->len == 0) && (!watch->overflow))
+    return 0;
+
+  if (watch->overflow) {
+    kk_log (KK_LOG_INFO, "Missed changes of the library, reading every directory again.");
+    watch->overflow = 0;
+    if (kk_library_rescan (watch->lib) != 0)
+      return -1;
+
+    /* The rescan reads them anyway */
+    watch->rescan = 1;
+    watch->len = 0;
+    return 0;
+  }
+
+  kk_log (KK_LOG_DEBUG, "Updating %zu library directories.", watch->len);
+  result = kk_library_update (watch->lib, watch->dirty, watch->len,
+      (kk_library_update_f) library_watch_changed, watch);
+
+  watch->len = 0;
+  return (result == 0) ? 1 : -1;
+}
+
+int
+kk_library_watch_rescan_done (kk_library_watch_t *watch, int status)
+{
+  kk_library_dir_t **watches = watch->watches;
+  uint8_t *shared = watch->shared;
+  size_t cap = watch->cap;
+  kk_library_dir_t *dir;
+  size_t len = 0;
+  size_t wd;
+  size_t i;
+
+  watch->rescan = 0;
+  if (kk_library_finish_rescan (watch->lib, status) != 0) {
+    kk_log (KK_LOG_WARNING, "Reading the library again failed.");
+    return -1;
+  }
+
+  /* Watching a directory again returns the descriptor it already has */
+  watch->watches = NULL;
+  watch->shared = NULL;
+  watch->cap = 0;
+  for (dir = watch->lib->dirs; dir != NULL; dir = dir->next)
+    library_watch_add (watch, dir);
+
+  for (wd = 0; wd < cap; wd++) {
+    if ((watches[wd] != NULL) && ((wd >= watch->cap) || (watch->watches[wd] == NULL)))
+      inotify_rm_watch (watch->fd, (int) wd);
+  }
+  free (watches);
+  free (shared);
+
+  /* Directories marked during the rescan belong to the old library */
+  for (i = 0; i < watch->len; i++) {
+    for (dir = watch->lib->dirs; dir != NULL; dir = dir->next) {
+      if (strcmp (dir->base, watch->dirty[i]->base) == 0)
+        break;
+    }
+    if (dir)
+      watch->dirty[len++] = dir;
+  }
+  watch->len = len;
+  return 0;
+}
+
+#else
+
+int
+kk_library_watch_init (kk_library_watch_t **watch, kk_library_t *lib)
+{
+  (void) lib;
+
+  kk_log (KK_LOG_INFO, "Watching the library is not supported.");
+  *watch = NULL;
+  return -1;
+}
+
+int
+kk_library_watch_free (kk_library_watch_t *watch)
+{
+  (void) watch;
+  return 0;
+}
+
+int
+kk_library_watch_get_fd (kk_library_watch_t *watch)
+{
+  (void) watch;
+  return -1;
+}
+
+int
+kk_library_watch_read (kk_library_watch_t *watch)
+{
+  (void) watch;
+  return 0;
+}
+
+int
+kk_library_watch_update (kk_library_watch_t *watch)
+{
+  (void) watch;
+  return 0;
+}
+
+int
+kk_library_watch_rescan_done (kk_library_watch_t *watch, int status)
+{
+  (void) watch;
+  (void) status;
+  return 0;
+}
+
+#endif
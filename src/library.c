@@ -1,5 +1,9 @@
 #include <klingklang/base.h>
 #include <klingklang/library.h>
+#include <klingklang/library-cache.h>
+#include <klingklang/library-scan.h>
+#include <klingklang/realtime.h>
+#include <klingklang/settings.h>
 #include <klingklang/str.h>
 #include <klingklang/util.h>
 
@@ -7,6 +11,10 @@
 #  include <dirent.h>
 #endif
 
+#ifdef HAVE_FCNTL_H
+#  include <fcntl.h>
+#endif
+
 #ifdef HAVE_SYS_STAT_H
 #  include <sys/stat.h>
 #endif
@@ -15,6 +23,10 @@
 #  include <sys/types.h>
 #endif
 
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
 #define get_array_len(x) \
   (sizeof (x) / sizeof ((x)[0]))
 
@@ -148,54 +160,215 @@ error:
   return out + 32;              /* 32 = space for album cover filename */
 }
 
+/**
+ * Shared by all workers of a scan. Directories get opened relative to the
+ * root directory, so that we don't have to build absolute paths. Changed is
+ * set once a directory had to be read instead of being taken from the
+ * cache. Background scans set lib and scan dirs. Visited directories only
+ * get published to the snapshot of lib if publish is set.
+ */
+struct library_load {
+  kk_library_t *lib;
+  kk_library_dir_t *dirs;
+  kk_library_cache_t *cache;
+  int fd;
+  int follow;
+  int changed;
+  int publish;
+};
+
+static int64_t
+library_get_mtime (const struct stat *sbuf)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  return (int64_t) sbuf->st_mtim.tv_sec * 1000000000 + sbuf->st_mtim.tv_nsec;
+#else
+  return (int64_t) sbuf->st_mtime * 1000000000;
+#endif
+}
+
+/**
+ * Creates the subdirectory name of parent and queues it, so that some
+ * worker of the scan visits it.
+ */
 static int
-library_dir_load (kk_library_dir_t *dir)
+library_dir_add (kk_library_scan_worker_t *worker, kk_library_dir_t *parent, const char *name)
 {
-  size_t len_root;
-  size_t len_base;
+  kk_library_dir_t *dir;
   size_t len;
 
+  dir = calloc (1, sizeof (kk_library_dir_t));
+  if (dir == NULL)
+    return -1;
+
+  len = strlen (parent->base) + strlen (name) + 2;
+  dir->base = calloc (len, sizeof (char));
+  if (dir->base == NULL)
+    goto error;
+
+  if (*parent->base)
+    snprintf (dir->base, len, "%s/%s", parent->base, name);
+  else
+    snprintf (dir->base, len, "%s", name);
+
+  dir->root = parent->root;
+  dir->parent = parent;
+
+  if (kk_library_scan_push (worker, dir) != 0)
+    goto error;
+  return 0;
+error:
+  free (dir->base);
+  free (dir);
+  return -1;
+}
+
+static int
+library_file_add (kk_library_dir_t *dir, const char *name, size_t order)
+{
+  kk_library_file_t *file;
+
+  file = calloc (1, sizeof (kk_library_file_t));
+  if (file == NULL)
+    return -1;
+
+  file->name = strdup (name);
+  if (file->name == NULL) {
+    free (file);
+    return -1;
+  }
+
+  file->parent = dir;
+  file->order = order;
+  file->next = dir->children;
+  dir->children = file;
+  return 0;
+}
+
+/**
+ * Takes files and subdirectories of a directory which didn't change since
+ * the last scan from the cache instead of reading the directory.
+ */
+static int
+library_dir_load_cached (kk_library_scan_worker_t *worker, kk_library_cache_t *cache,
+    kk_library_dir_t *dir, const kk_library_cache_dir_t *cached)
+{
+  const kk_library_cache_file_t *file;
+  const kk_library_cache_dir_t *sub;
+  const char *name;
+  size_t i;
+
+  for (i = 0; i < cached->count; i++) {
+    file = cache->files + cached->first + i;
+    if (library_file_add (dir, kk_library_cache_get_str (cache, file->name), file->order) != 0)
+      return -1;
+  }
+
+  sub = kk_library_cache_next_subdir (cache, cached, NULL);
+  while (sub) {
+    name = kk_library_cache_get_str (cache, sub->base);
+    if (strrchr (name, '/'))
+      name = strrchr (name, '/') + 1;
+    if (library_dir_add (worker, dir, name) != 0)
+      return -1;
+    sub = kk_library_cache_next_subdir (cache, cached, sub);
+  }
+  return (int) cached->count;
+}
+
+/**
+ * Following a symbolic link leads into a loop if it points to a directory
+ * we're already in.
+ */
+static int
+library_dir_is_loop (kk_library_dir_t *dir)
+{
+  kk_library_dir_t *parent;
+
+  for (parent = dir->parent; parent != NULL; parent = parent->parent) {
+    if ((parent->dev == dir->dev) && (parent->ino == dir->ino))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Returns the type of a directory entry as DT_DIR or DT_REG. Some
+ * filesystems don't fill in d_type, in which case we have to ask for it.
+ * Symbolic links are only followed if the scan was told to.
+ */
+static int
+library_dir_get_type (struct library_load *load, DIR *dirst, struct dirent *ent)
+{
+  struct stat sbuf;
+
+  if ((ent->d_type == DT_DIR) || (ent->d_type == DT_REG))
+    return ent->d_type;
+
+  if ((ent->d_type != DT_UNKNOWN) && ((ent->d_type != DT_LNK) || (!load->follow)))
+    return DT_UNKNOWN;
+
+  if (fstatat (dirfd (dirst), ent->d_name, &sbuf, (load->follow) ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+    return DT_UNKNOWN;
+
+  if (S_ISDIR (sbuf.st_mode))
+    return DT_DIR;
+  if (S_ISREG (sbuf.st_mode))
+    return DT_REG;
+  return DT_UNKNOWN;
+}
+
+/**
+ * Visit function of the scan. Subdirectories get queued instead of visited
+ * right away, so that idle workers can pick them up.
+ */
+static int
+library_dir_load (kk_library_scan_t *scan, kk_library_scan_worker_t *worker,
+    kk_library_dir_t *dir)
+{
+  struct library_load *load = scan->arg;
+
+  const kk_library_cache_dir_t *cached = NULL;
   struct dirent *ent = NULL;
+  struct stat sbuf;
   DIR *dirst = NULL;
+  int files = 0;
+  int fd;
 
-  char *pfst;
-  char *plst;
-
-  len_root = strlen (dir->root);
-  len_base = strlen (dir->base);
+  fd = openat (load->fd, (*dir->base) ? dir->base : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    goto error;
 
-  /**
-   * If these two paths don't end with a slash, we have to add one
-   * for each and the required buffer size increases.
-   */
-  len_root += (len_root > 0) && (dir->root[len_root - 1] != '/');
-  len_base += (len_base > 0) && (dir->base[len_base - 1] != '/');
+  if (fstat (fd, &sbuf) != 0)
+    goto error;
 
   /**
-   * Build string "root/base/", so that we can append the names of the
-   * directory entries to get a valid path.
-   *
-   *                    root/base/\0
-   *                    ^         ^
-   *                    pfst      plst
-   *
-   * pfst points to the first char of the path. plst points to the terminating
-   * zero char. Calling strcpy (plst, dirent->d_name) leads to the full path
-   * of a given dirent.
+   * Adding or removing entries changes the mtime of a directory, so as long
+   * as the mtime stays the same, the cached entries are still valid.
    */
-  len = kk_get_next_pow2 (len_root + len_base + NAME_MAX + 1);
+  dir->mtime = library_get_mtime (&sbuf);
+  dir->dev = (uint64_t) sbuf.st_dev;
+  dir->ino = (uint64_t) sbuf.st_ino;
 
-  pfst = calloc (len, sizeof (char));
-  if (pfst == NULL)
-    goto error;
+  if (library_dir_is_loop (dir)) {
+    kk_log (KK_LOG_DEBUG, "Not following loop at '%s'.", dir->base);
+    close (fd);
+    return 0;
+  }
 
-  len_root = path_append (pfst, dir->root, len, 1);
-  len_base = path_append (pfst, dir->base, len, 1);
-  plst = pfst + len_base;
+  if (load->cache)
+    cached = kk_library_cache_find (load->cache, dir->base);
+  if ((cached) && (cached->mtime == dir->mtime)) {
+    close (fd);
+    return library_dir_load_cached (worker, load->cache, dir, cached);
+  }
+  __atomic_store_n (&load->changed, 1, __ATOMIC_RELAXED);
 
-  dirst = opendir (pfst);
+  /* From now on, fd belongs to dirst */
+  dirst = fdopendir (fd);
   if (dirst == NULL)
     goto error;
+  fd = -1;
 
   for (;;) {
     ent = readdir (dirst);
@@ -207,165 +380,659 @@ library_dir_load (kk_library_dir_t *dir)
     if ((strcmp (ent->d_name, ".") && strcmp (ent->d_name, "..")) == 0)
         continue;
 
-    if (ent->d_type == DT_DIR) {
-      kk_library_dir_t *next;
-      kk_library_dir_t *temp;
+    switch (library_dir_get_type (load, dirst, ent)) {
+      case DT_DIR:
+        if (library_dir_add (worker, dir, ent->d_name) != 0)
+          goto error;
+        break;
+      case DT_REG:
+        if (!is_audio_file (ent->d_name))
+          break;
+        if (library_file_add (dir, ent->d_name, 0) != 0)
+          goto error;
+        files++;
+        break;
+      default:
+        break;
+    }
+  }
+  closedir (dirst);
+  return files;
+error:
+  __atomic_store_n (&load->changed, 1, __ATOMIC_RELAXED);
+  if (dirst)
+    closedir (dirst);
+  if (fd >= 0)
+    close (fd);
+  return -1;
+}
 
-      next = calloc (1, sizeof (kk_library_dir_t));
-      if (next == NULL)
-        goto error;
+/**
+ * Puts dir in front of the snapshot of lib. Workers publish concurrently,
+ * and readers walk the snapshot without any lock, so the head gets swapped
+ * atomically after dir is complete.
+ */
+static void
+library_publish (kk_library_t *lib, kk_library_dir_t *dir)
+{
+  kk_library_dir_t *head;
 
-      /**
-       * kk_str_cpy () should never cause this error, but if it does, just
-       * ignore this entry instead of giving up...
-       */
-      if (kk_str_cpy (plst, ent->d_name, NAME_MAX) >= NAME_MAX) {
-        free (next);
-        continue;
-      }
+  head = __atomic_load_n (&lib->snapshot, __ATOMIC_RELAXED);
+  do
+    dir->snapshot = head;
+  while (!__atomic_compare_exchange_n (&lib->snapshot, &head, dir, 1,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-      next->root = dir->root;
-      next->base = strdup (pfst + len_root);
-      library_dir_load (next);
+static int
+library_dir_visit (kk_library_scan_t *scan, kk_library_scan_worker_t *worker,
+    kk_library_dir_t *dir)
+{
+  struct library_load *load = scan->arg;
+  int files = 0;
 
-      /**
-       * If the result has no children, it doesn't contain any regular files
-       * but it might contain directories containing regular files, so we
-       * set next to next->next instead of NULL.
-       */
-      if (next->children == NULL) {
-        temp = next;
-        next = next->next;
-        free (temp->base);
-        free (temp);
-      }
+  /* Once cancelled, the remaining directories are skipped to end the scan quickly */
+  if ((load->lib) && (__atomic_load_n (&load->lib->cancel, __ATOMIC_RELAXED)))
+    return 0;
 
-      /**
-       * If next != NULL, we found one or mire directories in dir that
-       * cointained some music files and we append it to the linked list
-       * of directories.
-       */
-      if (next) {
-        temp = dir;
-        while (temp && temp->next)
-          temp = temp->next;
-        temp->next = next;
-      }
-    }
+  files = library_dir_load (scan, worker, dir);
+  if (load->publish)
+    library_publish (load->lib, dir);
+  return files;
+}
 
-    if ((ent->d_type == DT_REG) && (is_audio_file (ent->d_name))) {
-      kk_library_file_t *next;
+static int
+library_file_cmp (const void *a, const void *b)
+{
+  const kk_library_file_t *fa = (const kk_library_file_t *) a;
+  const kk_library_file_t *fb = (const kk_library_file_t *) b;
 
-      next = calloc (1, sizeof (kk_library_file_t));
-      if (next == NULL)
-        goto error;
+  int result;
 
-      next->parent = dir;
-      next->name = strdup (ent->d_name);
-      next->next = dir->children;
-      dir->children = next;
-    }
+  result = kk_str_natcmp (fa->parent->base, fb->parent->base);
+  if (result == 0)
+    result = kk_str_natcmp (fa->name, fb->name);
+  return result;
+}
+
+/**
+ * Compares two kk_library_file_t pointers, for use with qsort.
+ */
+static int
+library_file_cmp_ptr (const void *a, const void *b)
+{
+  return library_file_cmp (*((const kk_library_file_t *const *) a),
+      *((const kk_library_file_t *const *) b));
+}
+
+static int
+library_file_cmp_order (const void *a, const void *b)
+{
+  const kk_library_file_t *fa = (const kk_library_file_t *) a;
+  const kk_library_file_t *fb = (const kk_library_file_t *) b;
+
+  return (fa->order > fb->order) - (fa->order < fb->order);
+}
+
+/**
+ * Numbers all files in natural sort order of their paths. That's the only
+ * part of a scan that needs to look at every file, so it's only done if
+ * something changed. Otherwise the numbers from the cache are still valid.
+ * Updates leave it to kk_library_free.
+ */
+static int
+library_sort (kk_library_dir_t *dirs)
+{
+  kk_library_file_t **files;
+  kk_library_file_t *file;
+  kk_library_dir_t *dir;
+  size_t count = 0;
+  size_t i;
+
+  for (dir = dirs; dir != NULL; dir = dir->next) {
+    for (file = dir->children; file != NULL; file = file->next)
+      count++;
   }
-  closedir (dirst);
-  free (pfst);
+
+  if (count == 0)
+    return 0;
+
+  /* Libraries easily exceed what kk_list_t is meant for, so use a plain array */
+  files = calloc (count, sizeof (kk_library_file_t *));
+  if (files == NULL)
+    return -1;
+
+  i = 0;
+  for (dir = dirs; dir != NULL; dir = dir->next) {
+    for (file = dir->children; file != NULL; file = file->next)
+      files[i++] = file;
+  }
+
+  qsort (files, count, sizeof (kk_library_file_t *), library_file_cmp_ptr);
+  for (i = 0; i < count; i++)
+    files[i]->order = i;
+
+  free (files);
+  return 0;
+}
+
+/**
+ * Scans the directories linked to *dirs and everything below them with the
+ * scan settings of load. Updates happen while a rescan might be running on
+ * the scan of the library, so they use one of their own.
+ */
+static int
+library_scan_dirs (kk_library_dir_t **dirs, struct library_load *load)
+{
+  kk_library_scan_t *scan;
+  int result;
+
+  if (kk_library_scan_init (&scan, library_dir_visit, load) != 0)
+    return -1;
+
+  result = kk_library_scan_run (scan, dirs);
+  kk_library_scan_free (scan);
+  return result;
+}
+
+static void
+library_save_cache (kk_library_t *lib)
+{
+  kk_library_cache_t *cache;
+
+  if (kk_library_cache_init (&cache, lib->root, (uint32_t) lib->follow) != 0)
+    return;
+  kk_library_cache_save (cache, lib->dirs);
+  kk_library_cache_free (cache);
+}
+
+/**
+ * Runs the initial scan or a rescan.
+ */
+static void *
+library_scan_thread (struct library_load *load)
+{
+  kk_library_t *lib = load->lib;
+  int status = -1;
+
+  kk_realtime_setup_thread ("scanner", 0);
+
+  /* Without a cache, every directory gets read */
+  if (kk_library_cache_init (&load->cache, lib->root, (uint32_t) load->follow) != 0)
+    kk_log (KK_LOG_INFO, "Library cache not available.");
+
+  /* Only one background scan runs at a time, so the previous one is done with the scan */
+  lib->scan->arg = load;
+  if (kk_library_scan_run (lib->scan, &load->dirs) != 0)
+    goto done;
+
+  /* An incomplete scan must not end up in the cache */
+  if (__atomic_load_n (&lib->cancel, __ATOMIC_RELAXED))
+    goto done;
+
+  if (load->changed) {
+    if (library_sort (load->dirs) != 0)
+      goto done;
+  }
+  status = 0;
+done:
+  /* Dirs of the initial scan now belong to the main thread. Saving the cache only reads them. */
+  if (load->publish)
+    __atomic_store_n (&lib->complete, 1, __ATOMIC_RELEASE);
+
+  if ((status == 0) && (load->changed) && (load->cache))
+    kk_library_cache_save (load->cache, load->dirs);
+
+  kk_library_cache_free (load->cache);
+  close (load->fd);
+  free (load);
+
+  kk_library_event_scan_done (lib->events, status);
+  return NULL;
+}
+
+/**
+ * Starts scanning dirs on the background thread of lib. Fails right away if
+ * the library can't be opened, everything else happens in the background.
+ */
+static int
+library_scan_start (kk_library_t *lib, kk_library_dir_t *dirs, int publish)
+{
+  struct library_load *load;
+
+  load = calloc (1, sizeof (struct library_load));
+  if (load == NULL)
+    return -1;
+  load->lib = lib;
+  load->dirs = dirs;
+  load->follow = lib->follow;
+  load->publish = publish;
+
+  load->fd = open (lib->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (load->fd < 0)
+    goto error;
+
+  if (kk_thread_create (&lib->thread, NULL, (void *(*)(void *)) library_scan_thread, load) != 0)
+    goto error;
+  lib->running = 1;
   return 0;
 error:
-  if (dirst)
-    closedir (dirst);
-  free (pfst);
+  if (load->fd >= 0)
+    close (load->fd);
+  free (load);
   return -1;
 }
 
 int
 kk_library_init (kk_library_t **lib, const char *path)
 {
-  kk_library_dir_t *result = NULL;
+  kk_library_t *result = NULL;
+  kk_library_dir_t *root;
 
   if (path == NULL)
     goto error;
 
-  result = calloc (1, sizeof (kk_library_dir_t));
+  result = calloc (1, sizeof (kk_library_t));
   if (result == NULL)
     goto error;
 
-  /* strdup these so we can call free on all strings later  */
   result->root = strdup (path);
-  result->base = strdup ("");
-  if ((result->root == NULL) || (result->base == NULL))
+  if (result->root == NULL)
+    goto error;
+  result->follow = kk_settings_get_bool ("KK_LIBRARY_FOLLOW_LINKS", 1);
+
+  if (kk_event_queue_init (&result->events) != 0)
     goto error;
 
-  if (library_dir_load (result) != 0)
+  if (kk_library_scan_init (&result->scan, library_dir_visit, NULL) != 0)
     goto error;
 
-  if (result->children == NULL) {
-    kk_library_dir_t *next = result->next;
+  root = calloc (1, sizeof (kk_library_dir_t));
+  if (root == NULL)
+    goto error;
+  result->dirs = root;
 
-    if (next == NULL)
-      free (result->root);
+  /* strdup this so we can call free on all strings later  */
+  root->root = result->root;
+  root->base = strdup ("");
+  if (root->base == NULL)
+    goto error;
 
-    free (result->base);
-    free (result);
-    result = next;
-  }
+  if (library_scan_start (result, root, 1) != 0)
+    goto error;
 
   *lib = result;
   return 0;
 error:
-  if (result)
-    kk_library_free (result);
+  kk_library_free (result);
   *lib = NULL;
   return -1;
 }
 
+static void
+library_free_files (kk_library_file_t *file)
+{
+  kk_library_file_t *next;
+
+  while (file) {
+    next = file->next;
+    free (file->name);
+    free (file);
+    file = next;
+  }
+}
+
+static void
+library_free_dirs (kk_library_dir_t *dir)
+{
+  kk_library_dir_t *next;
+
+  while (dir) {
+    next = dir->next;
+    library_free_files (dir->children);
+    free (dir->base);
+    free (dir);
+    dir = next;
+  }
+}
+
 int
 kk_library_free (kk_library_t *lib)
 {
-  kk_library_dir_t *dir = lib;
+  if (lib == NULL)
+    return 0;
+
+  if (lib->running) {
+    __atomic_store_n (&lib->cancel, 1, __ATOMIC_RELAXED);
+    pthread_join (lib->thread, NULL);
+  }
+
+  /* Updates leave the numbers of the files and the cache behind */
+  if ((lib->dirty) && (library_sort (lib->dirs) == 0))
+    library_save_cache (lib);
+
+  if (lib->events)
+    kk_event_queue_free (lib->events);
+
+  kk_library_scan_free (lib->scan);
+
+  library_free_dirs (lib->dirs);
+  library_free_dirs (lib->rescan);
+  library_free_dirs (lib->removed_dirs);
+  library_free_files (lib->removed_files);
+
+  /* All dir structs share the same root pointer, so we only free it once */
+  free (lib->root);
+  free (lib);
+  return 0;
+}
+
+static int
+library_dir_is_below (kk_library_dir_t *dir, kk_library_dir_t *top)
+{
+  for (; dir != NULL; dir = dir->parent) {
+    if (dir == top)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Moves top and every directory below it to the removed directories of the
+ * library and clears their entries in dirs.
+ */
+static void
+library_dir_remove (kk_library_t *lib, kk_library_dir_t *top,
+    kk_library_dir_t **dirs, size_t count, kk_library_update_f func, void *arg)
+{
+  kk_library_dir_t **link = &lib->dirs;
+  kk_library_dir_t *dir;
+  size_t i;
+
+  while ((dir = *link) != NULL) {
+    if (!library_dir_is_below (dir, top)) {
+      link = &dir->next;
+      continue;
+    }
+
+    *link = dir->next;
+    dir->next = lib->removed_dirs;
+    lib->removed_dirs = dir;
+
+    for (i = 0; i < count; i++) {
+      if (dirs[i] == dir)
+        dirs[i] = NULL;
+    }
+    if (func)
+      func (dir, 0, arg);
+  }
+}
+
+static const char *
+library_dir_get_name (kk_library_dir_t *dir)
+{
+  const char *name = strrchr (dir->base, '/');
+
+  return (name) ? name + 1 : dir->base;
+}
+
+/**
+ * Reads a single directory again. Files and subdirectories that are still
+ * there keep their structs, since others might refer to them. New
+ * subdirectories get linked to added, so that the caller can scan them.
+ */
+static int
+library_dir_update (kk_library_t *lib, struct library_load *load, kk_library_dir_t *dir,
+    kk_library_dir_t **dirs, size_t count, kk_library_dir_t **added,
+    kk_library_update_f func, void *arg)
+{
+  kk_library_file_t **files = NULL;
+  kk_library_dir_t **subs = NULL;
+  kk_library_file_t **link;
   kk_library_file_t *file;
+  kk_library_dir_t *next;
+  kk_library_dir_t *sub;
+
+  struct dirent *ent;
+  struct stat sbuf;
+  DIR *dirst = NULL;
+  uint8_t *seen = NULL;
+  size_t num_files = 0;
+  size_t num_subs = 0;
+  size_t i;
+  int fd;
 
-  void *temp;
+  fd = openat (load->fd, (*dir->base) ? dir->base : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if ((fd < 0) || (fstat (fd, &sbuf) != 0)) {
+    if (fd >= 0)
+      close (fd);
+    if (dir->parent == NULL)
+      return -1;
 
-  if (lib == NULL)
+    /* Gone, the update of its parent would remove it anyway */
+    library_dir_remove (lib, dir, dirs, count, func, arg);
     return 0;
+  }
 
-  /* All dir structs share the same root pointer, so we only free it once */
-  free (dir->root);
+  dir->mtime = library_get_mtime (&sbuf);
+  dir->dev = (uint64_t) sbuf.st_dev;
+  dir->ino = (uint64_t) sbuf.st_ino;
 
-  while (dir) {
-    file = dir->children;
+  /* Loops stay empty, just like the scan left them */
+  if (library_dir_is_loop (dir)) {
+    close (fd);
+    return 0;
+  }
+
+  for (file = dir->children; file != NULL; file = file->next)
+    num_files++;
+  for (sub = lib->dirs; sub != NULL; sub = sub->next)
+    num_subs += (sub->parent == dir);
 
-    while (file) {
-      temp = file->next;
-      free (file->name);
-      free (file);
-      file = temp;
+  files = calloc (num_files + 1, sizeof (kk_library_file_t *));
+  subs = calloc (num_subs + 1, sizeof (kk_library_dir_t *));
+  seen = calloc (num_files + num_subs + 1, sizeof (uint8_t));
+  if ((files == NULL) || (subs == NULL) || (seen == NULL))
+    goto error;
+
+  for (file = dir->children, i = 0; file != NULL; file = file->next)
+    files[i++] = file;
+  for (sub = lib->dirs, i = 0; sub != NULL; sub = sub->next) {
+    if (sub->parent == dir)
+      subs[i++] = sub;
+  }
+
+  dirst = fdopendir (fd);
+  if (dirst == NULL)
+    goto error;
+  fd = -1;
+
+  while ((ent = readdir (dirst)) != NULL) {
+    if ((strcmp (ent->d_name, ".") && strcmp (ent->d_name, "..")) == 0)
+      continue;
+
+    switch (library_dir_get_type (load, dirst, ent)) {
+      case DT_DIR:
+        for (i = 0; i < num_subs; i++) {
+          if (strcmp (library_dir_get_name (subs[i]), ent->d_name) == 0)
+            break;
+        }
+        if (i < num_subs) {
+          seen[num_files + i] = 1;
+          break;
+        }
+
+        next = calloc (1, sizeof (kk_library_dir_t));
+        if (next == NULL)
+          goto error;
+        next->base = calloc (strlen (dir->base) + strlen (ent->d_name) + 2, sizeof (char));
+        if (next->base == NULL) {
+          free (next);
+          goto error;
+        }
+        if (*dir->base)
+          sprintf (next->base, "%s/%s", dir->base, ent->d_name);
+        else
+          strcpy (next->base, ent->d_name);
+        next->root = dir->root;
+        next->parent = dir;
+        next->next = *added;
+        *added = next;
+        break;
+      case DT_REG:
+        if (!is_audio_file (ent->d_name))
+          break;
+        for (i = 0; i < num_files; i++) {
+          if (strcmp (files[i]->name, ent->d_name) == 0)
+            break;
+        }
+        if (i < num_files)
+          seen[i] = 1;
+        else if (library_file_add (dir, ent->d_name, 0) != 0)
+          goto error;
+        break;
+      default:
+        break;
     }
+  }
 
-    temp = dir->next;
-    free (dir->base);
-    free (dir);
-    dir = temp;
+  /* New files got put in front of the old ones, so skip them */
+  link = &dir->children;
+  while (*link != files[0])
+    link = &(*link)->next;
+
+  for (i = 0; i < num_files; i++) {
+    if (seen[i]) {
+      link = &files[i]->next;
+      continue;
+    }
+    *link = files[i]->next;
+    files[i]->next = lib->removed_files;
+    lib->removed_files = files[i];
   }
 
-  /**
-   * No need to free lib since we already freed it in the first
-   * while-iteration
-   */
+  for (i = 0; i < num_subs; i++) {
+    if (!seen[num_files + i])
+      library_dir_remove (lib, subs[i], dirs, count, func, arg);
+  }
+
+  closedir (dirst);
+  free (files);
+  free (subs);
+  free (seen);
   return 0;
+error:
+  if (dirst)
+    closedir (dirst);
+  if (fd >= 0)
+    close (fd);
+  free (files);
+  free (subs);
+  free (seen);
+  return -1;
 }
 
-static int
-library_file_cmp (const void *a, const void *b)
+int
+kk_library_update (kk_library_t *lib, kk_library_dir_t **dirs, size_t count,
+    kk_library_update_f func, void *arg)
 {
-  const kk_library_file_t *fa = (const kk_library_file_t *) a;
-  const kk_library_file_t *fb = (const kk_library_file_t *) b;
+  kk_library_dir_t *added = NULL;
+  kk_library_dir_t *last;
+  kk_library_dir_t *dir;
+  struct library_load load;
+  size_t i;
 
-  int result;
+  memset (&load, 0, sizeof (struct library_load));
+  load.follow = lib->follow;
+  load.fd = open (lib->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (load.fd < 0)
+    return -1;
+
+  for (i = 0; i < count; i++) {
+    if (dirs[i] == NULL)
+      continue;
+    if (library_dir_update (lib, &load, dirs[i], dirs, count, &added, func, arg) != 0)
+      kk_log (KK_LOG_WARNING, "Updating directory '%s' failed.", dirs[i]->base);
+  }
 
-  result = kk_str_natcmp (fa->parent->base, fb->parent->base);
-  if (result == 0)
-    result = kk_str_natcmp (fa->name, fb->name);
-  return result;
+  for (last = lib->dirs; last->next != NULL; last = last->next);
+
+  /* Every new directory brings the directories below it. All get scanned in a single run. */
+  if ((added) && (library_scan_dirs (&added, &load) != 0))
+    kk_log (KK_LOG_WARNING, "Scanning new directories failed.");
+
+  last->next = added;
+  for (dir = added; dir != NULL; dir = dir->next) {
+    if (func)
+      func (dir, 1, arg);
+  }
+
+  /* Numbering every file again would take as long as the update itself */
+  lib->dirty = 1;
+
+  close (load.fd);
+  return 0;
+}
+
+int
+kk_library_rescan (kk_library_t *lib)
+{
+  kk_library_dir_t *root;
+
+  if ((!kk_library_is_complete (lib)) || (lib->rescan != NULL))
+    return -1;
+
+  /* The previous scan already sent its event, so it's about to end */
+  if (lib->running) {
+    pthread_join (lib->thread, NULL);
+    lib->running = 0;
+  }
+
+  root = calloc (1, sizeof (kk_library_dir_t));
+  if (root == NULL)
+    return -1;
+
+  root->root = lib->root;
+  root->base = strdup ("");
+  if (root->base == NULL)
+    goto error;
+
+  if (library_scan_start (lib, root, 0) != 0)
+    goto error;
+  lib->rescan = root;
+  return 0;
+error:
+  library_free_dirs (root);
+  return -1;
+}
+
+int
+kk_library_finish_rescan (kk_library_t *lib, int status)
+{
+  kk_library_dir_t *root = lib->rescan;
+  kk_library_dir_t *last;
+
+  if (root == NULL)
+    return -1;
+
+  pthread_join (lib->thread, NULL);
+  lib->running = 0;
+  lib->rescan = NULL;
+
+  if (status != 0) {
+    library_free_dirs (root);
+    return -1;
+  }
+
+  /* The player might still refer to the old files */
+  for (last = lib->dirs; last->next != NULL; last = last->next);
+  last->next = lib->removed_dirs;
+  lib->removed_dirs = lib->dirs;
+
+  /* The rescan numbered the files and saved the cache */
+  lib->dirs = root;
+  lib->dirty = 0;
+  return 0;
 }
 
 int
@@ -380,6 +1047,9 @@ kk_library_find (kk_library_t *lib, const char *keyword, kk_list_t **sel)
   kk_str_match_t match_base;
   kk_str_match_t match_file;
 
+  int complete;
+  int numbered;
+
   if ((keyword == NULL) || (*keyword == '\0'))
     goto error;
 
@@ -389,7 +1059,15 @@ kk_library_find (kk_library_t *lib, const char *keyword, kk_list_t **sel)
   if (kk_str_search_init (&search, keyword, " ") != 0)
     goto error;
 
-  for (dir = lib; dir != NULL; dir = dir->next) {
+  /* Numbers of files are only known once the scan is complete and until an update */
+  complete = kk_library_is_complete (lib);
+  numbered = (complete) && (!lib->dirty);
+  if (complete)
+    dir = lib->dirs;
+  else
+    dir = __atomic_load_n (&lib->snapshot, __ATOMIC_ACQUIRE);
+
+  for (; dir != NULL; dir = (complete) ? dir->next : dir->snapshot) {
     /* Search directory name */
     kk_str_search_find_all (search, dir->base, &match_base);
 
@@ -407,7 +1085,7 @@ kk_library_find (kk_library_t *lib, const char *keyword, kk_list_t **sel)
 
   kk_str_search_free (search);
   if (result->len)
-    kk_list_sort (result, library_file_cmp);
+    kk_list_sort (result, (numbered) ? library_file_cmp_order : library_file_cmp);
   *sel = result;
   return 0;
 error:
@@ -416,3 +1094,21 @@ error:
   *sel = NULL;
   return -1;
 }
+
+int
+kk_library_get_event_fd (kk_library_t *lib)
+{
+  return kk_event_queue_get_read_fd (lib->events);
+}
+
+int
+kk_library_is_complete (kk_library_t *lib)
+{
+  return __atomic_load_n (&lib->complete, __ATOMIC_ACQUIRE);
+}
+
+void
+kk_library_get_progress (kk_library_t *lib, kk_library_scan_progress_t *progress)
+{
+  kk_library_scan_get_progress (lib->scan, progress);
+}
@@ -21,7 +21,11 @@
  */
 #include <klingklang/base.h>
 #include <klingklang/library.h>
+#include <klingklang/library-watch.h>
 #include <klingklang/player.h>
+#include <klingklang/seek-index.h>
+#include <klingklang/settings.h>
+#include <klingklang/timer.h>
 #include <klingklang/ui/cover.h>
 #include <klingklang/ui/image.h>
 #include <klingklang/ui/progressbar.h>
@@ -40,25 +44,30 @@ typedef struct kk_context kk_context_t;
 struct kk_context {
   kk_event_loop_t *loop;
   kk_library_t *library;
+  kk_library_watch_t *watch;
   kk_player_t *player;
+  kk_timer_t *timer;
   kk_window_t *window;
 };
 
 static void
-on_player_pause (kk_context_t *ctx, kk_player_event_pause_t *event)
+on_player_done (kk_context_t *ctx, kk_player_event_done_t *event)
 {
   (void) ctx;
-  (void) event;
 
-  kk_log (KK_LOG_INFO, "Player pause toggled.");
-  return;
+  kk_log (KK_LOG_DEBUG, "Player command '%s' %s.",
+      kk_player_command_get_name (event->command),
+      (event->status == 0) ? "done" : "failed");
 }
 
 static void
-on_player_progress (kk_context_t *ctx, kk_player_event_progress_t *event)
+on_player_pause (kk_context_t *ctx, kk_player_event_pause_t *event)
 {
-  kk_log (KK_LOG_DEBUG, "Player progress %f [0,1].", (double) event->progress);
-  kk_progressbar_set_value (ctx->window->progressbar, event->progress);
+  (void) ctx;
+  (void) event;
+
+  kk_log (KK_LOG_INFO, "Player pause toggled.");
+  return;
 }
 
 static void
@@ -90,9 +99,52 @@ on_player_stop (kk_context_t *ctx, kk_player_event_stop_t *event)
   kk_window_update (ctx->window);
 }
 
+static void
+on_watch_event (kk_event_loop_t *loop, int fd, kk_context_t *ctx)
+{
+  (void) loop;
+  (void) fd;
+
+  kk_library_watch_read (ctx->watch);
+}
+
+/**
+ * The library is watched once the background scan is complete, since
+ * updates need the complete library. Later scans are rescans of the watch.
+ */
+static void
+on_library_scan_done (kk_context_t *ctx, kk_library_event_scan_done_t *event)
+{
+  kk_library_scan_progress_t progress;
+
+  if (ctx->watch) {
+    kk_library_watch_rescan_done (ctx->watch, event->status);
+    return;
+  }
+
+  if (event->status != 0) {
+    kk_log (KK_LOG_ERROR, "Scanning music library failed.");
+    return;
+  }
+
+  kk_library_get_progress (ctx->library, &progress);
+  kk_log (KK_LOG_INFO, "Music library scanned: %zu files in %zu directories.",
+      progress.files, progress.dirs);
+  if (!kk_settings_get_bool ("KK_LIBRARY_WATCH", 1))
+    return;
+
+  if (kk_library_watch_init (&ctx->watch, ctx->library) < 0) {
+    kk_log (KK_LOG_WARNING, "Could not watch music library.");
+    return;
+  }
+  kk_event_loop_add (ctx->loop, kk_library_watch_get_fd (ctx->watch),
+      (kk_event_func_f) on_watch_event, ctx);
+}
+
 static void
 on_window_input (kk_context_t *ctx, kk_window_event_input_t *event)
 {
+  kk_library_scan_progress_t progress;
   kk_list_t *sel = NULL;
 
   if (*event->text == '\0')
@@ -103,7 +155,13 @@ on_window_input (kk_context_t *ctx, kk_window_event_input_t *event)
     goto cleanup;
   }
 
-  kk_log (KK_LOG_INFO, "%d files matching '%s'.", sel->len, event->text);
+  if (kk_library_is_complete (ctx->library))
+    kk_log (KK_LOG_INFO, "%d files matching '%s'.", sel->len, event->text);
+  else {
+    kk_library_get_progress (ctx->library, &progress);
+    kk_log (KK_LOG_INFO, "%d files matching '%s' in the %zu directories scanned so far.",
+        sel->len, event->text, progress.dirs);
+  }
   if (sel->len == 0)
     goto cleanup;
 
@@ -147,6 +205,32 @@ on_window_key_press (kk_context_t *ctx, kk_window_event_key_press_t *event)
   }
 }
 
+static void
+on_library_event (kk_event_loop_t *loop, int fd, kk_context_t *ctx)
+{
+  kk_event_t event;
+  ssize_t rs;
+
+  (void) loop;
+
+  while (rs = read (fd, &event, sizeof (kk_event_t)), rs > 0) {
+    /* Sanity check... should not be necessary */
+    if (rs != sizeof (kk_event_t)) {
+      kk_log (KK_LOG_WARNING, "Invalid size read from event loop.");
+      continue;
+    }
+
+    switch (event.type) {
+      case KK_LIBRARY_SCAN_DONE:
+        on_library_scan_done (ctx, (kk_library_event_scan_done_t *) &event);
+        break;
+      default:
+        kk_log (KK_LOG_WARNING, "Read unkown library event.");
+        break;
+    }
+  }
+}
+
 static void
 on_player_event (kk_event_loop_t *loop, int fd, kk_context_t *ctx)
 {
@@ -163,6 +247,9 @@ on_player_event (kk_event_loop_t *loop, int fd, kk_context_t *ctx)
     }
 
     switch (event.type) {
+      case KK_PLAYER_DONE:
+        on_player_done (ctx, (kk_player_event_done_t *) &event);
+        break;
       case KK_PLAYER_SEEK:
         on_player_seek (ctx, (kk_player_event_seek_t *) &event);
         break;
@@ -175,9 +262,6 @@ on_player_event (kk_event_loop_t *loop, int fd, kk_context_t *ctx)
       case KK_PLAYER_PAUSE:
         on_player_pause (ctx, (kk_player_event_pause_t *) &event);
         break;
-      case KK_PLAYER_PROGRESS:
-        on_player_progress (ctx, (kk_player_event_progress_t *) &event);
-        break;
       default:
         kk_log (KK_LOG_WARNING, "Read unkown player event.");
         break;
@@ -185,6 +269,31 @@ on_player_event (kk_event_loop_t *loop, int fd, kk_context_t *ctx)
   }
 }
 
+/**
+ * The progressbar follows the playback clock of the player, which we read
+ * every time the timer fires.
+ */
+static void
+on_timer_event (kk_event_loop_t *loop, int fd, kk_context_t *ctx)
+{
+  kk_event_t event;
+  double duration;
+  double time;
+
+  (void) loop;
+
+  /* No matter how often the timer fired, only the current position counts */
+  while (read (fd, &event, sizeof (kk_event_t)) > 0)
+    continue;
+
+  kk_player_get_position (ctx->player, &time, &duration);
+  if (duration > 0.0)
+    kk_progressbar_set_value (ctx->window->progressbar, time / duration);
+
+  if (ctx->watch)
+    kk_library_watch_update (ctx->watch);
+}
+
 static void
 on_window_event (kk_event_loop_t *loop, int fd, kk_context_t *ctx)
 {
@@ -235,13 +344,23 @@ main (int argc, char **argv)
   if (kk_window_init (&context.window, KK_WINDOW_WIDTH, KK_WINDOW_HEIGHT) < 0)
     kk_err (EXIT_FAILURE, "Could not initialize window.");
 
-  if (kk_event_loop_init (&context.loop, 2) != 0)
+  if (kk_timer_init (&context.timer) < 0)
+    kk_err (EXIT_FAILURE, "Could not initialize timer.");
+
+  if (kk_event_loop_init (&context.loop, 5) != 0)
     kk_err (EXIT_FAILURE, "Could not initialize event loop.");
 
   kk_event_loop_add (context.loop, kk_player_get_event_fd (context.player),
       (kk_event_func_f) on_player_event, &context);
   kk_event_loop_add (context.loop, kk_window_get_event_fd (context.window),
       (kk_event_func_f) on_window_event, &context);
+  kk_event_loop_add (context.loop, kk_timer_get_event_fd (context.timer),
+      (kk_event_func_f) on_timer_event, &context);
+  kk_event_loop_add (context.loop, kk_library_get_event_fd (context.library),
+      (kk_event_func_f) on_library_event, &context);
+
+  if (kk_timer_start (context.timer, 1) != 0)
+    kk_log (KK_LOG_WARNING, "Could not start timer.");
 
   kk_window_show (context.window);
   kk_player_start (context.player);
@@ -249,9 +368,12 @@ main (int argc, char **argv)
   kk_player_stop (context.player);
 
   kk_event_loop_free (context.loop);
+  kk_timer_free (context.timer);
+  kk_library_watch_free (context.watch);
   kk_library_free (context.library);
   kk_player_free (context.player);
   kk_window_free (context.window);
+  kk_seek_index_finish ();
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,281 @@
+#include <klingklang/cpu.h>
+#include <klingklang/mix.h>
+#include <klingklang/util.h>
+
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define MIX_X86
+#  include <immintrin.h>
+#endif
+
+typedef void (*mix_float_func) (float *dst, const float *src, size_t n,
+    float a, float b);
+typedef void (*mix_s16_func) (int16_t *dst, const int16_t *src, size_t n,
+    float a, float b);
+typedef void (*mix_s32_func) (int32_t *dst, const int32_t *src, size_t n,
+    float a, float b);
+
+/**
+ * Reference implementations. Since dst and src may point to the same
+ * samples, there's no restrict here.
+ */
+static void
+mix_float (float *dst, const float *src, size_t n, float a, float b)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = dst[i] * a + src[i] * b;
+}
+
+static void
+mix_s16 (int16_t *dst, const int16_t *src, size_t n, float a, float b)
+{
+  size_t i;
+  long v;
+
+  for (i = 0; i < n; i++) {
+    v = lrintf ((float) dst[i] * a + (float) src[i] * b);
+    if (v > INT16_MAX)
+      v = INT16_MAX;
+    if (v < INT16_MIN)
+      v = INT16_MIN;
+    dst[i] = (int16_t) v;
+  }
+}
+
+/**
+ * A float only has 24 bits of precision, so 32 bit samples get mixed as
+ * doubles.
+ */
+static void
+mix_s32 (int32_t *dst, const int32_t *src, size_t n, float a, float b)
+{
+  size_t i;
+  double v;
+
+  for (i = 0; i < n; i++) {
+    v = (double) dst[i] * (double) a + (double) src[i] * (double) b;
+    if (v > (double) INT32_MAX)
+      v = (double) INT32_MAX;
+    if (v < (double) INT32_MIN)
+      v = (double) INT32_MIN;
+    dst[i] = (int32_t) lrint (v);
+  }
+}
+
+/**
+ * The vector kernels process as many samples as fill whole registers and
+ * leave the rest to the reference implementation. They round the same way,
+ * so all kernels produce exactly the same samples.
+ */
+#ifdef MIX_X86
+__attribute__ ((target ("sse2")))
+static void
+mix_float_sse2 (float *dst, const float *src, size_t n, float a, float b)
+{
+  const __m128 va = _mm_set1_ps (a);
+  const __m128 vb = _mm_set1_ps (b);
+
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128 d = _mm_loadu_ps (dst + i);
+    __m128 s = _mm_loadu_ps (src + i);
+    _mm_storeu_ps (dst + i, _mm_add_ps (_mm_mul_ps (d, va), _mm_mul_ps (s, vb)));
+  }
+  mix_float (dst + i, src + i, n - i, a, b);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+mix_s16_sse2 (int16_t *dst, const int16_t *src, size_t n, float a, float b)
+{
+  const __m128 va = _mm_set1_ps (a);
+  const __m128 vb = _mm_set1_ps (b);
+
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m128i d = _mm_loadu_si128 ((const __m128i *) (const void *) (dst + i));
+    __m128i s = _mm_loadu_si128 ((const __m128i *) (const void *) (src + i));
+
+    /* Sign extend to 32 bits by unpacking into the upper halves */
+    __m128 dl = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (d, d), 16));
+    __m128 dh = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpackhi_epi16 (d, d), 16));
+    __m128 sl = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpacklo_epi16 (s, s), 16));
+    __m128 sh = _mm_cvtepi32_ps (_mm_srai_epi32 (_mm_unpackhi_epi16 (s, s), 16));
+
+    dl = _mm_add_ps (_mm_mul_ps (dl, va), _mm_mul_ps (sl, vb));
+    dh = _mm_add_ps (_mm_mul_ps (dh, va), _mm_mul_ps (sh, vb));
+
+    /* Packing saturates, so there's no need to clamp */
+    _mm_storeu_si128 ((__m128i *) (void *) (dst + i),
+        _mm_packs_epi32 (_mm_cvtps_epi32 (dl), _mm_cvtps_epi32 (dh)));
+  }
+  mix_s16 (dst + i, src + i, n - i, a, b);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+mix_s32_sse2 (int32_t *dst, const int32_t *src, size_t n, float a, float b)
+{
+  const __m128d va = _mm_set1_pd ((double) a);
+  const __m128d vb = _mm_set1_pd ((double) b);
+  const __m128d max = _mm_set1_pd ((double) INT32_MAX);
+  const __m128d min = _mm_set1_pd ((double) INT32_MIN);
+
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m128i d = _mm_loadu_si128 ((const __m128i *) (const void *) (dst + i));
+    __m128i s = _mm_loadu_si128 ((const __m128i *) (const void *) (src + i));
+
+    __m128d dl = _mm_cvtepi32_pd (d);
+    __m128d dh = _mm_cvtepi32_pd (_mm_shuffle_epi32 (d, 0x4e));
+    __m128d sl = _mm_cvtepi32_pd (s);
+    __m128d sh = _mm_cvtepi32_pd (_mm_shuffle_epi32 (s, 0x4e));
+
+    dl = _mm_add_pd (_mm_mul_pd (dl, va), _mm_mul_pd (sl, vb));
+    dh = _mm_add_pd (_mm_mul_pd (dh, va), _mm_mul_pd (sh, vb));
+
+    /* Out of range values would turn into INT32_MIN */
+    dl = _mm_max_pd (_mm_min_pd (dl, max), min);
+    dh = _mm_max_pd (_mm_min_pd (dh, max), min);
+
+    _mm_storeu_si128 ((__m128i *) (void *) (dst + i),
+        _mm_unpacklo_epi64 (_mm_cvtpd_epi32 (dl), _mm_cvtpd_epi32 (dh)));
+  }
+  mix_s32 (dst + i, src + i, n - i, a, b);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+mix_float_avx2 (float *dst, const float *src, size_t n, float a, float b)
+{
+  const __m256 va = _mm256_set1_ps (a);
+  const __m256 vb = _mm256_set1_ps (b);
+
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 d = _mm256_loadu_ps (dst + i);
+    __m256 s = _mm256_loadu_ps (src + i);
+    _mm256_storeu_ps (dst + i, _mm256_add_ps (_mm256_mul_ps (d, va), _mm256_mul_ps (s, vb)));
+  }
+  mix_float (dst + i, src + i, n - i, a, b);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+mix_s16_avx2 (int16_t *dst, const int16_t *src, size_t n, float a, float b)
+{
+  const __m256 va = _mm256_set1_ps (a);
+  const __m256 vb = _mm256_set1_ps (b);
+
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 d = _mm256_cvtepi32_ps (_mm256_cvtepi16_epi32 (
+            _mm_loadu_si128 ((const __m128i *) (const void *) (dst + i))));
+    __m256 s = _mm256_cvtepi32_ps (_mm256_cvtepi16_epi32 (
+            _mm_loadu_si128 ((const __m128i *) (const void *) (src + i))));
+    __m256i v = _mm256_cvtps_epi32 (_mm256_add_ps (_mm256_mul_ps (d, va), _mm256_mul_ps (s, vb)));
+
+    _mm_storeu_si128 ((__m128i *) (void *) (dst + i),
+        _mm_packs_epi32 (_mm256_castsi256_si128 (v), _mm256_extracti128_si256 (v, 1)));
+  }
+  mix_s16 (dst + i, src + i, n - i, a, b);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+mix_s32_avx2 (int32_t *dst, const int32_t *src, size_t n, float a, float b)
+{
+  const __m256d va = _mm256_set1_pd ((double) a);
+  const __m256d vb = _mm256_set1_pd ((double) b);
+  const __m256d max = _mm256_set1_pd ((double) INT32_MAX);
+  const __m256d min = _mm256_set1_pd ((double) INT32_MIN);
+
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m256d d = _mm256_cvtepi32_pd (_mm_loadu_si128 ((const __m128i *) (const void *) (dst + i)));
+    __m256d s = _mm256_cvtepi32_pd (_mm_loadu_si128 ((const __m128i *) (const void *) (src + i)));
+
+    d = _mm256_add_pd (_mm256_mul_pd (d, va), _mm256_mul_pd (s, vb));
+    d = _mm256_max_pd (_mm256_min_pd (d, max), min);
+    _mm_storeu_si128 ((__m128i *) (void *) (dst + i), _mm256_cvtpd_epi32 (d));
+  }
+  mix_s32 (dst + i, src + i, n - i, a, b);
+}
+#endif
+
+static mix_float_func mix_float_kernel = mix_float;
+static mix_s16_func mix_s16_kernel = mix_s16;
+static mix_s32_func mix_s32_kernel = mix_s32;
+static pthread_once_t mix_kernels_once = PTHREAD_ONCE_INIT;
+
+static void
+mix_select_kernels (void)
+{
+  const unsigned int features = kk_cpu_get_features ();
+
+#ifdef MIX_X86
+  if (features & KK_CPU_SSE2) {
+    mix_float_kernel = mix_float_sse2;
+    mix_s16_kernel = mix_s16_sse2;
+    mix_s32_kernel = mix_s32_sse2;
+  }
+  if (features & KK_CPU_AVX2) {
+    mix_float_kernel = mix_float_avx2;
+    mix_s16_kernel = mix_s16_avx2;
+    mix_s32_kernel = mix_s32_avx2;
+  }
+#endif
+
+  (void) features;
+}
+
+int
+kk_mix_is_supported (kk_format_t *fmt)
+{
+  if (fmt->byte_order != KK_BYTE_ORDER_NATIVE)
+    return 0;
+
+  switch (fmt->type) {
+    case KK_TYPE_SINT:
+      return (fmt->bits == KK_BITS_16) || (fmt->bits == KK_BITS_32);
+    case KK_TYPE_FLOAT:
+      return (fmt->bits == KK_BITS_32);
+    case KK_TYPE_UINT:
+      break;
+  }
+  return 0;
+}
+
+void
+kk_mix (kk_format_t *fmt, void *dst, const void *src, size_t len,
+    float a, float b)
+{
+  pthread_once (&mix_kernels_once, mix_select_kernels);
+
+  if (fmt->type == KK_TYPE_FLOAT)
+    mix_float_kernel (dst, src, len / sizeof (float), a, b);
+  else if (fmt->bits == KK_BITS_16)
+    mix_s16_kernel (dst, src, len / sizeof (int16_t), a, b);
+  else
+    mix_s32_kernel (dst, src, len / sizeof (int32_t), a, b);
+}
+
+float
+kk_mix_gain (float t)
+{
+  if (t <= 0.0f)
+    return 0.0f;
+  if (t >= 1.0f)
+    return 1.0f;
+  return sinf (t * (float) M_PI_2);
+}
@@ -0,0 +1,132 @@
+#include <klingklang/player-commands.h>
+
+#define KK_PLAYER_COMMANDS_MASK (KK_PLAYER_MAX_COMMANDS - 1)
+
+static const char *command_names[] = {
+  [KK_PLAYER_COMMAND_NEXT] = "next",
+  [KK_PLAYER_COMMAND_QUIT] = "quit",
+  [KK_PLAYER_COMMAND_SEEK] = "seek",
+  [KK_PLAYER_COMMAND_START] = "start",
+  [KK_PLAYER_COMMAND_STOP] = "stop",
+};
+
+int
+kk_player_commands_init (kk_player_commands_t **cmds)
+{
+  kk_player_commands_t *result;
+  size_t i;
+
+  result = calloc (1, sizeof (kk_player_commands_t));
+  if (result == NULL)
+    goto error;
+
+  /* Slot i is free for the command at position i */
+  for (i = 0; i < KK_PLAYER_MAX_COMMANDS; i++)
+    result->items[i].seq = i;
+
+  if (pthread_cond_init (&result->cond, NULL) != 0)
+    goto error;
+
+  if (pthread_mutex_init (&result->mutex, NULL) != 0)
+    goto error;
+
+  *cmds = result;
+  return 0;
+error:
+  kk_player_commands_free (result);
+  *cmds = NULL;
+  return -1;
+}
+
+int
+kk_player_commands_free (kk_player_commands_t *cmds)
+{
+  if (cmds == NULL)
+    return 0;
+
+  pthread_cond_destroy (&cmds->cond);
+  pthread_mutex_destroy (&cmds->mutex);
+  free (cmds);
+  return 0;
+}
+
+/**
+ * Producers claim the position at tail by advancing tail, which only works
+ * if the slot got freed since the queue went around the last time. Once the
+ * command is in place, the sequence number of the slot tells the consumer
+ * it may take it. Like the ring buffer, we only wake the consumer if it
+ * announced that it's waiting.
+ */
+int
+kk_player_commands_push (kk_player_commands_t *cmds, const kk_player_command_t *cmd)
+{
+  size_t pos = __atomic_load_n (&cmds->tail, __ATOMIC_RELAXED);
+  size_t seq;
+  ssize_t diff;
+
+  for (;;) {
+    seq = __atomic_load_n (&cmds->items[pos & KK_PLAYER_COMMANDS_MASK].seq, __ATOMIC_ACQUIRE);
+    diff = (ssize_t) (seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n (&cmds->tail, &pos, pos + 1, 1,
+              __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+      return -1;
+    else
+      pos = __atomic_load_n (&cmds->tail, __ATOMIC_RELAXED);
+  }
+
+  memcpy (&cmds->items[pos & KK_PLAYER_COMMANDS_MASK].command, cmd, sizeof (kk_player_command_t));
+  __atomic_store_n (&cmds->items[pos & KK_PLAYER_COMMANDS_MASK].seq, pos + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n (&cmds->waiters, __ATOMIC_SEQ_CST) != 0) {
+    pthread_mutex_lock (&cmds->mutex);
+    pthread_cond_broadcast (&cmds->cond);
+    pthread_mutex_unlock (&cmds->mutex);
+  }
+  return 0;
+}
+
+static int
+player_commands_is_empty (kk_player_commands_t *cmds)
+{
+  const size_t pos = cmds->head;
+
+  return __atomic_load_n (&cmds->items[pos & KK_PLAYER_COMMANDS_MASK].seq, __ATOMIC_SEQ_CST) != pos + 1;
+}
+
+int
+kk_player_commands_pop (kk_player_commands_t *cmds, kk_player_command_t *cmd)
+{
+  const size_t pos = cmds->head;
+
+  if (player_commands_is_empty (cmds))
+    return -1;
+
+  memcpy (cmd, &cmds->items[pos & KK_PLAYER_COMMANDS_MASK].command, sizeof (kk_player_command_t));
+  __atomic_store_n (&cmds->items[pos & KK_PLAYER_COMMANDS_MASK].seq,
+      pos + KK_PLAYER_MAX_COMMANDS, __ATOMIC_RELEASE);
+  cmds->head = pos + 1;
+  return 0;
+}
+
+void
+kk_player_commands_wait (kk_player_commands_t *cmds)
+{
+  pthread_mutex_lock (&cmds->mutex);
+  __atomic_add_fetch (&cmds->waiters, 1, __ATOMIC_SEQ_CST);
+  while (player_commands_is_empty (cmds))
+    pthread_cond_wait (&cmds->cond, &cmds->mutex);
+  __atomic_sub_fetch (&cmds->waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&cmds->mutex);
+}
+
+const char *
+kk_player_command_get_name (int type)
+{
+  if ((type < 0) || ((size_t) type >= sizeof (command_names) / sizeof (command_names[0])))
+    return "unknown";
+  return command_names[type];
+}
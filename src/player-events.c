@@ -5,6 +5,18 @@
  * gcc/clang don't complain about type punning and valgrind doesn't report some
  * mysterious uninitialized bytes.
  */
+void
+kk_player_event_done (kk_event_queue_t *queue, int command, int status)
+{
+  kk_player_event_done_t event;
+
+  memset (&event, 0, sizeof (kk_player_event_done_t));
+  event.type = KK_PLAYER_DONE;
+  event.command = command;
+  event.status = status;
+  kk_event_queue_write (queue, (void *) &event, sizeof (kk_player_event_done_t));
+}
+
 void
 kk_player_event_seek (kk_event_queue_t *queue, float perc)
 {
@@ -27,17 +39,6 @@ kk_player_event_start (kk_event_queue_t *queue, kk_library_file_t *file)
   kk_event_queue_write (queue, (void *) &event, sizeof (kk_player_event_start_t));
 }
 
-void
-kk_player_event_progress (kk_event_queue_t *queue, float progress)
-{
-  kk_player_event_progress_t event;
-
-  memset (&event, 0, sizeof (kk_player_event_progress_t));
-  event.type = KK_PLAYER_PROGRESS;
-  event.progress = progress;
-  kk_event_queue_write (queue, (void *) &event, sizeof (kk_player_event_progress_t));
-}
-
 void
 kk_player_event_stop (kk_event_queue_t *queue)
 {
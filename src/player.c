@@ -1,10 +1,1192 @@
+#include <klingklang/convert.h>
+#include <klingklang/mix.h>
 #include <klingklang/player.h>
+#include <klingklang/realtime.h>
+#include <klingklang/resample.h>
+#include <klingklang/settings.h>
 #include <klingklang/util.h>
 
+#include <sched.h>
+#include <time.h>
+
+/**
+ * Default size of the sample buffer between decoder and output thread in
+ * bytes. Can be changed with the KK_BUFFER_SIZE environment variable.
+ */
+#define KK_PLAYER_BUFFER_SIZE   (1 << 20)
+
+/**
+ * Maximum number of bytes the output thread passes to the device at once.
+ */
+#define KK_PLAYER_CHUNK_SIZE    (1 << 14)
+
+/**
+ * Maximum duration in seconds of the samples the output thread passes to the
+ * device at once. Pausing and flushing have to wait for the current write,
+ * so this keeps them well below one device period.
+ */
+#define KK_PLAYER_CHUNK_TIME    0.02
+
+/**
+ * Longest crossfade in seconds and the number of sample frames which get
+ * mixed with the same gains during a crossfade.
+ */
+#define KK_PLAYER_FADE_MAX      30.0f
+#define KK_PLAYER_FADE_FRAMES   64
+
+/**
+ * Number of samples per channel most codecs decode at most at once. The
+ * frame pool reserves a buffer of this size whenever the format changes.
+ */
+#define KK_PLAYER_FRAME_SAMPLES 8192
+
+/**
+ * Highest sample rate KK_SAMPLE_RATE accepts.
+ */
+#define KK_PLAYER_RATE_MAX      384000
+
+enum {
+  KK_PLAYER_OUTPUT_FLUSH = 1 << 0,
+  KK_PLAYER_OUTPUT_QUIT = 1 << 1,
+  KK_PLAYER_OUTPUT_MARK = 1 << 2,
+  KK_PLAYER_OUTPUT_PAUSE = 1 << 3,
+};
+
+static double
+player_get_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Whoever posts a command that drops the current position calls
+ * player_abort_begin first. This makes the decoder thread drop its current
+ * frame and stop waiting for buffer space, so that it executes the command
+ * right away. Once it did, it calls player_abort_end. Until then, it drops
+ * the frames it decodes in the meantime.
+ */
+static void
+player_abort_begin (kk_player_t *player)
+{
+  __atomic_add_fetch (&player->abort, 1, __ATOMIC_SEQ_CST);
+  kk_ringbuffer_wakeup (player->buffer);
+}
+
+static void
+player_abort_end (kk_player_t *player)
+{
+  __atomic_sub_fetch (&player->abort, 1, __ATOMIC_SEQ_CST);
+}
+
+static int
+player_is_aborted (kk_player_t *player)
+{
+  return __atomic_load_n (&player->abort, __ATOMIC_SEQ_CST) != 0;
+}
+
+/**
+ * Flush and pause requests remember when they were made, so that the output
+ * thread can log how long the device took to react.
+ */
+static void
+player_output_request (kk_player_t *player, int request)
+{
+  pthread_mutex_lock (&player->output.mutex);
+  if (request & (KK_PLAYER_OUTPUT_FLUSH | KK_PLAYER_OUTPUT_PAUSE))
+    player->output.time = player_get_time ();
+  __atomic_or_fetch (&player->output.request, request, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast (&player->output.cond);
+  pthread_mutex_unlock (&player->output.mutex);
+  kk_ringbuffer_wakeup (player->buffer);
+}
+
+/**
+ * The marks form a single-producer/single-consumer queue as well. The decoder
+ * thread adds marks, the output thread removes them.
+ */
+static int
+player_mark (kk_player_t *player, kk_library_file_t *file)
+{
+  const size_t head = player->marks.head;
+  const size_t tail = __atomic_load_n (&player->marks.tail, __ATOMIC_SEQ_CST);
+
+  kk_player_mark_t *mark;
+
+  if (head - tail >= KK_PLAYER_MAX_MARKS) {
+    kk_log (KK_LOG_WARNING, "Too many tracks in buffer.");
+    return -1;
+  }
+
+  mark = player->marks.items + (head % KK_PLAYER_MAX_MARKS);
+  mark->pos = kk_ringbuffer_get_write_pos (player->buffer);
+  mark->file = file;
+  mark->duration = ((file) && (player->input)) ? kk_input_get_duration (player->input) : 0.0;
+  mark->rate = player->format.sample_rate;
+  __atomic_store_n (&player->marks.head, head + 1, __ATOMIC_SEQ_CST);
+
+  /* The output thread might be waiting for data that never comes */
+  player_output_request (player, KK_PLAYER_OUTPUT_MARK);
+  return 0;
+}
+
+/**
+ * Returns the mark the output thread has to handle next or NULL.
+ */
+static kk_player_mark_t *
+player_mark_peek (kk_player_t *player)
+{
+  const size_t head = __atomic_load_n (&player->marks.head, __ATOMIC_SEQ_CST);
+  const size_t tail = player->marks.tail;
+
+  if (head == tail)
+    return NULL;
+  return player->marks.items + (tail % KK_PLAYER_MAX_MARKS);
+}
+
+static void
+player_mark_pop (kk_player_t *player)
+{
+  __atomic_store_n (&player->marks.tail, player->marks.tail + 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Returns the mark the decoder thread added last if the output thread didn't
+ * reach it yet, NULL otherwise. Only the decoder thread may call this.
+ */
+static kk_player_mark_t *
+player_mark_pending (kk_player_t *player)
+{
+  const size_t head = player->marks.head;
+  const size_t tail = __atomic_load_n (&player->marks.tail, __ATOMIC_SEQ_CST);
+
+  if (head == tail)
+    return NULL;
+  return player->marks.items + ((head - 1) % KK_PLAYER_MAX_MARKS);
+}
+
+/**
+ * Sends the events of all marks the output thread reached. If the buffer gets
+ * flushed, the marks get dropped without sending any events. Whoever
+ * flushed the buffer knows what the user hears next. Reached marks become
+ * the next anchor of the clock, which takes over once the user hears it.
+ */
+static void
+player_output_marks (kk_player_t *player, int flush)
+{
+  const size_t pos = kk_ringbuffer_get_read_pos (player->buffer);
+
+  kk_player_mark_t *mark;
+
+  while ((mark = player_mark_peek (player)) != NULL) {
+    if ((!flush) && ((ssize_t) (pos - mark->pos) < 0))
+      break;
+
+    if (!flush) {
+      if (mark->file)
+        kk_player_event_start (player->events, mark->file);
+      else
+        kk_player_event_stop (player->events);
+
+      player->clock.next.pos = mark->pos;
+      player->clock.next.time = 0.0;
+      player->clock.next.duration = mark->duration;
+      player->clock.next.rate = mark->rate;
+      player->clock.pending = 1;
+    }
+    player_mark_pop (player);
+  }
+}
+
+/**
+ * Makes the output thread discard all buffered samples and drop the
+ * samples queued in the device. Returns after the output thread is done.
+ * The clock continues at time seconds of a track with the given duration.
+ */
+static void
+player_output_flush (kk_player_t *player, double time, double duration)
+{
+  pthread_mutex_lock (&player->output.mutex);
+  player->output.flush.time = time;
+  player->output.flush.duration = duration;
+  player->output.flush.rate = player->format.sample_rate;
+  pthread_mutex_unlock (&player->output.mutex);
+
+  player_output_request (player, KK_PLAYER_OUTPUT_FLUSH);
+
+  pthread_mutex_lock (&player->output.mutex);
+  while (__atomic_load_n (&player->output.request, __ATOMIC_SEQ_CST) & KK_PLAYER_OUTPUT_FLUSH)
+    pthread_cond_wait (&player->output.cond, &player->output.mutex);
+  pthread_mutex_unlock (&player->output.mutex);
+}
+
+static void
+player_output_write (kk_player_t *player, size_t fill)
+{
+  const size_t stride = __atomic_load_n (&player->stride, __ATOMIC_SEQ_CST);
+  const size_t chunk = __atomic_load_n (&player->chunk, __ATOMIC_SEQ_CST);
+
+  kk_player_mark_t *mark;
+  kk_frame_t frame;
+  void *data = NULL;
+  size_t len;
+  int copied = 0;
+
+  if (stride == 0)
+    return;
+
+  /**
+   * Don't write past the next mark, so that its event gets sent right
+   * before the device gets the first samples of the track.
+   */
+  mark = player_mark_peek (player);
+  if (mark) {
+    len = mark->pos - kk_ringbuffer_get_read_pos (player->buffer);
+    if (len < fill)
+      fill = len;
+  }
+
+  /**
+   * Usually we pass the samples to the device right from the buffer. Only if
+   * a sample frame wraps around the end of the buffer, we have to copy the
+   * samples first.
+   */
+  len = kk_ringbuffer_peek (player->buffer, &data);
+  if (len > fill)
+    len = fill;
+  if (len > chunk)
+    len = chunk;
+  len -= len % stride;
+
+  if (len == 0) {
+    len = (fill < chunk) ? fill : chunk;
+    len -= len % stride;
+    len = kk_ringbuffer_read (player->buffer, player->output.buffer, len);
+    data = player->output.buffer;
+    copied = 1;
+  }
+
+  if (len == 0)
+    return;
+
+  memset (&frame, 0, sizeof (kk_frame_t));
+  frame.size = len;
+  frame.samples = len / stride;
+  frame.planes = 1;
+  frame.data[0] = (uint8_t *) data;
+
+  if (kk_device_write (player->device, &frame) != 0)
+    kk_log (KK_LOG_WARNING, "Writing %zu bytes to device failed.", len);
+
+  if (!copied)
+    kk_ringbuffer_skip (player->buffer, len);
+}
+
+/**
+ * Only the output thread writes the clock. It makes the sequence number odd
+ * before it changes the values and even again afterwards. Readers retry
+ * until they read the same even sequence number before and after reading
+ * the values.
+ */
+static void
+player_clock_publish (kk_player_t *player, double time, double duration)
+{
+  const unsigned seq = player->clock.seq;
+
+  __atomic_store_n (&player->clock.seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  __atomic_store (&player->clock.time, &time, __ATOMIC_RELAXED);
+  __atomic_store (&player->clock.duration, &duration, __ATOMIC_RELAXED);
+  __atomic_store_n (&player->clock.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * The user hears the sample the device got delay sample frames before the
+ * current read position. Backends which can't tell their delay make the
+ * clock run ahead by the size of the device buffer.
+ */
+static void
+player_output_clock (kk_player_t *player)
+{
+  const size_t stride = __atomic_load_n (&player->stride, __ATOMIC_SEQ_CST);
+
+  kk_player_anchor_t *anchor = &player->clock.current;
+  size_t delay = 0;
+  size_t pos;
+  double time;
+
+  if (stride == 0)
+    return;
+
+  if (kk_device_delay (player->device, &delay) != 0)
+    delay = 0;
+  pos = kk_ringbuffer_get_read_pos (player->buffer) - delay * stride;
+
+  if ((player->clock.pending) && ((ssize_t) (pos - player->clock.next.pos) >= 0)) {
+    memcpy (anchor, &player->clock.next, sizeof (kk_player_anchor_t));
+    player->clock.pending = 0;
+  }
+
+  time = anchor->time;
+  if (((ssize_t) (pos - anchor->pos) > 0) && (anchor->rate > 0))
+    time += (double) ((pos - anchor->pos) / stride) / (double) anchor->rate;
+  if ((anchor->duration > 0.0) && (time > anchor->duration))
+    time = anchor->duration;
+
+  player_clock_publish (player, time, anchor->duration);
+}
+
+static double
+player_output_latency (double time)
+{
+  return (player_get_time () - time) * 1000.0;
+}
+
+/**
+ * If the device can pause, it stops right away and keeps the samples it
+ * already has. Otherwise the output thread just stops writing and the
+ * device plays what it has.
+ */
+static void *
+player_output (kk_player_t *player)
+{
+  kk_player_anchor_t flush;
+  double time;
+  size_t fill;
+  int request;
+  int paused;
+  int device_paused = 0;
+
+  kk_realtime_setup_thread ("output", 1);
+
+  for (;;) {
+    pthread_mutex_lock (&player->output.mutex);
+    for (;;) {
+      request = __atomic_load_n (&player->output.request, __ATOMIC_SEQ_CST);
+      paused = player->pause;
+      if ((request) || (!paused) || (paused != device_paused))
+        break;
+      pthread_cond_wait (&player->output.cond, &player->output.mutex);
+    }
+    time = player->output.time;
+    memcpy (&flush, &player->output.flush, sizeof (kk_player_anchor_t));
+    pthread_mutex_unlock (&player->output.mutex);
+
+    if (request & KK_PLAYER_OUTPUT_QUIT)
+      break;
+
+    if (request & KK_PLAYER_OUTPUT_FLUSH) {
+      kk_ringbuffer_skip (player->buffer, kk_ringbuffer_get_fill (player->buffer));
+      kk_device_drop (player->device);
+      player_output_marks (player, 1);
+
+      flush.pos = kk_ringbuffer_get_read_pos (player->buffer);
+      memcpy (&player->clock.current, &flush, sizeof (kk_player_anchor_t));
+      player->clock.pending = 0;
+      player_clock_publish (player, flush.time, flush.duration);
+      kk_log (KK_LOG_DEBUG, "Flushed device after %.1f ms.", player_output_latency (time));
+
+      pthread_mutex_lock (&player->output.mutex);
+      __atomic_and_fetch (&player->output.request, ~KK_PLAYER_OUTPUT_FLUSH, __ATOMIC_SEQ_CST);
+      pthread_cond_broadcast (&player->output.cond);
+      pthread_mutex_unlock (&player->output.mutex);
+      continue;
+    }
+
+    __atomic_and_fetch (&player->output.request,
+        ~(KK_PLAYER_OUTPUT_MARK | KK_PLAYER_OUTPUT_PAUSE), __ATOMIC_SEQ_CST);
+    player_output_marks (player, 0);
+
+    if (paused != device_paused) {
+      if (kk_device_pause (player->device, paused) == 0)
+        kk_log (KK_LOG_DEBUG, "%s device after %.1f ms.",
+            (paused) ? "Paused" : "Resumed", player_output_latency (time));
+      device_paused = paused;
+    }
+
+    if (paused)
+      continue;
+
+    fill = kk_ringbuffer_wait_fill (player->buffer, 1, &player->output.request);
+    if (fill > 0) {
+      player_output_write (player, fill);
+      player_output_clock (player);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Before the decoder thread decodes a frame, it waits until the buffer has
+ * enough space for a frame as large as the previous one. This way it
+ * usually doesn't have to wait for space halfway through a frame, where it
+ * can't execute commands.
+ */
+static void
+player_buffer_wait (kk_player_t *player)
+{
+  size_t need = player->need;
+
+  if (need > kk_ringbuffer_get_size (player->buffer))
+    need = kk_ringbuffer_get_size (player->buffer);
+  kk_ringbuffer_wait_space (player->buffer, need, &player->abort);
+}
+
+/**
+ * Writes the samples to the buffer. Blocks while the buffer is full.
+ * Returns -1 if someone wants to abort the decoding.
+ */
+static int
+player_buffer_write (kk_player_t *player, const uint8_t *data, size_t len)
+{
+  const size_t stride = player->stride;
+
+  size_t out;
+
+  if (stride == 0)
+    return -1;
+
+  player->need = len;
+  while (len > 0) {
+    out = kk_ringbuffer_wait_space (player->buffer, stride, &player->abort);
+    if (player_is_aborted (player))
+      return -1;
+
+    if (out > len)
+      out = len;
+    out -= out % stride;
+
+    out = kk_ringbuffer_write (player->buffer, data, out);
+    data += out;
+    len -= out;
+  }
+  return 0;
+}
+
+/**
+ * The fade buffer is a ring buffer as well, but only the decoder thread
+ * uses it. Its size is a multiple of stride, so every piece in it consists
+ * of whole sample frames.
+ */
+static void
+player_fade_reset (kk_player_t *player)
+{
+  player->fade.head = 0;
+  player->fade.fill = 0;
+  player->fade.pos = 0;
+  player->fade.len = 0;
+}
+
+static void
+player_fade_setup (kk_player_t *player)
+{
+  const size_t stride = player->stride;
+
+  size_t window = 0;
+  size_t size = 0;
+
+  player_fade_reset (player);
+
+  if ((stride != 0) && (player->crossfade > 0.0f)
+      && (kk_mix_is_supported (&player->format)))
+    window = (size_t) (player->crossfade * (float) player->format.sample_rate) * stride;
+
+  if (window != 0) {
+    size = window + KK_PLAYER_CHUNK_SIZE;
+    size += (stride - size % stride) % stride;
+  }
+
+  if (size != player->fade.size) {
+    free (player->fade.data);
+    player->fade.data = NULL;
+    if (size != 0) {
+      player->fade.data = calloc (size, sizeof (uint8_t));
+      if (player->fade.data == NULL) {
+        kk_log (KK_LOG_WARNING, "Allocating crossfade buffer failed.");
+        window = 0;
+        size = 0;
+      }
+    }
+  }
+
+  player->fade.size = size;
+  player->fade.window = window;
+}
+
+/**
+ * Moves samples from the fade buffer to the buffer until only keep bytes
+ * are left.
+ */
+static int
+player_fade_commit (kk_player_t *player, size_t keep)
+{
+  size_t len;
+
+  while (player->fade.fill > keep) {
+    len = player->fade.size - player->fade.head;
+    if (len > player->fade.fill - keep)
+      len = player->fade.fill - keep;
+
+    if (player_buffer_write (player, player->fade.data + player->fade.head, len) != 0)
+      return -1;
+
+    player->fade.head = (player->fade.head + len) % player->fade.size;
+    player->fade.fill -= len;
+  }
+  return 0;
+}
+
+/**
+ * While a crossfade runs, the tail of the previous track sits at the front
+ * of the fade buffer. The samples of the next track get mixed into it and
+ * the result goes straight to the buffer. If src is NULL, the tail just
+ * fades out. Returns the number of bytes of src used up or -1 if someone
+ * wants to abort.
+ */
+static ssize_t
+player_fade_mix (kk_player_t *player, const uint8_t *src, size_t len)
+{
+  const size_t block = KK_PLAYER_FADE_FRAMES * player->stride;
+
+  uint8_t *dst;
+  size_t used = 0;
+  size_t n;
+  float t;
+
+  while ((len > 0) && (player->fade.pos < player->fade.len)) {
+    dst = player->fade.data + player->fade.head;
+
+    n = player->fade.size - player->fade.head;
+    if (n > player->fade.len - player->fade.pos)
+      n = player->fade.len - player->fade.pos;
+    if (n > block)
+      n = block;
+    if (n > len)
+      n = len;
+
+    t = ((float) player->fade.pos + (float) n * 0.5f) / (float) player->fade.len;
+    if (src)
+      kk_mix (&player->format, dst, src + used, n, kk_mix_gain (1.0f - t), kk_mix_gain (t));
+    else
+      kk_mix (&player->format, dst, dst, n, kk_mix_gain (1.0f - t), 0.0f);
+
+    if (player_buffer_write (player, dst, n) != 0)
+      return -1;
+
+    player->fade.head = (player->fade.head + n) % player->fade.size;
+    player->fade.fill -= n;
+    player->fade.pos += n;
+    used += n;
+    len -= n;
+  }
+  return (ssize_t) used;
+}
+
+/**
+ * Fades out what's left of a running crossfade and moves all samples to the
+ * buffer. This happens if the next track ends before the crossfade does or
+ * if there's no next track to fade into.
+ */
+static int
+player_fade_flush (kk_player_t *player)
+{
+  if (player->fade.pos < player->fade.len) {
+    if (player_fade_mix (player, NULL, player->fade.len - player->fade.pos) < 0)
+      return -1;
+  }
+  player->fade.pos = 0;
+  player->fade.len = 0;
+  return player_fade_commit (player, 0);
+}
+
+/**
+ * Starts a crossfade between the samples in the fade buffer and the samples
+ * the decoder thread produces next.
+ */
+static int
+player_fade_start (kk_player_t *player)
+{
+  if (player->fade.window == 0)
+    return 0;
+
+  if (player->fade.pos < player->fade.len) {
+    if (player_fade_flush (player) != 0)
+      return -1;
+  }
+  player->fade.pos = 0;
+  player->fade.len = player->fade.fill;
+  return 0;
+}
+
+/**
+ * Without crossfading, the samples go straight to the buffer. Otherwise
+ * they get mixed into a running crossfade or go through the fade buffer.
+ */
+static int
+player_buffer_push (kk_player_t *player, const uint8_t *data, size_t len)
+{
+  ssize_t used;
+  size_t tail;
+  size_t n;
+
+  if (player->fade.window == 0)
+    return player_buffer_write (player, data, len);
+
+  used = player_fade_mix (player, data, len);
+  if (used < 0)
+    return -1;
+
+  data += used;
+  len -= (size_t) used;
+
+  while (len > 0) {
+    tail = (player->fade.head + player->fade.fill) % player->fade.size;
+
+    n = player->fade.size - tail;
+    if (n > player->fade.size - player->fade.fill)
+      n = player->fade.size - player->fade.fill;
+    if (n > len)
+      n = len;
+
+    memcpy (player->fade.data + tail, data, n);
+    player->fade.fill += n;
+    data += n;
+    len -= n;
+
+    if (player_fade_commit (player, player->fade.window) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * The buffer only holds interleaved samples in the format of the device. The
+ * samples of frame stay valid until the next kk_input_get_frames call, so
+ * they have to be written to the buffer before the next frames get decoded.
+ */
+static int
+player_buffer_write_frame (kk_player_t *player, kk_frame_t *frame)
+{
+  uint8_t *data = frame->data[0];
+  size_t len = frame->size;
+
+  if (len == 0)
+    return 0;
+
+  if (frame->planes > 1) {
+    if (kk_frame_interleave (player->frame, frame, &player->convert->src) != 0)
+      return -1;
+    data = player->frame->data[0];
+  }
+
+  if (kk_convert_is_needed (player->convert)) {
+    len = kk_convert_get_size (player->convert, frame->size);
+    if (kk_frame_reserve (player->converted, 1, len) != 0)
+      return -1;
+    len = kk_convert (player->convert, player->converted->data[0], data, frame->size);
+    data = player->converted->data[0];
+  }
+  return player_buffer_push (player, data, len);
+}
+
+static int
+player_open_file (kk_library_file_t *file, kk_input_t **input,
+    kk_format_t *format)
+{
+  char *path = NULL;
+  size_t len;
+  size_t out;
+
+  len = 512;
+  path = calloc (len, sizeof (char));
+  if (path == NULL)
+    goto error;
+
+  out = kk_library_file_get_path (file, path, len);
+  if (out >= len) {
+    if (out >= 8192)
+      goto error;
+
+    /* Contains truncated stuff - useless */
+    free (path);
+
+    /* Try one last time */
+    len = out + 1;
+    path = calloc (len, sizeof (char));
+    if (path == NULL)
+      goto error;
+
+    out = kk_library_file_get_path (file, path, len);
+    if (out >= len)
+      goto error;
+  }
+
+  if (kk_input_init (input, path) < 0) {
+    kk_log (KK_LOG_WARNING, "Could not open file '%s'...", path);
+    goto error;
+  }
+
+  memset (format, 0, sizeof (kk_format_t));
+  if (kk_input_get_format (*input, format)) {
+    kk_log (KK_LOG_WARNING, "Could not determine format of file '%s'...",
+        path);
+    goto error;
+  }
+
+  kk_log (KK_LOG_DEBUG, "Detected audio format of '%s':", file->name);
+  kk_log (KK_LOG_ATTACH, "Byte Order: %s",
+      kk_format_get_byte_order_str (format));
+  kk_log (KK_LOG_ATTACH, "Channels: %d",
+      kk_format_get_channels (format));
+  kk_log (KK_LOG_ATTACH, "Datatype: %d bits %s",
+      kk_format_get_bits (format), kk_format_get_type_str (format));
+  kk_log (KK_LOG_ATTACH, "Layout: %s",
+      kk_format_get_layout_str (format));
+
+  /* Planar samples get interleaved before they enter the buffer */
+  format->layout = KK_LAYOUT_INTERLEAVED;
+
+  free (path);
+  return 0;
+error:
+  if (*input)
+    kk_input_free (*input);
+  *input = NULL;
+  free (path);
+  return -1;
+}
+
+/**
+ * Opens the next playable track of the queue as next input.
+ */
+static int
+player_open_next (kk_player_t *player)
+{
+  kk_player_item_t item;
+
+  if (player->next.input)
+    return 0;
+
+  memset (&item, 0, sizeof (kk_player_item_t));
+  while (kk_player_queue_pop (player->queue, &item) == 0) {
+    if (player_open_file (item.file, &player->next.input, &player->next.format) == 0) {
+      player->next.file = item.file;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void
+player_close_next (kk_player_t *player)
+{
+  if (player->next.input)
+    kk_input_free (player->next.input);
+  player->next.input = NULL;
+  player->next.file = NULL;
+}
+
+static void
+player_close_prev (kk_player_t *player)
+{
+  if (player->prev.input)
+    kk_input_free (player->prev.input);
+  player->prev.input = NULL;
+}
+
+/**
+ * Keeps the current input open as prev, since the user still hears it.
+ */
+static void
+player_keep_prev (kk_player_t *player, kk_format_t *format)
+{
+  player_close_prev (player);
+  player->prev.input = player->input;
+  memcpy (&player->prev.format, format, sizeof (kk_format_t));
+  player->input = NULL;
+}
+
+/**
+ * Waits until the output thread read everything up to buffer position pos.
+ * Returns -1 if someone posted a command that drops the current position
+ * while we were waiting.
+ */
+static int
+player_buffer_wait_pos (kk_player_t *player, size_t pos)
+{
+  const size_t size = kk_ringbuffer_get_size (player->buffer);
+
+  size_t ahead;
+
+  ahead = kk_ringbuffer_get_write_pos (player->buffer) - pos;
+  if (ahead >= size)
+    return 0;
+
+  kk_ringbuffer_wait_space (player->buffer, size - ahead, &player->abort);
+  if (player_is_aborted (player))
+    return -1;
+  return 0;
+}
+
+static size_t
+player_get_stride (kk_format_t *format)
+{
+  return (size_t) (kk_format_get_channels (format)
+      * (kk_format_get_bits (format) >> 3));
+}
+
+static int
+player_has_format (kk_format_t *formats, size_t count, kk_format_t *format)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (kk_format_equal (formats + i, format))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Fills formats with the device formats samples in the given format can be
+ * played in, best first. With a fixed sample rate, all of them use that
+ * rate. If the number of channels is limited, formats with more channels
+ * get mixed down. Returns the number of formats.
+ */
+static size_t
+player_get_formats (kk_player_t *player, kk_format_t *format,
+    kk_format_t *formats)
+{
+  size_t count;
+  size_t result = 0;
+  size_t i;
+
+  count = kk_convert_get_formats (format, formats, KK_CONVERT_MAX_FORMATS);
+  for (i = 0; i < count; i++) {
+    if (player->rate != 0)
+      formats[i].sample_rate = player->rate;
+    if ((player->channels != 0)
+        && (kk_format_get_channels (formats + i) > (int) player->channels))
+      kk_format_set_channels (formats + i, (int) player->channels);
+    if ((kk_device_is_supported (player->device, formats + i))
+        && (!player_has_format (formats, result, formats + i)))
+      memmove (formats + result++, formats + i, sizeof (kk_format_t));
+  }
+  return result;
+}
+
+/**
+ * Sets up the device for samples in the given format. If the device can't
+ * play them, we try the formats the samples can be converted to.
+ */
+static int
+player_setup (kk_player_t *player, kk_format_t *format)
+{
+  kk_format_t formats[KK_CONVERT_MAX_FORMATS];
+  size_t stride = 0;
+  size_t chunk = 0;
+  size_t count;
+  size_t i;
+  int ret = -1;
+
+  count = player_get_formats (player, format, formats);
+  for (i = 0; (i < count) && (ret != 0); i++) {
+    memcpy (&player->format, formats + i, sizeof (kk_format_t));
+    ret = kk_device_setup (player->device, &player->format);
+    if ((ret == 0) && (kk_convert_setup (player->convert, format, &player->format) != 0))
+      ret = -1;
+  }
+
+  if (ret != 0)
+    kk_log (KK_LOG_WARNING, "Setting up device failed.");
+  else {
+    stride = player_get_stride (&player->format);
+    chunk = stride * (size_t) (KK_PLAYER_CHUNK_TIME * player->format.sample_rate);
+    if (chunk > KK_PLAYER_CHUNK_SIZE)
+      chunk = KK_PLAYER_CHUNK_SIZE;
+    if (chunk < stride)
+      chunk = stride;
+  }
+
+  __atomic_store_n (&player->chunk, chunk, __ATOMIC_SEQ_CST);
+  __atomic_store_n (&player->stride, stride, __ATOMIC_SEQ_CST);
+  player_fade_setup (player);
+
+  if (stride != 0) {
+    stride = player_get_stride (format);
+    kk_frame_pool_reserve (player->pool, KK_PLAYER_FRAME_SAMPLES * stride, 1);
+    if (kk_convert_is_needed (player->convert))
+      kk_frame_pool_reserve (player->pool,
+          kk_convert_get_size (player->convert, KK_PLAYER_FRAME_SAMPLES * stride), 1);
+  }
+  return ret;
+}
+
+/**
+ * Checks whether samples in the given format can go to the device without
+ * setting it up again. That's the case if the format didn't change or if
+ * the samples end up in the current device format anyway.
+ */
+static int
+player_can_continue (kk_player_t *player, kk_format_t *format)
+{
+  kk_format_t formats[KK_CONVERT_MAX_FORMATS];
+
+  if (player->stride == 0)
+    return 0;
+  if (kk_format_equal (&player->convert->src, format))
+    return 1;
+  return (player_get_formats (player, format, formats) > 0)
+      && (kk_format_equal (formats, &player->format));
+}
+
+/**
+ * Switches from the current input to the next one. If the format of the
+ * next track differs from the current format, we have to wait until the
+ * device played all buffered samples before we can set it up again.
+ * Otherwise the samples of the next track go right behind the samples of
+ * the current track.
+ */
 static void
-player_worker_cleanup (kk_player_t *player)
+player_advance (kk_player_t *player)
+{
+  kk_player_mark_t *mark;
+
+  /**
+   * The current input becomes prev, which has to be the track the user
+   * hears. So the output thread must have reached the current track first.
+   * If someone stopped or seeked in the meantime, we try again later.
+   */
+  if ((player->input) && ((mark = player_mark_pending (player)) != NULL)) {
+    if (player_buffer_wait_pos (player, mark->pos) != 0)
+      return;
+  }
+
+  for (;;) {
+    if (player_open_next (player) != 0) {
+      /* Nothing left to play */
+      if (player->input) {
+        if (player_fade_flush (player) != 0)
+          return;
+        player_keep_prev (player, &player->convert->src);
+        player_mark (player, NULL);
+      }
+      return;
+    }
+
+    if (player_can_continue (player, &player->next.format))
+      break;
+
+    /* If someone stopped or seeked, we keep next input for later */
+    if (player_fade_flush (player) != 0)
+      return;
+    if (player_buffer_wait_pos (player, kk_ringbuffer_get_write_pos (player->buffer)) != 0)
+      return;
+
+    /* Everything got played, there's no previous track anymore */
+    player_close_prev (player);
+    if (player->input)
+      kk_input_free (player->input);
+    player->input = NULL;
+
+    if (player->stride != 0)
+      kk_device_drain (player->device);
+
+    if (player_setup (player, &player->next.format) == 0)
+      break;
+
+    player_close_next (player);
+  }
+
+  if (player_fade_start (player) != 0)
+    return;
+
+  if (player->input)
+    player_keep_prev (player, &player->convert->src);
+
+  if ((!kk_format_equal (&player->convert->src, &player->next.format))
+      && (kk_convert_setup (player->convert, &player->next.format, &player->format) != 0)) {
+    player_close_next (player);
+    if (player_fade_flush (player) == 0)
+      player_mark (player, NULL);
+    return;
+  }
+
+  kk_log (KK_LOG_DEBUG, "Starting '%s' after %zu frame allocations.",
+      player->next.file->name, kk_frame_pool_get_allocs (player->pool));
+
+  player->input = player->next.input;
+  player_mark (player, player->next.file);
+  player->next.input = NULL;
+  player->next.file = NULL;
+}
+
+/**
+ * The following functions execute the commands. The decoder thread calls
+ * them between two frames.
+ */
+static int
+player_start (kk_player_t *player)
+{
+  /* Already playing? Not an error. */
+  if (player->input)
+    return 0;
+
+  /* Queue empty? We consider that an error. */
+  if ((player->next.input == NULL) && (kk_player_queue_is_empty (player->queue)))
+    return -1;
+
+  player->start = 1;
+  pthread_mutex_lock (&player->output.mutex);
+  player->pause = 0;
+  pthread_mutex_unlock (&player->output.mutex);
+  player_output_request (player, KK_PLAYER_OUTPUT_PAUSE);
+  return 0;
+}
+
+static int
+player_stop (kk_player_t *player)
+{
+  if ((player->input == NULL) && (kk_ringbuffer_get_fill (player->buffer) == 0))
+    return 0;
+
+  player_output_flush (player, 0.0, 0.0);
+  player_fade_reset (player);
+  kk_convert_reset (player->convert);
+  if (player->input)
+    kk_input_free (player->input);
+  player->input = NULL;
+  player_close_prev (player);
+  kk_player_event_stop (player->events);
+  return 0;
+}
+
+/**
+ * Seeks to time seconds if time isn't negative, otherwise to perc of the
+ * current track. Either way, the samples of the old position still in the
+ * buffer or the device get dropped.
+ */
+static int
+player_seek (kk_player_t *player, float perc, double time)
+{
+  kk_player_mark_t *mark;
+  double duration;
+
+  /**
+   * If the output thread didn't reach the last mark yet, the user hears the
+   * previous track. The current input goes back to the next slot and
+   * becomes the next track again.
+   */
+  mark = player_mark_pending (player);
+  if ((mark) && (player->prev.input)) {
+    if (player->input) {
+      kk_input_seek (player->input, 0.0f);
+      player->next.input = player->input;
+      player->next.file = mark->file;
+      memcpy (&player->next.format, &player->convert->src, sizeof (kk_format_t));
+    }
+    player->input = player->prev.input;
+    player->prev.input = NULL;
+
+    /**
+     * Like a next track we can't convert, the previous track gets closed.
+     * Everything buffered belongs to the old position, so the track that
+     * went back to the next slot starts over.
+     */
+    if (kk_convert_setup (player->convert, &player->prev.format, &player->format) != 0) {
+      kk_input_free (player->input);
+      player->input = NULL;
+      player->start = 1;
+      player_output_flush (player, 0.0, 0.0);
+      player_fade_reset (player);
+      return 0;
+    }
+  }
+
+  if (player->input == NULL)
+    return 0;
+
+  duration = kk_input_get_duration (player->input);
+  if (time >= 0.0) {
+    perc = (duration > 0.0) ? (float) (time / duration) : 0.0f;
+    kk_input_seek_time (player->input, time);
+  }
+  else {
+    time = (double) perc * duration;
+    kk_input_seek (player->input, perc);
+  }
+
+  player_output_flush (player, time, duration);
+  player_fade_reset (player);
+  kk_convert_reset (player->convert);
+  kk_player_event_seek (player->events, perc);
+  return 0;
+}
+
+static int
+player_next (kk_player_t *player)
+{
+  kk_player_mark_t *mark;
+
+  /**
+   * If the decoder thread already moved on to the next track, the user still
+   * hears the previous one. Skipping it means dropping the buffered samples
+   * and starting the current input from the beginning.
+   */
+  mark = player_mark_pending (player);
+  if ((player->input) && (mark) && (mark->file)) {
+    kk_player_event_start (player->events, mark->file);
+    kk_input_seek (player->input, 0.0f);
+    player_output_flush (player, 0.0, kk_input_get_duration (player->input));
+    player_fade_reset (player);
+    kk_convert_reset (player->convert);
+    player_close_prev (player);
+    return 0;
+  }
+
+  if (player_stop (player) != 0)
+    return -1;
+  return player_start (player);
+}
+
+/**
+ * Executes all pending commands. Returns -1 if the decoder thread has to
+ * quit.
+ */
+static int
+player_run_commands (kk_player_t *player)
 {
-  pthread_mutex_unlock (&player->mutex);
+  kk_player_command_t cmd;
+  int ret;
+
+  while (kk_player_commands_pop (player->commands, &cmd) == 0) {
+    switch (cmd.type) {
+      case KK_PLAYER_COMMAND_NEXT:
+        ret = player_next (player);
+        break;
+      case KK_PLAYER_COMMAND_QUIT:
+        return -1;
+      case KK_PLAYER_COMMAND_SEEK:
+        ret = player_seek (player, cmd.perc, cmd.time);
+        break;
+      case KK_PLAYER_COMMAND_START:
+        ret = player_start (player);
+        break;
+      case KK_PLAYER_COMMAND_STOP:
+        ret = player_stop (player);
+        break;
+      default:
+        ret = -1;
+        break;
+    }
+
+    if (cmd.type != KK_PLAYER_COMMAND_START)
+      player_abort_end (player);
+    kk_player_event_done (player->events, cmd.type, ret);
+  }
+  return 0;
 }
 
 static void *
@@ -12,85 +1194,108 @@ player_worker (kk_player_t *player)
 {
   const int max_retries = 3;
 
-  pthread_cleanup_push ((void (*)(void *)) player_worker_cleanup, player);
+  kk_frame_t frames[KK_INPUT_MAX_FRAMES];
+  int s;
+  int e;
+  int i;
+
+  kk_realtime_setup_thread ("decoder", 0);
 
   for (;;) {
-    int d = 0;
+    if (player_run_commands (player) != 0)
+      break;
 
-    for (;;) {
-      int s = 0;
-      int e = 0;
+    /* Nothing to do until someone asks us to start playing */
+    if ((player->input == NULL) && (!player->start)) {
+      kk_player_commands_wait (player->commands);
+      continue;
+    }
 
-      kk_frame_t frame;
+    /**
+     * Commands which drop the current position abort the wait, so that
+     * we execute them before decoding anything else.
+     */
+    player_buffer_wait (player);
+    if (player_is_aborted (player))
+      continue;
 
-      /**
-       * We lock our mutex and check if the input field is NULL. If it is,
-       * we call pthread_cond_wait (with mutex still locked). Every call of
-       * pthread_cond_wait releases the mutex and locks our thread on the
-       * condition variable. Thus other threads are able to aquire the mutex.
-       * These other threads hopefully assign something to input and wake us
-       * with a pthread_cond_signal call. This call causes pthread_cond_wait
-       * to return with mutex locked. Then we try to read a frame from input
-       * and write it to the output device. Releasing the mutex before writing
-       * our frame to the input device allows other threads to change input
-       * in the meantime.
-       */
-      pthread_mutex_lock (&player->mutex);
-      while ((player->input == NULL) || (player->pause)) {
-        pthread_cond_wait (&player->cond, &player->mutex);
-      }
+    s = 0;
+    e = 0;
 
+    if (player->input == NULL) {
+      player->start = 0;
+      player_advance (player);
+    }
+    else {
       /**
        * Done decoding a frame. This should work on the first try,
        * but sometimes it doesn't. In this case the loop handles these
        * errors pretty well and the user won't notice them at all. Unless
        * something is very wrong and we give up.
        */
-      pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
-
       for (e = 0; e < max_retries; e++) {
-        if ((s = kk_input_get_frame (player->input, &frame)) >= 0)
+        if ((s = kk_input_get_frames (player->input, frames, KK_INPUT_MAX_FRAMES)) >= 0)
           break;
         kk_log (KK_LOG_WARNING,
             "Error while reading and decoding frame (%d). " \
             "Trying to recover.", s);
       }
-      pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
-      pthread_mutex_unlock (&player->mutex);
-
-      /* No data read? Stop */
-      if (s == 0)
-        break;
 
       /**
        * Now if this happened we really failed reading and decoding another
        * frame.
        */
-      if (e == max_retries) {
+      if (e == max_retries)
         kk_log (KK_LOG_WARNING,
             "Reading frame failed %d times. I'm giving up now.", max_retries);
-        break;
+
+      if ((s > 0) && (e < max_retries)) {
+        for (i = 0; i < s; i++) {
+          if (player_buffer_write_frame (player, frames + i) != 0)
+            break;
+        }
       }
+      else
+        player_advance (player);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Commands other than start drop the current position. They abort whatever
+ * the decoder thread is waiting for, so that it gets to them right away.
+ */
+static int
+player_post (kk_player_t *player, int type, float perc, double time)
+{
+  kk_player_command_t cmd;
 
-      /* Don't send this event too often */
-      if ((++d & 0x7f) == 0)
-        kk_player_event_progress (player->events, frame.prog);
+  memset (&cmd, 0, sizeof (kk_player_command_t));
+  cmd.type = type;
+  cmd.perc = perc;
+  cmd.time = time;
 
-      kk_device_write (player->device, &frame);
-    }
+  if (type != KK_PLAYER_COMMAND_START)
+    player_abort_begin (player);
 
-    kk_player_next (player);
+  if (kk_player_commands_push (player->commands, &cmd) != 0) {
+    if (type != KK_PLAYER_COMMAND_START)
+      player_abort_end (player);
+    kk_log (KK_LOG_WARNING, "Too many pending player commands.");
+    return -1;
   }
-
-  /* Basically unreachable, yes */
-  pthread_cleanup_pop (0);
-  return NULL;
+  return 0;
 }
 
 int
 kk_player_init (kk_player_t **player)
 {
   kk_player_t *result;
+  long size;
+  long rate;
+  long channels;
+  int quality;
 
   result = calloc (1, sizeof (kk_player_t));
   if (result == NULL)
@@ -102,16 +1307,80 @@ kk_player_init (kk_player_t **player)
   if (kk_player_queue_init (&result->queue) != 0)
     goto error;
 
+  if (kk_player_commands_init (&result->commands) != 0)
+    goto error;
+
   if (kk_event_queue_init (&result->events) != 0)
     goto error;
 
-  if (pthread_cond_init (&result->cond, NULL) != 0)
+  size = kk_settings_get_int ("KK_BUFFER_SIZE", KK_PLAYER_BUFFER_SIZE);
+  if (size < KK_PLAYER_CHUNK_SIZE)
+    size = KK_PLAYER_CHUNK_SIZE;
+
+  if (kk_ringbuffer_init (&result->buffer, (size_t) size) != 0)
+    goto error;
+
+  if (kk_frame_pool_init (&result->pool) != 0)
+    goto error;
+
+  if (kk_frame_init_pooled (&result->frame, result->pool) != 0)
+    goto error;
+
+  if (kk_frame_init_pooled (&result->converted, result->pool) != 0)
+    goto error;
+
+  rate = kk_settings_get_int ("KK_SAMPLE_RATE", 0);
+  if ((rate < 0) || (rate > KK_PLAYER_RATE_MAX)) {
+    kk_log (KK_LOG_WARNING, "Ignoring invalid sample rate %ld.", rate);
+    rate = 0;
+  }
+  result->rate = (unsigned int) rate;
+
+  channels = kk_settings_get_int ("KK_CHANNELS", 0);
+  if ((channels < 0) || (channels > KK_FORMAT_MAX_CHANNELS)) {
+    kk_log (KK_LOG_WARNING, "Ignoring invalid number of channels %ld.", channels);
+    channels = 0;
+  }
+  result->channels = (unsigned int) channels;
+
+  quality = kk_resample_get_quality (kk_settings_get_str ("KK_RESAMPLE_QUALITY", "medium"));
+  if (quality < 0) {
+    kk_log (KK_LOG_WARNING, "Unknown resample quality, using medium.");
+    quality = KK_RESAMPLE_MEDIUM;
+  }
+
+  if (kk_convert_init (&result->convert, quality,
+        kk_settings_get_str ("KK_DOWNMIX", NULL)) != 0)
+    goto error;
+
+  result->crossfade = (float) kk_settings_get_float ("KK_CROSSFADE", 0.0);
+  if (result->crossfade < 0.0f)
+    result->crossfade = 0.0f;
+  if (result->crossfade > KK_PLAYER_FADE_MAX)
+    result->crossfade = KK_PLAYER_FADE_MAX;
+
+  result->output.buffer = calloc (KK_PLAYER_CHUNK_SIZE, sizeof (uint8_t));
+  if (result->output.buffer == NULL)
+    goto error;
+
+  /* Lock at least the buffers the output thread touches */
+  if ((kk_realtime_is_enabled ()) && (kk_realtime_lock_memory () != 0)) {
+    kk_realtime_lock ("sample buffer", result->buffer->data, kk_ringbuffer_get_size (result->buffer));
+    kk_realtime_lock ("output buffer", result->output.buffer, KK_PLAYER_CHUNK_SIZE);
+  }
+
+  if (pthread_cond_init (&result->output.cond, NULL) != 0)
+    goto error;
+
+  if (pthread_mutex_init (&result->output.mutex, NULL) != 0)
     goto error;
 
-  if (pthread_mutex_init (&result->mutex, NULL) != 0)
+  if (kk_thread_create (&result->output.thread, NULL,
+        (void *(*)(void *)) player_output, result) != 0)
     goto error;
+  result->output.alive = 1;
 
-  if (pthread_create (&result->thread, NULL,
+  if (kk_thread_create (&result->thread, NULL,
         (void *(*)(void *)) player_worker, result) != 0)
     goto error;
 
@@ -129,177 +1398,108 @@ kk_player_free (kk_player_t *player)
   if (player == NULL)
     return 0;
 
-  if ((player->thread) && (pthread_cancel (player->thread) == 0))
+  /* The decoder thread quits as soon as it sees the command */
+  if (player->thread) {
+    while (player_post (player, KK_PLAYER_COMMAND_QUIT, 0.0f, -1.0) != 0)
+      sched_yield ();
     pthread_join (player->thread, NULL);
+  }
+
+  if (player->output.alive) {
+    player_output_request (player, KK_PLAYER_OUTPUT_QUIT);
+    pthread_join (player->output.thread, NULL);
+  }
+
+  pthread_cond_destroy (&player->output.cond);
+  pthread_mutex_destroy (&player->output.mutex);
 
-  pthread_cond_destroy (&player->cond);
-  pthread_mutex_destroy (&player->mutex);
+  if (player->input)
+    kk_input_free (player->input);
+
+  player_close_prev (player);
+  player_close_next (player);
 
   if (player->queue)
     kk_player_queue_free (player->queue);
 
+  if (player->commands)
+    kk_player_commands_free (player->commands);
+
   if (player->events)
     kk_event_queue_free (player->events);
 
   if (player->device)
     kk_device_free (player->device);
 
-  free (player);
-  return 0;
-}
-
-static int
-player_start (kk_player_t *player)
-{
-  static kk_format_t format;
-
-  char *path = NULL;
-  size_t len;
-  size_t out;
-
-  kk_player_item_t item;
-
-  memset (&item, 0, sizeof (kk_player_item_t));
-  if (kk_player_queue_pop (player->queue, &item) != 0)
-    goto error;
-
-  len = 512;
-  path = calloc (len, sizeof (char));
-  if (path == NULL)
-    goto error;
-
-  out = kk_library_file_get_path (item.file, path, len);
-  if (out >= len) {
-    if (out >= 8192)
-      goto error;
-
-    /* Contains truncated stuff - useless */
-    free (path);
-
-    /* Try one last time */
-    len = out + 1;
-    path = calloc (len, sizeof (char));
-    if (path == NULL)
-      goto error;
-
-    out = kk_library_file_get_path (item.file, path, len);
-    if (out >= len)
-      goto error;
-  }
+  if (player->buffer)
+    kk_ringbuffer_free (player->buffer);
 
-  if (kk_input_init (&player->input, path) < 0) {
-    kk_log (KK_LOG_WARNING, "Could not open file '%s'...", path);
-    goto error;
-  }
+  if (player->frame)
+    kk_frame_free (player->frame);
 
-  memset (&format, 0, sizeof (kk_format_t));
-  if (kk_input_get_format (player->input, &format)) {
-    kk_log (KK_LOG_WARNING, "Could not determine format of file '%s'...",
-        path);
-    goto error;
-  }
+  if (player->converted)
+    kk_frame_free (player->converted);
 
-  kk_log (KK_LOG_DEBUG, "Detected audio format of '%s':", item.file->name);
-  kk_log (KK_LOG_ATTACH, "Byte Order: %s",
-      kk_format_get_byte_order_str (&format));
-  kk_log (KK_LOG_ATTACH, "Channels: %d",
-      kk_format_get_channels (&format));
-  kk_log (KK_LOG_ATTACH, "Datatype: %d bits %s",
-      kk_format_get_bits (&format), kk_format_get_type_str (&format));
-  kk_log (KK_LOG_ATTACH, "Layout: %s",
-      kk_format_get_layout_str (&format));
+  if (player->convert)
+    kk_convert_free (player->convert);
 
-  if (kk_device_setup (player->device, &format)) {
-    kk_log (KK_LOG_WARNING, "Setting up device failed.");
-    goto error;
-  }
+  if (player->pool)
+    kk_frame_pool_free (player->pool);
 
-  kk_player_event_start (player->events, item.file);
-  player->pause = 0;
-  free (path);
+  free (player->output.buffer);
+  free (player->fade.data);
+  free (player);
   return 0;
-error:
-  if (player->input)
-    kk_input_free (player->input);
-  player->input = NULL;
-  free (path);
-  return -1;
 }
 
 int
 kk_player_start (kk_player_t *player)
 {
-  int ret = -1;
-
-  /* Already playing? Not an error. */
-  if (player->input != NULL)
-    return 0;
-
-  /* Queue empty? We consider that an error. */
-  if (kk_player_queue_is_empty (player->queue))
-    return -1;
-
-  pthread_mutex_lock (&player->mutex);
-  while (kk_player_queue_is_filled (player->queue)) {
-    ret = player_start (player);
-    if (ret == 0)
-      break;
-  }
-  if (ret == 0)
-    pthread_cond_signal (&player->cond);
-  pthread_mutex_unlock (&player->mutex);
-  return ret;
+  return player_post (player, KK_PLAYER_COMMAND_START, 0.0f, -1.0);
 }
 
+/**
+ * Doesn't wait for the output thread. It pauses or resumes the device as
+ * soon as it's done with its current write.
+ */
 int
 kk_player_pause (kk_player_t *player)
 {
-  int was_paused = player->pause;
-
   kk_player_event_pause (player->events);
-  pthread_mutex_lock (&player->mutex);
+  pthread_mutex_lock (&player->output.mutex);
   /* Toggle lowest bit */
   player->pause = (player->pause ^ 1) & 1;
-  if (was_paused)
-    pthread_cond_signal (&player->cond);
-  pthread_mutex_unlock (&player->mutex);
+  pthread_mutex_unlock (&player->output.mutex);
+  player_output_request (player, KK_PLAYER_OUTPUT_PAUSE);
   return 0;
 }
 
 int
 kk_player_stop (kk_player_t *player)
 {
-  if (player->input == NULL)
-    return 0;
-
-  kk_player_event_stop (player->events);
-  pthread_mutex_lock (&player->mutex);
-  kk_device_drop (player->device);
-  kk_input_free (player->input);
-  player->input = NULL;
-  pthread_mutex_unlock (&player->mutex);
-  return 0;
+  return player_post (player, KK_PLAYER_COMMAND_STOP, 0.0f, -1.0);
 }
 
 int
 kk_player_seek (kk_player_t *player, float perc)
 {
-  if (player->input == NULL)
-    return 0;
+  if (perc < 0.0f)
+    perc = 0.0f;
+  return player_post (player, KK_PLAYER_COMMAND_SEEK, perc, -1.0);
+}
 
-  pthread_mutex_lock (&player->mutex);
-  kk_input_seek (player->input, perc);
-  kk_player_event_seek (player->events, perc);
-  pthread_mutex_unlock (&player->mutex);
-  return 0;
+int
+kk_player_seek_time (kk_player_t *player, double time)
+{
+  if (time < 0.0)
+    time = 0.0;
+  return player_post (player, KK_PLAYER_COMMAND_SEEK, 0.0f, time);
 }
 
 int
 kk_player_next (kk_player_t *player)
 {
-  if ((player->input) && (kk_player_stop (player) != 0))
-    return -1;
-  return kk_player_start (player);
+  return player_post (player, KK_PLAYER_COMMAND_NEXT, 0.0f, -1.0);
 }
 
 int
@@ -307,3 +1507,42 @@ kk_player_get_event_fd (kk_player_t *player)
 {
   return kk_event_queue_get_read_fd (player->events);
 }
+
+/**
+ * Returns the position the user hears in seconds and the duration of the
+ * track. Both are 0 if nothing plays.
+ */
+int
+kk_player_get_position (kk_player_t *player, double *time, double *duration)
+{
+  unsigned seq;
+
+  for (;;) {
+    seq = __atomic_load_n (&player->clock.seq, __ATOMIC_ACQUIRE);
+    __atomic_load (&player->clock.time, time, __ATOMIC_RELAXED);
+    __atomic_load (&player->clock.duration, duration, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (((seq & 1) == 0) && (seq == __atomic_load_n (&player->clock.seq, __ATOMIC_RELAXED)))
+      break;
+    sched_yield ();
+  }
+  return 0;
+}
+
+int
+kk_player_get_buffer_fill (kk_player_t *player, size_t *fill, size_t *size)
+{
+  *fill = kk_ringbuffer_get_fill (player->buffer);
+  *size = kk_ringbuffer_get_size (player->buffer);
+  return 0;
+}
+
+/**
+ * Returns the number of sample buffers the decoder thread allocated so far.
+ * Once the buffers for the current format exist, this number stops growing.
+ */
+size_t
+kk_player_get_frame_allocs (kk_player_t *player)
+{
+  return kk_frame_pool_get_allocs (player->pool);
+}
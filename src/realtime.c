@@ -0,0 +1,233 @@
+#include <klingklang/realtime.h>
+#include <klingklang/settings.h>
+#include <klingklang/util.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_RESOURCE_H
+#  include <sys/resource.h>
+#endif
+
+/**
+ * Default priority of the output thread. Low enough to leave room for the
+ * threads of the sound server and the kernel's interrupt handlers.
+ */
+#define KK_REALTIME_PRIORITY    20
+
+/**
+ * Number of stack bytes a thread touches before it starts working.
+ */
+#define KK_REALTIME_STACK       (1 << 16)
+
+static size_t
+realtime_get_page_size (void)
+{
+  long size = sysconf (_SC_PAGESIZE);
+
+  return (size > 0) ? (size_t) size : 4096;
+}
+
+/**
+ * Writes to every page of a stack area as large as KK_REALTIME_STACK, so
+ * that the thread doesn't take page faults while it's playing.
+ */
+static void __attribute__ ((noinline))
+realtime_prefault_stack (void)
+{
+  const size_t page = realtime_get_page_size ();
+
+  volatile uint8_t stack[KK_REALTIME_STACK];
+  size_t i;
+
+  for (i = 0; i < sizeof (stack); i += page)
+    stack[i] = 0;
+}
+
+int
+kk_realtime_is_enabled (void)
+{
+  return kk_settings_get_bool ("KK_REALTIME", 0);
+}
+
+int
+kk_realtime_lock_memory (void)
+{
+#if defined(HAVE_MLOCKALL) && defined(HAVE_SYS_RESOURCE_H)
+  struct rlimit lim;
+
+  if ((getrlimit (RLIMIT_MEMLOCK, &lim) != 0) || (lim.rlim_cur != RLIM_INFINITY)) {
+    kk_log (KK_LOG_INFO, "Locking all memory not granted, memory lock limit is set.");
+    return -1;
+  }
+
+  if (mlockall (MCL_CURRENT | MCL_FUTURE) != 0) {
+    kk_log (KK_LOG_INFO, "Locking all memory not granted: %s.", strerror (errno));
+    return -1;
+  }
+
+  kk_log (KK_LOG_INFO, "Locking all memory granted.");
+  return 0;
+#else
+  kk_log (KK_LOG_INFO, "Locking all memory not supported.");
+  return -1;
+#endif
+}
+
+int
+kk_realtime_lock (const char *name, void *ptr, size_t len)
+{
+  const size_t page = realtime_get_page_size ();
+
+  volatile uint8_t *data = (volatile uint8_t *) ptr;
+  size_t i;
+
+  /* Write the same value back, the buffer might be in use already */
+  for (i = 0; i < len; i += page)
+    data[i] = data[i];
+
+#ifdef HAVE_SYS_MMAN_H
+  if (mlock (ptr, len) != 0) {
+    kk_log (KK_LOG_INFO, "Locking %s (%zu bytes) not granted: %s.", name, len, strerror (errno));
+    return -1;
+  }
+  kk_log (KK_LOG_INFO, "Locking %s (%zu bytes) granted.", name, len);
+  return 0;
+#else
+  kk_log (KK_LOG_INFO, "Locking %s not supported.", name);
+  return -1;
+#endif
+}
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+/**
+ * Parses a list of CPUs like "0,2-3".
+ */
+static int
+realtime_parse_cpus (const char *str, cpu_set_t *set)
+{
+  char *end = NULL;
+  long first;
+  long last;
+  long cpu;
+
+  CPU_ZERO (set);
+  while (*str) {
+    first = strtol (str, &end, 10);
+    if (end == str)
+      return -1;
+    str = end;
+    last = first;
+
+    if (*str == '-') {
+      str++;
+      last = strtol (str, &end, 10);
+      if (end == str)
+        return -1;
+      str = end;
+    }
+
+    if ((first < 0) || (last < first) || (last >= CPU_SETSIZE))
+      return -1;
+    for (cpu = first; cpu <= last; cpu++)
+      CPU_SET ((size_t) cpu, set);
+
+    if (*str == ',')
+      str++;
+    else if (*str != '\0')
+      return -1;
+  }
+  return (CPU_COUNT (set) > 0) ? 0 : -1;
+}
+
+static void
+realtime_set_affinity (const char *name, const char *cpus)
+{
+  cpu_set_t set;
+  int ret;
+
+  if (realtime_parse_cpus (cpus, &set) != 0) {
+    kk_log (KK_LOG_WARNING, "Ignoring invalid CPU list '%s'.", cpus);
+    return;
+  }
+
+  ret = pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t), &set);
+  if (ret != 0)
+    kk_log (KK_LOG_INFO, "CPU affinity %s of %s thread not granted: %s.", cpus, name, strerror (ret));
+  else
+    kk_log (KK_LOG_INFO, "CPU affinity %s of %s thread granted.", cpus, name);
+}
+#else
+static void
+realtime_set_affinity (const char *name, const char *cpus)
+{
+  (void) cpus;
+  kk_log (KK_LOG_INFO, "CPU affinity of %s thread not supported.", name);
+}
+#endif
+
+static void
+realtime_set_scheduling (const char *name)
+{
+  const char *policy_name = kk_settings_get_str ("KK_REALTIME_POLICY", "fifo");
+
+  struct sched_param param;
+  int policy = SCHED_FIFO;
+  long priority;
+  int ret;
+
+  if (strcmp (policy_name, "rr") == 0)
+    policy = SCHED_RR;
+  else if (strcmp (policy_name, "fifo") != 0) {
+    kk_log (KK_LOG_WARNING, "Unknown scheduling policy '%s', using fifo.", policy_name);
+    policy_name = "fifo";
+  }
+
+  priority = kk_settings_get_int ("KK_REALTIME_PRIORITY", KK_REALTIME_PRIORITY);
+  if (priority < sched_get_priority_min (policy))
+    priority = sched_get_priority_min (policy);
+  if (priority > sched_get_priority_max (policy))
+    priority = sched_get_priority_max (policy);
+
+  memset (&param, 0, sizeof (struct sched_param));
+  param.sched_priority = (int) priority;
+
+  ret = pthread_setschedparam (pthread_self (), policy, &param);
+  if (ret != 0)
+    kk_log (KK_LOG_INFO, "Real-time scheduling of %s thread not granted: %s.", name, strerror (ret));
+  else
+    kk_log (KK_LOG_INFO, "Real-time scheduling of %s thread granted (%s, priority %ld).",
+        name, policy_name, priority);
+}
+
+int
+kk_realtime_setup_thread (const char *name, int realtime)
+{
+  const char *cpus;
+  char setting[64];
+  size_t i;
+
+  snprintf (setting, sizeof (setting), "KK_AFFINITY_%s", name);
+  for (i = 0; setting[i] != '\0'; i++)
+    setting[i] = (char) toupper ((unsigned char) setting[i]);
+
+  cpus = kk_settings_get_str (setting, NULL);
+  if (cpus)
+    realtime_set_affinity (name, cpus);
+
+  if ((realtime) && (kk_realtime_is_enabled ())) {
+    realtime_set_scheduling (name);
+    realtime_prefault_stack ();
+  }
+  return 0;
+}
@@ -0,0 +1,384 @@
+#include <klingklang/cpu.h>
+#include <klingklang/resample.h>
+#include <klingklang/util.h>
+
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define RESAMPLE_X86
+#  include <immintrin.h>
+#endif
+
+/**
+ * Downsampling lowers the cutoff frequency, which makes the filter longer.
+ * The number of taps grows with the ratio of the sample rates, but not
+ * beyond this factor.
+ */
+#define KK_RESAMPLE_MAX_STRETCH 4
+
+static const struct {
+  const char *name;
+  size_t taps;
+  size_t phases;
+  double beta;
+  double rolloff;
+} resample_presets[] = {
+  [KK_RESAMPLE_LOW] = { "low", 16, 64, 5.0, 0.80 },
+  [KK_RESAMPLE_MEDIUM] = { "medium", 32, 256, 7.0, 0.90 },
+  [KK_RESAMPLE_HIGH] = { "high", 64, 1024, 9.0, 0.95 },
+};
+
+#define KK_RESAMPLE_PRESETS \
+  (sizeof (resample_presets) / sizeof (resample_presets[0]))
+
+typedef float (*resample_dot_func) (const float *, const float *, size_t);
+
+/**
+ * Filter kernels. The number of taps is always a multiple of 8 and the rows
+ * of the filter are 32 byte aligned. The samples might be unaligned.
+ */
+static float
+resample_dot (const float *a, const float *b, size_t n)
+{
+  float sum = 0.0f;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+#ifdef RESAMPLE_X86
+__attribute__ ((target ("sse2")))
+static float
+resample_dot_sse2 (const float *a, const float *b, size_t n)
+{
+  __m128 acc0 = _mm_setzero_ps ();
+  __m128 acc1 = _mm_setzero_ps ();
+  size_t i;
+
+  for (i = 0; i < n; i += 8) {
+    acc0 = _mm_add_ps (acc0, _mm_mul_ps (_mm_load_ps (a + i), _mm_loadu_ps (b + i)));
+    acc1 = _mm_add_ps (acc1, _mm_mul_ps (_mm_load_ps (a + i + 4), _mm_loadu_ps (b + i + 4)));
+  }
+
+  acc0 = _mm_add_ps (acc0, acc1);
+  acc0 = _mm_add_ps (acc0, _mm_movehl_ps (acc0, acc0));
+  acc0 = _mm_add_ss (acc0, _mm_shuffle_ps (acc0, acc0, 0x55));
+  return _mm_cvtss_f32 (acc0);
+}
+
+__attribute__ ((target ("avx2")))
+static float
+resample_dot_avx2 (const float *a, const float *b, size_t n)
+{
+  __m256 acc = _mm256_setzero_ps ();
+  __m128 sum;
+  size_t i;
+
+  for (i = 0; i < n; i += 8)
+    acc = _mm256_add_ps (acc, _mm256_mul_ps (_mm256_load_ps (a + i), _mm256_loadu_ps (b + i)));
+
+  sum = _mm_add_ps (_mm256_castps256_ps128 (acc), _mm256_extractf128_ps (acc, 1));
+  sum = _mm_add_ps (sum, _mm_movehl_ps (sum, sum));
+  sum = _mm_add_ss (sum, _mm_shuffle_ps (sum, sum, 0x55));
+  return _mm_cvtss_f32 (sum);
+}
+#endif
+
+static resample_dot_func resample_kernel;
+static pthread_once_t resample_kernel_once = PTHREAD_ONCE_INIT;
+
+static void
+resample_select_kernel (void)
+{
+  const unsigned int features = kk_cpu_get_features ();
+
+  resample_kernel = resample_dot;
+
+#ifdef RESAMPLE_X86
+  if (features & KK_CPU_SSE2)
+    resample_kernel = resample_dot_sse2;
+  if (features & KK_CPU_AVX2)
+    resample_kernel = resample_dot_avx2;
+#endif
+
+  (void) features;
+}
+
+static size_t
+resample_gcd (size_t a, size_t b)
+{
+  size_t t;
+
+  while (b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/**
+ * Modified Bessel function of the first kind, needed by the Kaiser window.
+ */
+static double
+resample_bessel_i0 (double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  int k;
+
+  for (k = 1; k < 64; k++) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+    if (term < sum * 1e-12)
+      break;
+  }
+  return sum;
+}
+
+/**
+ * Row p of the filter interpolates the sample p / phases frames behind the
+ * center of the window. Every row gets normalized, so that the filter
+ * doesn't change the volume.
+ */
+static void
+resample_build_filter (kk_resample_t *rs)
+{
+  const double beta = resample_presets[rs->quality].beta;
+  const double half = (double) (rs->taps / 2);
+  const double norm = resample_bessel_i0 (beta);
+
+  double cutoff;
+  double sum;
+  double d;
+  double x;
+  double h;
+  float *row;
+  size_t p;
+  size_t j;
+
+  cutoff = 0.5 * resample_presets[rs->quality].rolloff;
+  if (rs->out_rate < rs->in_rate)
+    cutoff *= (double) rs->out_rate / (double) rs->in_rate;
+
+  for (p = 0; p <= rs->phases; p++) {
+    row = rs->filter + p * rs->taps;
+    sum = 0.0;
+    for (j = 0; j < rs->taps; j++) {
+      d = (double) j - (half - 1.0) - (double) p / (double) rs->phases;
+      x = d / half;
+
+      h = 2.0 * cutoff;
+      if (fabs (d) > 1e-12)
+        h = sin (2.0 * M_PI * cutoff * d) / (M_PI * d);
+      if (fabs (x) <= 1.0)
+        h *= resample_bessel_i0 (beta * sqrt (1.0 - x * x)) / norm;
+      else
+        h = 0.0;
+
+      row[j] = (float) h;
+      sum += h;
+    }
+    for (j = 0; j < rs->taps; j++)
+      row[j] = (float) ((double) row[j] / sum);
+  }
+}
+
+static void
+resample_free_buffers (kk_resample_t *rs)
+{
+  free (rs->filter);
+  free (rs->planes);
+  rs->filter = NULL;
+  rs->planes = NULL;
+}
+
+int
+kk_resample_init (kk_resample_t **rs)
+{
+  kk_resample_t *result;
+
+  result = calloc (1, sizeof (kk_resample_t));
+  if (result == NULL)
+    goto error;
+
+  pthread_once (&resample_kernel_once, resample_select_kernel);
+
+  *rs = result;
+  return 0;
+error:
+  *rs = NULL;
+  return -1;
+}
+
+int
+kk_resample_free (kk_resample_t *rs)
+{
+  if (rs == NULL)
+    return 0;
+
+  resample_free_buffers (rs);
+  free (rs);
+  return 0;
+}
+
+int
+kk_resample_get_quality (const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < KK_RESAMPLE_PRESETS; i++) {
+    if (strcasecmp (name, resample_presets[i].name) == 0)
+      return (int) i;
+  }
+  return -1;
+}
+
+int
+kk_resample_setup (kk_resample_t *rs, unsigned int in_rate,
+    unsigned int out_rate, size_t channels, size_t frames, int quality)
+{
+  size_t taps;
+  size_t gcd;
+  void *filter = NULL;
+
+  if ((quality < 0) || ((size_t) quality >= KK_RESAMPLE_PRESETS))
+    quality = KK_RESAMPLE_MEDIUM;
+
+  if ((rs->filter) && (rs->in_rate == in_rate) && (rs->out_rate == out_rate)
+      && (rs->channels == channels) && (rs->frames >= frames)
+      && (rs->quality == quality))
+    return 0;
+
+  resample_free_buffers (rs);
+
+  if ((in_rate == 0) || (out_rate == 0) || (channels == 0) || (frames == 0))
+    goto error;
+
+  taps = resample_presets[quality].taps;
+  if (in_rate > out_rate) {
+    if (in_rate >= KK_RESAMPLE_MAX_STRETCH * out_rate)
+      taps *= KK_RESAMPLE_MAX_STRETCH;
+    else
+      taps = (taps * in_rate + out_rate - 1) / out_rate;
+    taps = (taps + 7) & ~((size_t) 7);
+  }
+
+  gcd = resample_gcd (in_rate, out_rate);
+
+  rs->in_rate = in_rate;
+  rs->out_rate = out_rate;
+  rs->quality = quality;
+  rs->channels = channels;
+  rs->taps = taps;
+  rs->step = in_rate / gcd;
+  rs->den = out_rate / gcd;
+  rs->phases = (rs->den < resample_presets[quality].phases) ?
+      rs->den : resample_presets[quality].phases;
+  rs->frames = frames;
+  rs->size = taps + frames;
+
+  if (posix_memalign (&filter, 32, (rs->phases + 1) * taps * sizeof (float)) != 0)
+    goto error;
+  rs->filter = filter;
+
+  rs->planes = calloc (channels * rs->size, sizeof (float));
+  if (rs->planes == NULL)
+    goto error;
+
+  resample_build_filter (rs);
+  kk_resample_reset (rs);
+
+  kk_log (KK_LOG_DEBUG, "Resampling from %u Hz to %u Hz with %zu taps and %zu phases.",
+      in_rate, out_rate, taps, rs->phases);
+  return 0;
+error:
+  kk_log (KK_LOG_WARNING, "Setting up resampler failed.");
+  resample_free_buffers (rs);
+  return -1;
+}
+
+/**
+ * The planes start with half a window of silence, so the first output frame
+ * lines up with the first input frame.
+ */
+void
+kk_resample_reset (kk_resample_t *rs)
+{
+  if (rs->planes)
+    memset (rs->planes, 0, rs->channels * rs->size * sizeof (float));
+  rs->fill = rs->taps / 2 - 1;
+  rs->pos = 0;
+  rs->frac = 0;
+}
+
+size_t
+kk_resample_get_frames (kk_resample_t *rs, size_t frames)
+{
+  return (size_t) (((uint64_t) frames + 1) * rs->den / rs->step) + 1;
+}
+
+static size_t
+resample_run (kk_resample_t *rs, float *dst, const float *src, size_t frames)
+{
+  const size_t channels = rs->channels;
+
+  const float *row;
+  float *plane;
+  size_t phase;
+  size_t out = 0;
+  size_t drop;
+  size_t c;
+  size_t i;
+
+  for (c = 0; c < channels; c++) {
+    plane = rs->planes + c * rs->size + rs->fill;
+    for (i = 0; i < frames; i++)
+      plane[i] = src[i * channels + c];
+  }
+  rs->fill += frames;
+
+  while (rs->pos + rs->taps <= rs->fill) {
+    phase = (size_t) (((uint64_t) rs->frac * rs->phases + rs->den / 2) / rs->den);
+    row = rs->filter + phase * rs->taps;
+
+    for (c = 0; c < channels; c++)
+      dst[out * channels + c] = resample_kernel (row,
+          rs->planes + c * rs->size + rs->pos, rs->taps);
+    out++;
+
+    rs->frac += rs->step;
+    rs->pos += rs->frac / rs->den;
+    rs->frac %= rs->den;
+  }
+
+  /* Only keep the frames the next window needs */
+  drop = (rs->pos < rs->fill) ? rs->pos : rs->fill;
+  if (drop > 0) {
+    for (c = 0; c < channels; c++) {
+      plane = rs->planes + c * rs->size;
+      memmove (plane, plane + drop, (rs->fill - drop) * sizeof (float));
+    }
+    rs->fill -= drop;
+    rs->pos -= drop;
+  }
+  return out;
+}
+
+size_t
+kk_resample (kk_resample_t *rs, float *dst, const float *src, size_t frames)
+{
+  size_t out = 0;
+  size_t n;
+
+  while (frames > 0) {
+    n = (frames < rs->frames) ? frames : rs->frames;
+    out += resample_run (rs, dst + out * rs->channels, src, n);
+    src += n * rs->channels;
+    frames -= n;
+  }
+  return out;
+}
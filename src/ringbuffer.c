@@ -0,0 +1,302 @@
+#include <klingklang/ringbuffer.h>
+#include <klingklang/util.h>
+
+#include <time.h>
+
+/**
+ * The read and write positions are free-running counters. They are never
+ * wrapped, only the index into the data array is. This way the fill level is
+ * simply the difference of both counters, even if the buffer is completely
+ * full. Each position gets written by one thread only, the other thread only
+ * reads it.
+ */
+static inline size_t
+ringbuffer_load (size_t *pos)
+{
+  return __atomic_load_n (pos, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+ringbuffer_store (size_t *pos, size_t val)
+{
+  __atomic_store_n (pos, val, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Wakes up the other side if it's sleeping. The waiting thread increments
+ * waiters before checking the fill level, we check waiters after updating
+ * the position. Both happen sequentially consistent, so either the waiter
+ * sees the new position or we see the waiter.
+ */
+static inline void
+ringbuffer_notify (kk_ringbuffer_t *rb)
+{
+  if (__atomic_load_n (&rb->waiters, __ATOMIC_SEQ_CST) == 0)
+    return;
+
+  pthread_mutex_lock (&rb->mutex);
+  pthread_cond_broadcast (&rb->cond);
+  pthread_mutex_unlock (&rb->mutex);
+}
+
+int
+kk_ringbuffer_init (kk_ringbuffer_t **rb, size_t size)
+{
+  kk_ringbuffer_t *result;
+
+  result = calloc (1, sizeof (kk_ringbuffer_t));
+  if (result == NULL)
+    goto error;
+
+  if (size < 2)
+    goto error;
+
+  /* Round up to a power of 2 so we can mask instead of using modulo */
+  result->size = kk_get_next_pow2 (size - 1);
+  result->mask = result->size - 1;
+
+  result->data = calloc (result->size, sizeof (uint8_t));
+  if (result->data == NULL)
+    goto error;
+
+  if (pthread_cond_init (&result->cond, NULL) != 0)
+    goto error;
+  result->init.cond = 1;
+
+  if (pthread_mutex_init (&result->mutex, NULL) != 0)
+    goto error;
+  result->init.mutex = 1;
+
+  *rb = result;
+  return 0;
+error:
+  kk_ringbuffer_free (result);
+  *rb = NULL;
+  return -1;
+}
+
+int
+kk_ringbuffer_free (kk_ringbuffer_t *rb)
+{
+  if (rb == NULL)
+    return 0;
+
+  if (rb->init.cond)
+    pthread_cond_destroy (&rb->cond);
+  if (rb->init.mutex)
+    pthread_mutex_destroy (&rb->mutex);
+  free (rb->data);
+  free (rb);
+  return 0;
+}
+
+size_t
+kk_ringbuffer_get_fill (kk_ringbuffer_t *rb)
+{
+  return ringbuffer_load (&rb->wpos) - ringbuffer_load (&rb->rpos);
+}
+
+size_t
+kk_ringbuffer_get_space (kk_ringbuffer_t *rb)
+{
+  return rb->size - kk_ringbuffer_get_fill (rb);
+}
+
+size_t
+kk_ringbuffer_get_size (kk_ringbuffer_t *rb)
+{
+  return rb->size;
+}
+
+/**
+ * The positions count all bytes ever read or written. They can be used to
+ * tell whether the reader already reached a certain byte the writer wrote.
+ */
+size_t
+kk_ringbuffer_get_read_pos (kk_ringbuffer_t *rb)
+{
+  return ringbuffer_load (&rb->rpos);
+}
+
+size_t
+kk_ringbuffer_get_write_pos (kk_ringbuffer_t *rb)
+{
+  return ringbuffer_load (&rb->wpos);
+}
+
+size_t
+kk_ringbuffer_write (kk_ringbuffer_t *rb, const void *src, size_t len)
+{
+  const size_t wpos = rb->wpos;
+  const size_t idx = wpos & rb->mask;
+
+  size_t fst;
+
+  if (len > kk_ringbuffer_get_space (rb))
+    len = kk_ringbuffer_get_space (rb);
+
+  if (len == 0)
+    return 0;
+
+  fst = rb->size - idx;
+  if (fst > len)
+    fst = len;
+
+  memcpy (rb->data + idx, src, fst);
+  memcpy (rb->data, (const uint8_t *) src + fst, len - fst);
+
+  ringbuffer_store (&rb->wpos, wpos + len);
+  ringbuffer_notify (rb);
+  return len;
+}
+
+size_t
+kk_ringbuffer_read (kk_ringbuffer_t *rb, void *dst, size_t len)
+{
+  const size_t rpos = rb->rpos;
+  const size_t idx = rpos & rb->mask;
+
+  size_t fst;
+
+  if (len > kk_ringbuffer_get_fill (rb))
+    len = kk_ringbuffer_get_fill (rb);
+
+  if (len == 0)
+    return 0;
+
+  fst = rb->size - idx;
+  if (fst > len)
+    fst = len;
+
+  memcpy (dst, rb->data + idx, fst);
+  memcpy ((uint8_t *) dst + fst, rb->data, len - fst);
+
+  ringbuffer_store (&rb->rpos, rpos + len);
+  ringbuffer_notify (rb);
+  return len;
+}
+
+/**
+ * Returns the number of bytes which can be read in one piece starting at
+ * *ptr. The data stays in the buffer until kk_ringbuffer_skip gets called.
+ */
+size_t
+kk_ringbuffer_peek (kk_ringbuffer_t *rb, void **ptr)
+{
+  const size_t idx = rb->rpos & rb->mask;
+  const size_t len = kk_ringbuffer_get_fill (rb);
+
+  *ptr = rb->data + idx;
+  if (len > rb->size - idx)
+    return rb->size - idx;
+  return len;
+}
+
+size_t
+kk_ringbuffer_skip (kk_ringbuffer_t *rb, size_t len)
+{
+  if (len > kk_ringbuffer_get_fill (rb))
+    len = kk_ringbuffer_get_fill (rb);
+
+  if (len == 0)
+    return 0;
+
+  ringbuffer_store (&rb->rpos, rb->rpos + len);
+  ringbuffer_notify (rb);
+  return len;
+}
+
+/**
+ * The waiting functions block until the requested amount of data / space is
+ * available or until *cancel becomes non-zero. Whoever sets *cancel has to
+ * call kk_ringbuffer_wakeup afterwards. Both functions return the amount
+ * of data / space available at the time they returned.
+ */
+static void
+ringbuffer_wait_cleanup (void *arg)
+{
+  kk_ringbuffer_t *rb = arg;
+
+  __atomic_sub_fetch (&rb->waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&rb->mutex);
+}
+
+static size_t
+ringbuffer_wait (kk_ringbuffer_t *rb, size_t len, const int *cancel,
+    size_t (*avail) (kk_ringbuffer_t *))
+{
+  size_t result;
+
+  pthread_mutex_lock (&rb->mutex);
+  __atomic_add_fetch (&rb->waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_cleanup_push (ringbuffer_wait_cleanup, rb);
+  for (;;) {
+    result = avail (rb);
+    if (result >= len)
+      break;
+    if ((cancel) && (__atomic_load_n (cancel, __ATOMIC_SEQ_CST)))
+      break;
+    pthread_cond_wait (&rb->cond, &rb->mutex);
+  }
+  pthread_cleanup_pop (1);
+  return result;
+}
+
+size_t
+kk_ringbuffer_wait_fill (kk_ringbuffer_t *rb, size_t len, const int *cancel)
+{
+  return ringbuffer_wait (rb, len, cancel, kk_ringbuffer_get_fill);
+}
+
+size_t
+kk_ringbuffer_wait_space (kk_ringbuffer_t *rb, size_t len, const int *cancel)
+{
+  return ringbuffer_wait (rb, len, cancel, kk_ringbuffer_get_space);
+}
+
+/**
+ * Pollers don't count as waiters, so the reader never takes the mutex on
+ * their behalf. They sleep interval milliseconds at a time and check the
+ * space again, or wake up early from kk_ringbuffer_wakeup.
+ */
+static void
+ringbuffer_poll_cleanup (void *arg)
+{
+  kk_ringbuffer_t *rb = arg;
+
+  pthread_mutex_unlock (&rb->mutex);
+}
+
+size_t
+kk_ringbuffer_poll_space (kk_ringbuffer_t *rb, size_t len, const int *cancel,
+    unsigned interval)
+{
+  struct timespec wakeup;
+  size_t result;
+
+  pthread_mutex_lock (&rb->mutex);
+  pthread_cleanup_push (ringbuffer_poll_cleanup, rb);
+  for (;;) {
+    result = kk_ringbuffer_get_space (rb);
+    if (result >= len)
+      break;
+    if ((cancel) && (__atomic_load_n (cancel, __ATOMIC_SEQ_CST)))
+      break;
+
+    clock_gettime (CLOCK_REALTIME, &wakeup);
+    wakeup.tv_nsec += (long) interval * 1000000;
+    wakeup.tv_sec += wakeup.tv_nsec / 1000000000;
+    wakeup.tv_nsec %= 1000000000;
+    pthread_cond_timedwait (&rb->cond, &rb->mutex, &wakeup);
+  }
+  pthread_cleanup_pop (1);
+  return result;
+}
+
+void
+kk_ringbuffer_wakeup (kk_ringbuffer_t *rb)
+{
+  pthread_mutex_lock (&rb->mutex);
+  pthread_cond_broadcast (&rb->cond);
+  pthread_mutex_unlock (&rb->mutex);
+}
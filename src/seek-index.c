@@ -0,0 +1,401 @@
+#include <klingklang/base.h>
+#include <klingklang/realtime.h>
+#include <klingklang/seek-index.h>
+#include <klingklang/settings.h>
+#include <klingklang/util.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#define KK_SEEK_INDEX_MAGIC     "KKSEEK01"
+
+/**
+ * Cache files start with this header, followed by the path of the indexed
+ * file and count - 1 pairs of 32 bit deltas to the previous entry. The
+ * first entry is part of the header. Everything is stored in native byte
+ * order, the cache never leaves the machine.
+ */
+struct seek_index_header {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime;
+  int64_t ts;
+  int64_t pos;
+  uint32_t count;
+  uint32_t complete;
+  uint32_t length;
+  uint32_t reserved;
+};
+
+/**
+ * The cache directory gets looked up and created once per process, not for
+ * every file we open.
+ */
+static pthread_once_t seek_index_dir_once = PTHREAD_ONCE_INIT;
+static char seek_index_dir[4096];
+static int seek_index_dir_status = -1;
+
+static void
+seek_index_find_dir (void)
+{
+  seek_index_dir_status = kk_settings_get_cache_dir ("seek", seek_index_dir,
+      sizeof (seek_index_dir));
+}
+
+/**
+ * Released indexes wait in pending until the writer thread gets to them.
+ * The thread exits once finish is set and nothing is pending anymore.
+ */
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  kk_seek_index_t *pending;
+  unsigned running:1;
+  unsigned finish:1;
+} seek_index_writer = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int
+seek_index_reserve (kk_seek_index_t *idx, size_t cap)
+{
+  kk_seek_index_entry_t *entries;
+
+  if (cap <= idx->cap)
+    return 0;
+
+  entries = realloc (idx->entries, cap * sizeof (kk_seek_index_entry_t));
+  if (entries == NULL)
+    return -1;
+
+  idx->entries = entries;
+  idx->cap = cap;
+  return 0;
+}
+
+static int
+seek_index_load (kk_seek_index_t *idx)
+{
+  struct seek_index_header header;
+  struct stat sbuf;
+  uint32_t delta[2];
+  char *file = NULL;
+  FILE *fp;
+  size_t avail;
+  size_t i;
+
+  fp = fopen (idx->path, "rb");
+  if (fp == NULL)
+    return -1;
+
+  if ((fstat (fileno (fp), &sbuf) != 0) || ((size_t) sbuf.st_size < sizeof (header)))
+    goto error;
+
+  if (fread (&header, sizeof (header), 1, fp) != 1)
+    goto error;
+
+  if ((memcmp (header.magic, KK_SEEK_INDEX_MAGIC, 8) != 0)
+      || (header.size != idx->size) || (header.mtime != idx->mtime)
+      || (header.length != strlen (idx->file)) || (header.count == 0))
+    goto error;
+
+  /* Don't trust the header to allocate, the file has to hold what it claims */
+  avail = (size_t) sbuf.st_size - sizeof (header);
+  if ((header.length > avail)
+      || (header.count - 1 > (avail - header.length) / sizeof (delta)))
+    goto error;
+
+  /* Different files might have the same hash */
+  file = calloc (header.length + 1, sizeof (char));
+  if (file == NULL)
+    goto error;
+  if ((fread (file, 1, header.length, fp) != header.length)
+      || (strcmp (file, idx->file) != 0))
+    goto error;
+
+  if (seek_index_reserve (idx, header.count) != 0)
+    goto error;
+
+  idx->entries[0].ts = header.ts;
+  idx->entries[0].pos = header.pos;
+  for (i = 1; i < header.count; i++) {
+    if (fread (delta, sizeof (delta), 1, fp) != 1)
+      goto error;
+    idx->entries[i].ts = idx->entries[i - 1].ts + delta[0];
+    idx->entries[i].pos = idx->entries[i - 1].pos + delta[1];
+  }
+
+  idx->count = header.count;
+  idx->complete = (header.complete != 0);
+
+  free (file);
+  fclose (fp);
+  return 0;
+error:
+  free (file);
+  fclose (fp);
+  return -1;
+}
+
+int
+kk_seek_index_init (kk_seek_index_t **idx, const char *file, int64_t interval)
+{
+  kk_seek_index_t *result;
+  struct stat sbuf;
+  size_t len;
+
+  result = calloc (1, sizeof (kk_seek_index_t));
+  if (result == NULL)
+    goto error;
+
+  if (stat (file, &sbuf) != 0)
+    goto error;
+
+  pthread_once (&seek_index_dir_once, seek_index_find_dir);
+  if (seek_index_dir_status != 0)
+    goto error;
+
+  result->file = strdup (file);
+  if (result->file == NULL)
+    goto error;
+
+  len = strlen (seek_index_dir) + 32;
+  result->path = calloc (len, sizeof (char));
+  if (result->path == NULL)
+    goto error;
+  snprintf (result->path, len, "%s/%016llx", seek_index_dir,
+      (unsigned long long) kk_get_hash (file));
+
+  result->interval = interval;
+  result->size = (uint64_t) sbuf.st_size;
+  result->mtime = (int64_t) sbuf.st_mtime;
+
+  if (seek_index_load (result) == 0)
+    kk_log (KK_LOG_DEBUG, "Loaded seek index with %zu entries.", result->count);
+  else
+    result->count = 0;
+
+  *idx = result;
+  return 0;
+error:
+  kk_seek_index_free (result);
+  *idx = NULL;
+  return -1;
+}
+
+int
+kk_seek_index_free (kk_seek_index_t *idx)
+{
+  if (idx == NULL)
+    return 0;
+
+  free (idx->entries);
+  free (idx->file);
+  free (idx->path);
+  free (idx);
+  return 0;
+}
+
+int
+kk_seek_index_add (kk_seek_index_t *idx, int64_t ts, int64_t pos)
+{
+  kk_seek_index_entry_t *last;
+
+  if (idx->count > 0) {
+    last = idx->entries + idx->count - 1;
+    if (ts - last->ts < idx->interval)
+      return 0;
+
+    /* Only deltas fitting into 32 bits can be stored */
+    if ((pos <= last->pos) || (ts - last->ts > UINT32_MAX)
+        || (pos - last->pos > UINT32_MAX))
+      return 0;
+  }
+
+  if (idx->count == idx->cap) {
+    if (seek_index_reserve (idx, (idx->cap) ? 2 * idx->cap : 256) != 0)
+      return -1;
+  }
+
+  idx->entries[idx->count].ts = ts;
+  idx->entries[idx->count].pos = pos;
+  idx->count++;
+  idx->dirty = 1;
+  return 0;
+}
+
+/**
+ * The index gets written to a temporary file first, so that other
+ * instances never read half written indexes. Every instance gets a
+ * temporary file of its own.
+ */
+int
+kk_seek_index_save (kk_seek_index_t *idx)
+{
+  struct seek_index_header header;
+  uint32_t delta[2];
+  char *tmp = NULL;
+  FILE *fp = NULL;
+  size_t len;
+  size_t i;
+  int fd;
+
+  if ((!idx->dirty) || (idx->count == 0))
+    return 0;
+
+  len = strlen (idx->path) + 8;
+  tmp = calloc (len, sizeof (char));
+  if (tmp == NULL)
+    goto error;
+  snprintf (tmp, len, "%s.XXXXXX", idx->path);
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, KK_SEEK_INDEX_MAGIC, 8);
+  header.size = idx->size;
+  header.mtime = idx->mtime;
+  header.ts = idx->entries[0].ts;
+  header.pos = idx->entries[0].pos;
+  header.count = (uint32_t) idx->count;
+  header.complete = idx->complete;
+  header.length = (uint32_t) strlen (idx->file);
+
+  fd = mkstemp (tmp);
+  if (fd < 0) {
+    free (tmp);
+    tmp = NULL;
+    goto error;
+  }
+
+  fp = fdopen (fd, "wb");
+  if (fp == NULL) {
+    close (fd);
+    goto error;
+  }
+
+  if ((fwrite (&header, sizeof (header), 1, fp) != 1)
+      || (fwrite (idx->file, 1, header.length, fp) != header.length))
+    goto error;
+
+  for (i = 1; i < idx->count; i++) {
+    delta[0] = (uint32_t) (idx->entries[i].ts - idx->entries[i - 1].ts);
+    delta[1] = (uint32_t) (idx->entries[i].pos - idx->entries[i - 1].pos);
+    if (fwrite (delta, sizeof (delta), 1, fp) != 1)
+      goto error;
+  }
+
+  if (fclose (fp) != 0) {
+    fp = NULL;
+    goto error;
+  }
+  fp = NULL;
+
+  if (rename (tmp, idx->path) != 0)
+    goto error;
+
+  idx->dirty = 0;
+  free (tmp);
+  return 0;
+error:
+  kk_log (KK_LOG_WARNING, "Writing seek index '%s' failed.", idx->path);
+  if (fp)
+    fclose (fp);
+  if (tmp)
+    remove (tmp);
+  free (tmp);
+  return -1;
+}
+
+static void *
+seek_index_writer_thread (void *arg)
+{
+  kk_seek_index_t *idx;
+
+  (void) arg;
+  kk_realtime_setup_thread ("indexer", 0);
+
+  pthread_mutex_lock (&seek_index_writer.mutex);
+  for (;;) {
+    while ((seek_index_writer.pending == NULL) && (!seek_index_writer.finish))
+      pthread_cond_wait (&seek_index_writer.cond, &seek_index_writer.mutex);
+
+    idx = seek_index_writer.pending;
+    if (idx == NULL)
+      break;
+    seek_index_writer.pending = idx->next;
+
+    pthread_mutex_unlock (&seek_index_writer.mutex);
+    kk_seek_index_save (idx);
+    kk_seek_index_free (idx);
+    pthread_mutex_lock (&seek_index_writer.mutex);
+  }
+  pthread_mutex_unlock (&seek_index_writer.mutex);
+  return NULL;
+}
+
+/**
+ * The writer thread gets started with the first index that needs writing.
+ * If it can't be started, the index gets written right away.
+ */
+int
+kk_seek_index_release (kk_seek_index_t *idx)
+{
+  if (idx == NULL)
+    return 0;
+
+  if ((!idx->dirty) || (idx->count == 0))
+    return kk_seek_index_free (idx);
+
+  pthread_mutex_lock (&seek_index_writer.mutex);
+  if (!seek_index_writer.running) {
+    seek_index_writer.finish = 0;
+    if (kk_thread_create (&seek_index_writer.thread, NULL,
+            seek_index_writer_thread, NULL) == 0)
+      seek_index_writer.running = 1;
+  }
+
+  if (seek_index_writer.running) {
+    idx->next = seek_index_writer.pending;
+    seek_index_writer.pending = idx;
+    pthread_cond_signal (&seek_index_writer.cond);
+    idx = NULL;
+  }
+  pthread_mutex_unlock (&seek_index_writer.mutex);
+
+  if (idx) {
+    kk_seek_index_save (idx);
+    kk_seek_index_free (idx);
+  }
+  return 0;
+}
+
+void
+kk_seek_index_finish (void)
+{
+  pthread_mutex_lock (&seek_index_writer.mutex);
+  if (!seek_index_writer.running) {
+    pthread_mutex_unlock (&seek_index_writer.mutex);
+    return;
+  }
+  seek_index_writer.finish = 1;
+  pthread_cond_signal (&seek_index_writer.cond);
+  pthread_mutex_unlock (&seek_index_writer.mutex);
+
+  pthread_join (seek_index_writer.thread, NULL);
+
+  pthread_mutex_lock (&seek_index_writer.mutex);
+  seek_index_writer.running = 0;
+  pthread_mutex_unlock (&seek_index_writer.mutex);
+}
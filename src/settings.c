@@ -0,0 +1,128 @@
+#include <klingklang/settings.h>
+#include <klingklang/util.h>
+
+#include <errno.h>
+
+#ifdef HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#  include <sys/types.h>
+#endif
+
+const char *
+kk_settings_get_str (const char *name, const char *def)
+{
+  const char *val;
+
+  val = getenv (name);
+  if ((val == NULL) || (*val == '\0'))
+    return def;
+  return val;
+}
+
+long
+kk_settings_get_int (const char *name, long def)
+{
+  const char *val;
+  char *end = NULL;
+  long result;
+
+  val = kk_settings_get_str (name, NULL);
+  if (val == NULL)
+    return def;
+
+  errno = 0;
+  result = strtol (val, &end, 0);
+  if ((errno != 0) || (end == val) || (*end != '\0')) {
+    kk_log (KK_LOG_WARNING, "Ignoring invalid value '%s' of %s.", val, name);
+    return def;
+  }
+  return result;
+}
+
+double
+kk_settings_get_float (const char *name, double def)
+{
+  const char *val;
+  char *end = NULL;
+  double result;
+
+  val = kk_settings_get_str (name, NULL);
+  if (val == NULL)
+    return def;
+
+  errno = 0;
+  result = strtod (val, &end);
+  if ((errno != 0) || (end == val) || (*end != '\0')) {
+    kk_log (KK_LOG_WARNING, "Ignoring invalid value '%s' of %s.", val, name);
+    return def;
+  }
+  return result;
+}
+
+int
+kk_settings_get_bool (const char *name, int def)
+{
+  const char *val;
+
+  val = kk_settings_get_str (name, NULL);
+  if (val == NULL)
+    return def;
+
+  if ((strcmp (val, "1") == 0) || (strcasecmp (val, "yes") == 0)
+      || (strcasecmp (val, "true") == 0) || (strcasecmp (val, "on") == 0))
+    return 1;
+
+  if ((strcmp (val, "0") == 0) || (strcasecmp (val, "no") == 0)
+      || (strcasecmp (val, "false") == 0) || (strcasecmp (val, "off") == 0))
+    return 0;
+
+  kk_log (KK_LOG_WARNING, "Ignoring invalid value '%s' of %s.", val, name);
+  return def;
+}
+
+static int
+settings_mkdir (const char *path)
+{
+  if ((mkdir (path, 0700) != 0) && (errno != EEXIST))
+    return -1;
+  return 0;
+}
+
+/**
+ * Caches live in $XDG_CACHE_HOME/klingklang or, if that isn't set, in
+ * $HOME/.cache/klingklang. Missing directories get created.
+ */
+int
+kk_settings_get_cache_dir (const char *name, char *dst, size_t len)
+{
+  const char *base;
+  const char *sub = "klingklang";
+  char *ptr;
+  int out;
+
+  base = kk_settings_get_str ("XDG_CACHE_HOME", NULL);
+  if ((base == NULL) || (base[0] != '/')) {
+    base = kk_settings_get_str ("HOME", NULL);
+    sub = ".cache/klingklang";
+  }
+
+  if (base == NULL)
+    return -1;
+
+  out = snprintf (dst, len, "%s/%s/%s", base, sub, name);
+  if ((out < 0) || ((size_t) out >= len))
+    return -1;
+
+  for (ptr = dst + 1; *ptr != '\0'; ptr++) {
+    if (*ptr != '/')
+      continue;
+    *ptr = '\0';
+    if (settings_mkdir (dst) != 0)
+      return -1;
+    *ptr = '/';
+  }
+  return settings_mkdir (dst);
+}
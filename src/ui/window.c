@@ -1,3 +1,4 @@
+#include <klingklang/realtime.h>
 #include <klingklang/ui/window.h>
 #include <klingklang/util.h>
 
@@ -45,6 +46,8 @@ window_draw_thread (kk_window_t *win)
   struct timespec wakeup;
   int status;
 
+  kk_realtime_setup_thread ("draw", 0);
+
   win->state.alive = 1;
 
   pthread_cleanup_push ((void (*)(void *)) window_draw_thread_cleanup, win);
@@ -122,7 +125,7 @@ kk_window_init (kk_window_t **win, int width, int height)
   if (pthread_mutex_init (&result->draw.mutex, NULL) != 0)
     goto error;
 
-  if (pthread_create (&result->draw.thread, NULL, (void *(*)(void *)) window_draw_thread, result) != 0)
+  if (kk_thread_create (&result->draw.thread, NULL, (void *(*)(void *)) window_draw_thread, result) != 0)
     goto error;
 
   *win = result;
@@ -265,7 +268,7 @@ window_input_reader_detach (kk_window_t *win, int fd)
   if (pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED) != 0)
     goto error;
 
-  if (pthread_create (&thread, &attr, (void *(*)(void *)) window_input_reader, state) != 0)
+  if (kk_thread_create (&thread, &attr, (void *(*)(void *)) window_input_reader, state) != 0)
     goto error;
 
   pthread_attr_destroy (&attr);
@@ -420,7 +420,7 @@ window_init (kk_window_t *win_base)
     return -1;
   }
 
-  if (pthread_create (&win->thread, 0, (void *(*)(void *)) window_event_handler, win) != 0)
+  if (kk_thread_create (&win->thread, 0, (void *(*)(void *)) window_event_handler, win) != 0)
     return -1;
 
   return 0;
@@ -10,8 +10,13 @@
 
 #include <klingklang/util.h>
 
+#include <pthread.h>
 #include <stdarg.h>
 
+#ifdef HAVE_SIGNAL_H
+#  include <signal.h>
+#endif
+
 #ifdef HAVE_UNISTD_H
 #  include <unistd.h> /* getpid */
 #endif
@@ -30,6 +35,12 @@
 
 static const int log_level = KK_LOG_DEBUG;
 
+/**
+ * Several threads log messages. The mutex keeps them from interleaving and
+ * guards the static variables of vlogf.
+ */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static const char *log_level_str[] = {
   [KK_LOG_DEBUG]   = KK_COL_STR ("dbg", BLUE),
   [KK_LOG_INFO]    = KK_COL_STR ("inf", GREEN),
@@ -44,8 +55,10 @@ vlogf (int level, const char *fmt, va_list args)
   static char info[64] = { '\0' };
   static int ignore = 0;
 
+  pthread_mutex_lock (&log_mutex);
   if (((level != KK_LOG_ATTACH) && (level < log_level)) || ((level == KK_LOG_ATTACH) && (ignore))) {
     ignore = 1;
+    pthread_mutex_unlock (&log_mutex);
     return;
   }
 
@@ -63,6 +76,7 @@ vlogf (int level, const char *fmt, va_list args)
   vfprintf (stderr, fmt, args);
   fputc ('\n', stderr);
   ignore = 0;
+  pthread_mutex_unlock (&log_mutex);
 }
 
 void
@@ -96,3 +110,35 @@ kk_get_next_pow2 (size_t val)
   val |= val >> 16;
   return ++val;
 }
+
+uint64_t
+kk_get_hash (const char *str)
+{
+  uint64_t hash = 14695981039346656037ull;
+
+  while (*str) {
+    hash ^= (uint8_t) *str++;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+int
+kk_thread_create (pthread_t *thread, const pthread_attr_t *attr,
+    void *(*func) (void *), void *arg)
+{
+#ifdef HAVE_SIGNAL_H
+  sigset_t set;
+  sigset_t old;
+  int result;
+
+  /* The thread inherits the mask of its creator */
+  sigfillset (&set);
+  pthread_sigmask (SIG_SETMASK, &set, &old);
+  result = pthread_create (thread, attr, func, arg);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  return result;
+#else
+  return pthread_create (thread, attr, func, arg);
+#endif
+}
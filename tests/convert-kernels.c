@@ -0,0 +1,165 @@
+/**
+ * Checks the vector load and store kernels of the converter against the
+ * reference implementations. Without dither, they have to produce exactly
+ * the same samples. With dither, every sample may be off by one step from
+ * the undithered one, but not more. Kernels the CPU doesn't support get
+ * skipped.
+ */
+#include "../src/convert.c"
+
+#include <stdio.h>
+
+#define TEST_MAX_SAMPLES  1031
+#define TEST_MAX_OFFSET   7
+
+typedef struct {
+  const char *name;
+  unsigned int feature;
+  kk_convert_load_func load[CONVERT_KERNELS];
+  kk_convert_store_func store[CONVERT_KERNELS];
+} test_kernels_t;
+
+static const test_kernels_t test_reference = {
+  "reference", 0,
+  { convert_load_u8, convert_load_s16, convert_load_s32, convert_load_f32, convert_load_f64 },
+  { convert_store_u8, convert_store_s16, convert_store_s32, convert_store_f32, NULL }
+};
+
+static const test_kernels_t test_kernels[] = {
+#ifdef CONVERT_X86
+  { "sse2", KK_CPU_SSE2,
+    { convert_load_u8_sse2, convert_load_s16_sse2, convert_load_s32_sse2, NULL, convert_load_f64_sse2 },
+    { convert_store_u8_sse2, convert_store_s16_sse2, convert_store_s32_sse2, NULL, NULL } },
+  { "avx2", KK_CPU_AVX2,
+    { convert_load_u8_avx2, convert_load_s16_avx2, convert_load_s32_avx2, NULL, convert_load_f64_avx2 },
+    { convert_store_u8_avx2, convert_store_s16_avx2, convert_store_s32_avx2, NULL, NULL } },
+#endif
+  { NULL, 0, { NULL }, { NULL } }
+};
+
+static const size_t test_bytes[CONVERT_KERNELS] = {
+  [CONVERT_U8] = 1,
+  [CONVERT_S16] = 2,
+  [CONVERT_S32] = 4,
+  [CONVERT_F32] = 4,
+  [CONVERT_F64] = 8,
+};
+
+static uint8_t test_src[TEST_MAX_SAMPLES * 8 + TEST_MAX_OFFSET * 8];
+static float test_floats[TEST_MAX_SAMPLES + TEST_MAX_OFFSET];
+
+static void
+test_fill (void)
+{
+  double *d = (double *) (void *) test_src;
+  size_t i;
+
+  for (i = 0; i < sizeof (test_src); i++)
+    test_src[i] = (uint8_t) (i * 131 + 7);
+
+  /* Doubles need real values, random bytes might be NaN */
+  for (i = 0; i < sizeof (test_src) / sizeof (double); i++)
+    d[i] = (double) ((long) (i * 7919 % 4001) - 2000) / 1900.0;
+
+  /* Some samples are out of range, so clamping gets tested too */
+  for (i = 0; i < TEST_MAX_SAMPLES + TEST_MAX_OFFSET; i++)
+    test_floats[i] = (float) ((long) (i * 7919 % 4001) - 2000) / 1600.0f;
+}
+
+static long
+test_get_sample (const void *buf, int kernel, size_t i)
+{
+  switch (kernel) {
+    case CONVERT_U8:
+      return (long) ((const uint8_t *) buf)[i];
+    case CONVERT_S16:
+      return (long) ((const int16_t *) buf)[i];
+    default:
+      return (long) ((const int32_t *) buf)[i];
+  }
+}
+
+static int
+test_load (const test_kernels_t *k, int kernel, size_t n, size_t offset)
+{
+  float expect[TEST_MAX_SAMPLES];
+  float result[TEST_MAX_SAMPLES];
+  const void *src;
+
+  if (k->load[kernel] == NULL)
+    return 0;
+
+  src = (kernel == CONVERT_F64) ? (const void *) (test_src + offset * 8) : (const void *) (test_src + offset);
+
+  test_reference.load[kernel] (expect, src, n);
+  k->load[kernel] (result, src, n);
+
+  if (memcmp (expect, result, n * sizeof (float)) != 0) {
+    fprintf (stderr, "%s: Loading %zu byte samples: %zu samples at offset %zu differ.\n",
+        k->name, test_bytes[kernel], n, offset);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+test_store (const test_kernels_t *k, int kernel, size_t n, size_t offset, int dither)
+{
+  uint8_t expect[TEST_MAX_SAMPLES * 4];
+  uint8_t result[TEST_MAX_SAMPLES * 4];
+  kk_convert_t conv;
+  size_t i;
+
+  if (k->store[kernel] == NULL)
+    return 0;
+
+  memset (&conv, 0, sizeof (kk_convert_t));
+  test_reference.store[kernel] (&conv, expect, test_floats + offset, n);
+
+  conv.dither = dither;
+  for (i = 0; i < 8; i++)
+    conv.seed[i] = 0x9e3779b9u * (uint32_t) (i + 1);
+  k->store[kernel] (&conv, result, test_floats + offset, n);
+
+  for (i = 0; i < n; i++) {
+    if (labs (test_get_sample (expect, kernel, i) - test_get_sample (result, kernel, i)) > dither) {
+      fprintf (stderr, "%s: Storing %zu byte samples%s: %zu samples at offset %zu differ.\n",
+          k->name, test_bytes[kernel], dither ? " with dither" : "", n, offset);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int
+main (void)
+{
+  const unsigned int features = kk_cpu_get_features ();
+
+  const test_kernels_t *k;
+  size_t n;
+  size_t offset;
+  int kernel;
+  int result = EXIT_SUCCESS;
+
+  test_fill ();
+
+  for (k = test_kernels; k->name != NULL; k++) {
+    if ((features & k->feature) == 0)
+      continue;
+
+    for (kernel = 0; kernel < CONVERT_KERNELS; kernel++) {
+      for (n = 0; n <= TEST_MAX_SAMPLES; n += (n < 80) ? 1 : 37) {
+        for (offset = 0; offset <= TEST_MAX_OFFSET; offset++) {
+          if (test_load (k, kernel, n, offset) != 0)
+            result = EXIT_FAILURE;
+          if (test_store (k, kernel, n, offset, 0) != 0)
+            result = EXIT_FAILURE;
+          if (test_store (k, kernel, n, offset, 1) != 0)
+            result = EXIT_FAILURE;
+        }
+      }
+    }
+  }
+  return result;
+}
@@ -0,0 +1,95 @@
+/**
+ * Checks the vector downmix kernels against the reference implementation
+ * for every pair of channel counts they get used for. Output buffers have
+ * exactly the size of the output, so stores running past the end show up
+ * with a memory checker. Kernels the CPU doesn't support get skipped.
+ */
+#include "../src/downmix.c"
+
+#include <stdio.h>
+
+#define TEST_MAX_FRAMES   257
+
+static const struct {
+  const char *name;
+  unsigned int feature;
+  size_t max_out;
+  kk_downmix_func kernel;
+} test_kernels[] = {
+#ifdef DOWNMIX_X86
+  { "sse2", KK_CPU_SSE2, 4, downmix_sse2 },
+  { "avx2", KK_CPU_AVX2, KK_FORMAT_MAX_CHANNELS, downmix_avx2 },
+#endif
+  { NULL, 0, 0, NULL }
+};
+
+static float test_src[TEST_MAX_FRAMES * KK_FORMAT_MAX_CHANNELS];
+
+static int
+test_downmix (size_t k, kk_downmix_t *mix, size_t frames)
+{
+  const size_t total = frames * mix->out;
+
+  float *expect;
+  float *result;
+  size_t i;
+  int status = -1;
+
+  expect = malloc ((total + 1) * sizeof (float));
+  result = malloc ((total + 1) * sizeof (float));
+  if ((expect == NULL) || (result == NULL))
+    goto cleanup;
+
+  downmix_scalar (mix, expect, test_src, frames);
+  test_kernels[k].kernel (mix, result, test_src, frames);
+
+  for (i = 0; i < total; i++) {
+    if (fabsf (expect[i] - result[i]) > 1e-6f * (1.0f + fabsf (expect[i]))) {
+      fprintf (stderr, "%s: %zu to %zu channels: %zu frames differ.\n",
+          test_kernels[k].name, mix->in, mix->out, frames);
+      goto cleanup;
+    }
+  }
+  status = 0;
+cleanup:
+  free (expect);
+  free (result);
+  return status;
+}
+
+int
+main (void)
+{
+  const unsigned int features = kk_cpu_get_features ();
+
+  kk_downmix_t mix;
+  size_t frames;
+  size_t i;
+  size_t k;
+  size_t o;
+  int status = EXIT_SUCCESS;
+
+  for (i = 0; i < TEST_MAX_FRAMES * KK_FORMAT_MAX_CHANNELS; i++)
+    test_src[i] = (float) ((long) (i * 7919 % 4001) - 2000) / 2000.0f;
+
+  for (k = 0; test_kernels[k].name != NULL; k++) {
+    if ((features & test_kernels[k].feature) == 0)
+      continue;
+
+    for (mix.in = 2; mix.in <= KK_FORMAT_MAX_CHANNELS; mix.in++) {
+      for (mix.out = 1; (mix.out < mix.in) && (mix.out <= test_kernels[k].max_out); mix.out++) {
+        memset (mix.columns, 0, sizeof (mix.columns));
+        for (i = 0; i < mix.in; i++) {
+          for (o = 0; o < mix.out; o++)
+            mix.columns[i][o] = (float) ((long) ((i * 8 + o) * 37 % 17) - 8) / 8.0f;
+        }
+
+        for (frames = 1; frames <= TEST_MAX_FRAMES; frames += (frames < 20) ? 1 : 13) {
+          if (test_downmix (k, &mix, frames) != 0)
+            status = EXIT_FAILURE;
+        }
+      }
+    }
+  }
+  return status;
+}
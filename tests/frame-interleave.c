@@ -0,0 +1,152 @@
+/**
+ * Checks that kk_frame_interleave puts the samples of every plane exactly
+ * where they belong, both with the two channel kernels and with the path
+ * taken by three to eight channels. The test runs once with KK_SIMD=0 and
+ * once with KK_SIMD=1. Kernels get picked once per process, so every run
+ * happens in a child process of its own.
+ */
+#include "../src/frame.c"
+
+#include <klingklang/format.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TEST_MAX_SAMPLES  1031
+#define TEST_MAX_OFFSET   7
+
+static const kk_bits_t test_bits[] = {
+  KK_BITS_8,
+  KK_BITS_16,
+  KK_BITS_24,
+  KK_BITS_32,
+  KK_BITS_64
+};
+
+static const kk_channels_t test_channels[] = {
+  KK_CHANNELS_2,
+  KK_CHANNELS_3,
+  KK_CHANNELS_4,
+  KK_CHANNELS_5,
+  KK_CHANNELS_6,
+  KK_CHANNELS_7,
+  KK_CHANNELS_8
+};
+
+static int
+test_interleave (kk_format_t *fmt, size_t n, size_t offset)
+{
+  const size_t channels = (size_t) kk_format_get_channels (fmt);
+  const size_t byte = (size_t) kk_format_get_bits (fmt) >> 3;
+  const size_t size = n * byte;
+  const size_t stride = size + TEST_MAX_OFFSET;
+
+  kk_frame_t *src = NULL;
+  kk_frame_t *dst = NULL;
+  uint8_t *planes = NULL;
+  uint8_t *expect = NULL;
+  size_t c;
+  size_t i;
+  int result = -1;
+
+  planes = calloc (channels * stride, sizeof (uint8_t));
+  expect = calloc (channels * size + 1, sizeof (uint8_t));
+  if ((planes == NULL) || (expect == NULL))
+    goto cleanup;
+
+  if ((kk_frame_init (&src) != 0) || (kk_frame_init (&dst) != 0))
+    goto cleanup;
+
+  for (i = 0; i < channels * stride; i++)
+    planes[i] = (uint8_t) (i * 131 + 7);
+
+  /* Planes are put at odd offsets, so the kernels see unaligned data */
+  src->planes = channels;
+  src->size = channels * size;
+  src->samples = n;
+  for (c = 0; c < channels; c++)
+    src->data[c] = planes + c * stride + ((c & 1) ? TEST_MAX_OFFSET - offset : offset);
+
+  for (i = 0; i < n; i++) {
+    for (c = 0; c < channels; c++)
+      memcpy (expect + (i * channels + c) * byte, src->data[c] + i * byte, byte);
+  }
+
+  if (kk_frame_interleave (dst, src, fmt) != 0)
+    goto cleanup;
+
+  if (memcmp (dst->data[0], expect, channels * size) != 0) {
+    fprintf (stderr, "%zu channels of %zu bit samples: %zu samples at offset %zu differ.\n",
+        channels, 8 * byte, n, offset);
+    goto cleanup;
+  }
+  result = 0;
+cleanup:
+  /* The planes belong to us, not to the frame */
+  if (src) {
+    for (c = 0; c < channels; c++)
+      src->data[c] = NULL;
+  }
+  kk_frame_free (src);
+  kk_frame_free (dst);
+  free (planes);
+  free (expect);
+  return result;
+}
+
+static int
+test_run (void)
+{
+  kk_format_t fmt;
+  size_t c;
+  size_t i;
+  size_t n;
+  size_t offset;
+  int result = 0;
+
+  memset (&fmt, 0, sizeof (kk_format_t));
+  fmt.layout = KK_LAYOUT_PLANAR;
+
+  for (c = 0; c < sizeof (test_channels) / sizeof (test_channels[0]); c++) {
+    fmt.channels = test_channels[c];
+    for (i = 0; i < sizeof (test_bits) / sizeof (test_bits[0]); i++) {
+      fmt.bits = test_bits[i];
+      for (n = 1; n <= TEST_MAX_SAMPLES; n += (n < 80) ? 1 : 37) {
+        for (offset = 0; offset <= TEST_MAX_OFFSET; offset++) {
+          if (test_interleave (&fmt, n, offset) != 0)
+            result = -1;
+        }
+      }
+    }
+  }
+  return result;
+}
+
+int
+main (void)
+{
+  static const char *simd[] = { "0", "1" };
+
+  pid_t pid;
+  size_t i;
+  int status;
+  int result = EXIT_SUCCESS;
+
+  for (i = 0; i < sizeof (simd) / sizeof (simd[0]); i++) {
+    pid = fork ();
+    if (pid < 0)
+      return EXIT_FAILURE;
+
+    if (pid == 0) {
+      setenv ("KK_SIMD", simd[i], 1);
+      exit ((test_run () == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if ((waitpid (pid, &status, 0) != pid) || (!WIFEXITED (status))
+        || (WEXITSTATUS (status) != EXIT_SUCCESS)) {
+      fprintf (stderr, "KK_SIMD=%s failed.\n", simd[i]);
+      result = EXIT_FAILURE;
+    }
+  }
+  return result;
+}
@@ -0,0 +1,109 @@
+/**
+ * Checks the vector mix kernels against the reference implementations.
+ * They round the same way, so the samples have to be exactly the same.
+ * Kernels the CPU doesn't support get skipped.
+ */
+#include "../src/mix.c"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_MAX_SAMPLES  1031
+#define TEST_MAX_OFFSET   7
+
+static const struct {
+  const char *name;
+  unsigned int feature;
+  mix_float_func mix_float;
+  mix_s16_func mix_s16;
+  mix_s32_func mix_s32;
+} test_kernels[] = {
+#ifdef MIX_X86
+  { "sse2", KK_CPU_SSE2, mix_float_sse2, mix_s16_sse2, mix_s32_sse2 },
+  { "avx2", KK_CPU_AVX2, mix_float_avx2, mix_s16_avx2, mix_s32_avx2 },
+#endif
+  { NULL, 0, NULL, NULL, NULL }
+};
+
+/* Gains of a crossfade, plain scaling and sums that need clamping */
+static const float test_gains[][2] = {
+  { 0.3f, 0.7f },
+  { 0.9999f, 0.0123f },
+  { 0.5f, 0.0f },
+  { 1.0f, 1.0f },
+};
+
+static float test_float[3][TEST_MAX_SAMPLES + TEST_MAX_OFFSET];
+static int16_t test_s16[3][TEST_MAX_SAMPLES + TEST_MAX_OFFSET];
+static int32_t test_s32[3][TEST_MAX_SAMPLES + TEST_MAX_OFFSET];
+
+static void
+test_fill (void)
+{
+  size_t i;
+
+  for (i = 0; i < TEST_MAX_SAMPLES + TEST_MAX_OFFSET; i++) {
+    test_float[0][i] = (float) ((long) (i * 7919 % 4001) - 2000) / 1900.0f;
+    test_s16[0][i] = (int16_t) ((i * 2654435761u) >> 16);
+    test_s32[0][i] = (int32_t) (i * 2654435761u);
+  }
+}
+
+static int
+test_mix (size_t k, size_t n, size_t offset, float a, float b)
+{
+  const size_t size = TEST_MAX_SAMPLES + TEST_MAX_OFFSET;
+
+  memcpy (test_float[1], test_float[0], size * sizeof (float));
+  memcpy (test_float[2], test_float[0], size * sizeof (float));
+  memcpy (test_s16[1], test_s16[0], size * sizeof (int16_t));
+  memcpy (test_s16[2], test_s16[0], size * sizeof (int16_t));
+  memcpy (test_s32[1], test_s32[0], size * sizeof (int32_t));
+  memcpy (test_s32[2], test_s32[0], size * sizeof (int32_t));
+
+  /* Destination and source start at different offsets */
+  mix_float (test_float[1] + offset, test_float[0], n, a, b);
+  test_kernels[k].mix_float (test_float[2] + offset, test_float[0], n, a, b);
+  mix_s16 (test_s16[1] + offset, test_s16[0], n, a, b);
+  test_kernels[k].mix_s16 (test_s16[2] + offset, test_s16[0], n, a, b);
+  mix_s32 (test_s32[1] + offset, test_s32[0], n, a, b);
+  test_kernels[k].mix_s32 (test_s32[2] + offset, test_s32[0], n, a, b);
+
+  if ((memcmp (test_float[1], test_float[2], size * sizeof (float)) != 0)
+      || (memcmp (test_s16[1], test_s16[2], size * sizeof (int16_t)) != 0)
+      || (memcmp (test_s32[1], test_s32[2], size * sizeof (int32_t)) != 0)) {
+    fprintf (stderr, "%s: %zu samples at offset %zu with gains %g and %g differ.\n",
+        test_kernels[k].name, n, offset, (double) a, (double) b);
+    return -1;
+  }
+  return 0;
+}
+
+int
+main (void)
+{
+  const unsigned int features = kk_cpu_get_features ();
+
+  size_t g;
+  size_t k;
+  size_t n;
+  size_t offset;
+  int status = EXIT_SUCCESS;
+
+  test_fill ();
+
+  for (k = 0; test_kernels[k].name != NULL; k++) {
+    if ((features & test_kernels[k].feature) == 0)
+      continue;
+
+    for (g = 0; g < sizeof (test_gains) / sizeof (test_gains[0]); g++) {
+      for (n = 0; n <= TEST_MAX_SAMPLES; n += (n < 80) ? 1 : 37) {
+        for (offset = 0; offset <= TEST_MAX_OFFSET; offset++) {
+          if (test_mix (k, n, offset, test_gains[g][0], test_gains[g][1]) != 0)
+            status = EXIT_FAILURE;
+        }
+      }
+    }
+  }
+  return status;
+}
@@ -0,0 +1,72 @@
+/**
+ * Checks the vector filter kernels of the resampler against the reference
+ * implementation. The kernels add the products in a different order, so
+ * the sums may differ by rounding errors, relative to the sum of the
+ * magnitudes of the products. Kernels the CPU doesn't support get skipped.
+ */
+#include "../src/resample.c"
+
+#include <stdio.h>
+
+#define TEST_MAX_TAPS     256
+#define TEST_MAX_OFFSET   7
+
+static const struct {
+  const char *name;
+  unsigned int feature;
+  resample_dot_func dot;
+} test_kernels[] = {
+#ifdef RESAMPLE_X86
+  { "sse2", KK_CPU_SSE2, resample_dot_sse2 },
+  { "avx2", KK_CPU_AVX2, resample_dot_avx2 },
+#endif
+  { NULL, 0, NULL }
+};
+
+/* Filter rows are 32 byte aligned, samples aren't */
+static float test_filter[TEST_MAX_TAPS] __attribute__ ((aligned (32)));
+static float test_samples[TEST_MAX_TAPS + TEST_MAX_OFFSET];
+
+int
+main (void)
+{
+  const unsigned int features = kk_cpu_get_features ();
+
+  float expect;
+  float result;
+  float bound;
+  size_t i;
+  size_t k;
+  size_t n;
+  size_t offset;
+  int status = EXIT_SUCCESS;
+
+  for (i = 0; i < TEST_MAX_TAPS; i++)
+    test_filter[i] = (float) ((long) (i * 7919 % 4001) - 2000) / 4000.0f;
+  for (i = 0; i < TEST_MAX_TAPS + TEST_MAX_OFFSET; i++)
+    test_samples[i] = (float) ((long) (i * 104729 % 3001) - 1500) / 1500.0f;
+
+  for (k = 0; test_kernels[k].name != NULL; k++) {
+    if ((features & test_kernels[k].feature) == 0)
+      continue;
+
+    /* The number of taps is always a multiple of 8 */
+    for (n = 8; n <= TEST_MAX_TAPS; n += 8) {
+      for (offset = 0; offset <= TEST_MAX_OFFSET; offset++) {
+        bound = 0.0f;
+        for (i = 0; i < n; i++)
+          bound += fabsf (test_filter[i] * test_samples[offset + i]);
+
+        expect = resample_dot (test_filter, test_samples + offset, n);
+        result = test_kernels[k].dot (test_filter, test_samples + offset, n);
+
+        if (fabsf (expect - result) > bound * 1e-5f) {
+          fprintf (stderr, "%s: %zu taps at offset %zu: %g instead of %g.\n",
+              test_kernels[k].name, n, offset, (double) result, (double) expect);
+          status = EXIT_FAILURE;
+        }
+      }
+    }
+  }
+  return status;
+}